@@ -327,6 +327,8 @@ struct MapStats {
  * @return New Map instance or NULL on failure
  * @note Uses MapNode_Hash and MapNode_Compare internally
  * @note Initial capacity: 16, max load factor: 0.75
+ * @note Growth is incremental: the old buckets move a few at a time on
+ *       later puts and removes, so no single put rehashes the whole map
  */
 Map* MapMake(void);
 
@@ -337,6 +339,22 @@ Map* MapMake(void);
  */
 Map* MapMakeWithCapacity(size_t initial_capacity);
 
+/**
+ * @brief Create a new open-addressing Map (defined in map_flat_impl.c)
+ * @return New Map instance or NULL on failure
+ * @note Same interface as MapMake(); entries live in one flat slot array
+ *       probed by 7-bit hash fingerprints, so misses rarely compare keys
+ * @note Initial capacity: 16, max load factor: 0.875
+ */
+Map* MapMakeFlat(void);
+
+/**
+ * @brief Create a new open-addressing Map sized for a number of entries
+ * @param initial_capacity Entries to hold without growing
+ * @return New Map instance or NULL on failure
+ */
+Map* MapMakeFlatWithCapacity(size_t initial_capacity);
+
 /* ======================================================================== */
 /* Utility Functions                                                        */
 /* ======================================================================== */
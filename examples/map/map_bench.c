@@ -0,0 +1,228 @@
+/**
+ * @file map_bench.c
+ * @brief Chained MapMake() against open-addressing MapMakeFlat()
+ *
+ * For each size, both engines get the same int keys, then the same string
+ * keys. The bench times put for every key, then lookups that hit and
+ * lookups that miss, and reports the longest chain (or probe sequence).
+ * Nodes are built before the clock starts. Then a random mix of
+ * put/remove/get runs on both maps at once, and any disagreement fails the
+ * run. Last, every put into a map growing from empty is timed on its own,
+ * and the latency percentiles show what the growth steps cost the unlucky
+ * callers.
+ * Usage: map_bench [max_entries]   (default 262144)
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <trampoline/trampoline.h>
+
+#include "map.h"
+#include "map_flat_impl.c"
+
+#define LOOKUP_ROUNDS 50
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Spread the keys out so neither engine sees them in insertion order */
+static int key_for(size_t index) {
+    return (int)((uint32_t)index * 2654435761u >> 1);
+}
+
+/* Strings share a long prefix and differ only near the end */
+static void** make_nodes(size_t count, size_t offset, bool strings) {
+    void** nodes = malloc(sizeof(void*) * count);
+    char text[64];
+    size_t i;
+
+    if (!nodes) return NULL;
+    for (i = 0; i < count; i++) {
+        if (strings) {
+            snprintf(text, sizeof(text), "session:user:%08zu", i + offset);
+            nodes[i] = MapNodeFromString(text);
+        } else {
+            nodes[i] = MapNodeFromInt(key_for(i + offset));
+        }
+        if (!nodes[i]) {
+            fprintf(stderr, "Out of MapNodes after %zu\n", i);
+            exit(1);
+        }
+    }
+    return nodes;
+}
+
+static void free_nodes(void** nodes, size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++) MapNode_Free(nodes[i]);
+    free(nodes);
+}
+
+/* Nanoseconds per operation for put, get hit and get miss */
+static void bench_engine(const char* label, Map* map, size_t count,
+                         void** hits, void** misses, bool strings) {
+    void** keys = make_nodes(count, 0, strings);
+    void** values = make_nodes(count, 0, false);
+    struct MapStats stats;
+    double start, put_ns, hit_ns, miss_ns;
+    size_t found = 0;
+    size_t round, i;
+
+    start = now_seconds();
+    for (i = 0; i < count; i++) map->put(keys[i], values[i]);
+    put_ns = (now_seconds() - start) * 1e9 / (double)count;
+
+    start = now_seconds();
+    for (round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (i = 0; i < count; i++) found += map->get(hits[i]) != NULL;
+    }
+    hit_ns = (now_seconds() - start) * 1e9 / (double)(count * LOOKUP_ROUNDS);
+
+    start = now_seconds();
+    for (round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (i = 0; i < count; i++) found += map->get(misses[i]) != NULL;
+    }
+    miss_ns = (now_seconds() - start) * 1e9 / (double)(count * LOOKUP_ROUNDS);
+
+    map->getStats(&stats);
+    printf("  %-8s %8zu   put %7.1f ns   hit %7.1f ns   miss %7.1f ns   "
+           "longest %zu%s\n", label, count, put_ns, hit_ns, miss_ns,
+           stats.max_chain_length, found == count * LOOKUP_ROUNDS ? "" : "   WRONG");
+
+    /* The map owns keys and values now */
+    free(keys);
+    free(values);
+}
+
+static void bench_size(size_t count, bool strings) {
+    void** hits = make_nodes(count, 0, strings);
+    void** misses = make_nodes(count, count, strings);
+    Map* chained = MapMake();
+    Map* flat = MapMakeFlat();
+
+    bench_engine("chained", chained, count, hits, misses, strings);
+    bench_engine("flat", flat, count, hits, misses, strings);
+
+    chained->free();
+    flat->free();
+    free_nodes(hits, count);
+    free_nodes(misses, count);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double* sorted, size_t count, double p) {
+    return sorted[(size_t)(p * (double)(count - 1) + 0.5)];
+}
+
+static void bench_put_latency(const char* label, Map* map, size_t count) {
+    void** keys = make_nodes(count, 0, false);
+    void** values = make_nodes(count, 0, false);
+    double* latencies = malloc(sizeof(double) * count);
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        double start = now_seconds();
+        map->put(keys[i], values[i]);
+        latencies[i] = now_seconds() - start;
+    }
+
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    printf("  %-8s %8zu   p50 %7.2f us   p99 %7.2f us   p99.9 %8.2f us   "
+           "max %8.2f us\n", label, count,
+           percentile(latencies, count, 0.50) * 1e6,
+           percentile(latencies, count, 0.99) * 1e6,
+           percentile(latencies, count, 0.999) * 1e6,
+           latencies[count - 1] * 1e6);
+
+    map->free();
+    free(latencies);
+    free(keys);
+    free(values);
+}
+
+/* Same random operations on both engines; returns the number of mismatches */
+static size_t check_engines(size_t operations, size_t key_range) {
+    Map* chained = MapMake();
+    Map* flat = MapMakeFlat();
+    void** probes = make_nodes(key_range, 0, false);
+    size_t mismatches = 0;
+    size_t i;
+
+    srand(7);
+    for (i = 0; i < operations; i++) {
+        size_t index = (size_t)rand() % key_range;
+        int action = rand() % 4;
+
+        if (action < 2) {
+            /* put keeps the stored key on update, so replace whole entries */
+            chained->remove(probes[index]);
+            flat->remove(probes[index]);
+            chained->putInt(MapNodeFromInt(key_for(index)), (int)i);
+            flat->putInt(MapNodeFromInt(key_for(index)), (int)i);
+        } else if (action == 2) {
+            mismatches += chained->remove(probes[index]) != flat->remove(probes[index]);
+        } else {
+            mismatches += chained->getInt(probes[index], -1) !=
+                          flat->getInt(probes[index], -1);
+        }
+    }
+
+    for (i = 0; i < key_range; i++) {
+        mismatches += chained->getInt(probes[i], -1) != flat->getInt(probes[i], -1);
+    }
+    mismatches += chained->size() != flat->size();
+    mismatches += flat->validate();
+
+    /* Shrink to nothing and grow back past the old capacity */
+    flat->clear();
+    for (i = 0; i < key_range; i++) flat->putInt(MapNodeFromInt(key_for(i)), (int)i);
+    flat->resize(1);
+    for (i = 0; i < key_range; i++) {
+        mismatches += flat->getInt(probes[i], -1) != (int)i;
+    }
+    mismatches += flat->size() != key_range;
+    mismatches += flat->validate();
+
+    chained->free();
+    flat->free();
+    free_nodes(probes, key_range);
+    return mismatches;
+}
+
+int main(int argc, char** argv) {
+    size_t max_entries = argc > 1 ? (size_t)strtoul(argv[1], NULL, 10) : 262144;
+    size_t mismatches;
+    size_t count;
+
+    printf("=== Chained vs flat Map, int keys ===\n");
+    for (count = 256; count <= max_entries; count *= 4) {
+        bench_size(count, false);
+    }
+
+    printf("\n=== Chained vs flat Map, string keys ===\n");
+    for (count = 256; count <= max_entries; count *= 4) {
+        bench_size(count, true);
+    }
+
+    if (max_entries >= 1) {
+        printf("\n=== Put latency while growing from empty ===\n");
+        bench_put_latency("chained", MapMake(), max_entries);
+        bench_put_latency("flat", MapMakeFlat(), max_entries);
+    }
+
+    printf("\n=== Chained vs flat Map, random operations ===\n");
+    mismatches = check_engines(4000, 500);
+    printf("  %zu mismatches\n", mismatches);
+    return mismatches ? 1 : 0;
+}
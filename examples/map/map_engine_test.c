@@ -0,0 +1,233 @@
+/**
+ * @file map_engine_test.c
+ * @brief Chained and flat Map engines checked against a reference model
+ *
+ * Random put/get/remove/getAllKeys sequences run on both engines, and
+ * every answer is checked against a plain array of expected values. The
+ * chained map is rebuilt every round so it keeps growing, and the test
+ * counts the operations that land while an incremental migration is only
+ * partly done; each kind has to happen at least once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+
+#include "map.h"
+#include "map_flat_impl.c"
+
+#define KEY_RANGE 1500
+#define ROUNDS 12
+#define OPERATIONS 6000
+
+/* Operations seen while the chained map was between two tables */
+typedef struct MigrationCounts {
+    size_t puts;
+    size_t gets;
+    size_t removes;
+    size_t walks;
+} MigrationCounts;
+
+/* Spread the keys out so they don't arrive in bucket order */
+static int key_for(size_t index) {
+    return (int)((uint32_t)index * 2654435761u >> 1);
+}
+
+/* key_for() values sorted, to map a returned key back to its index */
+typedef struct KeyIndex {
+    int key;
+    size_t index;
+} KeyIndex;
+
+static KeyIndex key_index[KEY_RANGE];
+
+static int compare_key_index(const void* a, const void* b) {
+    int x = ((const KeyIndex*)a)->key;
+    int y = ((const KeyIndex*)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static void build_key_index(void) {
+    size_t i;
+    for (i = 0; i < KEY_RANGE; i++) {
+        key_index[i].key = key_for(i);
+        key_index[i].index = i;
+    }
+    qsort(key_index, KEY_RANGE, sizeof(KeyIndex), compare_key_index);
+}
+
+static bool migrating(Map* map, bool chained) {
+    return chained && ((MapPrivate*)map)->old_buckets != NULL;
+}
+
+/* Every key getAllKeys returns is live, distinct and has its value */
+static void check_walk(Map* map, void** probes, const int* expected) {
+    bool seen[KEY_RANGE];
+    size_t live = 0;
+    size_t count;
+    size_t i;
+    void** keys = map->getAllKeys(&count);
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < KEY_RANGE; i++) live += expected[i] >= 0;
+    assert(count == live && count == map->size());
+
+    for (i = 0; i < count; i++) {
+        KeyIndex wanted;
+        const KeyIndex* found;
+        size_t index;
+
+        assert(MapNode_GetType(keys[i]) == MAPNODE_TYPE_INT);
+        wanted.key = MapNode_AsInt(keys[i]);
+        found = bsearch(&wanted, key_index, KEY_RANGE, sizeof(KeyIndex),
+                        compare_key_index);
+        assert(found);
+        index = found->index;
+        assert(!seen[index] && MapNode_Equals(keys[i], probes[index]));
+        seen[index] = true;
+        assert(map->getInt(keys[i], -1) == expected[index]);
+    }
+    free(keys);
+}
+
+/* One round of random operations; returns how many entries are left */
+static size_t run_model(Map* map, bool chained, void** probes,
+                        unsigned int seed, MigrationCounts* counts) {
+    int expected[KEY_RANGE];
+    size_t live = 0;
+    size_t op;
+    size_t i;
+
+    for (i = 0; i < KEY_RANGE; i++) expected[i] = -1;
+    srand(seed);
+
+    for (op = 0; op < OPERATIONS; op++) {
+        size_t index = (size_t)rand() % KEY_RANGE;
+        int action = rand() % 64;
+        bool mid = migrating(map, chained);
+
+        if (action < 28) {
+            /* An update keeps the stored key, so only new keys get a node */
+            if (expected[index] >= 0) {
+                assert(map->putInt(probes[index], (int)op));
+            } else {
+                assert(map->putInt(MapNodeFromInt(key_for(index)), (int)op));
+                live++;
+            }
+            expected[index] = (int)op;
+            if (mid) counts->puts++;
+        } else if (action < 44) {
+            assert(map->remove(probes[index]) == (expected[index] >= 0));
+            if (expected[index] >= 0) live--;
+            expected[index] = -1;
+            if (mid) counts->removes++;
+        } else if (action < 63) {
+            assert(map->getInt(probes[index], -1) == expected[index]);
+            assert(map->contains(probes[index]) == (expected[index] >= 0));
+            if (mid) counts->gets++;
+        } else {
+            check_walk(map, probes, expected);
+            assert(!migrating(map, chained));
+            if (mid) counts->walks++;
+        }
+        assert(map->size() == live);
+    }
+
+    for (i = 0; i < KEY_RANGE; i++) {
+        assert(map->getInt(probes[i], -1) == expected[i]);
+    }
+    check_walk(map, probes, expected);
+    assert(map->validate() == 0);
+    return live;
+}
+
+void test_chained_migration(void** probes) {
+    MigrationCounts counts;
+    unsigned int round;
+
+    printf("=== Chained Map During Incremental Growth ===\n");
+    memset(&counts, 0, sizeof(counts));
+
+    for (round = 0; round < ROUNDS; round++) {
+        Map* map = MapMake();
+        size_t live = run_model(map, true, probes, round + 1, &counts);
+        printf("Round %u: %zu entries, %zu buckets\n", round, live, map->capacity());
+        map->free();
+    }
+
+    printf("Mid-migration: %zu puts, %zu gets, %zu removes, %zu walks\n",
+           counts.puts, counts.gets, counts.removes, counts.walks);
+    assert(counts.puts > 0 && counts.gets > 0);
+    assert(counts.removes > 0 && counts.walks > 0);
+    printf("✓ Chained map agrees with the model while migrating\n\n");
+}
+
+void test_flat_engine(void** probes) {
+    MigrationCounts unused;
+    unsigned int round;
+    size_t i;
+
+    printf("=== Flat Map ===\n");
+    memset(&unused, 0, sizeof(unused));
+
+    /* As documented in map.h: 16 slots, holding 14 entries before growing */
+    {
+        Map* map = MapMakeFlat();
+        assert(map->capacity() == 16);
+        for (i = 0; i < 14; i++) map->putInt(MapNodeFromInt(key_for(i)), (int)i);
+        assert(map->capacity() == 16);
+        map->putInt(MapNodeFromInt(key_for(14)), 14);
+        assert(map->capacity() == 32 && map->size() == 15);
+        map->free();
+    }
+
+    for (round = 0; round < ROUNDS; round++) {
+        Map* map = MapMakeFlat();
+        size_t live = run_model(map, false, probes, round + 101, &unused);
+        printf("Round %u: %zu entries, %zu slots\n", round, live, map->capacity());
+        map->free();
+    }
+
+    /* Fill with tombstones, shrink to nothing and grow back */
+    {
+        Map* map = MapMakeFlatWithCapacity(KEY_RANGE);
+        for (i = 0; i < KEY_RANGE; i++) {
+            assert(map->putInt(MapNodeFromInt(key_for(i)), (int)i));
+        }
+        for (i = 0; i < KEY_RANGE; i += 2) assert(map->remove(probes[i]));
+        map->resize(1);
+        for (i = 0; i < KEY_RANGE; i++) {
+            assert(map->getInt(probes[i], -1) == (i % 2 ? (int)i : -1));
+        }
+        for (i = 0; i < KEY_RANGE; i += 2) {
+            assert(map->putInt(MapNodeFromInt(key_for(i)), (int)i));
+        }
+        assert(map->size() == KEY_RANGE && map->validate() == 0);
+        map->clear();
+        assert(map->size() == 0 && !map->contains(probes[0]));
+        map->free();
+    }
+    printf("✓ Flat map agrees with the model, through tombstones and shrinking\n\n");
+}
+
+int main() {
+    void* probes[KEY_RANGE];
+    size_t i;
+
+    printf("Map Engine Test Suite\n");
+    printf("=====================\n\n");
+
+    build_key_index();
+    for (i = 0; i < KEY_RANGE; i++) probes[i] = MapNodeFromInt(key_for(i));
+
+    test_chained_migration(probes);
+    test_flat_engine(probes);
+
+    for (i = 0; i < KEY_RANGE; i++) MapNode_Free(probes[i]);
+
+    printf("🎉 All map engine tests passed successfully!\n");
+    return 0;
+}
@@ -0,0 +1,660 @@
+/**
+ * @file map_flat_impl.c
+ * @brief Open-addressing Map engine with Swiss-table style control bytes
+ *
+ * MapMakeFlat() returns the same Map interface as MapMake(), backed by one
+ * flat array of key/value slots instead of bucket chains. Every slot has a
+ * control byte, kept in a separate array: EMPTY, DELETED, or a 7-bit
+ * fingerprint of the key's hash. A lookup hashes the key once, then scans
+ * the control bytes a group at a time (16 with SSE2, 8 in a 64-bit word
+ * otherwise) and only compares keys whose fingerprint matches, so a miss
+ * usually touches no key at all. Groups are probed triangularly until one
+ * with an EMPTY byte is seen.
+ *
+ * Removing a key leaves a DELETED tombstone, unless its group still has an
+ * EMPTY byte: no probe ever went past such a group, so the slot can become
+ * EMPTY again. The table is rebuilt when 7/8 of the slots are full or
+ * tombstones, doubling if it is more than 7/16 full and dropping the
+ * tombstones in place otherwise.
+ *
+ * The convenience methods (putInt, getString, ...) are shared with the
+ * chained engine in map_impl.c; they only go through the public interface.
+ */
+
+#include "map.h"
+#include "mapnode.h"
+#include "map_impl.c"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* ======================================================================== */
+/* Control Bytes and Groups                                                 */
+/* ======================================================================== */
+
+#define MAP_FLAT_EMPTY   ((signed char)-128)  /* 0x80: never used */
+#define MAP_FLAT_DELETED ((signed char)-2)    /* 0xFE: tombstone */
+/* Full slots hold the fingerprint, 0..127, so the high bit means free */
+
+#if defined(__SSE2__)
+#define MAP_FLAT_GROUP 16
+#define MAP_FLAT_MASK_SHIFT 0         /* One mask bit per slot */
+#else
+#define MAP_FLAT_GROUP 8
+#define MAP_FLAT_MASK_SHIFT 3         /* The top bit of each slot's byte */
+#define MAP_FLAT_LSBS 0x0101010101010101ULL
+#define MAP_FLAT_MSBS 0x8080808080808080ULL
+#endif
+
+/* Slots in a group that matched, lowest first */
+typedef uint64_t MapFlatMask;
+
+static int map_flat_mask_next(MapFlatMask* mask) {
+    int bit;
+#if defined(__GNUC__) || defined(__clang__)
+    bit = __builtin_ctzll(*mask);
+#else
+    bit = 0;
+    while (!((*mask >> bit) & 1)) bit++;
+#endif
+    *mask &= *mask - 1;
+    return bit >> MAP_FLAT_MASK_SHIFT;
+}
+
+#if defined(__SSE2__)
+
+static MapFlatMask map_flat_match(const signed char* group, signed char h2) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)(const void*)group);
+    return (MapFlatMask)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+}
+
+static MapFlatMask map_flat_match_empty(const signed char* group) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)(const void*)group);
+    return (MapFlatMask)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_set1_epi8(MAP_FLAT_EMPTY), ctrl));
+}
+
+static MapFlatMask map_flat_match_free(const signed char* group) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)(const void*)group);
+    return (MapFlatMask)_mm_movemask_epi8(ctrl);
+}
+
+#else
+
+/* The group as a word with slot i in byte i, whatever the byte order */
+static uint64_t map_flat_load(const signed char* group) {
+    uint64_t word = 0;
+    int i;
+    for (i = MAP_FLAT_GROUP - 1; i >= 0; i--) {
+        word = (word << 8) | (unsigned char)group[i];
+    }
+    return word;
+}
+
+/* May also flag a byte just above a real match; keys are compared anyway */
+static MapFlatMask map_flat_match(const signed char* group, signed char h2) {
+    uint64_t x = map_flat_load(group) ^ (MAP_FLAT_LSBS * (unsigned char)h2);
+    return (x - MAP_FLAT_LSBS) & ~x & MAP_FLAT_MSBS;
+}
+
+/* EMPTY (0x80) is the only free byte without bit 1; DELETED is 0xFE.
+ * Shifting by 6 lines bit 1 of each byte up under its top bit. */
+static MapFlatMask map_flat_match_empty(const signed char* group) {
+    uint64_t word = map_flat_load(group);
+    return word & ~(word << 6) & MAP_FLAT_MSBS;
+}
+
+static MapFlatMask map_flat_match_free(const signed char* group) {
+    return map_flat_load(group) & MAP_FLAT_MSBS;
+}
+
+#endif
+
+/* ======================================================================== */
+/* Private Map Structure                                                    */
+/* ======================================================================== */
+
+typedef struct MapSlot {
+    void* key;                    /* MapNode key */
+    void* value;                  /* MapNode value */
+} MapSlot;
+
+typedef struct MapFlatPrivate {
+    Map public;                   /* Public interface MUST be first */
+    MapSlot* slots;               /* capacity slots, then the control bytes */
+    signed char* ctrl;            /* One control byte per slot */
+    size_t capacity;              /* Slots; a power of 2, at least one group */
+    size_t size;                  /* Number of entries */
+    size_t growth_left;           /* EMPTY slots that may fill before a rebuild */
+} MapFlatPrivate;
+
+/* ======================================================================== */
+/* Internal Map Operations                                                  */
+/* ======================================================================== */
+
+/* MapNode_Hash spread over every bit: low bits pick the group, the top 7
+ * are the fingerprint */
+static uint64_t map_flat_hash(void* key) {
+    uint64_t hash = (uint64_t)MapNode_Hash(key) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+static signed char map_flat_h2(uint64_t hash) {
+    return (signed char)(hash >> 57);
+}
+
+static size_t map_flat_max_load(size_t capacity) {
+    return capacity - capacity / 8;
+}
+
+static bool map_flat_allocate(MapFlatPrivate* priv, size_t capacity) {
+    MapSlot* slots = malloc(capacity * (sizeof(MapSlot) + 1));
+    if (!slots) return false;
+
+    priv->slots = slots;
+    priv->ctrl = (signed char*)(slots + capacity);
+    priv->capacity = capacity;
+    memset(priv->ctrl, MAP_FLAT_EMPTY, capacity);
+    priv->growth_left = map_flat_max_load(capacity) - priv->size;
+    return true;
+}
+
+/* Slot holding key, or capacity when it is not in the map */
+static size_t map_flat_find(MapFlatPrivate* priv, void* key, uint64_t hash) {
+    size_t mask = priv->capacity - 1;
+    size_t group = (size_t)hash & mask & ~(size_t)(MAP_FLAT_GROUP - 1);
+    size_t step = 0;
+    signed char h2 = map_flat_h2(hash);
+
+    for (;;) {
+        MapFlatMask match = map_flat_match(priv->ctrl + group, h2);
+
+        while (match) {
+            size_t slot = group + (size_t)map_flat_mask_next(&match);
+            if (MapNode_Compare(priv->slots[slot].key, key) == 0) {
+                return slot;
+            }
+        }
+        if (map_flat_match_empty(priv->ctrl + group)) return priv->capacity;
+
+        step += MAP_FLAT_GROUP;
+        group = (group + step) & mask;
+    }
+}
+
+/* First EMPTY or DELETED slot on hash's probe sequence */
+static size_t map_flat_find_free(MapFlatPrivate* priv, uint64_t hash) {
+    size_t mask = priv->capacity - 1;
+    size_t group = (size_t)hash & mask & ~(size_t)(MAP_FLAT_GROUP - 1);
+    size_t step = 0;
+
+    for (;;) {
+        MapFlatMask free_slots = map_flat_match_free(priv->ctrl + group);
+        if (free_slots) {
+            return group + (size_t)map_flat_mask_next(&free_slots);
+        }
+        step += MAP_FLAT_GROUP;
+        group = (group + step) & mask;
+    }
+}
+
+static bool map_flat_rehash(MapFlatPrivate* priv, size_t new_capacity) {
+    MapSlot* old_slots = priv->slots;
+    signed char* old_ctrl = priv->ctrl;
+    size_t old_capacity = priv->capacity;
+    size_t i;
+
+    if (!map_flat_allocate(priv, new_capacity)) {
+        priv->slots = old_slots;
+        priv->ctrl = old_ctrl;
+        priv->capacity = old_capacity;
+        return false;
+    }
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old_ctrl[i] >= 0) {
+            uint64_t hash = map_flat_hash(old_slots[i].key);
+            size_t slot = map_flat_find_free(priv, hash);
+
+            priv->ctrl[slot] = map_flat_h2(hash);
+            priv->slots[slot] = old_slots[i];
+        }
+    }
+
+    free(old_slots);
+    return true;
+}
+
+/* Smallest capacity whose load limit (7/8) still holds count entries */
+static size_t map_flat_capacity_for(size_t count) {
+    size_t capacity = next_power_of_2(count + (count + 6) / 7);
+    return capacity < MAP_FLAT_GROUP ? MAP_FLAT_GROUP : capacity;
+}
+
+/* ======================================================================== */
+/* Map Trampoline Function Implementations                                 */
+/* ======================================================================== */
+
+bool map_flat_put(Map* self, void* key, void* value) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    uint64_t hash;
+    size_t slot;
+
+    if (!priv || !MapNode_IsValid(key) || !MapNode_IsValid(value)) {
+        return false;
+    }
+
+    hash = map_flat_hash(key);
+    slot = map_flat_find(priv, key, hash);
+    if (slot < priv->capacity) {
+        /* Update existing entry - free old value, store new one */
+        MapNode_Free(priv->slots[slot].value);
+        priv->slots[slot].value = value;
+        return true;
+    }
+
+    if (priv->growth_left == 0) {
+        /* Mostly tombstones: rebuild at the same size to drop them */
+        size_t capacity = priv->size + 1 > priv->capacity * 7 / 16
+                        ? priv->capacity * 2 : priv->capacity;
+        if (!map_flat_rehash(priv, capacity)) return false;
+    }
+
+    slot = map_flat_find_free(priv, hash);
+    if (priv->ctrl[slot] == MAP_FLAT_EMPTY) priv->growth_left--;
+    priv->ctrl[slot] = map_flat_h2(hash);
+    priv->slots[slot].key = key;
+    priv->slots[slot].value = value;
+    priv->size++;
+    return true;
+}
+
+void* map_flat_get(Map* self, void* key) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    size_t slot;
+
+    if (!priv || !MapNode_IsValid(key)) return NULL;
+
+    slot = map_flat_find(priv, key, map_flat_hash(key));
+    return slot < priv->capacity ? priv->slots[slot].value : NULL;
+}
+
+bool map_flat_remove(Map* self, void* key) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    size_t slot;
+    size_t group;
+
+    if (!priv || !MapNode_IsValid(key)) return false;
+
+    slot = map_flat_find(priv, key, map_flat_hash(key));
+    if (slot == priv->capacity) return false;
+
+    MapNode_Free(priv->slots[slot].key);
+    MapNode_Free(priv->slots[slot].value);
+    priv->size--;
+
+    /* Probes stop at a group with an EMPTY slot, so none ever passed it */
+    group = slot & ~(size_t)(MAP_FLAT_GROUP - 1);
+    if (map_flat_match_empty(priv->ctrl + group)) {
+        priv->ctrl[slot] = MAP_FLAT_EMPTY;
+        priv->growth_left++;
+    } else {
+        priv->ctrl[slot] = MAP_FLAT_DELETED;
+    }
+    return true;
+}
+
+bool map_flat_contains(Map* self, void* key) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    if (!priv || !MapNode_IsValid(key)) return false;
+    return map_flat_find(priv, key, map_flat_hash(key)) < priv->capacity;
+}
+
+/* ======================================================================== */
+/* Map Information Functions                                                */
+/* ======================================================================== */
+
+size_t map_flat_size(Map* self) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    return priv ? priv->size : 0;
+}
+
+bool map_flat_is_empty(Map* self) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    return priv ? (priv->size == 0) : true;
+}
+
+size_t map_flat_capacity(Map* self) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    return priv ? priv->capacity : 0;
+}
+
+float map_flat_load_factor(Map* self) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    return priv ? ((float)priv->size / (float)priv->capacity) : 0.0f;
+}
+
+void map_flat_clear(Map* self) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    size_t i;
+
+    if (!priv) return;
+
+    for (i = 0; i < priv->capacity; i++) {
+        if (priv->ctrl[i] >= 0) {
+            MapNode_Free(priv->slots[i].key);
+            MapNode_Free(priv->slots[i].value);
+        }
+    }
+    memset(priv->ctrl, MAP_FLAT_EMPTY, priv->capacity);
+    priv->size = 0;
+    priv->growth_left = map_flat_max_load(priv->capacity);
+}
+
+void map_flat_resize(Map* self, size_t new_capacity) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    size_t needed;
+
+    if (!priv) return;
+
+    /* Never below what the current entries need */
+    new_capacity = next_power_of_2(new_capacity);
+    needed = map_flat_capacity_for(priv->size);
+    if (new_capacity < needed) new_capacity = needed;
+    if (new_capacity != priv->capacity) map_flat_rehash(priv, new_capacity);
+}
+
+static void** map_flat_collect(MapFlatPrivate* priv, size_t* out_count, bool keys) {
+    void** items;
+    size_t index = 0;
+    size_t i;
+
+    if (!priv || !out_count) {
+        if (out_count) *out_count = 0;
+        return NULL;
+    }
+    if (priv->size == 0) {
+        *out_count = 0;
+        return NULL;
+    }
+
+    items = malloc(sizeof(void*) * priv->size);
+    if (!items) {
+        *out_count = 0;
+        return NULL;
+    }
+    for (i = 0; i < priv->capacity; i++) {
+        if (priv->ctrl[i] >= 0) {
+            items[index++] = keys ? priv->slots[i].key : priv->slots[i].value;
+        }
+    }
+    *out_count = index;
+    return items;
+}
+
+void** map_flat_get_all_keys(Map* self, size_t* out_count) {
+    return map_flat_collect((MapFlatPrivate*)self, out_count, true);
+}
+
+void** map_flat_get_all_values(Map* self, size_t* out_count) {
+    return map_flat_collect((MapFlatPrivate*)self, out_count, false);
+}
+
+/* ======================================================================== */
+/* Debugging Functions                                                      */
+/* ======================================================================== */
+
+void map_flat_debug(Map* self, size_t max_entries) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    size_t printed = 0;
+    size_t i;
+
+    if (!priv) {
+        printf("Map: NULL\n");
+        return;
+    }
+
+    printf("Map Debug Info (flat):\n");
+    printf("  Size: %zu, Capacity: %zu, Load Factor: %.2f\n",
+           priv->size, priv->capacity, map_flat_load_factor(self));
+
+    if (max_entries == 0) max_entries = priv->size;
+
+    for (i = 0; i < priv->capacity && printed < max_entries; i++) {
+        char key_str[128], value_str[128];
+
+        if (priv->ctrl[i] < 0) continue;
+        MapNode_ToString(priv->slots[i].key, key_str, sizeof(key_str));
+        MapNode_ToString(priv->slots[i].value, value_str, sizeof(value_str));
+        printf("  [%zu] %s -> %s\n", i, key_str, value_str);
+        printed++;
+    }
+
+    if (printed < priv->size) {
+        printf("  ... (%zu more entries)\n", priv->size - printed);
+    }
+}
+
+size_t map_flat_validate(Map* self) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    size_t errors = 0;
+    size_t actual_size = 0;
+    size_t i;
+
+    if (!priv) {
+        fprintf(stderr, "Map validation: NULL map\n");
+        return 1;
+    }
+
+    for (i = 0; i < priv->capacity; i++) {
+        if (priv->ctrl[i] < 0) continue;
+        actual_size++;
+
+        if (!MapNode_IsValid(priv->slots[i].key)) {
+            fprintf(stderr, "Map validation: Invalid key in slot %zu\n", i);
+            errors++;
+            continue;
+        }
+        if (!MapNode_IsValid(priv->slots[i].value)) {
+            fprintf(stderr, "Map validation: Invalid value in slot %zu\n", i);
+            errors++;
+        }
+        if (priv->ctrl[i] != map_flat_h2(map_flat_hash(priv->slots[i].key)) ||
+            map_flat_find(priv, priv->slots[i].key,
+                          map_flat_hash(priv->slots[i].key)) != i) {
+            fprintf(stderr, "Map validation: Key in slot %zu is unreachable\n", i);
+            errors++;
+        }
+    }
+
+    if (actual_size != priv->size) {
+        fprintf(stderr, "Map validation: Size mismatch (stored: %zu, actual: %zu)\n",
+                priv->size, actual_size);
+        errors++;
+    }
+
+    return errors;
+}
+
+static void map_flat_count_type(void* node, size_t* ints, size_t* floats,
+                                size_t* doubles, size_t* strings,
+                                size_t* pointers, size_t* bytes) {
+    switch (MapNode_GetType(node)) {
+        case MAPNODE_TYPE_INT: (*ints)++; break;
+        case MAPNODE_TYPE_FLOAT: (*floats)++; break;
+        case MAPNODE_TYPE_DOUBLE: (*doubles)++; break;
+        case MAPNODE_TYPE_STRING: (*strings)++; break;
+        case MAPNODE_TYPE_POINTER: (*pointers)++; break;
+        case MAPNODE_TYPE_BYTES: (*bytes)++; break;
+    }
+}
+
+/* Chain statistics report probe lengths, in groups scanned to reach a key */
+bool map_flat_get_stats(Map* self, void* stats_ptr) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    struct MapStats* stats = (struct MapStats*)stats_ptr;
+    size_t total_probes = 0;
+    size_t i;
+
+    if (!priv || !stats) return false;
+
+    memset(stats, 0, sizeof(struct MapStats));
+    stats->entry_count = priv->size;
+    stats->bucket_count = priv->capacity;
+    stats->load_factor = map_flat_load_factor(self);
+
+    for (i = 0; i < priv->capacity; i++) {
+        size_t mask = priv->capacity - 1;
+        size_t group;
+        size_t step = 0;
+        size_t probes = 1;
+
+        if (priv->ctrl[i] < 0) {
+            stats->empty_buckets++;
+            continue;
+        }
+
+        map_flat_count_type(priv->slots[i].key, &stats->int_keys, &stats->float_keys,
+                            &stats->double_keys, &stats->string_keys,
+                            &stats->pointer_keys, &stats->bytes_keys);
+        map_flat_count_type(priv->slots[i].value, &stats->int_values,
+                            &stats->float_values, &stats->double_values,
+                            &stats->string_values, &stats->pointer_values,
+                            &stats->bytes_values);
+
+        group = (size_t)map_flat_hash(priv->slots[i].key) & mask &
+                ~(size_t)(MAP_FLAT_GROUP - 1);
+        while (group != (i & ~(size_t)(MAP_FLAT_GROUP - 1))) {
+            step += MAP_FLAT_GROUP;
+            group = (group + step) & mask;
+            probes++;
+        }
+        total_probes += probes;
+        if (probes > stats->max_chain_length) stats->max_chain_length = probes;
+    }
+
+    stats->average_chain_length = priv->size > 0 ?
+        (float)total_probes / (float)priv->size : 0.0f;
+    stats->total_memory = sizeof(MapFlatPrivate) +
+                          priv->capacity * (sizeof(MapSlot) + 1);
+    return true;
+}
+
+void map_flat_free(Map* self) {
+    MapFlatPrivate* priv = (MapFlatPrivate*)self;
+    if (!priv) return;
+
+    /* Free all entries, then the slots and control bytes together */
+    map_flat_clear(self);
+    free(priv->slots);
+
+    /* Free trampoline functions */
+    if (self->put) trampoline_free(self->put);
+    if (self->get) trampoline_free(self->get);
+    if (self->remove) trampoline_free(self->remove);
+    if (self->contains) trampoline_free(self->contains);
+    if (self->putInt) trampoline_free(self->putInt);
+    if (self->putFloat) trampoline_free(self->putFloat);
+    if (self->putDouble) trampoline_free(self->putDouble);
+    if (self->putString) trampoline_free(self->putString);
+    if (self->putPointer) trampoline_free(self->putPointer);
+    if (self->getInt) trampoline_free(self->getInt);
+    if (self->getFloat) trampoline_free(self->getFloat);
+    if (self->getDouble) trampoline_free(self->getDouble);
+    if (self->getString) trampoline_free(self->getString);
+    if (self->getPointer) trampoline_free(self->getPointer);
+    if (self->size) trampoline_free(self->size);
+    if (self->isEmpty) trampoline_free(self->isEmpty);
+    if (self->capacity) trampoline_free(self->capacity);
+    if (self->loadFactor) trampoline_free(self->loadFactor);
+    if (self->clear) trampoline_free(self->clear);
+    if (self->resize) trampoline_free(self->resize);
+    if (self->getAllKeys) trampoline_free(self->getAllKeys);
+    if (self->getAllValues) trampoline_free(self->getAllValues);
+    if (self->debug) trampoline_free(self->debug);
+    if (self->validate) trampoline_free(self->validate);
+    if (self->getStats) trampoline_free(self->getStats);
+    if (self->free) trampoline_free(self->free);
+
+    /* Free the map structure itself */
+    free(priv);
+}
+
+/* ======================================================================== */
+/* Map Creation Functions                                                   */
+/* ======================================================================== */
+
+static Map* map_flat_make_internal(size_t initial_capacity) {
+    MapFlatPrivate* priv = calloc(1, sizeof(MapFlatPrivate));
+    if (!priv) return NULL;
+
+    if (!map_flat_allocate(priv, map_flat_capacity_for(initial_capacity))) {
+        free(priv);
+        return NULL;
+    }
+
+    /* Get reference to embedded public interface */
+    Map* map = &priv->public;
+
+    /* Create trampoline functions */
+    trampoline_allocations allocations = {0};
+
+    /* Core operations */
+    map->put = trampoline_create_and_track(map_flat_put, map, 2, &allocations);
+    map->get = trampoline_create_and_track(map_flat_get, map, 1, &allocations);
+    map->remove = trampoline_create_and_track(map_flat_remove, map, 1, &allocations);
+    map->contains = trampoline_create_and_track(map_flat_contains, map, 1, &allocations);
+
+    /* Convenience functions, shared with the chained engine */
+    map->putInt = trampoline_create_and_track(map_put_int, map, 2, &allocations);
+    map->putFloat = trampoline_create_and_track(map_put_float, map, 2, &allocations);
+    map->putDouble = trampoline_create_and_track(map_put_double, map, 2, &allocations);
+    map->putString = trampoline_create_and_track(map_put_string, map, 2, &allocations);
+    map->putPointer = trampoline_create_and_track(map_put_pointer, map, 2, &allocations);
+    map->getInt = trampoline_create_and_track(map_get_int, map, 2, &allocations);
+    map->getFloat = trampoline_create_and_track(map_get_float, map, 2, &allocations);
+    map->getDouble = trampoline_create_and_track(map_get_double, map, 2, &allocations);
+    map->getString = trampoline_create_and_track(map_get_string, map, 1, &allocations);
+    map->getPointer = trampoline_create_and_track(map_get_pointer, map, 1, &allocations);
+
+    /* Information functions */
+    map->size = trampoline_create_and_track(map_flat_size, map, 0, &allocations);
+    map->isEmpty = trampoline_create_and_track(map_flat_is_empty, map, 0, &allocations);
+    map->capacity = trampoline_create_and_track(map_flat_capacity, map, 0, &allocations);
+    map->loadFactor = trampoline_create_and_track(map_flat_load_factor, map, 0, &allocations);
+    map->clear = trampoline_create_and_track(map_flat_clear, map, 0, &allocations);
+    map->resize = trampoline_create_and_track(map_flat_resize, map, 1, &allocations);
+
+    /* Bulk operations */
+    map->getAllKeys = trampoline_create_and_track(map_flat_get_all_keys, map, 1, &allocations);
+    map->getAllValues = trampoline_create_and_track(map_flat_get_all_values, map, 1, &allocations);
+
+    /* Debug functions */
+    map->debug = trampoline_create_and_track(map_flat_debug, map, 1, &allocations);
+    map->validate = trampoline_create_and_track(map_flat_validate, map, 0, &allocations);
+    map->getStats = trampoline_create_and_track(map_flat_get_stats, map, 1, &allocations);
+
+    /* Management */
+    map->free = trampoline_create_and_track(map_flat_free, map, 0, &allocations);
+
+    if (!trampolines_validate(&allocations)) {
+        free(priv->slots);
+        free(priv);
+        return NULL;
+    }
+
+    return map;
+}
+
+Map* MapMakeFlat(void) {
+    return map_flat_make_internal(14);
+}
+
+Map* MapMakeFlatWithCapacity(size_t initial_capacity) {
+    return map_flat_make_internal(initial_capacity);
+}
@@ -17,6 +17,7 @@
 typedef struct MapEntry {
     void* key;                    /* MapNode key */
     void* value;                  /* MapNode value */
+    size_t hash;                  /* MapNode_Hash(key), kept for rehashing */
     struct MapEntry* next;        /* Next entry in collision chain */
 } MapEntry;
 
@@ -24,10 +25,19 @@ typedef struct MapPrivate {
     Map public;                   /* Public interface MUST be first */
     MapEntry** buckets;           /* Array of bucket heads */
     size_t capacity;              /* Number of buckets */
-    size_t size;                  /* Number of entries */
+    size_t size;                  /* Number of entries, in both tables */
     float max_load_factor;        /* Resize threshold */
+    MapEntry** old_buckets;       /* Table being migrated from, or NULL */
+    size_t old_capacity;          /* Number of old buckets */
+    size_t migrate_index;         /* Old buckets below this are empty */
 } MapPrivate;
 
+/* Old buckets moved per put or remove while growing. The old table has
+ * at most 0.75 entries per bucket, and the new one takes another
+ * capacity * 0.75 puts to fill, so migration finishes well before the
+ * next growth and every operation does a bounded amount of work. */
+#define MAP_MIGRATE_BUCKETS 4
+
 /* ======================================================================== */
 /* Utility Functions                                                        */
 /* ======================================================================== */
@@ -43,12 +53,13 @@ static size_t next_power_of_2(size_t n) {
     return result;
 }
 
-static MapEntry* map_entry_create(void* key, void* value) {
+static MapEntry* map_entry_create(void* key, void* value, size_t hash) {
     MapEntry* entry = calloc(1, sizeof(MapEntry));
     if (!entry) return NULL;
     
     entry->key = key;
     entry->value = value;
+    entry->hash = hash;
     entry->next = NULL;
     return entry;
 }
@@ -74,17 +85,30 @@ static void map_entry_chain_free(MapEntry* head) {
 /* Internal Map Operations                                                  */
 /* ======================================================================== */
 
-static MapEntry* map_find_entry(MapPrivate* priv, void* key, size_t* out_bucket) {
+/* Head of the chain that holds hash: in the old table until its bucket
+ * has been migrated, in the new one after */
+static MapEntry** map_chain_for(MapPrivate* priv, size_t hash) {
+    if (priv->old_buckets) {
+        size_t old_bucket = hash & (priv->old_capacity - 1);
+        if (old_bucket >= priv->migrate_index) {
+            return &priv->old_buckets[old_bucket];
+        }
+    }
+    return &priv->buckets[hash & (priv->capacity - 1)];
+}
+
+static MapEntry* map_find_entry(MapPrivate* priv, void* key, MapEntry*** out_chain) {
     if (!priv || !MapNode_IsValid(key)) return NULL;
     
     size_t hash = MapNode_Hash(key);
-    size_t bucket = hash & (priv->capacity - 1);
+    MapEntry** chain = map_chain_for(priv, hash);
     
-    if (out_bucket) *out_bucket = bucket;
+    if (out_chain) *out_chain = chain;
     
-    MapEntry* current = priv->buckets[bucket];
+    /* Only keys with the same hash can be equal */
+    MapEntry* current = *chain;
     while (current) {
-        if (MapNode_Compare(current->key, key) == 0) {
+        if (current->hash == hash && MapNode_Compare(current->key, key) == 0) {
             return current;
         }
         current = current->next;
@@ -93,7 +117,58 @@ static MapEntry* map_find_entry(MapPrivate* priv, void* key, size_t* out_bucket)
     return NULL;
 }
 
+/* Move up to count old buckets into the new table */
+static void map_migrate(MapPrivate* priv, size_t count) {
+    if (!priv->old_buckets) return;
+    
+    while (count-- > 0 && priv->migrate_index < priv->old_capacity) {
+        MapEntry* current = priv->old_buckets[priv->migrate_index];
+        priv->old_buckets[priv->migrate_index++] = NULL;
+        
+        while (current) {
+            MapEntry* next = current->next;
+            size_t bucket = current->hash & (priv->capacity - 1);
+            
+            current->next = priv->buckets[bucket];
+            priv->buckets[bucket] = current;
+            current = next;
+        }
+    }
+    
+    if (priv->migrate_index == priv->old_capacity) {
+        free(priv->old_buckets);
+        priv->old_buckets = NULL;
+        priv->old_capacity = 0;
+        priv->migrate_index = 0;
+    }
+}
+
+/* For walks over every entry, which then see a single table */
+static void map_finish_migration(MapPrivate* priv) {
+    map_migrate(priv, priv->old_capacity);
+}
+
+/* Start growing: the current table becomes the old one, drained by
+ * map_migrate() a few buckets at a time */
+static bool map_grow_incremental(MapPrivate* priv, size_t new_capacity) {
+    MapEntry** buckets;
+    
+    map_finish_migration(priv);
+    
+    buckets = calloc(new_capacity, sizeof(MapEntry*));
+    if (!buckets) return false;
+    
+    priv->old_buckets = priv->buckets;
+    priv->old_capacity = priv->capacity;
+    priv->migrate_index = 0;
+    priv->buckets = buckets;
+    priv->capacity = new_capacity;
+    return true;
+}
+
 static bool map_resize_internal(MapPrivate* priv, size_t new_capacity) {
+    map_finish_migration(priv);
+    
     new_capacity = next_power_of_2(new_capacity);
     if (new_capacity == priv->capacity) return true;
     
@@ -118,8 +193,7 @@ static bool map_resize_internal(MapPrivate* priv, size_t new_capacity) {
             MapEntry* next = current->next;
             
             /* Rehash this entry */
-            size_t hash = MapNode_Hash(current->key);
-            size_t bucket = hash & (new_capacity - 1);
+            size_t bucket = current->hash & (new_capacity - 1);
             
             current->next = priv->buckets[bucket];
             priv->buckets[bucket] = current;
@@ -137,7 +211,7 @@ static bool map_resize_internal(MapPrivate* priv, size_t new_capacity) {
 static void map_maybe_resize(MapPrivate* priv) {
     float load = (float)priv->size / (float)priv->capacity;
     if (load > priv->max_load_factor) {
-        map_resize_internal(priv, priv->capacity * 2);
+        map_grow_incremental(priv, priv->capacity * 2);
     }
 }
 
@@ -151,8 +225,10 @@ bool map_put(Map* self, void* key, void* value) {
         return false;
     }
     
-    size_t bucket;
-    MapEntry* existing = map_find_entry(priv, key, &bucket);
+    map_migrate(priv, MAP_MIGRATE_BUCKETS);
+    
+    MapEntry** chain;
+    MapEntry* existing = map_find_entry(priv, key, &chain);
     
     if (existing) {
         /* Update existing entry - free old value, store new one */
@@ -162,12 +238,12 @@ bool map_put(Map* self, void* key, void* value) {
     }
     
     /* Create new entry */
-    MapEntry* entry = map_entry_create(key, value);
+    MapEntry* entry = map_entry_create(key, value, MapNode_Hash(key));
     if (!entry) return false;
     
     /* Insert at head of bucket chain */
-    entry->next = priv->buckets[bucket];
-    priv->buckets[bucket] = entry;
+    entry->next = *chain;
+    *chain = entry;
     priv->size++;
     
     map_maybe_resize(priv);
@@ -186,12 +262,12 @@ bool map_remove(Map* self, void* key) {
     MapPrivate* priv = (MapPrivate*)self;
     if (!priv || !MapNode_IsValid(key)) return false;
     
-    size_t hash = MapNode_Hash(key);
-    size_t bucket = hash & (priv->capacity - 1);
+    map_migrate(priv, MAP_MIGRATE_BUCKETS);
     
-    MapEntry** current = &priv->buckets[bucket];
+    size_t hash = MapNode_Hash(key);
+    MapEntry** current = map_chain_for(priv, hash);
     while (*current) {
-        if (MapNode_Compare((*current)->key, key) == 0) {
+        if ((*current)->hash == hash && MapNode_Compare((*current)->key, key) == 0) {
             MapEntry* to_remove = *current;
             *current = to_remove->next;
             map_entry_free(to_remove);
@@ -262,40 +338,35 @@ int map_get_int(Map* self, void* key, int default_value) {
     void* value = self->get(key);
     if (!MapNode_IsValid(value)) return default_value;
     
-    MapNode* node = MapNode_Cast(value);
-    return node && node->isInt() ? node->asInt() : default_value;
+    return MapNode_GetType(value) == MAPNODE_TYPE_INT ? MapNode_AsInt(value) : default_value;
 }
 
 float map_get_float(Map* self, void* key, float default_value) {
     void* value = self->get(key);
     if (!MapNode_IsValid(value)) return default_value;
     
-    MapNode* node = MapNode_Cast(value);
-    return node && node->isFloat() ? node->asFloat() : default_value;
+    return MapNode_GetType(value) == MAPNODE_TYPE_FLOAT ? MapNode_AsFloat(value) : default_value;
 }
 
 double map_get_double(Map* self, void* key, double default_value) {
     void* value = self->get(key);
     if (!MapNode_IsValid(value)) return default_value;
     
-    MapNode* node = MapNode_Cast(value);
-    return node && node->isDouble() ? node->asDouble() : default_value;
+    return MapNode_GetType(value) == MAPNODE_TYPE_DOUBLE ? MapNode_AsDouble(value) : default_value;
 }
 
 const char* map_get_string(Map* self, void* key) {
     void* value = self->get(key);
     if (!MapNode_IsValid(value)) return NULL;
     
-    MapNode* node = MapNode_Cast(value);
-    return node && node->isString() ? node->asString() : NULL;
+    return MapNode_GetType(value) == MAPNODE_TYPE_STRING ? MapNode_AsString(value) : NULL;
 }
 
 void* map_get_pointer(Map* self, void* key) {
     void* value = self->get(key);
     if (!MapNode_IsValid(value)) return NULL;
     
-    MapNode* node = MapNode_Cast(value);
-    return node && node->isPointer() ? node->asPointer() : NULL;
+    return MapNode_GetType(value) == MAPNODE_TYPE_POINTER ? MapNode_AsPointer(value) : NULL;
 }
 
 /* ======================================================================== */
@@ -328,6 +399,16 @@ void map_clear(Map* self) {
     
     if (!priv) return;
     
+    if (priv->old_buckets) {
+        for (i = priv->migrate_index; i < priv->old_capacity; i++) {
+            map_entry_chain_free(priv->old_buckets[i]);
+        }
+        free(priv->old_buckets);
+        priv->old_buckets = NULL;
+        priv->old_capacity = 0;
+        priv->migrate_index = 0;
+    }
+    
     for (i = 0; i < priv->capacity; i++) {
         map_entry_chain_free(priv->buckets[i]);
         priv->buckets[i] = NULL;
@@ -350,6 +431,8 @@ void** map_get_all_keys(Map* self, size_t* out_count) {
         return NULL;
     }
     
+    map_finish_migration(priv);
+    
     if (priv->size == 0) {
         *out_count = 0;
         return NULL;
@@ -384,6 +467,8 @@ void** map_get_all_values(Map* self, size_t* out_count) {
         return NULL;
     }
     
+    map_finish_migration(priv);
+    
     if (priv->size == 0) {
         *out_count = 0;
         return NULL;
@@ -423,6 +508,8 @@ void map_debug(Map* self, size_t max_entries) {
         return;
     }
     
+    map_finish_migration(priv);
+    
     printf("Map Debug Info:\n");
     printf("  Size: %zu, Capacity: %zu, Load Factor: %.2f\n", 
            priv->size, priv->capacity, map_load_factor(self));
@@ -462,6 +549,8 @@ size_t map_validate(Map* self) {
         return 1;
     }
     
+    map_finish_migration(priv);
+    
     {
         size_t errors = 0;
         size_t actual_size = 0;
@@ -501,6 +590,8 @@ bool map_get_stats(Map* self, void* stats_ptr) {
     struct MapStats* stats = (struct MapStats*)stats_ptr;
     if (!priv || !stats) return false;
     
+    map_finish_migration(priv);
+    
     memset(stats, 0, sizeof(struct MapStats));
     
     stats->entry_count = priv->size;
@@ -526,29 +617,23 @@ bool map_get_stats(Map* self, void* stats_ptr) {
                 total_chain_length++;
                 
                 /* Count key types */
-                MapNode* key_node = MapNode_Cast(current->key);
-                if (key_node) {
-                    switch (key_node->type()) {
-                        case MAPNODE_TYPE_INT: stats->int_keys++; break;
-                        case MAPNODE_TYPE_FLOAT: stats->float_keys++; break;
-                        case MAPNODE_TYPE_DOUBLE: stats->double_keys++; break;
-                        case MAPNODE_TYPE_STRING: stats->string_keys++; break;
-                        case MAPNODE_TYPE_POINTER: stats->pointer_keys++; break;
-                        case MAPNODE_TYPE_BYTES: stats->bytes_keys++; break;
-                    }
+                switch (MapNode_GetType(current->key)) {
+                    case MAPNODE_TYPE_INT: stats->int_keys++; break;
+                    case MAPNODE_TYPE_FLOAT: stats->float_keys++; break;
+                    case MAPNODE_TYPE_DOUBLE: stats->double_keys++; break;
+                    case MAPNODE_TYPE_STRING: stats->string_keys++; break;
+                    case MAPNODE_TYPE_POINTER: stats->pointer_keys++; break;
+                    case MAPNODE_TYPE_BYTES: stats->bytes_keys++; break;
                 }
                 
                 /* Count value types */
-                MapNode* value_node = MapNode_Cast(current->value);
-                if (value_node) {
-                    switch (value_node->type()) {
-                        case MAPNODE_TYPE_INT: stats->int_values++; break;
-                        case MAPNODE_TYPE_FLOAT: stats->float_values++; break;
-                        case MAPNODE_TYPE_DOUBLE: stats->double_values++; break;
-                        case MAPNODE_TYPE_STRING: stats->string_values++; break;
-                        case MAPNODE_TYPE_POINTER: stats->pointer_values++; break;
-                        case MAPNODE_TYPE_BYTES: stats->bytes_values++; break;
-                    }
+                switch (MapNode_GetType(current->value)) {
+                    case MAPNODE_TYPE_INT: stats->int_values++; break;
+                    case MAPNODE_TYPE_FLOAT: stats->float_values++; break;
+                    case MAPNODE_TYPE_DOUBLE: stats->double_values++; break;
+                    case MAPNODE_TYPE_STRING: stats->string_values++; break;
+                    case MAPNODE_TYPE_POINTER: stats->pointer_values++; break;
+                    case MAPNODE_TYPE_BYTES: stats->bytes_values++; break;
                 }
                 
                 current = current->next;
@@ -12,7 +12,15 @@
  *   uint32_t magic <- Magic bytes for validation (offset sizeof(void*))
  *   uint32_t type  <- Type identifier (offset sizeof(void*) + sizeof(uint32_t))
  *   ... rest of private data ...
- *   MapNode public <- Trampoline interface
+ *   MapNode public <- Trampoline interface, created on first MapNode_Cast()
+ *
+ * Nodes live in cells of aligned slabs, so MapNode_IsValid can reject a
+ * foreign pointer from its address alone and only reads magic bytes that
+ * belong to a slab. A node costs one cell and no trampolines until
+ * something asks for the MapNode interface; the functions below never do.
+ * On 64-bit targets MapNodeImmediateInt() and MapNodeImmediateDouble() go
+ * further and encode the value in the pointer itself, with no allocation
+ * at all.
  *
  * @author Trampoline Map Example
  * @date 2025
@@ -199,7 +207,8 @@ typedef struct MapNode {
  * @brief Check if a void* is a valid MapNode
  * @param ptr Pointer to test
  * @return true if ptr points to a valid MapNode, false otherwise
- * @note Safe to call on any pointer, including NULL
+ * @note Safe to call on any pointer, including NULL and freed nodes: memory
+ *       outside the MapNode slabs is never read
  */
 bool MapNode_IsValid(const void* ptr);
 
@@ -218,11 +227,21 @@ MapNodeType MapNode_GetType(const void* ptr);
  */
 uint32_t MapNode_GetMagic(const void* ptr);
 
+/**
+ * @brief Check if a MapNode is an immediate (value encoded in the pointer)
+ * @param ptr Pointer to test
+ * @return true for nodes from MapNodeImmediateInt/MapNodeImmediateDouble
+ *         that were encoded without allocating
+ */
+bool MapNode_IsImmediate(const void* ptr);
+
 /**
  * @brief Cast a void* to MapNode interface if valid
  * @param ptr Pointer to cast
- * @return MapNode interface pointer, or NULL if invalid
+ * @return MapNode interface pointer, or NULL if invalid or immediate
  * @note Always check return value before use
+ * @note The first cast of a node creates its trampolines; prefer the
+ *       MapNode_As* functions when only the value is needed
  */
 MapNode* MapNode_Cast(void* ptr);
 
@@ -233,6 +252,17 @@ MapNode* MapNode_Cast(void* ptr);
  */
 size_t MapNode_GetSize(const void* ptr);
 
+/**
+ * @brief Read a MapNode's value without casting to MapNode
+ * @param ptr MapNode to read, allocated or immediate
+ * @return The value, or 0 / 0.0 / NULL if invalid or of another type
+ */
+int MapNode_AsInt(const void* ptr);
+float MapNode_AsFloat(const void* ptr);
+double MapNode_AsDouble(const void* ptr);
+const char* MapNode_AsString(const void* ptr);
+void* MapNode_AsPointer(const void* ptr);
+
 /* ======================================================================== */
 /* Constructor Functions                                                    */
 /* ======================================================================== */
@@ -283,6 +313,26 @@ void* MapNodeFromPointer(void* ptr);
  */
 void* MapNodeFromBytes(const void* data, size_t size);
 
+/**
+ * @brief Create an integer MapNode without allocating
+ * @param value Integer value to store
+ * @return MapNode as void*; never NULL on 64-bit targets
+ * @note The value lives in the pointer: MapNode_Free is a no-op and
+ *       MapNode_Cast returns NULL, so read it with MapNode_AsInt
+ * @note Falls back to MapNodeFromInt on 32-bit targets
+ */
+void* MapNodeImmediateInt(int value);
+
+/**
+ * @brief Create a double MapNode without allocating, when it fits
+ * @param value Double value to store
+ * @return MapNode as void*, or NULL on failure
+ * @note Doubles whose low 16 mantissa bits are zero (small integers,
+ *       halves, quarters, ...) are immediates like MapNodeImmediateInt;
+ *       others fall back to MapNodeFromDouble
+ */
+void* MapNodeImmediateDouble(double value);
+
 /**
  * @brief Create a MapNode by copying another MapNode
  * @param other MapNode to copy (can be void* or MapNode*)
@@ -324,11 +374,21 @@ int MapNode_ToString(const void* ptr, char* buffer, size_t buffer_size);
  */
 int MapNode_Compare(const void* a, const void* b);
 
+/**
+ * @brief Check two MapNodes for equal type and value
+ * @param a First MapNode
+ * @param b Second MapNode
+ * @return true if equal, false if different or either is invalid
+ * @note Nodes whose hashes differ are rejected without comparing values
+ */
+bool MapNode_Equals(const void* a, const void* b);
+
 /**
  * @brief Hash a MapNode for use in hash tables
  * @param ptr MapNode to hash
  * @return Hash value
- * @note Consistent hash based on type and value
+ * @note Consistent hash based on type and value, covering the whole value
+ * @note Computed once when the node is created, so this is a field read
  */
 size_t MapNode_Hash(const void* ptr);
 
@@ -14,25 +14,311 @@
 
 /**
  * @brief Private implementation of MapNode
- * 
+ *
  * Memory layout is crucial for magic byte introspection:
- * - data pointer at offset 0 (this is what gets passed around as void*)  
+ * - data pointer at offset 0 (this is what gets passed around as void*)
  * - magic bytes immediately after data pointer for validation
  * - type information follows magic bytes
  * - public interface embedded later in the struct
+ *
+ * A node is one cell of a slab (see below). Scalars live in inline_value,
+ * short strings and bytes in the rest of the cell, and longer ones in a
+ * separate allocation; data points at whichever holds the value. The
+ * trampolines behind the public interface are only created the first time
+ * MapNode_Cast() asks for it.
  */
 typedef struct MagicMapNode {
     void* data;              /* Offset 0 - the pointer passed around */
     uint32_t magic;          /* Offset sizeof(void*) - magic bytes */
     uint32_t type;           /* Offset sizeof(void*) + 4 - type enum */
     size_t data_size;        /* Size of data pointed to by data pointer */
-    bool owns_data;          /* Whether we need to free the data */
+    size_t hash;             /* Hash of type and value, set at creation */
+    bool has_interface;      /* Whether the trampolines in public exist */
+    bool owns_data;          /* Whether data was allocated separately */
+    
+    union {                  /* Storage for int, float, double and pointer */
+        int i;
+        float f;
+        double d;
+        void* p;
+    } inline_value;
     
     MapNode public;          /* Public trampoline interface */
     
-    /* Additional private fields can go here */
+    /* Short strings and bytes follow the struct in the same cell */
 } MagicMapNode;
 
+/* ======================================================================== */
+/* Slab Allocation                                                          */
+/* ======================================================================== */
+
+/*
+ * Nodes are carved out of 1 MiB slabs aligned to their size, so the slab
+ * holding any address is that address with the low bits cleared. A
+ * pointer is a node only if it falls within the range of all slabs, its
+ * slab base is in the registry, and it sits on a cell boundary below the
+ * slab's high-water mark. Only then are the magic bytes read, and they are
+ * always inside memory the allocator owns. Foreign pointers are rejected
+ * without being dereferenced. Like the rest of MapNode, this is not
+ * thread-safe.
+ */
+
+#define MAPNODE_SLAB_SIZE    ((uintptr_t)1 << 20)  /* Bytes per slab, and its alignment */
+#define MAPNODE_SLAB_SHIFT   20
+#define MAPNODE_CELL_PAYLOAD 48                    /* Short-value bytes after the struct */
+
+typedef struct MapNodeSlab {
+    void* raw;                       /* What malloc returned */
+    size_t live;                     /* Cells in use */
+    size_t bump;                     /* Cells handed out at least once */
+    void* free_cells;                /* Freed cells, linked through their data field */
+    struct MapNodeSlab* prev_open;   /* Slabs with free cells */
+    struct MapNodeSlab* next_open;
+    bool open;                       /* Whether the slab is on the open list */
+} MapNodeSlab;
+
+#define MAPNODE_CELL_SIZE \
+    ((sizeof(MagicMapNode) + MAPNODE_CELL_PAYLOAD + 15) & ~(size_t)15)
+#define MAPNODE_SLAB_HEADER  ((sizeof(MapNodeSlab) + 63) & ~(size_t)63)
+#define MAPNODE_SLAB_CELLS   ((MAPNODE_SLAB_SIZE - MAPNODE_SLAB_HEADER) / MAPNODE_CELL_SIZE)
+
+/* Released slabs leave this behind in the registry so probing continues */
+#define MAPNODE_SLAB_TOMBSTONE ((MapNodeSlab*)1)
+
+static struct {
+    MapNodeSlab** table;             /* Open-addressed set of slab bases */
+    size_t capacity;                 /* Power of 2 */
+    size_t used;                     /* Slabs plus tombstones */
+    uintptr_t low, high;             /* Addresses covered by every slab so far */
+    MapNodeSlab* open;               /* Slabs with free cells */
+} mapnode_slabs;
+
+static size_t mapnode_slab_index(uintptr_t base, size_t capacity) {
+    return (size_t)(base >> MAPNODE_SLAB_SHIFT) & (capacity - 1);
+}
+
+static bool mapnode_registry_add(MapNodeSlab* slab) {
+    size_t i;
+
+    if ((mapnode_slabs.used + 1) * 2 > mapnode_slabs.capacity) {
+        /* Rebuild at twice the live slabs, dropping tombstones */
+        size_t capacity = 16;
+        MapNodeSlab** table;
+
+        while (capacity < (mapnode_slabs.used + 1) * 4) capacity <<= 1;
+        table = calloc(capacity, sizeof(MapNodeSlab*));
+        if (!table) return false;
+
+        mapnode_slabs.used = 0;
+        for (i = 0; i < mapnode_slabs.capacity; i++) {
+            MapNodeSlab* entry = mapnode_slabs.table[i];
+            size_t j;
+
+            if (!entry || entry == MAPNODE_SLAB_TOMBSTONE) continue;
+            j = mapnode_slab_index((uintptr_t)entry, capacity);
+            while (table[j]) j = (j + 1) & (capacity - 1);
+            table[j] = entry;
+            mapnode_slabs.used++;
+        }
+        free(mapnode_slabs.table);
+        mapnode_slabs.table = table;
+        mapnode_slabs.capacity = capacity;
+    }
+
+    i = mapnode_slab_index((uintptr_t)slab, mapnode_slabs.capacity);
+    while (mapnode_slabs.table[i] && mapnode_slabs.table[i] != MAPNODE_SLAB_TOMBSTONE) {
+        i = (i + 1) & (mapnode_slabs.capacity - 1);
+    }
+    if (!mapnode_slabs.table[i]) mapnode_slabs.used++;
+    mapnode_slabs.table[i] = slab;
+
+    if (mapnode_slabs.low == 0 || (uintptr_t)slab < mapnode_slabs.low) {
+        mapnode_slabs.low = (uintptr_t)slab;
+    }
+    if ((uintptr_t)slab + MAPNODE_SLAB_SIZE > mapnode_slabs.high) {
+        mapnode_slabs.high = (uintptr_t)slab + MAPNODE_SLAB_SIZE;
+    }
+    return true;
+}
+
+/* Registry slot holding the slab that would contain address, or NULL */
+static MapNodeSlab** mapnode_registry_find(uintptr_t address) {
+    uintptr_t base = address & ~(MAPNODE_SLAB_SIZE - 1);
+    size_t i;
+
+    if (address < mapnode_slabs.low || address >= mapnode_slabs.high) return NULL;
+
+    i = mapnode_slab_index(base, mapnode_slabs.capacity);
+    while (mapnode_slabs.table[i]) {
+        if ((uintptr_t)mapnode_slabs.table[i] == base) return &mapnode_slabs.table[i];
+        i = (i + 1) & (mapnode_slabs.capacity - 1);
+    }
+    return NULL;
+}
+
+/* Whether ptr is the start of a cell that has been handed out */
+static bool mapnode_is_cell(const void* ptr) {
+    MapNodeSlab** entry = mapnode_registry_find((uintptr_t)ptr);
+    size_t offset;
+
+    if (!entry) return false;
+
+    offset = (size_t)((uintptr_t)ptr - (uintptr_t)*entry);
+    if (offset < MAPNODE_SLAB_HEADER) return false;
+    offset -= MAPNODE_SLAB_HEADER;
+    return offset % MAPNODE_CELL_SIZE == 0 && offset / MAPNODE_CELL_SIZE < (*entry)->bump;
+}
+
+static void mapnode_slab_open(MapNodeSlab* slab) {
+    slab->open = true;
+    slab->prev_open = NULL;
+    slab->next_open = mapnode_slabs.open;
+    if (mapnode_slabs.open) mapnode_slabs.open->prev_open = slab;
+    mapnode_slabs.open = slab;
+}
+
+static void mapnode_slab_close(MapNodeSlab* slab) {
+    if (slab->prev_open) slab->prev_open->next_open = slab->next_open;
+    else mapnode_slabs.open = slab->next_open;
+    if (slab->next_open) slab->next_open->prev_open = slab->prev_open;
+    slab->open = false;
+}
+
+static MapNodeSlab* mapnode_slab_create(void) {
+    /* Twice the size, to find an aligned slab inside; the unused part is
+     * never touched, so it costs address space but no memory */
+    void* raw = malloc(2 * MAPNODE_SLAB_SIZE);
+    MapNodeSlab* slab;
+
+    if (!raw) return NULL;
+
+    slab = (MapNodeSlab*)(((uintptr_t)raw + MAPNODE_SLAB_SIZE - 1) & ~(MAPNODE_SLAB_SIZE - 1));
+    memset(slab, 0, sizeof(MapNodeSlab));
+    slab->raw = raw;
+
+    if (!mapnode_registry_add(slab)) {
+        free(raw);
+        return NULL;
+    }
+    mapnode_slab_open(slab);
+    return slab;
+}
+
+static MagicMapNode* mapnode_cell_alloc(void) {
+    MapNodeSlab* slab = mapnode_slabs.open;
+    void* cell;
+
+    if (!slab) {
+        slab = mapnode_slab_create();
+        if (!slab) return NULL;
+    }
+
+    if (slab->free_cells) {
+        cell = slab->free_cells;
+        slab->free_cells = *(void**)cell;
+    } else {
+        cell = (char*)slab + MAPNODE_SLAB_HEADER + slab->bump++ * MAPNODE_CELL_SIZE;
+    }
+    slab->live++;
+
+    if (!slab->free_cells && slab->bump == MAPNODE_SLAB_CELLS) {
+        mapnode_slab_close(slab);
+    }
+
+    memset(cell, 0, MAPNODE_CELL_SIZE);
+    return (MagicMapNode*)cell;
+}
+
+/* The cell's magic must already be cleared, so it no longer validates */
+static void mapnode_cell_free(MagicMapNode* node) {
+    MapNodeSlab* slab = (MapNodeSlab*)((uintptr_t)node & ~(MAPNODE_SLAB_SIZE - 1));
+
+    node->data = slab->free_cells;
+    slab->free_cells = node;
+    slab->live--;
+
+    if (!slab->open) mapnode_slab_open(slab);
+
+    /* Keep one empty slab around so alternating alloc/free does not thrash */
+    if (slab->live == 0 && (slab->prev_open || slab->next_open)) {
+        *mapnode_registry_find((uintptr_t)slab) = MAPNODE_SLAB_TOMBSTONE;
+        mapnode_slab_close(slab);
+        free(slab->raw);
+    }
+}
+
+/* ======================================================================== */
+/* Immediate Encoding                                                       */
+/* ======================================================================== */
+
+/*
+ * On 64-bit targets an int, or a double whose low 16 mantissa bits are
+ * zero, can travel in the pointer itself. The top 16 bits hold a tag that
+ * no user-space pointer has (it is non-canonical on x86-64 and outside
+ * every arm64 address range, tagged or not), so these are recognized
+ * without touching memory and need no allocation.
+ */
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define MAPNODE_IMMEDIATES 1
+#define MAPNODE_IMMEDIATE_INT    0xFFF9u
+#define MAPNODE_IMMEDIATE_DOUBLE 0xFFFAu
+
+static unsigned mapnode_immediate_tag(const void* ptr) {
+    unsigned tag = (unsigned)((uintptr_t)ptr >> 48);
+    return tag == MAPNODE_IMMEDIATE_INT || tag == MAPNODE_IMMEDIATE_DOUBLE ? tag : 0;
+}
+#else
+#define MAPNODE_IMMEDIATES 0
+
+static unsigned mapnode_immediate_tag(const void* ptr) {
+    (void)ptr;
+    return 0;
+}
+#endif
+
+/**
+ * @brief Type, value and size of any MapNode, immediate or allocated
+ * @note data may point into the view itself, so views are not copied
+ */
+typedef struct MapNodeView {
+    uint32_t type;
+    const void* data;
+    size_t size;
+    union {
+        int i;
+        double d;
+    } decoded;
+} MapNodeView;
+
+static bool mapnode_view(const void* ptr, MapNodeView* view) {
+    if (!MapNode_IsValid(ptr)) return false;
+    
+#if MAPNODE_IMMEDIATES
+    switch (mapnode_immediate_tag(ptr)) {
+        case MAPNODE_IMMEDIATE_INT:
+            view->type = MAPNODE_TYPE_INT;
+            view->decoded.i = (int)(uint32_t)(uintptr_t)ptr;
+            view->data = &view->decoded.i;
+            view->size = sizeof(int);
+            return true;
+        case MAPNODE_IMMEDIATE_DOUBLE: {
+            uint64_t bits = ((uint64_t)(uintptr_t)ptr & 0xFFFFFFFFFFFFULL) << 16;
+            view->type = MAPNODE_TYPE_DOUBLE;
+            memcpy(&view->decoded.d, &bits, sizeof(double));
+            view->data = &view->decoded.d;
+            view->size = sizeof(double);
+            return true;
+        }
+    }
+#endif
+    
+    const MagicMapNode* node = (const MagicMapNode*)ptr;
+    view->type = node->type;
+    view->data = node->data;
+    view->size = node->data_size;
+    return true;
+}
+
 /* ======================================================================== */
 /* Helper Macros for Trampoline Functions                                  */
 /* ======================================================================== */
@@ -67,8 +353,14 @@ typedef struct MagicMapNode {
 /* Introspection Functions                                                  */
 /* ======================================================================== */
 
+static MapNode* mapnode_interface(MagicMapNode* node);
+
 bool MapNode_IsValid(const void* ptr) {
     if (!ptr) return false;
+    if (mapnode_immediate_tag(ptr)) return true;
+    
+    /* Anything that is not one of our cells is never dereferenced */
+    if (!mapnode_is_cell(ptr)) return false;
     
     /* Calculate where magic bytes should be */
     const char* byte_ptr = (const char*)ptr;
@@ -84,9 +376,20 @@ bool MapNode_IsValid(const void* ptr) {
             magic == MAPNODE_MAGIC_BYTES);
 }
 
+bool MapNode_IsImmediate(const void* ptr) {
+    return mapnode_immediate_tag(ptr) != 0;
+}
+
 MapNodeType MapNode_GetType(const void* ptr) {
     if (!MapNode_IsValid(ptr)) return 0;
     
+#if MAPNODE_IMMEDIATES
+    switch (mapnode_immediate_tag(ptr)) {
+        case MAPNODE_IMMEDIATE_INT: return MAPNODE_TYPE_INT;
+        case MAPNODE_IMMEDIATE_DOUBLE: return MAPNODE_TYPE_DOUBLE;
+    }
+#endif
+    
     const char* byte_ptr = (const char*)ptr;
     const uint32_t* type_ptr = (const uint32_t*)(byte_ptr + sizeof(void*) + sizeof(uint32_t));
     
@@ -96,6 +399,15 @@ MapNodeType MapNode_GetType(const void* ptr) {
 uint32_t MapNode_GetMagic(const void* ptr) {
     if (!ptr) return 0;
     
+#if MAPNODE_IMMEDIATES
+    switch (mapnode_immediate_tag(ptr)) {
+        case MAPNODE_IMMEDIATE_INT: return MAPNODE_MAGIC_INT;
+        case MAPNODE_IMMEDIATE_DOUBLE: return MAPNODE_MAGIC_DOUBLE;
+    }
+#endif
+    
+    if (!mapnode_is_cell(ptr)) return 0;
+    
     const char* byte_ptr = (const char*)ptr;
     const uint32_t* magic_ptr = (const uint32_t*)(byte_ptr + sizeof(void*));
     
@@ -103,18 +415,51 @@ uint32_t MapNode_GetMagic(const void* ptr) {
 }
 
 MapNode* MapNode_Cast(void* ptr) {
-    if (!MapNode_IsValid(ptr)) return NULL;
+    /* Immediates have no storage to hang an interface on */
+    if (!MapNode_IsValid(ptr) || mapnode_immediate_tag(ptr)) return NULL;
     
     /* ptr points to MagicMapNode.data, we need to get to MagicMapNode.public */
     MagicMapNode* priv = (MagicMapNode*)ptr;
-    return &priv->public;
+    return mapnode_interface(priv);
 }
 
 size_t MapNode_GetSize(const void* ptr) {
-    if (!MapNode_IsValid(ptr)) return 0;
-    
-    const MagicMapNode* priv = (const MagicMapNode*)ptr;
-    return priv->data_size;
+    MapNodeView view;
+    return mapnode_view(ptr, &view) ? view.size : 0;
+}
+
+/* ======================================================================== */
+/* Direct Value Access                                                      */
+/* ======================================================================== */
+
+int MapNode_AsInt(const void* ptr) {
+    MapNodeView view;
+    if (!mapnode_view(ptr, &view) || view.type != MAPNODE_TYPE_INT) return 0;
+    return *(const int*)view.data;
+}
+
+float MapNode_AsFloat(const void* ptr) {
+    MapNodeView view;
+    if (!mapnode_view(ptr, &view) || view.type != MAPNODE_TYPE_FLOAT) return 0.0f;
+    return *(const float*)view.data;
+}
+
+double MapNode_AsDouble(const void* ptr) {
+    MapNodeView view;
+    if (!mapnode_view(ptr, &view) || view.type != MAPNODE_TYPE_DOUBLE) return 0.0;
+    return *(const double*)view.data;
+}
+
+const char* MapNode_AsString(const void* ptr) {
+    MapNodeView view;
+    if (!mapnode_view(ptr, &view) || view.type != MAPNODE_TYPE_STRING) return NULL;
+    return (const char*)view.data;
+}
+
+void* MapNode_AsPointer(const void* ptr) {
+    MapNodeView view;
+    if (!mapnode_view(ptr, &view) || view.type != MAPNODE_TYPE_POINTER) return NULL;
+    return *(void* const*)view.data;
 }
 
 /* ======================================================================== */
@@ -122,7 +467,7 @@ size_t MapNode_GetSize(const void* ptr) {
 /* ======================================================================== */
 
 /* Type conversion functions */
-MAPNODE_GETTER(as_int, int, 
+MAPNODE_GETTER(as_int, int,
     (priv->type == MAPNODE_TYPE_INT && priv->data) ? *(int*)priv->data : 0)
 
 MAPNODE_GETTER(as_float, float,
@@ -155,9 +500,8 @@ MAPNODE_TYPE_CHECKER(bytes, MAPNODE_MAGIC_BYTES, MAPNODE_TYPE_BYTES)
 MAPNODE_GETTER(size, size_t, priv->data_size)
 MAPNODE_GETTER(type, MapNodeType, (MapNodeType)priv->type)
 
-const char* mapnode_type_name(MapNode* self) {
-    MagicMapNode* priv = MAPNODE_PRIVATE(self);
-    switch (priv->type) {
+static const char* mapnode_type_name_of(uint32_t type) {
+    switch (type) {
         case MAPNODE_TYPE_INT: return "int";
         case MAPNODE_TYPE_FLOAT: return "float";
         case MAPNODE_TYPE_DOUBLE: return "double";
@@ -168,93 +512,160 @@ const char* mapnode_type_name(MapNode* self) {
     }
 }
 
+const char* mapnode_type_name(MapNode* self) {
+    return mapnode_type_name_of(MAPNODE_PRIVATE(self)->type);
+}
+
 void* mapnode_copy(MapNode* self) {
-    MagicMapNode* priv = MAPNODE_PRIVATE(self);
-    
-    /* Delegate to the appropriate constructor based on type */
-    switch (priv->type) {
-        case MAPNODE_TYPE_INT:
-            return MapNodeFromInt(*(int*)priv->data);
-        case MAPNODE_TYPE_FLOAT:
-            return MapNodeFromFloat(*(float*)priv->data);
-        case MAPNODE_TYPE_DOUBLE:
-            return MapNodeFromDouble(*(double*)priv->data);
-        case MAPNODE_TYPE_STRING:
-            return MapNodeFromString((const char*)priv->data);
-        case MAPNODE_TYPE_POINTER:
-            return MapNodeFromPointer(*(void**)priv->data);
-        case MAPNODE_TYPE_BYTES:
-            return MapNodeFromBytes(priv->data, priv->data_size);
-        default:
-            return NULL;
-    }
+    return MapNodeCopy(MAPNODE_PRIVATE(self));
 }
 
-void mapnode_free(MapNode* self) {
-    MagicMapNode* priv = MAPNODE_PRIVATE(self);
-    
-    /* Free the data if we own it */
-    if (priv->owns_data && priv->data) {
-        free(priv->data);
+/* Release a node and, if they were ever created, its trampolines */
+static void mapnode_destroy(MagicMapNode* priv) {
+    MapNode* self = &priv->public;
+    
+    if (priv->has_interface) {
+        trampoline_free(self->asInt);
+        trampoline_free(self->asFloat);
+        trampoline_free(self->asDouble);
+        trampoline_free(self->asString);
+        trampoline_free(self->asPointer);
+        trampoline_free(self->asBytes);
+        trampoline_free(self->isInt);
+        trampoline_free(self->isFloat);
+        trampoline_free(self->isDouble);
+        trampoline_free(self->isString);
+        trampoline_free(self->isPointer);
+        trampoline_free(self->isBytes);
+        trampoline_free(self->typeName);
+        trampoline_free(self->size);
+        trampoline_free(self->type);
+        trampoline_free(self->copy);
+        trampoline_free(self->free);
     }
     
-    /* Free trampoline functions */
-    if (self->asInt) trampoline_free(self->asInt);
-    if (self->asFloat) trampoline_free(self->asFloat);
-    if (self->asDouble) trampoline_free(self->asDouble);
-    if (self->asString) trampoline_free(self->asString);
-    if (self->asPointer) trampoline_free(self->asPointer);
-    if (self->asBytes) trampoline_free(self->asBytes);
-    if (self->isInt) trampoline_free(self->isInt);
-    if (self->isFloat) trampoline_free(self->isFloat);
-    if (self->isDouble) trampoline_free(self->isDouble);
-    if (self->isString) trampoline_free(self->isString);
-    if (self->isPointer) trampoline_free(self->isPointer);
-    if (self->isBytes) trampoline_free(self->isBytes);
-    if (self->typeName) trampoline_free(self->typeName);
-    if (self->size) trampoline_free(self->size);
-    if (self->type) trampoline_free(self->type);
-    if (self->copy) trampoline_free(self->copy);
-    if (self->free) trampoline_free(self->free);
-    
-    /* Clear magic bytes to make debugging easier */
+    if (priv->owns_data) free(priv->data);
+    
+    /* Clear magic bytes so the cell no longer validates */
     priv->magic = 0xDEADBEEF;
     
-    /* Free the MapNode structure itself */
-    free(priv);
+    mapnode_cell_free(priv);
+}
+
+void mapnode_free(MapNode* self) {
+    mapnode_destroy(MAPNODE_PRIVATE(self));
 }
 
 /* ======================================================================== */
-/* Internal Constructor Helper                                              */
+/* Hashing                                                                  */
+/* ======================================================================== */
+
+/* Multiply-fold mixing in the style of wyhash: the full 128-bit product of
+ * a and b, with its halves xored together */
+static uint64_t mapnode_mix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32;
+    uint64_t la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t high = ha * hb, mid0 = ha * lb, mid1 = hb * la, low = la * lb;
+    uint64_t t = low + (mid0 << 32);
+    uint64_t carry = t < low;
+    uint64_t lo = t + (mid1 << 32);
+    carry += lo < t;
+    return lo ^ (high + (mid0 >> 32) + (mid1 >> 32) + carry);
+#endif
+}
+
+static uint64_t mapnode_read64(const unsigned char* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+#define MAPNODE_HASH_P0 0xa0761d6478bd642fULL
+#define MAPNODE_HASH_P1 0xe7037ed1a0b428dbULL
+#define MAPNODE_HASH_P2 0x8ebc6af09c88c6e3ULL
+
+/* 16 bytes per step; the whole value, whatever its length */
+static size_t mapnode_hash_bytes(const void* data, size_t size, uint64_t seed) {
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t hash = seed ^ mapnode_mix((uint64_t)size ^ MAPNODE_HASH_P0, MAPNODE_HASH_P1);
+    size_t left = size;
+    
+    while (left >= 16) {
+        hash = mapnode_mix(mapnode_read64(p) ^ MAPNODE_HASH_P1,
+                           mapnode_read64(p + 8) ^ hash);
+        p += 16;
+        left -= 16;
+    }
+    if (left > 0) {
+        uint64_t a = 0, b = 0;
+        memcpy(&a, p, left < 8 ? left : 8);
+        if (left > 8) memcpy(&b, p + 8, left - 8);
+        hash = mapnode_mix(a ^ MAPNODE_HASH_P1, b ^ hash);
+    }
+    return (size_t)mapnode_mix(hash ^ MAPNODE_HASH_P0, (uint64_t)size ^ MAPNODE_HASH_P2);
+}
+
+/* Equal values (by MapNode_Compare) must hash alike, so -0.0 hashes as 0.0 */
+static size_t mapnode_compute_hash(uint32_t type, const void* data, size_t size) {
+    if (type == MAPNODE_TYPE_FLOAT && *(const float*)data == 0.0f) {
+        float zero = 0.0f;
+        return mapnode_hash_bytes(&zero, sizeof(zero), type);
+    }
+    if (type == MAPNODE_TYPE_DOUBLE && *(const double*)data == 0.0) {
+        double zero = 0.0;
+        return mapnode_hash_bytes(&zero, sizeof(zero), type);
+    }
+    return mapnode_hash_bytes(data, size, type);
+}
+
+/* ======================================================================== */
+/* Internal Constructor Helpers                                             */
 /* ======================================================================== */
 
 /**
  * @brief Internal function to create MapNode with given parameters
+ * @note The value is copied into the node; no trampolines are created yet
  */
-static void* mapnode_create_internal(uint32_t magic, MapNodeType type, 
-                                     const void* data, size_t data_size, 
-                                     bool copy_data) {
-    MagicMapNode* node = calloc(1, sizeof(MagicMapNode));
+static void* mapnode_create_internal(uint32_t magic, MapNodeType type,
+                                     const void* data, size_t data_size) {
+    MagicMapNode* node = mapnode_cell_alloc();
     if (!node) return NULL;
     
-    /* Set up the magic bytes and type for introspection */
-    node->magic = magic;
-    node->type = type;
-    node->data_size = data_size;
-    node->owns_data = copy_data;
-    
-    /* Handle data storage */
-    if (copy_data && data && data_size > 0) {
+    /* Payload goes inline, right behind the struct, or on the heap */
+    if (data_size <= sizeof(node->inline_value)) {
+        node->data = &node->inline_value;
+    } else if (data_size <= MAPNODE_CELL_PAYLOAD) {
+        node->data = node + 1;
+    } else {
         node->data = malloc(data_size);
         if (!node->data) {
-            free(node);
+            mapnode_cell_free(node);
             return NULL;
         }
-        memcpy(node->data, data, data_size);
-    } else {
-        /* Just store the pointer (for non-copied data like string literals) */
-        node->data = (void*)data;
+        node->owns_data = true;
     }
+    memcpy(node->data, data, data_size);
+    
+    /* Set up the magic bytes and type for introspection */
+    node->magic = magic;
+    node->type = type;
+    node->data_size = data_size;
+    node->hash = mapnode_compute_hash(type, node->data, data_size);
+    
+    /* Return pointer to data member (offset 0), which is what gets passed around */
+    return &node->data;
+}
+
+/**
+ * @brief Create the trampolines behind the public interface on first use
+ * @return The interface, or NULL if the trampolines could not be created
+ */
+static MapNode* mapnode_interface(MagicMapNode* node) {
+    if (node->has_interface) return &node->public;
     
     /* Set up the trampoline functions */
     trampoline_allocations allocations = {0};
@@ -281,15 +692,12 @@ static void* mapnode_create_internal(uint32_t magic, MapNodeType type,
     
     /* Validate that all trampolines were created successfully */
     if (!trampolines_validate(&allocations)) {
-        if (node->owns_data && node->data) {
-            free(node->data);
-        }
-        free(node);
+        memset(&node->public, 0, sizeof(node->public));
         return NULL;
     }
     
-    /* Return pointer to data member (offset 0), which is what gets passed around */
-    return &node->data;
+    node->has_interface = true;
+    return &node->public;
 }
 
 /* ======================================================================== */
@@ -297,47 +705,72 @@ static void* mapnode_create_internal(uint32_t magic, MapNodeType type,
 /* ======================================================================== */
 
 void* MapNodeFromInt(int value) {
-    return mapnode_create_internal(MAPNODE_MAGIC_INT, MAPNODE_TYPE_INT, 
-                                   &value, sizeof(int), true);
+    return mapnode_create_internal(MAPNODE_MAGIC_INT, MAPNODE_TYPE_INT,
+                                   &value, sizeof(int));
 }
 
 void* MapNodeFromFloat(float value) {
-    return mapnode_create_internal(MAPNODE_MAGIC_FLOAT, MAPNODE_TYPE_FLOAT, 
-                                   &value, sizeof(float), true);
+    return mapnode_create_internal(MAPNODE_MAGIC_FLOAT, MAPNODE_TYPE_FLOAT,
+                                   &value, sizeof(float));
 }
 
 void* MapNodeFromDouble(double value) {
-    return mapnode_create_internal(MAPNODE_MAGIC_DOUBLE, MAPNODE_TYPE_DOUBLE, 
-                                   &value, sizeof(double), true);
+    return mapnode_create_internal(MAPNODE_MAGIC_DOUBLE, MAPNODE_TYPE_DOUBLE,
+                                   &value, sizeof(double));
 }
 
 void* MapNodeFromString(const char* str) {
     if (!str) return NULL;
     
     size_t len = strlen(str) + 1;  /* Include null terminator */
-    return mapnode_create_internal(MAPNODE_MAGIC_STRING, MAPNODE_TYPE_STRING, 
-                                   str, len, true);
+    return mapnode_create_internal(MAPNODE_MAGIC_STRING, MAPNODE_TYPE_STRING,
+                                   str, len);
 }
 
 void* MapNodeFromPointer(void* ptr) {
-    return mapnode_create_internal(MAPNODE_MAGIC_POINTER, MAPNODE_TYPE_POINTER, 
-                                   &ptr, sizeof(void*), true);
+    return mapnode_create_internal(MAPNODE_MAGIC_POINTER, MAPNODE_TYPE_POINTER,
+                                   &ptr, sizeof(void*));
 }
 
 void* MapNodeFromBytes(const void* data, size_t size) {
     if (!data || size == 0) return NULL;
     
-    return mapnode_create_internal(MAPNODE_MAGIC_BYTES, MAPNODE_TYPE_BYTES, 
-                                   data, size, true);
+    return mapnode_create_internal(MAPNODE_MAGIC_BYTES, MAPNODE_TYPE_BYTES,
+                                   data, size);
+}
+
+void* MapNodeImmediateInt(int value) {
+#if MAPNODE_IMMEDIATES
+    return (void*)(((uintptr_t)MAPNODE_IMMEDIATE_INT << 48) | (uint32_t)value);
+#else
+    return MapNodeFromInt(value);
+#endif
+}
+
+void* MapNodeImmediateDouble(double value) {
+#if MAPNODE_IMMEDIATES
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    
+    /* Only the top 48 bits fit beside the tag */
+    if ((bits & 0xFFFF) == 0) {
+        return (void*)(((uintptr_t)MAPNODE_IMMEDIATE_DOUBLE << 48) | (uintptr_t)(bits >> 16));
+    }
+#endif
+    return MapNodeFromDouble(value);
 }
 
 void* MapNodeCopy(const void* other) {
-    if (!MapNode_IsValid(other)) return NULL;
+    MapNodeView view;
     
-    MapNode* node = MapNode_Cast((void*)other);
-    if (!node) return NULL;
+    if (!mapnode_view(other, &view)) return NULL;
+    
+    /* Immediates are values; the copy is the same word */
+    if (mapnode_immediate_tag(other)) return (void*)other;
     
-    return node->copy();
+    const MagicMapNode* node = (const MagicMapNode*)other;
+    return mapnode_create_internal(node->magic, (MapNodeType)view.type,
+                                   view.data, view.size);
 }
 
 /* ======================================================================== */
@@ -345,12 +778,9 @@ void* MapNodeCopy(const void* other) {
 /* ======================================================================== */
 
 void MapNode_Free(void* ptr) {
-    if (!MapNode_IsValid(ptr)) return;
+    if (!MapNode_IsValid(ptr) || mapnode_immediate_tag(ptr)) return;
     
-    MapNode* node = MapNode_Cast(ptr);
-    if (node) {
-        node->free();
-    }
+    mapnode_destroy((MagicMapNode*)ptr);
 }
 
 /* ======================================================================== */
@@ -358,175 +788,123 @@ void MapNode_Free(void* ptr) {
 /* ======================================================================== */
 
 int MapNode_ToString(const void* ptr, char* buffer, size_t buffer_size) {
+    MapNodeView view;
+    
     if (!buffer || buffer_size == 0) return -1;
     
     buffer[0] = '\0';  /* Ensure null termination */
     
-    if (!MapNode_IsValid(ptr)) {
+    if (!mapnode_view(ptr, &view)) {
         return snprintf(buffer, buffer_size, "<invalid>");
     }
     
-    MapNode* node = MapNode_Cast((void*)ptr);
-    if (!node) {
-        return snprintf(buffer, buffer_size, "<cast_failed>");
-    }
-    
-    const char* type_name = node->typeName();
-    size_t size = node->size();
+    const char* type_name = mapnode_type_name_of(view.type);
     
-    switch (node->type()) {
+    switch (view.type) {
         case MAPNODE_TYPE_INT:
-            return snprintf(buffer, buffer_size, "%s(%d)", type_name, node->asInt());
+            return snprintf(buffer, buffer_size, "%s(%d)", type_name, *(const int*)view.data);
         case MAPNODE_TYPE_FLOAT:
-            return snprintf(buffer, buffer_size, "%s(%.2f)", type_name, node->asFloat());
+            return snprintf(buffer, buffer_size, "%s(%.2f)", type_name, *(const float*)view.data);
         case MAPNODE_TYPE_DOUBLE:
-            return snprintf(buffer, buffer_size, "%s(%.2lf)", type_name, node->asDouble());
+            return snprintf(buffer, buffer_size, "%s(%.2lf)", type_name, *(const double*)view.data);
         case MAPNODE_TYPE_STRING:
-            return snprintf(buffer, buffer_size, "%s(\"%s\")", type_name, 
-                           node->asString() ? node->asString() : "NULL");
+            return snprintf(buffer, buffer_size, "%s(\"%s\")", type_name,
+                           view.data ? (const char*)view.data : "NULL");
         case MAPNODE_TYPE_POINTER:
-            return snprintf(buffer, buffer_size, "%s(%p)", type_name, node->asPointer());
+            return snprintf(buffer, buffer_size, "%s(%p)", type_name, *(void* const*)view.data);
         case MAPNODE_TYPE_BYTES:
-            return snprintf(buffer, buffer_size, "%s(%zu bytes)", type_name, size);
+            return snprintf(buffer, buffer_size, "%s(%zu bytes)", type_name, view.size);
         default:
             return snprintf(buffer, buffer_size, "%s(?)", type_name);
     }
 }
 
 int MapNode_Compare(const void* a, const void* b) {
+    MapNodeView view_a, view_b;
+    
     /* Handle NULL cases */
     if (!a && !b) return 0;
     if (!a) return -1;
     if (!b) return 1;
     
-    /* Validate both are MapNodes */
-    if (!MapNode_IsValid(a) || !MapNode_IsValid(b)) {
-        return (MapNode_IsValid(a) ? 1 : 0) - (MapNode_IsValid(b) ? 1 : 0);
+    /* Validate both are MapNodes, reading their values directly rather
+     * than through the node's trampolines */
+    bool valid_a = mapnode_view(a, &view_a);
+    bool valid_b = mapnode_view(b, &view_b);
+    if (!valid_a || !valid_b) {
+        return (valid_a ? 1 : 0) - (valid_b ? 1 : 0);
     }
     
-    MapNode* node_a = MapNode_Cast((void*)a);
-    MapNode* node_b = MapNode_Cast((void*)b);
-    
-    if (!node_a || !node_b) return 0;
-    
     /* Compare types first */
-    MapNodeType type_a = node_a->type();
-    MapNodeType type_b = node_b->type();
-    
-    if (type_a != type_b) {
-        return (int)type_a - (int)type_b;
+    if (view_a.type != view_b.type) {
+        return (int)view_a.type - (int)view_b.type;
     }
     
     /* Compare values based on type */
-    switch (type_a) {
+    switch (view_a.type) {
         case MAPNODE_TYPE_INT: {
-            int val_a = node_a->asInt();
-            int val_b = node_b->asInt();
+            int val_a = *(const int*)view_a.data;
+            int val_b = *(const int*)view_b.data;
             return (val_a > val_b) - (val_a < val_b);
         }
         case MAPNODE_TYPE_FLOAT: {
-            float val_a = node_a->asFloat();
-            float val_b = node_b->asFloat();
+            float val_a = *(const float*)view_a.data;
+            float val_b = *(const float*)view_b.data;
             return (val_a > val_b) - (val_a < val_b);
         }
         case MAPNODE_TYPE_DOUBLE: {
-            double val_a = node_a->asDouble();
-            double val_b = node_b->asDouble();
+            double val_a = *(const double*)view_a.data;
+            double val_b = *(const double*)view_b.data;
             return (val_a > val_b) - (val_a < val_b);
         }
         case MAPNODE_TYPE_STRING: {
-            const char* str_a = node_a->asString();
-            const char* str_b = node_b->asString();
+            const char* str_a = (const char*)view_a.data;
+            const char* str_b = (const char*)view_b.data;
             if (!str_a && !str_b) return 0;
             if (!str_a) return -1;
             if (!str_b) return 1;
             return strcmp(str_a, str_b);
         }
         case MAPNODE_TYPE_POINTER: {
-            void* ptr_a = node_a->asPointer();
-            void* ptr_b = node_b->asPointer();
+            void* ptr_a = *(void* const*)view_a.data;
+            void* ptr_b = *(void* const*)view_b.data;
             return (ptr_a > ptr_b) - (ptr_a < ptr_b);
         }
         case MAPNODE_TYPE_BYTES: {
-            size_t size_a, size_b;
-            const void* data_a = node_a->asBytes(&size_a);
-            const void* data_b = node_b->asBytes(&size_b);
-            
-            if (size_a != size_b) {
-                return (size_a > size_b) - (size_a < size_b);
+            if (view_a.size != view_b.size) {
+                return (view_a.size > view_b.size) - (view_a.size < view_b.size);
             }
-            
-            if (!data_a && !data_b) return 0;
-            if (!data_a) return -1;
-            if (!data_b) return 1;
-            
-            return memcmp(data_a, data_b, size_a);
+    
+            if (!view_a.data && !view_b.data) return 0;
+            if (!view_a.data) return -1;
+            if (!view_b.data) return 1;
+    
+            return memcmp(view_a.data, view_b.data, view_a.size);
         }
         default:
             return 0;
     }
 }
 
+bool MapNode_Equals(const void* a, const void* b) {
+    if (a == b) return MapNode_IsValid(a);
+    if (!MapNode_IsValid(a) || !MapNode_IsValid(b)) return false;
+    
+    /* Different hashes mean different values; skip the comparison */
+    if (MapNode_Hash(a) != MapNode_Hash(b)) return false;
+    return MapNode_Compare(a, b) == 0;
+}
+
 size_t MapNode_Hash(const void* ptr) {
     if (!MapNode_IsValid(ptr)) return 0;
     
-    MapNode* node = MapNode_Cast((void*)ptr);
-    if (!node) return 0;
-    
-    /* Simple djb2-style hash incorporating type and value */
-    size_t hash = 5381;
-    
-    /* Hash the type first */
-    hash = ((hash << 5) + hash) + (size_t)node->type();
-    
-    /* Hash the value based on type */
-    switch (node->type()) {
-        case MAPNODE_TYPE_INT: {
-            int val = node->asInt();
-            hash = ((hash << 5) + hash) + (size_t)val;
-            break;
-        }
-        case MAPNODE_TYPE_FLOAT: {
-            /* Convert to int for hashing (simple approach) */
-            union { float f; uint32_t i; } converter;
-            converter.f = node->asFloat();
-            hash = ((hash << 5) + hash) + converter.i;
-            break;
-        }
-        case MAPNODE_TYPE_DOUBLE: {
-            /* Convert to int for hashing (simple approach) */
-            union { double d; uint64_t i; } converter;
-            converter.d = node->asDouble();
-            hash = ((hash << 5) + hash) + (size_t)converter.i;
-            break;
-        }
-        case MAPNODE_TYPE_STRING: {
-            const char* str = node->asString();
-            if (str) {
-                while (*str) {
-                    hash = ((hash << 5) + hash) + (unsigned char)*str;
-                    str++;
-                }
-            }
-            break;
-        }
-        case MAPNODE_TYPE_POINTER: {
-            uintptr_t addr = (uintptr_t)node->asPointer();
-            hash = ((hash << 5) + hash) + (size_t)addr;
-            break;
-        }
-        case MAPNODE_TYPE_BYTES: {
-            size_t size;
-            const unsigned char* data = (const unsigned char*)node->asBytes(&size);
-            if (data) {
-                size_t i;
-                for (i = 0; i < size && i < 64; i++) {  /* Limit to first 64 bytes */
-                    hash = ((hash << 5) + hash) + data[i];
-                }
-            }
-            break;
-        }
+    /* Immediates hash like the allocated node holding the same value */
+    if (mapnode_immediate_tag(ptr)) {
+        MapNodeView view;
+        mapnode_view(ptr, &view);
+        return mapnode_compute_hash(view.type, view.data, view.size);
     }
     
-    return hash;
-}
\ No newline at end of file
+    /* Computed once, when the node was created */
+    return ((const MagicMapNode*)ptr)->hash;
+}
@@ -236,6 +236,106 @@ void test_memory_introspection() {
     printf("Memory introspection tests passed!\n\n");
 }
 
+void test_compact_nodes() {
+    printf("=== Testing Inline and Immediate MapNodes ===\n");
+
+    // Values are readable without creating the trampoline interface
+    void* heap_int = MapNodeFromInt(-7);
+    void* heap_double = MapNodeFromDouble(2.5);
+    void* text = MapNodeFromString("a string longer than the inline slot");
+    assert(MapNode_AsInt(heap_int) == -7);
+    assert(MapNode_AsDouble(heap_double) == 2.5);
+    assert(strcmp(MapNode_AsString(text), "a string longer than the inline slot") == 0);
+    assert(MapNode_AsString(heap_int) == NULL);
+    assert(!MapNode_IsImmediate(heap_int));
+
+    // Interface is created on demand, and stays the same afterwards
+    MapNode* iface = MapNode_Cast(heap_int);
+    assert(iface != NULL && iface == MapNode_Cast(heap_int));
+    assert(iface->asInt() == -7);
+
+    void* imm_int = MapNodeImmediateInt(-7);
+    void* imm_double = MapNodeImmediateDouble(2.5);
+    void* odd_double = MapNodeImmediateDouble(0.1);
+    printf("Immediate int: %p, immediate double: %p\n", imm_int, imm_double);
+
+    if (sizeof(void*) == 8) {
+        assert(MapNode_IsImmediate(imm_int));
+        assert(MapNode_IsImmediate(imm_double));
+        assert(!MapNode_IsImmediate(odd_double));  // Needs all 64 bits
+        assert(MapNode_Cast(imm_int) == NULL);
+    }
+    assert(MapNode_IsValid(imm_int) && MapNode_IsValid(imm_double));
+    assert(MapNode_GetType(imm_int) == MAPNODE_TYPE_INT);
+    assert(MapNode_GetType(imm_double) == MAPNODE_TYPE_DOUBLE);
+    assert(MapNode_GetMagic(imm_int) == MAPNODE_MAGIC_INT);
+    assert(MapNode_AsInt(imm_int) == -7);
+    assert(MapNode_AsDouble(imm_double) == 2.5);
+    assert(MapNode_AsDouble(odd_double) == 0.1);
+
+    // Immediate and allocated nodes holding one value are interchangeable
+    assert(MapNode_Compare(imm_int, heap_int) == 0);
+    assert(MapNode_Equals(imm_double, heap_double));
+    assert(MapNode_Hash(imm_int) == MapNode_Hash(heap_int));
+    assert(MapNode_Hash(imm_double) == MapNode_Hash(heap_double));
+
+    char buffer[64];
+    MapNode_ToString(imm_int, buffer, sizeof(buffer));
+    printf("Immediate toString: %s\n", buffer);
+    assert(strcmp(buffer, "int(-7)") == 0);
+
+    void* copy = MapNodeCopy(text);
+    assert(MapNode_Equals(copy, text) && copy != text);
+
+    MapNode_Free(imm_int);     // No-ops
+    MapNode_Free(imm_double);
+    MapNode_Free(odd_double);
+    MapNode_Free(heap_int);
+    MapNode_Free(heap_double);
+    MapNode_Free(text);
+    MapNode_Free(copy);
+
+    printf("Inline and immediate MapNode tests passed!\n\n");
+}
+
+void test_foreign_pointers() {
+    printf("=== Testing Validation of Foreign Pointers ===\n");
+
+    // Too small to hold magic bytes: must be rejected without reading them
+    int small = 0;
+    char* heap = calloc(1, 1);
+    assert(!MapNode_IsValid(&small));
+    assert(!MapNode_IsValid(heap));
+    assert(MapNode_GetMagic(heap) == 0);
+    assert(MapNode_GetType(heap) == 0);
+    MapNode_Free(heap);  // Ignored, not a MapNode
+    free(heap);
+
+    // Pointers into a node but not at its start are not nodes
+    void* node = MapNodeFromString("slab");
+    assert(MapNode_IsValid(node));
+    assert(!MapNode_IsValid((char*)node + 8));
+    assert(!MapNode_IsValid((char*)node - 1));
+
+    // A freed node stops validating, and its cell is reused
+    MapNode_Free(node);
+    assert(!MapNode_IsValid(node));
+    void* reused = MapNodeFromInt(1);
+    printf("Freed cell %p, next node %p\n", node, reused);
+    assert(MapNode_IsValid(reused) && MapNode_AsInt(reused) == 1);
+    MapNode_Free(reused);
+
+    // Long values live outside the cell
+    char long_text[300];
+    memset(long_text, 'z', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+    void* long_node = MapNodeFromString(long_text);
+    assert(strcmp(MapNode_AsString(long_node), long_text) == 0);
+    MapNode_Free(long_node);
+
+    printf("Foreign pointer tests passed!\n\n");
+}
+
 void stress_test() {
     printf("=== Stress Testing MapNode ===\n");
 
@@ -304,6 +404,8 @@ int main() {
     test_mapnode_copying();
     test_mapnode_utilities();
     test_memory_introspection();
+    test_compact_nodes();
+    test_foreign_pointers();
     stress_test();
 
     printf("🎉 All MapNode tests passed successfully!\n");
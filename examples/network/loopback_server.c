@@ -0,0 +1,795 @@
+/**
+ * @file loopback_server.c
+ * @brief Thread-per-connection loopback HTTP server used by the examples
+ */
+
+#include "loopback_server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef NO_SSL_SUPPORT
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#endif
+
+#ifndef NO_ZLIB_SUPPORT
+#include <zlib.h>
+#endif
+
+#define LOOPBACK_MAX_CLIENTS 1024
+#define LOOPBACK_FILLER 16384       /* Body bytes sent per write */
+
+struct LoopbackServer {
+  int listen_fd;
+  int port;
+  LoopbackOptions options;
+  char* response;
+  size_t response_length;
+  char* filler;               /* LOOPBACK_FILLER bytes of body */
+  volatile int running;
+  unsigned long connections;
+  unsigned long requests;
+  int active;                 /* Client threads still running */
+  int client_fds[LOOPBACK_MAX_CLIENTS];
+  size_t last_body_length;    /* Most recently completed request body */
+  unsigned long long last_body_hash;
+  pthread_mutex_t lock;
+  pthread_t accept_thread;
+#ifndef NO_SSL_SUPPORT
+  SSL_CTX* tls;
+#endif
+};
+
+typedef struct LoopbackClient {
+  LoopbackServer* server;
+  int fd;
+#ifndef NO_SSL_SUPPORT
+  SSL* ssl;
+#endif
+} LoopbackClient;
+
+/* What the request head asked for */
+typedef struct LoopbackRequest {
+  char path[256];
+  int accepts_gzip;
+  int close;
+} LoopbackRequest;
+
+/* What the path routes to */
+typedef struct LoopbackReply {
+  int status;
+  size_t body_size;
+  int delay_ms;
+  char location[64];
+  int custom;                 /* Differs from the prebuilt response */
+} LoopbackReply;
+
+static int client_send(LoopbackClient* client, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t n;
+#ifndef NO_SSL_SUPPORT
+    if (client->ssl) {
+      n = SSL_write(client->ssl, data, (int)length);
+    } else
+#endif
+    n = send(client->fd, data, length, MSG_NOSIGNAL);
+    if (n <= 0) return -1;
+    data += n;
+    length -= (size_t)n;
+  }
+  return 0;
+}
+
+static ssize_t client_recv(LoopbackClient* client, char* buf, size_t length) {
+#ifndef NO_SSL_SUPPORT
+  if (client->ssl) return SSL_read(client->ssl, buf, (int)length);
+#endif
+  return recv(client->fd, buf, length, 0);
+}
+
+unsigned long long loopback_hash(unsigned long long hash, const void* data,
+                                 size_t length) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/* Returns the length of the request head in buf and sets *body to its
+ * declared Content-Length, or returns 0 if more data is needed. buf is
+ * NUL-terminated at length. */
+static size_t head_length(const char* buf, size_t length, size_t* body) {
+  const char* end = NULL;
+  const char* cl;
+  size_t i;
+
+  for (i = 3; i < length; i++) {
+    if (buf[i - 3] == '\r' && buf[i - 2] == '\n' &&
+        buf[i - 1] == '\r' && buf[i] == '\n') {
+      end = buf + i + 1;
+      break;
+    }
+  }
+  if (!end) return 0;
+
+  *body = 0;
+  for (cl = buf; cl && cl < end; cl = strstr(cl, "\r\n")) {
+    if (*cl == '\r') cl += 2;
+    if (strncasecmp(cl, "Content-Length:", 15) == 0) {
+      *body = (size_t)strtoul(cl + 15, NULL, 10);
+      break;
+    }
+  }
+  return (size_t)(end - buf);
+}
+
+/* Whether the header line at line (up to end) is name and mentions token */
+static int header_has(const char* line, const char* end, const char* name,
+                      const char* token) {
+  size_t name_length = strlen(name);
+  size_t token_length = strlen(token);
+  const char* p;
+
+  if ((size_t)(end - line) < name_length ||
+      strncasecmp(line, name, name_length) != 0) {
+    return 0;
+  }
+  for (p = line + name_length; p + token_length <= end; p++) {
+    if (strncasecmp(p, token, token_length) == 0) return 1;
+  }
+  return 0;
+}
+
+static void parse_request(const char* head, size_t length, LoopbackRequest* request) {
+  const char* end = head + length;
+  const char* path = memchr(head, ' ', length);
+  const char* line;
+  size_t path_length = 0;
+
+  memset(request, 0, sizeof(*request));
+  if (path) {
+    path++;
+    while (path + path_length < end && path[path_length] != ' ' &&
+           path_length < sizeof(request->path) - 1) {
+      path_length++;
+    }
+    memcpy(request->path, path, path_length);
+  }
+  request->path[path_length] = '\0';
+
+  for (line = strstr(head, "\r\n"); line && line < end; ) {
+    const char* next;
+    line += 2;
+    next = strstr(line, "\r\n");
+    if (!next || next == line) break;
+    if (header_has(line, next, "Accept-Encoding:", "gzip")) request->accepts_gzip = 1;
+    if (header_has(line, next, "Connection:", "close")) request->close = 1;
+    line = next;
+  }
+}
+
+static void route_request(LoopbackServer* server, const LoopbackRequest* request,
+                          LoopbackReply* reply) {
+  const char* path = request->path;
+
+  memset(reply, 0, sizeof(*reply));
+  reply->status = 200;
+  reply->body_size = server->options.body_size;
+
+  if (strncmp(path, "/bytes/", 7) == 0) {
+    reply->body_size = (size_t)strtoull(path + 7, NULL, 10);
+    reply->custom = 1;
+  } else if (strncmp(path, "/delay/", 7) == 0) {
+    reply->delay_ms = atoi(path + 7);
+  } else if (strncmp(path, "/redirect/", 10) == 0) {
+    int hops = atoi(path + 10);
+    if (hops > 0) {
+      reply->status = 302;
+      reply->body_size = 0;
+      snprintf(reply->location, sizeof(reply->location), "/redirect/%d", hops - 1);
+      reply->custom = 1;
+    }
+  } else if (strncmp(path, "/status/", 8) == 0) {
+    reply->status = atoi(path + 8);
+    if (reply->status < 100 || reply->status > 599) reply->status = 200;
+    reply->custom = reply->status != 200;
+  }
+}
+
+#ifndef NO_ZLIB_SUPPORT
+/* length bytes of filler, gzipped */
+static char* gzip_filler(LoopbackServer* server, size_t length, size_t* packed_length) {
+  z_stream stream;
+  size_t capacity = length + length / 1000 + 64;
+  char* packed = malloc(capacity);
+  size_t left = length;
+  int result = Z_OK;
+
+  if (!packed) return NULL;
+  memset(&stream, 0, sizeof(stream));
+  /* 15 + 16: a gzip wrapper rather than zlib's */
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(packed);
+    return NULL;
+  }
+  stream.next_out = (Bytef*)packed;
+  stream.avail_out = (uInt)capacity;
+  while (result == Z_OK) {
+    size_t piece = left < LOOPBACK_FILLER ? left : LOOPBACK_FILLER;
+    stream.next_in = (Bytef*)server->filler;
+    stream.avail_in = (uInt)piece;
+    left -= piece;
+    result = deflate(&stream, left ? Z_NO_FLUSH : Z_FINISH);
+    if (stream.avail_out == 0) break;
+  }
+  *packed_length = stream.total_out;
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    free(packed);
+    return NULL;
+  }
+  return packed;
+}
+#endif
+
+/* Send length bytes of data, or of filler when data is NULL, chunked in
+ * pieces of chunk bytes unless chunk is 0 */
+static int send_body(LoopbackClient* client, const char* data, size_t length,
+                     size_t chunk) {
+  LoopbackServer* server = client->server;
+  size_t sent = 0;
+
+  while (sent < length) {
+    size_t piece = length - sent;
+    size_t done = 0;
+    char size_line[32];
+
+    if (chunk && piece > chunk) piece = chunk;
+    if (chunk) {
+      snprintf(size_line, sizeof(size_line), "%zx\r\n", piece);
+      if (client_send(client, size_line, strlen(size_line)) < 0) return -1;
+    }
+    while (done < piece) {
+      size_t part = piece - done;
+      if (!data && part > LOOPBACK_FILLER) part = LOOPBACK_FILLER;
+      if (client_send(client, data ? data + sent + done : server->filler, part) < 0) {
+        return -1;
+      }
+      done += part;
+    }
+    if (chunk && client_send(client, "\r\n", 2) < 0) return -1;
+    sent += piece;
+  }
+  return chunk ? client_send(client, "0\r\n\r\n", 5) : 0;
+}
+
+static int send_reply(LoopbackClient* client, const LoopbackReply* reply,
+                      int gzip, int close) {
+  LoopbackServer* server = client->server;
+  size_t chunk = server->options.chunk_size;
+  size_t length = reply->body_size;
+  char* packed = NULL;
+  char head[512];
+  size_t offset;
+  int result;
+
+#ifndef NO_ZLIB_SUPPORT
+  if (gzip && length > 0) packed = gzip_filler(server, length, &length);
+#endif
+  if (!packed) {
+    gzip = 0;
+    length = reply->body_size;
+  }
+
+  offset = (size_t)snprintf(head, sizeof(head),
+      "HTTP/1.1 %d %s\r\n"
+      "Content-Type: text/plain\r\n"
+      "Connection: %s\r\n",
+      reply->status, reply->status == 200 ? "OK" : reply->status == 302 ? "Found" : "Status",
+      close ? "close" : "keep-alive");
+  if (reply->location[0]) {
+    offset += (size_t)snprintf(head + offset, sizeof(head) - offset,
+                               "Location: %s\r\n", reply->location);
+  }
+  if (gzip) {
+    offset += (size_t)snprintf(head + offset, sizeof(head) - offset,
+                               "Content-Encoding: gzip\r\n");
+  }
+  if (chunk) {
+    offset += (size_t)snprintf(head + offset, sizeof(head) - offset,
+                               "Transfer-Encoding: chunked\r\n\r\n");
+  } else {
+    offset += (size_t)snprintf(head + offset, sizeof(head) - offset,
+                               "Content-Length: %zu\r\n\r\n", length);
+  }
+
+  result = client_send(client, head, offset);
+  if (result == 0) result = send_body(client, packed, length, chunk);
+  free(packed);
+  return result;
+}
+
+/* Answer one request; returns non-zero if the connection should close */
+static int respond(LoopbackClient* client, const char* head, size_t length) {
+  LoopbackServer* server = client->server;
+  LoopbackRequest request;
+  LoopbackReply reply;
+  int gzip;
+  int close;
+  int delay;
+
+  parse_request(head, length, &request);
+  route_request(server, &request, &reply);
+  gzip = server->options.gzip && request.accepts_gzip;
+  close = !server->options.keep_alive || request.close;
+
+  delay = server->options.latency_ms + reply.delay_ms;
+  if (delay > 0) usleep((useconds_t)delay * 1000);
+
+  /* The usual answer goes out prebuilt */
+  if (!reply.custom && !gzip && close == !server->options.keep_alive) {
+    if (client_send(client, server->response, server->response_length) < 0) return 1;
+  } else if (send_reply(client, &reply, gzip, close) < 0) {
+    return 1;
+  }
+  return close;
+}
+
+static void* client_thread(void* arg) {
+  LoopbackClient* client = (LoopbackClient*)arg;
+  LoopbackServer* server = client->server;
+  char buf[16384];
+  size_t used = 0;
+  size_t body_left = 0;
+  size_t body_length = 0;
+  unsigned long long body_hash = LOOPBACK_HASH_INIT;
+  size_t held = 0;            /* Head kept at the front of buf until answered */
+  int in_body = 0;
+
+#ifndef NO_SSL_SUPPORT
+  if (server->tls) {
+    client->ssl = SSL_new(server->tls);
+    if (!client->ssl || !SSL_set_fd(client->ssl, client->fd) ||
+        SSL_accept(client->ssl) <= 0) {
+      goto done;
+    }
+  }
+#endif
+
+  while (server->running) {
+    ssize_t n = client_recv(client, buf + used, sizeof(buf) - 1 - used);
+    if (n <= 0) break;
+    used += (size_t)n;
+    buf[used] = '\0';
+
+    /* Answer every complete request in the buffer (pipelining safe).
+     * Bodies are hashed as they stream through, so uploads may be any
+     * size. The head stays in buf until its body is in, so it can be
+     * routed. */
+    for (;;) {
+      size_t consumed;
+
+      if (!in_body) {
+        held = head_length(buf, used, &body_left);
+        if (held == 0) break;
+        in_body = 1;
+        body_length = body_left;
+        body_hash = LOOPBACK_HASH_INIT;
+      } else {
+        consumed = used - held < body_left ? used - held : body_left;
+        body_hash = loopback_hash(body_hash, buf + held, consumed);
+        body_left -= consumed;
+        memmove(buf + held, buf + held + consumed, used - held - consumed);
+        used -= consumed;
+        buf[used] = '\0';
+      }
+      if (body_left > 0) {
+        if (used == held) break;
+        continue;
+      }
+
+      in_body = 0;
+      pthread_mutex_lock(&server->lock);
+      server->last_body_length = body_length;
+      server->last_body_hash = body_hash;
+      server->requests++;
+      pthread_mutex_unlock(&server->lock);
+
+      if (respond(client, buf, held)) goto done;
+      memmove(buf, buf + held, used - held);
+      used -= held;
+      buf[used] = '\0';
+      held = 0;
+    }
+    if (used == sizeof(buf) - 1) break;
+  }
+
+done:
+  pthread_mutex_lock(&server->lock);
+  for (used = 0; used < LOOPBACK_MAX_CLIENTS; used++) {
+    if (server->client_fds[used] == client->fd) {
+      server->client_fds[used] = -1;
+      break;
+    }
+  }
+  server->active--;
+  pthread_mutex_unlock(&server->lock);
+#ifndef NO_SSL_SUPPORT
+  if (client->ssl) SSL_free(client->ssl);
+#endif
+  close(client->fd);
+  free(client);
+  return NULL;
+}
+
+static void* accept_thread(void* arg) {
+  LoopbackServer* server = (LoopbackServer*)arg;
+
+  while (server->running) {
+    pthread_t thread;
+    LoopbackClient* client;
+    int one = 1;
+    int i;
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+    if (!server->running) {
+      close(fd);
+      break;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    client = calloc(1, sizeof(LoopbackClient));
+    if (!client) {
+      close(fd);
+      continue;
+    }
+    client->server = server;
+    client->fd = fd;
+
+    pthread_mutex_lock(&server->lock);
+    server->connections++;
+    server->active++;
+    for (i = 0; i < LOOPBACK_MAX_CLIENTS; i++) {
+      if (server->client_fds[i] < 0) {
+        server->client_fds[i] = fd;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (pthread_create(&thread, NULL, client_thread, client) != 0) {
+      pthread_mutex_lock(&server->lock);
+      server->active--;
+      if (i < LOOPBACK_MAX_CLIENTS) server->client_fds[i] = -1;
+      pthread_mutex_unlock(&server->lock);
+      close(fd);
+      free(client);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static int build_response(LoopbackServer* server) {
+  const LoopbackOptions* options = &server->options;
+  size_t chunk = options->chunk_size;
+  size_t chunks = chunk ? options->body_size / chunk + 1 : 0;
+  size_t capacity = 256 + options->body_size + chunks * 16 + 8;
+  size_t offset;
+  size_t sent;
+
+  server->response = malloc(capacity);
+  if (!server->response) return 0;
+
+  offset = (size_t)snprintf(server->response, 256,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/plain\r\n"
+      "Connection: %s\r\n",
+      options->keep_alive ? "keep-alive" : "close");
+
+  if (!chunk) {
+    offset += (size_t)sprintf(server->response + offset,
+                              "Content-Length: %zu\r\n\r\n", options->body_size);
+    memset(server->response + offset, 'x', options->body_size);
+    server->response_length = offset + options->body_size;
+    return 1;
+  }
+
+  offset += (size_t)sprintf(server->response + offset,
+                            "Transfer-Encoding: chunked\r\n\r\n");
+  for (sent = 0; sent < options->body_size; sent += chunk) {
+    size_t piece = options->body_size - sent < chunk ?
+                   options->body_size - sent : chunk;
+    offset += (size_t)sprintf(server->response + offset, "%zx\r\n", piece);
+    memset(server->response + offset, 'x', piece);
+    offset += piece;
+    memcpy(server->response + offset, "\r\n", 2);
+    offset += 2;
+  }
+  memcpy(server->response + offset, "0\r\n\r\n", 5);
+  server->response_length = offset + 5;
+  return 1;
+}
+
+#ifndef NO_SSL_SUPPORT
+/* A TLS context with a fresh P-256 key and a self-signed certificate
+ * for localhost, good for a day */
+static SSL_CTX* build_tls(void) {
+  EVP_PKEY_CTX* key_context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  EVP_PKEY* key = NULL;
+  X509* cert = X509_new();
+  X509_NAME* name;
+  SSL_CTX* tls = NULL;
+
+  if (!key_context || !cert || EVP_PKEY_keygen_init(key_context) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_context, NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(key_context, &key) <= 0) {
+    goto done;
+  }
+
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+  X509_set_pubkey(cert, key);
+  name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char*)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  if (!X509_sign(cert, key, EVP_sha256())) goto done;
+
+  tls = SSL_CTX_new(TLS_server_method());
+  if (tls && (SSL_CTX_use_certificate(tls, cert) != 1 ||
+              SSL_CTX_use_PrivateKey(tls, key) != 1)) {
+    SSL_CTX_free(tls);
+    tls = NULL;
+  }
+
+done:
+  EVP_PKEY_CTX_free(key_context);
+  EVP_PKEY_free(key);
+  X509_free(cert);
+  return tls;
+}
+#endif
+
+static void server_free(LoopbackServer* server) {
+#ifndef NO_SSL_SUPPORT
+  if (server->tls) SSL_CTX_free(server->tls);
+#endif
+  free(server->filler);
+  free(server->response);
+  free(server);
+}
+
+LoopbackServer* loopback_server_start(const LoopbackOptions* options) {
+  LoopbackServer* server;
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  int one = 1;
+  int i;
+
+#ifdef NO_SSL_SUPPORT
+  if (options->tls) return NULL;
+#endif
+#ifdef NO_ZLIB_SUPPORT
+  if (options->gzip) return NULL;
+#endif
+
+  server = calloc(1, sizeof(LoopbackServer));
+  if (!server) return NULL;
+  server->options = *options;
+  for (i = 0; i < LOOPBACK_MAX_CLIENTS; i++) server->client_fds[i] = -1;
+
+  /* Pre-build the single response most requests receive */
+  server->filler = malloc(LOOPBACK_FILLER);
+  if (!server->filler || !build_response(server)) {
+    server_free(server);
+    return NULL;
+  }
+  memset(server->filler, 'x', LOOPBACK_FILLER);
+
+#ifndef NO_SSL_SUPPORT
+  if (options->tls) {
+    /* SSL_write has no MSG_NOSIGNAL; a client hanging up must not kill
+     * the process */
+    signal(SIGPIPE, SIG_IGN);
+    server->tls = build_tls();
+    if (!server->tls) {
+      server_free(server);
+      return NULL;
+    }
+  }
+#endif
+
+  memset(&addr, 0, sizeof(addr));
+  if (options->ipv6) {
+    struct sockaddr_in6* v6 = (struct sockaddr_in6*)&addr;
+    v6->sin6_family = AF_INET6;
+    v6->sin6_addr = in6addr_loopback;
+    v6->sin6_port = htons((unsigned short)options->port);
+    addr_len = sizeof(*v6);
+  } else {
+    struct sockaddr_in* v4 = (struct sockaddr_in*)&addr;
+    v4->sin_family = AF_INET;
+    v4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    v4->sin_port = htons((unsigned short)options->port);
+    addr_len = sizeof(*v4);
+  }
+
+  server->listen_fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(server->listen_fd, (struct sockaddr*)&addr, addr_len) < 0 ||
+      listen(server->listen_fd, 512) < 0 ||
+      getsockname(server->listen_fd, (struct sockaddr*)&addr, &addr_len) < 0) {
+    close(server->listen_fd);
+    server_free(server);
+    return NULL;
+  }
+  server->port = ntohs(options->ipv6 ? ((struct sockaddr_in6*)&addr)->sin6_port
+                                     : ((struct sockaddr_in*)&addr)->sin_port);
+  server->running = 1;
+  pthread_mutex_init(&server->lock, NULL);
+
+  if (pthread_create(&server->accept_thread, NULL, accept_thread, server) != 0) {
+    close(server->listen_fd);
+    pthread_mutex_destroy(&server->lock);
+    server_free(server);
+    return NULL;
+  }
+  return server;
+}
+
+int loopback_server_port(LoopbackServer* server) {
+  return server ? server->port : -1;
+}
+
+void loopback_server_last_body(LoopbackServer* server, size_t* length,
+                               unsigned long long* hash) {
+  pthread_mutex_lock(&server->lock);
+  *length = server->last_body_length;
+  *hash = server->last_body_hash;
+  pthread_mutex_unlock(&server->lock);
+}
+
+unsigned long loopback_server_connections(LoopbackServer* server) {
+  unsigned long count;
+  pthread_mutex_lock(&server->lock);
+  count = server->connections;
+  pthread_mutex_unlock(&server->lock);
+  return count;
+}
+
+unsigned long loopback_server_requests(LoopbackServer* server) {
+  unsigned long count;
+  pthread_mutex_lock(&server->lock);
+  count = server->requests;
+  pthread_mutex_unlock(&server->lock);
+  return count;
+}
+
+void loopback_server_stop(LoopbackServer* server) {
+  if (!server) return;
+
+  server->running = 0;
+  /* Wake the blocking accept() */
+  shutdown(server->listen_fd, SHUT_RDWR);
+  close(server->listen_fd);
+  pthread_join(server->accept_thread, NULL);
+
+  /* Unblock client threads parked in recv() and wait for them to exit
+   * before the shared response goes away */
+  for (;;) {
+    int active;
+    int i;
+    pthread_mutex_lock(&server->lock);
+    for (i = 0; i < LOOPBACK_MAX_CLIENTS; i++) {
+      if (server->client_fds[i] >= 0) {
+        shutdown(server->client_fds[i], SHUT_RDWR);
+      }
+    }
+    active = server->active;
+    pthread_mutex_unlock(&server->lock);
+    if (active == 0) break;
+    usleep(1000);
+  }
+  pthread_mutex_destroy(&server->lock);
+  server_free(server);
+}
+
+#ifdef LOOPBACK_SERVER_MAIN
+/* ======================================================================== */
+/* Standalone server                                                        */
+/* ======================================================================== */
+
+static void usage(const char* program) {
+  fprintf(stderr,
+          "Usage: %s [-p port] [-b body_bytes] [-c chunk_bytes] [-l latency_ms]\n"
+          "          [-z] [-t] [-k] [-6]\n"
+          "  -z  gzip bodies for requests that accept it\n"
+          "  -t  serve HTTPS with a generated self-signed certificate\n"
+          "  -k  close the connection after each response\n"
+          "  -6  listen on ::1\n"
+          "Paths: /bytes/N, /delay/MS, /redirect/N, /status/N; others get the body.\n",
+          program);
+}
+
+int main(int argc, char** argv) {
+  LoopbackOptions options;
+  LoopbackServer* server;
+  sigset_t signals;
+  int signal_number;
+  int i;
+
+  memset(&options, 0, sizeof(options));
+  options.body_size = 512;
+  options.keep_alive = 1;
+  for (i = 1; i < argc; i++) {
+    const char* flag = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (strcmp(flag, "-z") == 0) {
+      options.gzip = 1;
+    } else if (strcmp(flag, "-t") == 0) {
+      options.tls = 1;
+    } else if (strcmp(flag, "-k") == 0) {
+      options.keep_alive = 0;
+    } else if (strcmp(flag, "-6") == 0) {
+      options.ipv6 = 1;
+    } else if (value && strcmp(flag, "-p") == 0) {
+      options.port = atoi(value);
+      i++;
+    } else if (value && strcmp(flag, "-b") == 0) {
+      options.body_size = (size_t)strtoull(value, NULL, 10);
+      i++;
+    } else if (value && strcmp(flag, "-c") == 0) {
+      options.chunk_size = (size_t)strtoull(value, NULL, 10);
+      i++;
+    } else if (value && strcmp(flag, "-l") == 0) {
+      options.latency_ms = atoi(value);
+      i++;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  /* Taken by sigwait below, not by whichever thread is running */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  server = loopback_server_start(&options);
+  if (!server) {
+    fprintf(stderr, "Failed to start loopback server\n");
+    return 1;
+  }
+  printf("Listening on %s://%s:%d/\n", options.tls ? "https" : "http",
+         options.ipv6 ? "[::1]" : "127.0.0.1", loopback_server_port(server));
+  fflush(stdout);
+
+  sigwait(&signals, &signal_number);
+  printf("%lu requests on %lu connections\n", loopback_server_requests(server),
+         loopback_server_connections(server));
+  loopback_server_stop(server);
+  return 0;
+}
+#endif
@@ -0,0 +1,69 @@
+/**
+ * @file loopback_server.h
+ * @brief Tiny HTTP/1.1 server on loopback for offline tests and benchmarks
+ *
+ * The server runs on its own threads and answers every request with a fixed
+ * body. Request bodies of any size are read and hashed, so tests can check
+ * what an upload actually delivered. Keep-alive is honored unless the server is told to close after each
+ * response, which makes it easy to compare pooled and unpooled clients.
+ *
+ * A few paths answer differently, so one server covers most fixtures:
+ *
+ *   /bytes/N       N bytes of body, streamed, so N may be large
+ *   /delay/MS      the usual body after MS more milliseconds
+ *   /redirect/N    302 to /redirect/N-1; /redirect/0 is the usual body
+ *   /status/N      the usual body with status N
+ *
+ * Options add latency to every response, chunk or gzip the bodies, and
+ * serve HTTPS with a self-signed certificate made at start-up. Built with
+ * -DLOOPBACK_SERVER_MAIN the file is also a standalone server; run
+ * "loopback_server -h" for its flags.
+ */
+
+#ifndef LOOPBACK_SERVER_H
+#define LOOPBACK_SERVER_H
+
+#include <stddef.h>
+
+typedef struct LoopbackServer LoopbackServer;
+
+typedef struct LoopbackOptions {
+  size_t body_size;       /* Bytes of body in each response */
+  int keep_alive;         /* Non-zero to keep connections open */
+  size_t chunk_size;      /* Send the body chunked in pieces this big, 0 = off */
+  int ipv6;               /* Non-zero to listen on ::1 instead of 127.0.0.1 */
+  int latency_ms;         /* Wait this long before every response */
+  int gzip;               /* Gzip bodies for requests that accept it (zlib) */
+  int tls;                /* Serve HTTPS with a generated certificate (OpenSSL) */
+  int port;               /* Port to listen on, 0 = ephemeral */
+} LoopbackOptions;
+
+/**
+ * Start listening on a loopback port.
+ * @return NULL if the socket could not be bound, or TLS or gzip was asked
+ *         for in a build without it
+ */
+LoopbackServer* loopback_server_start(const LoopbackOptions* options);
+
+/** @return The port the server is listening on */
+int loopback_server_port(LoopbackServer* server);
+
+/** @return Number of TCP connections accepted so far */
+unsigned long loopback_server_connections(LoopbackServer* server);
+
+/** @return Number of requests answered so far */
+unsigned long loopback_server_requests(LoopbackServer* server);
+
+/** FNV-1a, the hash the server keeps of request bodies */
+#define LOOPBACK_HASH_INIT 0xcbf29ce484222325ULL
+unsigned long long loopback_hash(unsigned long long hash, const void* data,
+                                 size_t length);
+
+/** Length and hash of the most recently received request body */
+void loopback_server_last_body(LoopbackServer* server, size_t* length,
+                               unsigned long long* hash);
+
+/** Stop accepting, close the listener and free the server */
+void loopback_server_stop(LoopbackServer* server);
+
+#endif /* LOOPBACK_SERVER_H */
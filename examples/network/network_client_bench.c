@@ -0,0 +1,212 @@
+/**
+ * @file network_client_bench.c
+ * @brief Client throughput and latency against the loopback fixture server
+ *
+ * Each scenario starts its own loopback server (plain or TLS, chunked,
+ * gzipped, slow) and times the same request many times over, so the cost
+ * of each client feature can be compared offline. Blocking scenarios send
+ * one request at a time; the async ones keep a fixed number in flight on
+ * a NetworkLoop. A short unmeasured round opens the connections first.
+ * Usage: network_client_bench [requests]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <trampoline/classes/network.h>
+#include "loopback_server.h"
+
+typedef struct Scenario {
+    const char* label;
+    const char* path;
+    size_t body_size;
+    size_t chunk_size;
+    int keep_alive;
+    int gzip;
+    int tls;
+    int latency_ms;
+    int concurrency;        /* 0 = blocking send() */
+    int divisor;            /* Run requests / divisor of it */
+} Scenario;
+
+static const Scenario scenarios[] = {
+    { "keep-alive",      "/bench",          512, 0,    1, 0, 0, 0, 0,  1 },
+    { "new conn",        "/bench",          512, 0,    0, 0, 0, 0, 0,  4 },
+    { "chunked 64K",     "/bench",        65536, 4096, 1, 0, 0, 0, 0,  4 },
+    { "gzip 64K",        "/bench",        65536, 0,    1, 1, 0, 0, 0,  4 },
+    { "body 1M",         "/bytes/1048576",  512, 0,    1, 0, 0, 0, 0, 20 },
+    { "redirect x3",     "/redirect/3",     512, 0,    1, 0, 0, 0, 0,  4 },
+    { "latency 2ms",     "/bench",          512, 0,    1, 0, 0, 2, 0, 50 },
+    { "latency x64",     "/bench",          512, 0,    1, 0, 0, 2, 64, 4 },
+    { "async x64",       "/bench",          512, 0,    1, 0, 0, 0, 64, 1 },
+    { "https",           "/bench",          512, 0,    1, 0, 1, 0, 0,  1 },
+    { "https new conn",  "/bench",          512, 0,    0, 0, 1, 0, 0, 10 },
+};
+
+typedef struct Bench {
+    NetworkRequest* request;
+    NetworkLoop* loop;
+    int total;
+    int issued;
+    int done;
+    int failures;
+    double* latencies;
+} Bench;
+
+typedef struct Slot {
+    Bench* bench;
+    double started;
+} Slot;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double* sorted, int count, double p) {
+    int index = (int)(p * (count - 1) + 0.5);
+    return count > 0 ? sorted[index] : 0.0;
+}
+
+static void report(const char* label, double* latencies, int count,
+                   double elapsed, int failures) {
+    qsort(latencies, (size_t)count, sizeof(double), compare_doubles);
+    printf("  %-15s %9.0f req/s   p50 %7.3f ms  p90 %7.3f ms  "
+           "p99 %7.3f ms  max %7.3f ms  (%d failed)\n",
+           label, count / elapsed,
+           percentile(latencies, count, 0.50) * 1000,
+           percentile(latencies, count, 0.90) * 1000,
+           percentile(latencies, count, 0.99) * 1000,
+           count > 0 ? latencies[count - 1] * 1000 : 0.0,
+           failures);
+}
+
+static void on_response(NetworkResponse* response, void* context);
+
+static void issue(Slot* slot) {
+    Bench* bench = slot->bench;
+
+    bench->issued++;
+    slot->started = now_seconds();
+    if (!bench->request->sendAsync(bench->loop, on_response, slot)) {
+        bench->failures++;
+    }
+}
+
+static void on_response(NetworkResponse* response, void* context) {
+    Slot* slot = (Slot*)context;
+    Bench* bench = slot->bench;
+
+    bench->latencies[bench->done++] = now_seconds() - slot->started;
+    if (response->statusCode() != 200) bench->failures++;
+    response->free();
+    if (bench->issued < bench->total) issue(slot);
+}
+
+/* Label NULL runs unmeasured, to open connections */
+static int run(NetworkRequest* request, int requests, int concurrency,
+               const char* label) {
+    Bench bench;
+    Slot* slots = NULL;
+    double start;
+    int i;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.request = request;
+    bench.total = requests;
+    bench.latencies = calloc((size_t)requests, sizeof(double));
+    if (!bench.latencies) return 1;
+
+    start = now_seconds();
+    if (concurrency == 0) {
+        for (i = 0; i < requests; i++) {
+            double began = now_seconds();
+            NetworkResponse* response = request->send();
+            bench.latencies[bench.done++] = now_seconds() - began;
+            if (!response || response->statusCode() != 200) bench.failures++;
+            if (response) response->free();
+        }
+    } else {
+        bench.loop = NetworkLoopMake();
+        slots = calloc((size_t)concurrency, sizeof(Slot));
+        if (!bench.loop || !slots) return 1;
+        for (i = 0; i < concurrency && bench.issued < requests; i++) {
+            slots[i].bench = &bench;
+            issue(&slots[i]);
+        }
+        bench.loop->run();
+        bench.loop->free();
+        bench.failures += requests - bench.done;
+    }
+
+    if (label) {
+        report(label, bench.latencies, bench.done, now_seconds() - start,
+               bench.failures);
+    }
+    free(bench.latencies);
+    free(slots);
+    return bench.failures;
+}
+
+static int run_scenario(const Scenario* scenario, int requests) {
+    LoopbackOptions options;
+    LoopbackServer* server;
+    NetworkRequest* request;
+    char url[128];
+    int count = requests / scenario->divisor;
+    int failures;
+
+    memset(&options, 0, sizeof(options));
+    options.body_size = scenario->body_size;
+    options.chunk_size = scenario->chunk_size;
+    options.keep_alive = scenario->keep_alive;
+    options.gzip = scenario->gzip;
+    options.tls = scenario->tls;
+    options.latency_ms = scenario->latency_ms;
+
+    server = loopback_server_start(&options);
+    if (!server) {
+        printf("  %-15s skipped (not built in)\n", scenario->label);
+        return 0;
+    }
+    snprintf(url, sizeof(url), "%s://127.0.0.1:%d%s", scenario->tls ? "https" : "http",
+             loopback_server_port(server), scenario->path);
+    request = NetworkRequestMake(url, HTTP_GET);
+
+    run(request, scenario->concurrency ? scenario->concurrency : 1,
+        scenario->concurrency, NULL);
+    failures = run(request, count > 0 ? count : 1, scenario->concurrency,
+                   scenario->label);
+
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    int requests = argc > 1 ? atoi(argv[1]) : 5000;
+    NetworkPoolOptions pool;
+    int failures = 0;
+    size_t i;
+
+    /* Let the async scenarios hold all their connections open */
+    NetworkPoolGetOptions(&pool);
+    pool.max_per_host = 128;
+    pool.max_idle_per_host = 128;
+    NetworkPoolConfigure(&pool);
+
+    printf("Client benchmark against the loopback fixture (%d requests)\n", requests);
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        failures += run_scenario(&scenarios[i], requests);
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file network_loop_bench.c
+ * @brief Throughput and latency of NetworkLoop at several concurrency levels
+ *
+ * Runs entirely against a loopback server, so it needs no network access.
+ * Each level keeps a fixed number of requests in flight on one thread and
+ * reports requests/sec with latency percentiles once its connections are
+ * open. The blocking send() loop is measured first as the baseline.
+ * Usage: network_loop_bench [requests] [body_bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <trampoline/classes/network.h>
+#include "loopback_server.h"
+
+typedef struct Bench {
+    NetworkRequest* request;
+    NetworkLoop* loop;
+    int total;
+    int issued;
+    int done;
+    int failures;
+    double* latencies;
+} Bench;
+
+typedef struct Slot {
+    Bench* bench;
+    double started;
+} Slot;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double* sorted, int count, double p) {
+    int index = (int)(p * (count - 1) + 0.5);
+    return count > 0 ? sorted[index] : 0.0;
+}
+
+static void report(const char* label, double* latencies, int count,
+                   double elapsed, int failures) {
+    qsort(latencies, (size_t)count, sizeof(double), compare_doubles);
+    printf("  %-12s %9.0f req/s   p50 %7.3f ms  p90 %7.3f ms  "
+           "p99 %7.3f ms  max %7.3f ms  (%d failed)\n",
+           label, count / elapsed,
+           percentile(latencies, count, 0.50) * 1000,
+           percentile(latencies, count, 0.90) * 1000,
+           percentile(latencies, count, 0.99) * 1000,
+           count > 0 ? latencies[count - 1] * 1000 : 0.0,
+           failures);
+}
+
+static void on_response(NetworkResponse* response, void* context);
+
+static void issue(Slot* slot) {
+    Bench* bench = slot->bench;
+
+    bench->issued++;
+    slot->started = now_seconds();
+    if (!bench->request->sendAsync(bench->loop, on_response, slot)) {
+        bench->failures++;
+    }
+}
+
+static void on_response(NetworkResponse* response, void* context) {
+    Slot* slot = (Slot*)context;
+    Bench* bench = slot->bench;
+
+    bench->latencies[bench->done++] = now_seconds() - slot->started;
+    if (response->statusCode() != 200) bench->failures++;
+    response->free();
+
+    /* Keep the concurrency level constant until every request is issued */
+    if (bench->issued < bench->total) issue(slot);
+}
+
+static int run_blocking(NetworkRequest* request, int requests) {
+    double* latencies = calloc((size_t)requests, sizeof(double));
+    double start = now_seconds();
+    int failures = 0;
+    int i;
+
+    for (i = 0; i < requests; i++) {
+        double began = now_seconds();
+        NetworkResponse* response = request->send();
+        latencies[i] = now_seconds() - began;
+        if (!response || response->statusCode() != 200) failures++;
+        if (response) response->free();
+    }
+    report("blocking", latencies, requests, now_seconds() - start, failures);
+    free(latencies);
+    return failures;
+}
+
+/* Label NULL runs a warm-up round that opens the connections unmeasured */
+static int run_async(NetworkRequest* request, int requests, int concurrency,
+                     const char* label) {
+    Bench bench;
+    Slot* slots;
+    double start;
+    int i;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.request = request;
+    bench.loop = NetworkLoopMake();
+    bench.total = requests;
+    bench.latencies = calloc((size_t)requests, sizeof(double));
+    slots = calloc((size_t)concurrency, sizeof(Slot));
+    if (!bench.loop || !bench.latencies || !slots) return 1;
+
+    start = now_seconds();
+    for (i = 0; i < concurrency && bench.issued < requests; i++) {
+        slots[i].bench = &bench;
+        issue(&slots[i]);
+    }
+    bench.loop->run();
+
+    if (label) {
+        report(label, bench.latencies, bench.done, now_seconds() - start,
+               bench.failures + (requests - bench.done));
+    }
+
+    bench.loop->free();
+    free(bench.latencies);
+    free(slots);
+    return bench.failures;
+}
+
+int main(int argc, char** argv) {
+    static const int levels[] = { 1, 16, 64, 200 };
+    int requests = argc > 1 ? atoi(argv[1]) : 20000;
+    LoopbackOptions options;
+    LoopbackServer* server;
+    NetworkPoolOptions pool;
+    NetworkRequest* request;
+    char url[128];
+    int failures = 0;
+    size_t i;
+
+    memset(&options, 0, sizeof(options));
+    options.body_size = argc > 2 ? (size_t)atoi(argv[2]) : 512;
+    options.keep_alive = 1;
+
+    server = loopback_server_start(&options);
+    if (!server) {
+        fprintf(stderr, "Failed to start loopback server\n");
+        return 1;
+    }
+
+    /* Let the highest concurrency level hold all its connections open */
+    NetworkPoolGetOptions(&pool);
+    pool.max_per_host = 256;
+    pool.max_idle_per_host = 256;
+    NetworkPoolConfigure(&pool);
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bench",
+             loopback_server_port(server));
+    request = NetworkRequestMake(url, HTTP_GET);
+
+    printf("Event loop benchmark (127.0.0.1:%d, %d requests, %zu byte bodies)\n",
+           loopback_server_port(server), requests, options.body_size);
+
+    failures += run_blocking(request, requests / 4);
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "async x%d", levels[i]);
+        run_async(request, levels[i], levels[i], NULL);
+        failures += run_async(request, requests, levels[i], label);
+    }
+
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file network_pool_bench.c
+ * @brief Requests/sec with and without the keep-alive connection pool
+ *
+ * Runs entirely against a loopback server, so it needs no network access.
+ * Usage: network_pool_bench [requests] [body_bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <trampoline/classes/network.h>
+#include "loopback_server.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int run(const char* label, int port, int requests, int keep_alive) {
+    char url[128];
+    NetworkRequest* request;
+    double start;
+    double elapsed;
+    int failures = 0;
+    int i;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bench", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    if (!request) return -1;
+    request->setKeepAlive(keep_alive);
+
+    start = now_seconds();
+    for (i = 0; i < requests; i++) {
+        NetworkResponse* response = request->send();
+        if (!response || response->statusCode() != 200) failures++;
+        if (response) response->free();
+    }
+    elapsed = now_seconds() - start;
+
+    printf("  %-12s %8d requests  %8.3f s  %10.0f req/s  (%d failed)\n",
+           label, requests, elapsed, requests / elapsed, failures);
+
+    request->free();
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    int requests = argc > 1 ? atoi(argv[1]) : 5000;
+    LoopbackOptions options;
+    LoopbackServer* server;
+    NetworkPoolStats stats;
+    unsigned long before;
+    int failures = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.body_size = argc > 2 ? (size_t)atoi(argv[2]) : 512;
+    options.keep_alive = 1;
+
+    server = loopback_server_start(&options);
+    if (!server) {
+        fprintf(stderr, "Failed to start loopback server\n");
+        return 1;
+    }
+
+    printf("Connection pool benchmark (127.0.0.1:%d, %zu byte bodies)\n",
+           loopback_server_port(server), options.body_size);
+
+    before = loopback_server_connections(server);
+    failures += run("close", loopback_server_port(server), requests, 0);
+    printf("  %-12s %lu TCP connections\n", "",
+           loopback_server_connections(server) - before);
+
+    before = loopback_server_connections(server);
+    failures += run("keep-alive", loopback_server_port(server), requests, 1);
+    printf("  %-12s %lu TCP connections\n", "",
+           loopback_server_connections(server) - before);
+
+    NetworkPoolGetStats(&stats);
+    printf("  pool: %lu opened, %lu reused, %lu discarded, %zu idle\n",
+           stats.connections_opened, stats.connections_reused,
+           stats.connections_discarded, stats.idle_connections);
+
+    NetworkPoolClear();
+    loopback_server_stop(server);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,256 @@
+/**
+ * @file network_server_bench.c
+ * @brief Requests/sec and latency percentiles for HttpServer on loopback
+ *
+ * Starts an HttpServer with a fixed reply (/health) and a handler that
+ * builds a NetworkResponse per request (/echo), then drives each with a
+ * small load generator: several client threads, each on its own keep-alive
+ * connection, sending one request at a time and timing every round trip.
+ * Then /health is fetched with the library's own client, one send() at a
+ * time, through a NetworkRequestTemplate, and as NetworkRequestBatch
+ * bursts with and without pipelining.
+ * Usage: network_server_bench [connections] [seconds] [server threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <trampoline/classes/network.h>
+
+typedef struct Client {
+    pthread_t thread;
+    int port;
+    const char* path;
+    double seconds;
+    double* latencies;
+    size_t count;
+    size_t capacity;
+    int failed;
+} Client;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static NetworkResponse* echo_handler(const HttpServerRequest* request,
+                                     void* context) {
+    (void)context;
+    return NetworkResponseMake(200, "OK", request->path);
+}
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Read one response off a keep-alive connection */
+static int read_response(int fd, char* buffer, size_t size) {
+    size_t used = 0;
+    char* end = NULL;
+    size_t body;
+
+    while (!end) {
+        ssize_t n = recv(fd, buffer + used, size - used - 1, 0);
+        if (n <= 0) return 0;
+        used += (size_t)n;
+        buffer[used] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+    }
+    body = (size_t)atol(strstr(buffer, "Content-Length: ") + 16);
+    while (used < (size_t)(end + 4 - buffer) + body) {
+        ssize_t n = recv(fd, buffer + used, size - used - 1, 0);
+        if (n <= 0) return 0;
+        used += (size_t)n;
+    }
+    return strncmp(buffer, "HTTP/1.1 200", 12) == 0;
+}
+
+static void* client_main(void* arg) {
+    Client* client = (Client*)arg;
+    char request[256];
+    char buffer[4096];
+    int length = snprintf(request, sizeof(request),
+                          "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", client->path);
+    int fd = connect_to(client->port);
+    double stop = now_seconds() + client->seconds;
+
+    while (fd >= 0 && now_seconds() < stop) {
+        double start = now_seconds();
+
+        if (send(fd, request, (size_t)length, 0) != length ||
+            !read_response(fd, buffer, sizeof(buffer))) {
+            client->failed++;
+            break;
+        }
+        if (client->count == client->capacity) {
+            size_t capacity = client->capacity ? client->capacity * 2 : 4096;
+            double* grown = realloc(client->latencies, capacity * sizeof(double));
+            if (!grown) break;
+            client->latencies = grown;
+            client->capacity = capacity;
+        }
+        client->latencies[client->count++] = now_seconds() - start;
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run(const char* label, int port, const char* path,
+               int connections, double seconds) {
+    Client* clients = calloc((size_t)connections, sizeof(Client));
+    double* all;
+    size_t total = 0;
+    size_t offset = 0;
+    int failed = 0;
+    int i;
+
+    for (i = 0; i < connections; i++) {
+        clients[i].port = port;
+        clients[i].path = path;
+        clients[i].seconds = seconds;
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+    for (i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        total += clients[i].count;
+        failed += clients[i].failed;
+    }
+
+    all = malloc((total ? total : 1) * sizeof(double));
+    for (i = 0; i < connections; i++) {
+        memcpy(all + offset, clients[i].latencies,
+               clients[i].count * sizeof(double));
+        offset += clients[i].count;
+        free(clients[i].latencies);
+    }
+    qsort(all, total, sizeof(double), compare_doubles);
+
+    if (total > 0) {
+        printf("  %-8s %9.0f req/s   p50 %7.3f ms   p99 %7.3f ms   (%d failed)\n",
+               label, total / seconds, all[total / 2] * 1000,
+               all[(size_t)(total * 0.99)] * 1000, failed);
+    } else {
+        printf("  %-8s no requests completed\n", label);
+    }
+    free(all);
+    free(clients);
+    return failed || total == 0;
+}
+
+/* Client side: the same requests one at a time, then in batches */
+static int run_client(int port, int requests, int burst) {
+    NetworkRequestBatch* batch = NetworkRequestBatchMake();
+    NetworkRequestTemplate* prepared;
+    NetworkRequest* request;
+    char url[128];
+    double start;
+    int failures = 0;
+    int pass;
+    int i;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/health", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+
+    start = now_seconds();
+    for (i = 0; i < requests; i++) {
+        NetworkResponse* response = request->send();
+        failures += response->statusCode() != 200;
+        response->free();
+    }
+    printf("  %-22s %9.0f req/s\n", "send()", requests / (now_seconds() - start));
+
+    prepared = NetworkRequestTemplateMake(request);
+    start = now_seconds();
+    for (i = 0; i < requests; i++) {
+        NetworkResponse* response = prepared->send(NULL, NULL, 0);
+        failures += response->statusCode() != 200;
+        response->free();
+    }
+    printf("  %-22s %9.0f req/s\n", "template send()",
+           requests / (now_seconds() - start));
+    prepared->free();
+
+    for (pass = 0; pass < 2; pass++) {
+        char label[48];
+
+        batch->setPipelining(pass == 1);
+        start = now_seconds();
+        for (i = 0; i < requests; i += burst) {
+            NetworkResponse** responses;
+            int j;
+
+            for (j = 0; j < burst; j++) batch->add(request);
+            responses = batch->send();
+            for (j = 0; j < burst; j++) {
+                failures += responses[j]->statusCode() != 200;
+                responses[j]->free();
+            }
+            free(responses);
+        }
+        snprintf(label, sizeof(label), "batch of %d%s", burst,
+                 pass == 1 ? ", pipelined" : "");
+        printf("  %-22s %9.0f req/s\n", label, requests / (now_seconds() - start));
+    }
+
+    batch->free();
+    request->free();
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    int connections = argc > 1 ? atoi(argv[1]) : 8;
+    double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+    HttpServerOptions options = { argc > 3 ? atoi(argv[3]) : 4, 5, 1024 * 1024 };
+    HttpServer* server = HttpServerMake(&options);
+    int failures = 0;
+    int port;
+
+    server->routeResponse("GET", "/health",
+                          NetworkResponseMake(0, NULL, "HTTP/1.1 200 OK\r\n"
+                                              "Content-Type: text/plain\r\n\r\nok"));
+    server->route("GET", "/echo", echo_handler, NULL);
+    port = server->listen("127.0.0.1", 0);
+    if (port < 0) {
+        fprintf(stderr, "Could not listen on loopback\n");
+        server->free();
+        return 1;
+    }
+
+    printf("HttpServer benchmark (%d connections, %.0fs each, %d workers)\n",
+           connections, seconds, options.threads);
+    failures += run("/health", port, "/health", connections, seconds);
+    failures += run("/echo", port, "/echo", connections, seconds);
+
+    printf("Client requests to /health\n");
+    failures += run_client(port, 4000, 16);
+
+    server->free();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file network_tls_bench.c
+ * @brief Full TLS handshakes versus resumed sessions
+ *
+ * Opens a fresh HTTPS connection for every request (keep-alive off), first
+ * with the session cache disabled and then enabled, and reports
+ * handshakes/sec and how many were resumed. Run it against a local server,
+ * e.g. `make bench-tls`, which starts `openssl s_server -www` on port 4433.
+ * Usage: network_tls_bench [url] [connections]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <trampoline/classes/network.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int run(const char* label, const char* url, int connections,
+               int session_cache, unsigned long* resumed) {
+    NetworkTlsOptions options;
+    NetworkTlsStats before, after;
+    NetworkRequest* request = NetworkRequestMake(url, HTTP_GET);
+    NetworkResponse* response;
+    double start;
+    double elapsed;
+    int failures = 0;
+    int i;
+
+    NetworkTlsGetOptions(&options);
+    options.session_cache = session_cache;
+    NetworkTlsConfigure(&options);
+    NetworkTlsClearSessions();
+    request->setKeepAlive(0);
+
+    /* One unmeasured connection primes the cache with a session */
+    response = request->send();
+    if (response) response->free();
+
+    NetworkTlsGetStats(&before);
+    start = now_seconds();
+    for (i = 0; i < connections; i++) {
+        response = request->send();
+        if (!response || response->statusCode() != 200) failures++;
+        if (response) response->free();
+    }
+    elapsed = now_seconds() - start;
+    NetworkTlsGetStats(&after);
+
+    *resumed = after.resumed - before.resumed;
+    printf("  %-16s %8.0f conn/s   %7.3f ms/conn   %lu/%lu resumed  (%d failed)\n",
+           label, connections / elapsed, elapsed / connections * 1000,
+           *resumed, after.handshakes - before.handshakes, failures);
+
+    request->free();
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    const char* url = argc > 1 ? argv[1] : "https://localhost:4433/";
+    int connections = argc > 2 ? atoi(argv[2]) : 500;
+    unsigned long full, resumed;
+    int failures = 0;
+
+    printf("TLS handshake benchmark (%s, %d connections)\n", url, connections);
+
+    failures += run("full handshake", url, connections, 0, &full);
+    failures += run("resumed", url, connections, 1, &resumed);
+
+    if (resumed == 0) {
+        fprintf(stderr, "No session was resumed; does the server issue tickets?\n");
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,2965 @@
+/**
+ * @file test_network_local.c
+ * @brief NetworkRequest/NetworkResponse tests against a loopback server
+ *
+ * Everything runs on loopback, so these tests need no network access.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#ifndef NO_ZLIB_SUPPORT
+#include <zlib.h>
+#endif
+#ifndef NO_SSL_SUPPORT
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#endif
+#include <trampoline/classes/network.h>
+#include "loopback_server.h"
+
+static int failures = 0;
+
+#define CHECK(cond, msg) do { \
+    if (cond) { \
+        printf("  PASS: %s\n", msg); \
+    } else { \
+        printf("  FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+        failures++; \
+    } \
+} while (0)
+
+static LoopbackServer* start(size_t body_size, size_t chunk_size, int keep_alive) {
+    LoopbackOptions options;
+    memset(&options, 0, sizeof(options));
+    options.body_size = body_size;
+    options.chunk_size = chunk_size;
+    options.keep_alive = keep_alive;
+    return loopback_server_start(&options);
+}
+
+static NetworkRequest* request_for(LoopbackServer* server, const char* path) {
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d%s",
+             loopback_server_port(server), path);
+    return NetworkRequestMake(url, HTTP_GET);
+}
+
+static int all_x(const char* data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (data[i] != 'x') return 0;
+    }
+    return 1;
+}
+
+/* ======================================================================== */
+/* Keep-alive pool                                                          */
+/* ======================================================================== */
+
+static void test_keep_alive_reuse(void) {
+    LoopbackServer* server = start(64, 0, 1);
+    NetworkRequest* request = request_for(server, "/pool");
+    NetworkResponse* response;
+    int i;
+
+    printf("\n=== Keep-alive connection reuse ===\n");
+    for (i = 0; i < 10; i++) {
+        response = request->send();
+        if (response) response->free();
+    }
+    CHECK(loopback_server_connections(server) == 1,
+          "10 requests share one TCP connection");
+
+    request->setKeepAlive(0);
+    response = request->send();
+    CHECK(response && response->statusCode() == 200, "Connection: close request");
+    if (response) response->free();
+
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+/* ======================================================================== */
+/* Response framing                                                         */
+/* ======================================================================== */
+
+static void test_large_body(void) {
+    size_t size = 3 * 1024 * 1024 + 17;
+    LoopbackServer* server = start(size, 0, 1);
+    NetworkRequest* request = request_for(server, "/large");
+    NetworkResponse* response = request->send();
+
+    printf("\n=== Content-Length body larger than 64KB ===\n");
+    CHECK(response && response->statusCode() == 200, "status 200");
+    CHECK(response && response->bodyLength() == size, "full body received");
+    CHECK(response && all_x(response->body(), response->bodyLength()),
+          "body intact");
+    if (response) response->free();
+
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+static void test_chunked_body(void) {
+    size_t size = 200000;
+    LoopbackServer* server = start(size, 4096, 1);
+    NetworkRequest* request = request_for(server, "/chunked");
+    NetworkResponse* response;
+
+    printf("\n=== Chunked transfer encoding ===\n");
+    response = request->send();
+    CHECK(response && response->bodyLength() == size, "chunks decoded");
+    CHECK(response && all_x(response->body(), response->bodyLength()),
+          "no chunk framing left in body");
+    if (response) response->free();
+
+    response = request->send();
+    CHECK(response && response->bodyLength() == size,
+          "second chunked response on the same connection");
+    if (response) response->free();
+    CHECK(loopback_server_connections(server) == 1,
+          "chunked responses keep the connection reusable");
+
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+typedef struct StreamCount {
+    size_t bytes;
+    size_t calls;
+    size_t limit;
+} StreamCount;
+
+static int count_bytes(const char* data, size_t length, void* context) {
+    StreamCount* count = (StreamCount*)context;
+    if (!all_x(data, length)) return 0;
+    count->bytes += length;
+    count->calls++;
+    return count->limit == 0 || count->bytes < count->limit;
+}
+
+static void test_streaming_handler(void) {
+    size_t size = 8 * 1024 * 1024;
+    LoopbackServer* server = start(size, 0, 1);
+    NetworkRequest* request = request_for(server, "/stream");
+    NetworkResponse* response;
+    StreamCount count;
+
+    printf("\n=== Streaming body handler ===\n");
+    memset(&count, 0, sizeof(count));
+    request->setBodyHandler(count_bytes, &count);
+    response = request->send();
+    CHECK(response && response->statusCode() == 200, "status 200");
+    CHECK(response && response->body() == NULL, "body not buffered");
+    CHECK(count.bytes == size, "handler saw every byte");
+    CHECK(count.calls > 1, "body delivered incrementally");
+    if (response) response->free();
+
+    memset(&count, 0, sizeof(count));
+    count.limit = 100000;
+    response = request->send();
+    CHECK(response && response->statusCode() == 502,
+          "handler can abort the transfer");
+    if (response) response->free();
+
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+/* ======================================================================== */
+/* Event loop                                                               */
+/* ======================================================================== */
+
+typedef struct AsyncResults {
+    int responses;
+    int ok;
+    int last_status;
+    size_t bytes;
+} AsyncResults;
+
+static void collect(NetworkResponse* response, void* context) {
+    AsyncResults* results = (AsyncResults*)context;
+
+    results->responses++;
+    results->last_status = response->statusCode();
+    if (response->statusCode() == 200 &&
+        all_x(response->body(), response->bodyLength())) {
+        results->ok++;
+        results->bytes += response->bodyLength();
+    }
+    response->free();
+}
+
+static void test_async_requests(void) {
+    LoopbackServer* server = start(8192, 1000, 1);
+    NetworkRequest* request = request_for(server, "/async");
+    NetworkLoop* loop = NetworkLoopMake();
+    AsyncResults results;
+    size_t completed;
+    int queued = 1;
+    int i;
+
+    printf("\n=== Asynchronous requests ===\n");
+    memset(&results, 0, sizeof(results));
+    for (i = 0; i < 50; i++) {
+        queued = queued && request->sendAsync(loop, collect, &results);
+    }
+    CHECK(queued, "50 requests queued");
+    CHECK(loop->pending() == 50, "all pending before run");
+    CHECK(results.responses == 0, "no callback runs inside sendAsync");
+
+    completed = loop->run();
+    CHECK(completed == 50 && results.responses == 50, "run completes every request");
+    CHECK(results.ok == 50 && results.bytes == 50 * 8192,
+          "every chunked body decoded");
+    CHECK(loop->pending() == 0, "nothing left pending");
+
+    /* A second round reuses the connections the first one parked */
+    i = (int)loopback_server_connections(server);
+    request->sendAsync(loop, collect, &results);
+    loop->run();
+    CHECK(results.ok == 51 &&
+          (int)loopback_server_connections(server) == i,
+          "pooled connection reused by the loop");
+
+    loop->free();
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+/* Listens but never accepts, so requests connect and then hear nothing */
+static int silent_listener(int* port) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static void test_async_timeout(void) {
+    NetworkRequest* request;
+    NetworkLoop* loop = NetworkLoopMake();
+    AsyncResults results;
+    char url[128];
+    int port = 0;
+    int fd = silent_listener(&port);
+
+    printf("\n=== Asynchronous timeouts ===\n");
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/never", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setTimeout(1);
+
+    memset(&results, 0, sizeof(results));
+    request->sendAsync(loop, collect, &results);
+    loop->run();
+    CHECK(results.responses == 1 && results.last_status == 504,
+          "unanswered request times out with 504");
+
+    memset(&results, 0, sizeof(results));
+    request->sendAsync(loop, collect, &results);
+    loop->runOnce(50);
+    loop->free();
+    CHECK(results.responses == 1 && results.last_status == 503,
+          "freeing the loop cancels with 503");
+
+    request->free();
+    NetworkPoolClear();
+    close(fd);
+}
+
+/* ======================================================================== */
+/* DNS resolution                                                           */
+/* ======================================================================== */
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int status_of(const char* url) {
+    NetworkRequest* request = NetworkRequestMake(url, HTTP_GET);
+    NetworkResponse* response = request->send();
+    int status = response ? response->statusCode() : 0;
+
+    if (response) response->free();
+    request->free();
+    return status;
+}
+
+static int async_status_of(const char* url) {
+    NetworkRequest* request = NetworkRequestMake(url, HTTP_GET);
+    NetworkLoop* loop = NetworkLoopMake();
+    AsyncResults results;
+
+    memset(&results, 0, sizeof(results));
+    request->setTimeout(5);
+    request->sendAsync(loop, collect, &results);
+    loop->run();
+    loop->free();
+    request->free();
+    return results.last_status;
+}
+
+static void test_resolver_cache(void) {
+    LoopbackServer* server = start(16, 0, 0);
+    NetworkResolverStats before, after;
+    char url[128];
+
+    printf("\n=== DNS cache ===\n");
+    NetworkResolverClear();
+    NetworkResolverGetStats(&before);
+    snprintf(url, sizeof(url), "http://localhost:%d/dns",
+             loopback_server_port(server));
+
+    CHECK(status_of(url) == 200, "first request resolves localhost");
+    CHECK(status_of(url) == 200, "second request succeeds");
+    NetworkResolverGetStats(&after);
+    CHECK(after.cache_misses - before.cache_misses == 1 &&
+          after.cache_hits > before.cache_hits,
+          "second lookup served from the cache");
+    CHECK(async_status_of(url) == 200, "loop uses the cached addresses");
+
+    CHECK(status_of("http://no-such-host.invalid/") == 502,
+          "unresolvable host fails with 502");
+    CHECK(async_status_of("http://no-such-host.invalid/") == 502,
+          "unresolvable host fails asynchronously with 502");
+
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+static void test_resolver_ipv6(void) {
+    LoopbackOptions options;
+    LoopbackServer* v6;
+    LoopbackServer* v4;
+    char url[128];
+
+    printf("\n=== IPv6 and address fallback ===\n");
+    memset(&options, 0, sizeof(options));
+    options.body_size = 16;
+    options.ipv6 = 1;
+    v6 = loopback_server_start(&options);
+    if (!v6) {
+        printf("  SKIP: no IPv6 loopback\n");
+        return;
+    }
+    v4 = start(16, 0, 0);
+
+    snprintf(url, sizeof(url), "http://[::1]:%d/v6", loopback_server_port(v6));
+    CHECK(status_of(url) == 200, "bracketed IPv6 literal");
+    CHECK(async_status_of(url) == 200, "bracketed IPv6 literal asynchronously");
+
+    /* ::1 refuses on the IPv4 server's port, so the next address is tried */
+    NetworkResolverAddHost("dual.test", "::1");
+    NetworkResolverAddHost("dual.test", "127.0.0.1");
+    snprintf(url, sizeof(url), "http://dual.test:%d/dual",
+             loopback_server_port(v4));
+    CHECK(status_of(url) == 200, "refused IPv6 falls back to IPv4");
+    CHECK(async_status_of(url) == 200, "loop falls back to IPv4");
+
+    NetworkResolverClear();
+    NetworkPoolClear();
+    loopback_server_stop(v4);
+    loopback_server_stop(v6);
+}
+
+static void test_happy_eyeballs(void) {
+    LoopbackServer* server = start(16, 0, 0);
+    char url[128];
+    double began;
+
+    printf("\n=== Happy eyeballs ===\n");
+
+    /* 100::/64 discards traffic, so connecting there never finishes; the
+     * IPv4 address has to win once its head start is over */
+    NetworkResolverAddHost("slow.test", "100::1");
+    NetworkResolverAddHost("slow.test", "127.0.0.1");
+    snprintf(url, sizeof(url), "http://slow.test:%d/race",
+             loopback_server_port(server));
+
+    began = now_seconds();
+    CHECK(status_of(url) == 200, "blackholed first address is raced");
+    CHECK(now_seconds() - began < 2.0, "blocking connect won within the head start");
+
+    began = now_seconds();
+    CHECK(async_status_of(url) == 200, "loop races addresses too");
+    CHECK(now_seconds() - began < 2.0, "loop connect won within the head start");
+
+    NetworkResolverClear();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+/* ======================================================================== */
+/* Request bodies                                                           */
+/* ======================================================================== */
+
+static int body_arrived(LoopbackServer* server, const void* data, size_t length) {
+    size_t got_length;
+    unsigned long long got_hash;
+
+    loopback_server_last_body(server, &got_length, &got_hash);
+    return got_length == length &&
+           got_hash == loopback_hash(LOOPBACK_HASH_INIT, data, length);
+}
+
+static void test_binary_body(void) {
+    LoopbackServer* server = start(16, 0, 1);
+    NetworkRequest* request = request_for(server, "/upload");
+    NetworkResponse* response;
+    char data[1000];
+    size_t i;
+
+    printf("\n=== Binary request body ===\n");
+    for (i = 0; i < sizeof(data); i++) data[i] = (char)(i % 7 == 0 ? 0 : i);
+
+    request->setMethod(HTTP_POST);
+    request->setBodyData(data, sizeof(data));
+    CHECK(request->bodyLength() == sizeof(data), "length counts past NUL bytes");
+
+    response = request->send();
+    CHECK(response && response->statusCode() == 200, "status 200");
+    CHECK(body_arrived(server, data, sizeof(data)), "server received every byte");
+    if (response) response->free();
+
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+static void test_file_body(void) {
+    LoopbackServer* server = start(16, 0, 1);
+    NetworkRequest* request = request_for(server, "/upload");
+    NetworkResponse* response;
+    NetworkLoop* loop;
+    AsyncResults results;
+    char path[] = "/tmp/trampoline_upload_XXXXXX";
+    size_t length = 3 * 1024 * 1024 + 17;
+    char* data = malloc(length);
+    size_t i;
+    int fd = mkstemp(path);
+
+    printf("\n=== File-backed request body ===\n");
+    for (i = 0; i < length; i++) data[i] = (char)(i * 31 + (i >> 12));
+    CHECK(fd >= 0 && write(fd, data, length) == (ssize_t)length,
+          "temporary file written");
+    if (fd >= 0) close(fd);
+
+    CHECK(!request->setBodyFile("/nonexistent/upload"), "missing file rejected");
+    CHECK(request->setBodyFile(path), "file attached");
+    CHECK(request->bodyLength() == length && request->body() == NULL,
+          "length from the file, nothing read in");
+    request->setMethod(HTTP_PUT);
+
+    response = request->send();
+    CHECK(response && response->statusCode() == 200, "status 200");
+    CHECK(body_arrived(server, data, length), "server received the whole file");
+    if (response) response->free();
+
+    /* The file is sent by offset, so it can be sent again */
+    loop = NetworkLoopMake();
+    memset(&results, 0, sizeof(results));
+    request->sendAsync(loop, collect, &results);
+    request->free();
+    unlink(path);
+    loop->run();
+    CHECK(results.ok == 1, "asynchronous upload outlives the request");
+    CHECK(body_arrived(server, data, length), "server received it again");
+
+    loop->free();
+    free(data);
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+/* ======================================================================== */
+/* Response parsing                                                         */
+/* ======================================================================== */
+
+static void keep_response(NetworkResponse* response, void* context) {
+    *(NetworkResponse**)context = response;
+}
+
+/* Answer one request with raw bytes, written a byte at a time so the client
+ * parses the head across many reads */
+static NetworkResponse* fetch_raw(const char* raw) {
+    NetworkResponse* response = NULL;
+    NetworkRequest* request;
+    NetworkLoop* loop = NetworkLoopMake();
+    struct pollfd ready;
+    char url[128];
+    char discard[4096];
+    int one = 1;
+    int port = 0;
+    int listener = silent_listener(&port);
+    int peer = -1;
+    size_t i;
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/raw", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setKeepAlive(0);
+    request->setTimeout(5);
+    request->sendAsync(loop, keep_response, &response);
+
+    ready.fd = listener;
+    ready.events = POLLIN;
+    while (!response && poll(&ready, 1, 0) == 0) loop->runOnce(10);
+    if (!response) {
+        peer = accept(listener, NULL, NULL);
+        setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        ready.fd = peer;
+        while (!response && poll(&ready, 1, 0) == 0) loop->runOnce(10);
+        if (recv(peer, discard, sizeof(discard), 0) <= 0) {
+            printf("  (request not received)\n");
+        }
+        for (i = 0; raw[i] && !response; i++) {
+            if (send(peer, raw + i, 1, MSG_NOSIGNAL) != 1) break;
+            loop->runOnce(1);
+        }
+        close(peer);
+    }
+    while (!response) loop->runOnce(10);
+
+    loop->free();
+    request->free();
+    close(listener);
+    return response;
+}
+
+static void test_response_parsing(void) {
+    NetworkResponse* response;
+    const char* value;
+
+    printf("\n=== Response parsing ===\n");
+    response = fetch_raw("HTTP/1.1 200 Fine Thanks\r\n"
+                         "Content-Type: text/plain\r\n"
+                         "X-Folded: first\r\n"
+                         "   second\r\n"
+                         "X-Padded: \t padded value \t\r\n"
+                         "X-Empty:\r\n"
+                         "Content-Length: 5\r\n"
+                         "\r\n"
+                         "hello");
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->statusText(), "Fine Thanks") == 0,
+          "status line parsed a byte at a time");
+    value = response->header("CONTENT-TYPE");
+    CHECK(value && strcmp(value, "text/plain") == 0 &&
+          response->header("content-type") == value,
+          "header lookup ignores case");
+    value = response->header("X-Folded");
+    CHECK(value && strcmp(value, "first second") == 0,
+          "folded header joined with a space");
+    value = response->header("x-padded");
+    CHECK(value && strcmp(value, "padded value") == 0,
+          "whitespace around a value trimmed");
+    value = response->header("X-Empty");
+    CHECK(value && value[0] == '\0' && !response->header("X-Missing"),
+          "empty and missing headers told apart");
+    CHECK(response->headerCount() == 5 && response->bodyLength() == 5 &&
+          memcmp(response->body(), "hello", 5) == 0,
+          "body follows the head");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\nContent-Length: 2\n\nok");
+    CHECK(response->statusCode() == 200 && response->bodyLength() == 2,
+          "bare LF line endings accepted");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\r\nBad Name: x\r\n\r\n");
+    CHECK(response->statusCode() == 502, "malformed header name rejected");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\r\nX-Ctl: a\001b\r\n\r\n");
+    CHECK(response->statusCode() == 502, "control byte in a value rejected");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\r\nContent-Length: 2x\r\n\r\nok");
+    CHECK(response->statusCode() == 502, "non-digit Content-Length rejected");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\r\n"
+                         "Content-Length: 99999999999999999999999\r\n\r\nok");
+    CHECK(response->statusCode() == 502, "overflowing Content-Length rejected");
+    response->free();
+
+    /* Only what arrives is allocated, not what the head claims */
+    response = fetch_raw("HTTP/1.1 200 OK\r\n"
+                         "Content-Length: 1000000000000000\r\n\r\nok");
+    CHECK(response->statusCode() == 502, "huge Content-Length cut short fails");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                         "2 ;name=value\r\nok\r\n0\r\n\r\n");
+    CHECK(response->statusCode() == 200 && response->bodyLength() == 2 &&
+          memcmp(response->body(), "ok", 2) == 0,
+          "chunk extensions skipped");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                         "2z\r\nok\r\n0\r\n\r\n");
+    CHECK(response->statusCode() == 502, "malformed chunk size rejected");
+    response->free();
+
+    response = fetch_raw("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                         "2\r\nokXX0\r\n\r\n");
+    CHECK(response->statusCode() == 502, "chunk without its CRLF rejected");
+    response->free();
+
+    response = NetworkResponseMake(0, NULL, "HTTP/1.0 404 Not Found\r\n"
+                                            "Server: test\r\n\r\nmissing");
+    CHECK(response->statusCode() == 404 &&
+          strcmp(response->header("server"), "test") == 0 &&
+          strcmp(response->body(), "missing") == 0,
+          "raw response text parsed by NetworkResponseMake");
+    response->free();
+}
+
+/* ======================================================================== */
+/* HttpServer                                                               */
+/* ======================================================================== */
+
+static NetworkResponse* echo_handler(const HttpServerRequest* request,
+                                     void* context) {
+    const char* token = HttpServerRequestHeader(request, "x-token");
+    char reply[512];
+
+    (*(int*)context)++;
+    snprintf(reply, sizeof(reply),
+             "HTTP/1.1 201 Created\r\n"
+             "X-Path: %s\r\nX-Query: %s\r\nX-Token: %s\r\n\r\n%s",
+             request->path, request->query ? request->query : "",
+             token ? token : "", request->body ? request->body : "");
+    return NetworkResponseMake(0, NULL, reply);
+}
+
+static NetworkResponse* path_handler(const HttpServerRequest* request,
+                                     void* context) {
+    (void)context;
+    return NetworkResponseMake(200, "OK", request->path);
+}
+
+/* Send raw bytes to the server and read until it closes */
+static size_t raw_exchange(int port, const char* data, char* reply,
+                           size_t size) {
+    struct sockaddr_in addr;
+    size_t length = 0;
+    ssize_t n;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        send(fd, data, strlen(data), 0) < 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    while (length + 1 < size &&
+           (n = recv(fd, reply + length, size - length - 1, 0)) > 0) {
+        length += (size_t)n;
+    }
+    reply[length] = '\0';
+    close(fd);
+    return length;
+}
+
+static int count_of(const char* haystack, const char* needle) {
+    int count = 0;
+    while ((haystack = strstr(haystack, needle)) != NULL) {
+        count++;
+        haystack++;
+    }
+    return count;
+}
+
+static void test_http_server(void) {
+    HttpServerOptions options = { 2, 5, 64 };
+    HttpServer* server = HttpServerMake(&options);
+    NetworkRequest* request;
+    NetworkResponse* response;
+    NetworkPoolStats before, after;
+    NetworkLoop* loop;
+    AsyncResults results;
+    char url[128];
+    char reply[4096];
+    int calls = 0;
+    int port;
+    int i;
+
+    printf("\n=== HttpServer ===\n");
+    server->routeResponse("GET", "/health",
+                          NetworkResponseMake(0, NULL, "HTTP/1.1 200 OK\r\n"
+                                              "X-Check: yes\r\n\r\nok"));
+    server->route("POST", "/echo", echo_handler, &calls);
+    server->route(NULL, "/files/*", path_handler, NULL);
+    port = server->listen("127.0.0.1", 0);
+    CHECK(port > 0 && server->port() == port, "listening on a free port");
+    CHECK(!server->route(NULL, "/late", path_handler, NULL),
+          "routes are fixed once listening");
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/health", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    NetworkPoolGetStats(&before);
+    for (i = 0; i < 5; i++) {
+        response = request->send();
+        if (i == 0) {
+            CHECK(response->statusCode() == 200 &&
+                  strcmp(response->body(), "ok") == 0 &&
+                  strcmp(response->header("X-Check"), "yes") == 0 &&
+                  strcmp(response->header("Content-Length"), "2") == 0,
+                  "fixed reply with its headers");
+        }
+        response->free();
+    }
+    NetworkPoolGetStats(&after);
+    CHECK(after.connections_reused - before.connections_reused == 4,
+          "keep-alive connection reused");
+
+    request->setMethod(HTTP_HEAD);
+    response = request->send();
+    CHECK(response->statusCode() == 200 && response->bodyLength() == 0,
+          "HEAD served by a GET route without a body");
+    response->free();
+    request->free();
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/echo?x=1", port);
+    request = NetworkRequestMake(url, HTTP_POST);
+    request->setHeader("X-Token", "abc");
+    request->setBody("ping");
+    response = request->send();
+    CHECK(response->statusCode() == 201 && calls == 1 &&
+          strcmp(response->body(), "ping") == 0,
+          "handler sees the body and sets the status");
+    CHECK(strcmp(response->header("X-Path"), "/echo") == 0 &&
+          strcmp(response->header("X-Query"), "x=1") == 0 &&
+          strcmp(response->header("X-Token"), "abc") == 0,
+          "path, query and request headers reach the handler");
+    response->free();
+
+    request->setBody("this body is longer than the sixty-four byte limit set "
+                     "in the options");
+    response = request->send();
+    CHECK(response->statusCode() == 413, "oversized body refused");
+    response->free();
+
+    request->free();
+
+    CHECK(status_of(url) == 405, "wrong method is 405");
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/missing", port);
+    CHECK(status_of(url) == 404, "unknown path is 404");
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/files/a/b.txt", port);
+    request = NetworkRequestMake(url, HTTP_DELETE);
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->body(), "/files/a/b.txt") == 0,
+          "prefix route matches any method");
+    response->free();
+    request->free();
+
+    raw_exchange(port, "GET /health HTTP/1.1\r\nHost: a\r\n\r\n"
+                       "GET /files/x HTTP/1.1\r\nHost: a\r\n\r\n"
+                       "GET /health HTTP/1.1\r\nHost: a\r\n"
+                       "Connection: close\r\n\r\n", reply, sizeof(reply));
+    CHECK(count_of(reply, "HTTP/1.1 200 OK\r\n") == 3 &&
+          strstr(reply, "/files/x") != NULL,
+          "pipelined requests answered in order");
+    raw_exchange(port, "GET /health HTTP/1.1\r\nBad Header: x\r\n\r\n",
+                 reply, sizeof(reply));
+    CHECK(strncmp(reply, "HTTP/1.1 400 ", 13) == 0, "malformed request is 400");
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/health", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    loop = NetworkLoopMake();
+    memset(&results, 0, sizeof(results));
+    for (i = 0; i < 20; i++) request->sendAsync(loop, collect, &results);
+    loop->run();
+    CHECK(results.responses == 20 && results.last_status == 200,
+          "concurrent asynchronous clients served");
+    loop->free();
+    request->free();
+
+    NetworkPoolClear();
+    server->stop();
+    CHECK(server->port() == -1, "stopped");
+    server->free();
+}
+
+/* ======================================================================== */
+/* NetworkRequestBatch                                                      */
+/* ======================================================================== */
+
+typedef struct PipelineProbe {
+    int listener;
+    int requests;           /* Expected after the first */
+    int heads_seen;
+} PipelineProbe;
+
+/* Answers the first request alone, then answers nothing until every other
+ * request has arrived, so a client that waits for each response before
+ * sending the next never gets one. The replies go out in a single send. */
+static void* pipeline_probe(void* arg) {
+    PipelineProbe* probe = (PipelineProbe*)arg;
+    char buffer[16384];
+    char replies[2048];
+    size_t used = 0;
+    size_t length = 0;
+    int fd = accept(probe->listener, NULL, NULL);
+    int i;
+
+    if (fd < 0) return NULL;
+    buffer[0] = '\0';
+    while (!strstr(buffer, "\r\n\r\n")) {
+        ssize_t n = recv(fd, buffer + used, sizeof(buffer) - used - 1, 0);
+        if (n <= 0) break;
+        used += (size_t)n;
+        buffer[used] = '\0';
+    }
+    snprintf(replies, sizeof(replies),
+             "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n0");
+    send(fd, replies, strlen(replies), 0);
+
+    used = 0;
+    buffer[0] = '\0';
+    while (count_of(buffer, "\r\n\r\n") < probe->requests) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        ssize_t n;
+
+        if (poll(&pfd, 1, 3000) <= 0) break;
+        n = recv(fd, buffer + used, sizeof(buffer) - used - 1, 0);
+        if (n <= 0) break;
+        used += (size_t)n;
+        buffer[used] = '\0';
+    }
+    probe->heads_seen = count_of(buffer, "\r\n\r\n");
+
+    for (i = 1; i <= probe->requests; i++) {
+        length += (size_t)snprintf(replies + length, sizeof(replies) - length,
+                                   "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%d",
+                                   i < 10 ? 1 : 2, i);
+    }
+    send(fd, replies, length, 0);
+    close(fd);
+    return NULL;
+}
+
+static void test_request_batch(void) {
+    HttpServerOptions options = { 2, 5, 1024 };
+    HttpServer* server = HttpServerMake(&options);
+    NetworkRequestBatch* batch = NetworkRequestBatchMake();
+    NetworkRequest* request;
+    NetworkResponse** responses;
+    NetworkPoolStats before, after;
+    LoopbackServer* closing;
+    PipelineProbe probe;
+    pthread_t thread;
+    char url[128];
+    char expected[32];
+    int calls = 0;
+    int ordered = 1;
+    int ok = 0;
+    int port;
+    int i;
+
+    printf("\n=== NetworkRequestBatch ===\n");
+    server->route("GET", "/n/*", path_handler, NULL);
+    server->route("POST", "/echo", echo_handler, &calls);
+    port = server->listen("127.0.0.1", 0);
+
+    request = NetworkRequestMake("not a url", HTTP_GET);
+    CHECK(!request || !batch->add(request), "request without a URL refused");
+    if (request) request->free();
+    CHECK(batch->count() == 0 && batch->send() == NULL, "empty batch sends nothing");
+
+    /* Mixed methods keep their order; the POST is never pipelined */
+    NetworkPoolClear();
+    NetworkPoolGetStats(&before);
+    for (i = 0; i < 30; i++) {
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/n/%d", port, i);
+        request = NetworkRequestMake(url, i == 12 ? HTTP_POST : HTTP_GET);
+        if (i == 12) {
+            snprintf(url, sizeof(url), "http://127.0.0.1:%d/echo", port);
+            request->setUrl(url);
+            request->setBody("posted");
+        }
+        if (i == 20) request->setMethod(HTTP_HEAD);
+        batch->add(request);
+        request->free();
+    }
+    CHECK(batch->count() == 30, "30 requests captured");
+    responses = batch->send();
+    NetworkPoolGetStats(&after);
+    for (i = 0; i < 30; i++) {
+        snprintf(expected, sizeof(expected), "/n/%d", i);
+        if (i == 12) {
+            ordered &= responses[i]->statusCode() == 201 &&
+                       strcmp(responses[i]->body(), "posted") == 0;
+        } else if (i == 20) {
+            ordered &= responses[i]->statusCode() == 200 &&
+                       responses[i]->bodyLength() == 0;
+        } else {
+            ordered &= responses[i]->statusCode() == 200 &&
+                       strcmp(responses[i]->body(), expected) == 0;
+        }
+        responses[i]->free();
+    }
+    free(responses);
+    CHECK(ordered && calls == 1, "responses come back in the order added");
+    CHECK(after.connections_opened - before.connections_opened == 1,
+          "whole batch shared one connection");
+    CHECK(batch->count() == 0, "batch is empty after send");
+
+    /* Spread over several connections */
+    batch->setConnections(3);
+    for (i = 0; i < 24; i++) {
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/n/%d", port, i);
+        request = NetworkRequestMake(url, HTTP_GET);
+        batch->add(request);
+        request->free();
+    }
+    responses = batch->send();
+    ordered = 1;
+    for (i = 0; i < 24; i++) {
+        snprintf(expected, sizeof(expected), "/n/%d", i);
+        ordered &= responses[i]->statusCode() == 200 &&
+                   strcmp(responses[i]->body(), expected) == 0;
+        responses[i]->free();
+    }
+    free(responses);
+    CHECK(ordered, "three connections still answer in order");
+    batch->setConnections(1);
+
+    /* Only pipelined requests get through the probe in time */
+    probe.listener = silent_listener(&port);
+    probe.requests = 12;
+    probe.heads_seen = 0;
+    pthread_create(&thread, NULL, pipeline_probe, &probe);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/p", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setTimeout(2);
+    for (i = 0; i <= probe.requests; i++) batch->add(request);
+    request->free();
+    responses = batch->send();
+    pthread_join(thread, NULL);
+    close(probe.listener);
+    ordered = 1;
+    for (i = 0; i <= probe.requests; i++) {
+        snprintf(expected, sizeof(expected), "%d", i);
+        ordered &= responses[i]->statusCode() == 200 &&
+                   strcmp(responses[i]->body(), expected) == 0;
+        responses[i]->free();
+    }
+    free(responses);
+    CHECK(probe.heads_seen == probe.requests,
+          "requests pipelined once the server kept the connection open");
+    CHECK(ordered, "responses sent together are split apart in order");
+
+    /* A server that closes after every response gets one request per
+     * connection, with nothing lost */
+    closing = start(16, 0, 0);
+    for (i = 0; i < 6; i++) {
+        request = request_for(closing, "/");
+        batch->add(request);
+        request->free();
+    }
+    responses = batch->send();
+    for (i = 0; i < 6; i++) {
+        ok += responses[i]->statusCode() == 200 &&
+              responses[i]->bodyLength() == 16;
+        responses[i]->free();
+    }
+    free(responses);
+    CHECK(ok == 6 && loopback_server_connections(closing) == 6,
+          "closing server answers each request on its own connection");
+    loopback_server_stop(closing);
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    batch->add(request);
+    batch->add(request);
+    request->free();
+    responses = batch->send();
+    CHECK(responses[0]->statusCode() == 502 && responses[1]->statusCode() == 502,
+          "refused connection fails every request with 502");
+    responses[0]->free();
+    responses[1]->free();
+    free(responses);
+
+    batch->free();
+    NetworkPoolClear();
+    server->free();
+}
+
+/* ======================================================================== */
+/* NetworkRequestTemplate                                                   */
+/* ======================================================================== */
+
+static NetworkResponse* length_handler(const HttpServerRequest* request,
+                                       void* context) {
+    char reply[64];
+
+    (void)context;
+    snprintf(reply, sizeof(reply), "%zu %s", request->body_length,
+             request->query ? request->query : "-");
+    return NetworkResponseMake(200, "OK", reply);
+}
+
+typedef struct TemplateResults {
+    int responses;
+    unsigned int seen;      /* Bit n for each "3 n=<n>" reply */
+} TemplateResults;
+
+/* Replies may complete in any order */
+static void count_query(NetworkResponse* response, void* context) {
+    TemplateResults* results = (TemplateResults*)context;
+    int n = -1;
+
+    results->responses++;
+    if (response->bodyLength() > 0 &&
+        sscanf(response->body(), "3 n=%d", &n) == 1 && n >= 0 && n < 32) {
+        results->seen |= 1u << n;
+    }
+    response->free();
+}
+
+static void test_request_template(void) {
+    HttpServerOptions options = { 2, 5, 1024 * 1024 };
+    HttpServer* server = HttpServerMake(&options);
+    NetworkLoop* loop = NetworkLoopMake();
+    NetworkRequestTemplate* prepared;
+    NetworkRequest* prototype;
+    NetworkResponse* response;
+    TemplateResults results;
+    char url[128];
+    char query[32];
+    char* big = malloc(20000);
+    int calls = 0;
+    int queued = 1;
+    int port;
+    int i;
+
+    printf("\n=== NetworkRequestTemplate ===\n");
+    server->route("POST", "/echo", echo_handler, &calls);
+    server->route("POST", "/length", length_handler, NULL);
+    port = server->listen("127.0.0.1", 0);
+
+    CHECK(NetworkRequestTemplateMake(NULL) == NULL, "no template without a prototype");
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/echo?v=1", port);
+    prototype = NetworkRequestMake(url, HTTP_POST);
+    prototype->setHeader("X-Token", "abc");
+    prepared = NetworkRequestTemplateMake(prototype);
+    prototype->setHeader("X-Token", "changed");
+    prototype->free();
+
+    response = prepared->send(NULL, "hello", 5);
+    CHECK(response->statusCode() == 201 &&
+          strcmp(response->header("X-Path"), "/echo") == 0 &&
+          strcmp(response->header("X-Query"), "v=1") == 0 &&
+          strcmp(response->header("X-Token"), "abc") == 0 &&
+          strcmp(response->body(), "hello") == 0,
+          "headers and query captured when the template was made");
+    response->free();
+
+    response = prepared->send("page=2&q=x", "bye", 3);
+    CHECK(strcmp(response->header("X-Query"), "page=2&q=x") == 0 &&
+          strcmp(response->body(), "bye") == 0, "query replaced per send");
+    response->free();
+
+    response = prepared->send("", NULL, 0);
+    CHECK(response->statusCode() == 201 &&
+          strcmp(response->header("X-Query"), "") == 0 &&
+          response->bodyLength() == 0, "empty query and body");
+    response->free();
+    CHECK(calls == 3, "one handler call per send");
+    prepared->free();
+
+    /* Bodies too big for the stack take the heap */
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/length", port);
+    prototype = NetworkRequestMake(url, HTTP_POST);
+    prepared = NetworkRequestTemplateMake(prototype);
+    prototype->free();
+    memset(big, 'x', 20000);
+    response = prepared->send(NULL, big, 20000);
+    CHECK(response->statusCode() == 200 && strcmp(response->body(), "20000 -") == 0,
+          "large body sent whole");
+    response->free();
+
+    memset(&results, 0, sizeof(results));
+    for (i = 0; i < 20; i++) {
+        snprintf(query, sizeof(query), "n=%d", i);
+        queued = queued && prepared->sendAsync(loop, query, "abc",
+                                               count_query, &results);
+    }
+    loop->run();
+    CHECK(queued && results.responses == 20 && results.seen == 0xfffffu,
+          "async sends fill in their own query and body");
+
+    prepared->free();
+    loop->free();
+    free(big);
+    NetworkPoolClear();
+    server->free();
+}
+
+/* ======================================================================== */
+/* Request policies                                                         */
+/* ======================================================================== */
+
+/* What the deliberately slow server does with the calls it gets */
+typedef struct SlowPlan {
+    int calls;
+    int fail_first;         /* Answer the first few with 503 */
+    int sleep_first_ms;     /* Stall the call after those */
+    int sleep_all_ms;
+} SlowPlan;
+
+static NetworkResponse* slow_handler(const HttpServerRequest* request,
+                                     void* context) {
+    SlowPlan* plan = (SlowPlan*)context;
+    int call = __atomic_add_fetch(&plan->calls, 1, __ATOMIC_SEQ_CST);
+    char reply[32];
+
+    (void)request;
+    if (call <= plan->fail_first) {
+        return NetworkResponseMake(503, "Service Unavailable", "busy");
+    }
+    if (call == plan->fail_first + 1 && plan->sleep_first_ms > 0) {
+        usleep((useconds_t)plan->sleep_first_ms * 1000);
+    }
+    if (plan->sleep_all_ms > 0) usleep((useconds_t)plan->sleep_all_ms * 1000);
+    snprintf(reply, sizeof(reply), "call %d", call);
+    return NetworkResponseMake(200, "OK", reply);
+}
+
+static void plan_reset(SlowPlan* plan, int fail_first, int sleep_first_ms) {
+    __atomic_store_n(&plan->calls, 0, __ATOMIC_SEQ_CST);
+    plan->fail_first = fail_first;
+    plan->sleep_first_ms = sleep_first_ms;
+}
+
+static void test_request_policy(void) {
+    HttpServerOptions options = { 4, 5, 1024 };
+    HttpServer* server = HttpServerMake(&options);
+    NetworkRequestPolicy policy;
+    NetworkPolicyStats before, after;
+    NetworkResponse* response;
+    NetworkResponse* async_response = NULL;
+    NetworkRequest* request;
+    NetworkRequest* post;
+    NetworkLoop* loop;
+    SlowPlan plan, stall;
+    char url[128];
+    double started, elapsed;
+    int fast = 1;
+    int port;
+    int i;
+
+    printf("\n=== Request policies ===\n");
+    memset(&plan, 0, sizeof(plan));
+    memset(&stall, 0, sizeof(stall));
+    stall.sleep_all_ms = 600;
+    server->route("GET", "/plan", slow_handler, &plan);
+    server->route("POST", "/plan", slow_handler, &plan);
+    server->route("GET", "/stall", slow_handler, &stall);
+    port = server->listen("127.0.0.1", 0);
+    NetworkPolicyGetStats(&before);
+
+    /* Deadline shorter than the server takes */
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/stall", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    memset(&policy, 0, sizeof(policy));
+    policy.deadline_ms = 150;
+    request->setPolicy(&policy);
+    started = now_seconds();
+    response = request->send();
+    elapsed = now_seconds() - started;
+    CHECK(response->statusCode() == 504 && elapsed > 0.1 && elapsed < 0.4,
+          "deadline cuts a slow request short with 504");
+    printf("  (gave up after %.0f ms)\n", elapsed * 1000);
+    response->free();
+    request->free();
+
+    /* Retries with backoff until the server recovers */
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/plan", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    memset(&policy, 0, sizeof(policy));
+    policy.max_retries = 3;
+    policy.backoff_ms = 10;
+    policy.max_backoff_ms = 40;
+    request->setPolicy(&policy);
+    plan_reset(&plan, 2, 0);
+    response = request->send();
+    CHECK(response->statusCode() == 200 && strcmp(response->body(), "call 3") == 0,
+          "503s retried until one succeeds");
+    response->free();
+
+    plan_reset(&plan, 5, 0);
+    response = request->send();
+    CHECK(response->statusCode() == 503 && plan.calls == 4,
+          "last failure delivered once retries run out");
+    response->free();
+
+    post = NetworkRequestMake(url, HTTP_POST);
+    post->setBody("{}");
+    post->setPolicy(&policy);
+    plan_reset(&plan, 2, 0);
+    response = post->send();
+    CHECK(response->statusCode() == 503 && plan.calls == 1, "POST never retried");
+    response->free();
+    post->free();
+
+    /* Asynchronous sends go through the same policy on the caller's loop */
+    loop = NetworkLoopMake();
+    plan_reset(&plan, 1, 0);
+    CHECK(request->sendAsync(loop, keep_response, &async_response) &&
+          async_response == NULL, "policy request queued");
+    loop->run();
+    CHECK(async_response && async_response->statusCode() == 200 &&
+          plan.calls == 2, "async request retried on its loop");
+    if (async_response) async_response->free();
+    request->free();
+
+    /* A stalled first attempt is overtaken by its hedge */
+    request = NetworkRequestMake(url, HTTP_GET);
+    memset(&policy, 0, sizeof(policy));
+    policy.hedge_after_ms = 50;
+    request->setPolicy(&policy);
+    plan_reset(&plan, 0, 600);
+    started = now_seconds();
+    response = request->send();
+    elapsed = now_seconds() - started;
+    CHECK(response->statusCode() == 200 && strcmp(response->body(), "call 2") == 0 &&
+          elapsed < 0.3, "hedge answers while the first attempt stalls");
+    printf("  (hedged response in %.0f ms)\n", elapsed * 1000);
+    response->free();
+
+    /* Learn the origin's p95, then hedge on it */
+    policy.hedge_after_ms = NETWORK_HEDGE_P95;
+    request->setPolicy(&policy);
+    plan_reset(&plan, 0, 0);
+    for (i = 0; i < 25; i++) {
+        response = request->send();
+        fast = fast && response->statusCode() == 200;
+        response->free();
+    }
+    CHECK(fast && NetworkPolicyHedgeDelay("127.0.0.1", port) > 0,
+          "p95 learned from timed responses");
+    plan_reset(&plan, 0, 600);
+    started = now_seconds();
+    response = request->send();
+    elapsed = now_seconds() - started;
+    CHECK(response->statusCode() == 200 && elapsed < 0.3,
+          "p95 hedge rescues a stalled request");
+    response->free();
+    request->free();
+
+    NetworkPolicyGetStats(&after);
+    CHECK(after.retries - before.retries == 6 && after.hedges_won - before.hedges_won == 2 &&
+          after.deadlines_missed - before.deadlines_missed == 1,
+          "policy stats count retries, hedges and deadlines");
+
+    loop->free();
+    NetworkPoolClear();
+    server->free();
+}
+
+/* ======================================================================== */
+/* HTTP/2                                                                   */
+/* ======================================================================== */
+
+/* Response header blocks from an independent HPACK encoder (Huffman on):
+ * :status 200, content-type text/plain, x-server h2c-test. The first adds
+ * both headers to the dynamic table; the second refers back to them. */
+static const char h2_first_block[] =
+    "\x88\x5f\x87\x49\x7c\xa5\x8a\xe8\x19\xaa\x40\x86\xf2\xb2\x0b\x67"
+    "\x72\xd9\x86\x9c\x44\x59\x25\x42\x7f";
+static const char h2_later_block[] = "\x88\xbf\xbe";
+
+#define H2_TEST_CONNS 8
+
+typedef struct H2Conn {
+    int fd;
+    char* in;
+    size_t used;
+    size_t body[1024];      /* Request body bytes by (stream id / 2) */
+    int responses;
+} H2Conn;
+
+/* A cleartext HTTP/2 server for prior-knowledge clients: every stream is
+ * answered with its id and how many body bytes it sent */
+typedef struct H2Server {
+    int listener;
+    int port;
+    int wake[2];
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int connections;
+    size_t first_block;     /* Request header block sizes seen */
+    size_t last_block;
+    size_t streams;
+    H2Conn conns[H2_TEST_CONNS];
+} H2Server;
+
+static void h2_frame(int fd, int type, int flags, unsigned int stream,
+                     const void* payload, size_t length) {
+    unsigned char frame[9 + 256];
+
+    frame[0] = (unsigned char)(length >> 16);
+    frame[1] = (unsigned char)(length >> 8);
+    frame[2] = (unsigned char)length;
+    frame[3] = (unsigned char)type;
+    frame[4] = (unsigned char)flags;
+    frame[5] = (unsigned char)(stream >> 24);
+    frame[6] = (unsigned char)(stream >> 16);
+    frame[7] = (unsigned char)(stream >> 8);
+    frame[8] = (unsigned char)stream;
+    if (length > 0) memcpy(frame + 9, payload, length);
+    send(fd, frame, 9 + length, MSG_NOSIGNAL);
+}
+
+static void h2_window_update(int fd, unsigned int stream, size_t increment) {
+    unsigned char payload[4];
+
+    payload[0] = (unsigned char)(increment >> 24);
+    payload[1] = (unsigned char)(increment >> 16);
+    payload[2] = (unsigned char)(increment >> 8);
+    payload[3] = (unsigned char)increment;
+    h2_frame(fd, 0x8, 0, stream, payload, 4);
+}
+
+static void h2_respond(H2Conn* conn, unsigned int stream) {
+    char body[64];
+    int length = snprintf(body, sizeof(body), "stream %u got %zu", stream,
+                          conn->body[(stream / 2) % 1024]);
+
+    if (conn->responses++ == 0) {
+        h2_frame(conn->fd, 0x1, 0x4, stream, h2_first_block,
+                 sizeof(h2_first_block) - 1);
+    } else {
+        h2_frame(conn->fd, 0x1, 0x4, stream, h2_later_block,
+                 sizeof(h2_later_block) - 1);
+    }
+    h2_frame(conn->fd, 0x0, 0x1, stream, body, (size_t)length);
+}
+
+/* Handle the frames buffered on conn; false if it is broken */
+static int h2_serve(H2Server* server, H2Conn* conn) {
+    size_t offset = 24;
+
+    if (conn->used < 24) return 1;
+    if (memcmp(conn->in, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) != 0) return 0;
+
+    while (conn->used - offset >= 9) {
+        unsigned char* frame = (unsigned char*)conn->in + offset;
+        size_t length = ((size_t)frame[0] << 16) | ((size_t)frame[1] << 8) | frame[2];
+        unsigned int stream = (((unsigned int)frame[5] & 0x7f) << 24) |
+                              ((unsigned int)frame[6] << 16) |
+                              ((unsigned int)frame[7] << 8) | frame[8];
+        int type = frame[3];
+        int flags = frame[4];
+
+        if (conn->used - offset < 9 + length) break;
+        if (type == 0x4 && !(flags & 0x1)) {
+            h2_frame(conn->fd, 0x4, 0x1, 0, NULL, 0);
+        } else if (type == 0x1) {
+            pthread_mutex_lock(&server->mutex);
+            if (server->streams++ == 0) server->first_block = length;
+            server->last_block = length;
+            pthread_mutex_unlock(&server->mutex);
+            conn->body[(stream / 2) % 1024] = 0;
+            if (flags & 0x1) h2_respond(conn, stream);
+        } else if (type == 0x0) {
+            conn->body[(stream / 2) % 1024] += length;
+            if (length > 0) {
+                h2_window_update(conn->fd, 0, length);
+                h2_window_update(conn->fd, stream, length);
+            }
+            if (flags & 0x1) h2_respond(conn, stream);
+        }
+        offset += 9 + length;
+    }
+
+    /* Keep the preface so the next call skips it the same way */
+    memmove(conn->in + 24, conn->in + offset, conn->used - offset);
+    conn->used -= offset - 24;
+    return 1;
+}
+
+static void* h2_server_main(void* arg) {
+    H2Server* server = (H2Server*)arg;
+    struct pollfd fds[2 + H2_TEST_CONNS];
+    /* MAX_CONCURRENT_STREAMS 100, so a crowd of requests has to wait */
+    static const unsigned char settings[] = { 0, 3, 0, 0, 0, 100 };
+    int i;
+
+    for (;;) {
+        fds[0].fd = server->wake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = server->listener;
+        fds[1].events = POLLIN;
+        for (i = 0; i < H2_TEST_CONNS; i++) {
+            fds[2 + i].fd = server->conns[i].fd;
+            fds[2 + i].events = POLLIN;
+        }
+        if (poll(fds, 2 + H2_TEST_CONNS, -1) < 0) break;
+        if (fds[0].revents) break;
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(server->listener, NULL, NULL);
+            for (i = 0; fd >= 0 && i < H2_TEST_CONNS; i++) {
+                if (server->conns[i].fd < 0) {
+                    server->conns[i].fd = fd;
+                    server->conns[i].used = 0;
+                    server->conns[i].responses = 0;
+                    pthread_mutex_lock(&server->mutex);
+                    server->connections++;
+                    pthread_mutex_unlock(&server->mutex);
+                    h2_frame(fd, 0x4, 0, 0, settings, sizeof(settings));
+                    fd = -1;
+                }
+            }
+            if (fd >= 0) close(fd);
+        }
+
+        for (i = 0; i < H2_TEST_CONNS; i++) {
+            H2Conn* conn = &server->conns[i];
+            ssize_t n;
+
+            if (conn->fd < 0 || !fds[2 + i].revents) continue;
+            n = recv(conn->fd, conn->in + conn->used, 262144 - conn->used, 0);
+            if (n <= 0) {
+                close(conn->fd);
+                conn->fd = -1;
+                continue;
+            }
+            conn->used += (size_t)n;
+            if (!h2_serve(server, conn)) {
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+    }
+    return NULL;
+}
+
+static H2Server* h2_server_start(void) {
+    H2Server* server = calloc(1, sizeof(H2Server));
+    int i;
+
+    if (!server) return NULL;
+    server->listener = silent_listener(&server->port);
+    pthread_mutex_init(&server->mutex, NULL);
+    for (i = 0; i < H2_TEST_CONNS; i++) {
+        server->conns[i].fd = -1;
+        server->conns[i].in = malloc(262144);
+    }
+    if (server->listener < 0 || pipe(server->wake) < 0 ||
+        pthread_create(&server->thread, NULL, h2_server_main, server) != 0) {
+        return NULL;
+    }
+    return server;
+}
+
+static void h2_server_stop(H2Server* server) {
+    int i;
+
+    if (write(server->wake[1], "x", 1) < 0) return;
+    pthread_join(server->thread, NULL);
+    for (i = 0; i < H2_TEST_CONNS; i++) {
+        if (server->conns[i].fd >= 0) close(server->conns[i].fd);
+        free(server->conns[i].in);
+    }
+    close(server->listener);
+    close(server->wake[0]);
+    close(server->wake[1]);
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+}
+
+typedef struct H2Results {
+    int ok;
+    int responses;
+    unsigned char seen[512];    /* Stream ids answered, by id / 2 */
+    int duplicates;
+} H2Results;
+
+static void collect_h2(NetworkResponse* response, void* context) {
+    H2Results* results = (H2Results*)context;
+    unsigned int stream = 0;
+
+    results->responses++;
+    if (response->statusCode() == 200 &&
+        sscanf(response->body(), "stream %u got 0", &stream) == 1 &&
+        response->header("x-server") &&
+        strcmp(response->header("x-server"), "h2c-test") == 0 &&
+        strcmp(response->contentType(), "text/plain") == 0) {
+        results->ok++;
+        if (results->seen[(stream / 2) % 512]++) results->duplicates++;
+    }
+    response->free();
+}
+
+static void test_http2(void) {
+    H2Server* server = h2_server_start();
+    NetworkHttp2Stats before;
+    NetworkHttp2Stats after;
+    NetworkRequest* request;
+    NetworkResponse* response;
+    NetworkLoop* loop = NetworkLoopMake();
+    H2Results results;
+    char url[128];
+    char* big;
+    int queued = 1;
+    int i;
+
+    printf("\n=== HTTP/2 ===\n");
+    if (!server || !loop) {
+        CHECK(0, "h2c server and loop start");
+        return;
+    }
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/h2", server->port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setHeader("Accept", "text/plain");
+    request->setHttpVersion(HTTP_VERSION_2);
+    CHECK(request->httpVersion() == HTTP_VERSION_2, "request asks for HTTP/2");
+
+    /* Three times the server's stream limit, all at once */
+    NetworkHttp2GetStats(&before);
+    memset(&results, 0, sizeof(results));
+    for (i = 0; i < 300; i++) {
+        queued = queued && request->sendAsync(loop, collect_h2, &results);
+    }
+    CHECK(queued, "300 requests queued");
+    loop->run();
+    NetworkHttp2GetStats(&after);
+    CHECK(results.responses == 300 && results.ok == 300,
+          "every stream answered with a decoded head and body");
+    CHECK(results.duplicates == 0, "each answer came on its own stream");
+    CHECK(server->connections == 1 &&
+          after.sessions_opened == before.sessions_opened + 1,
+          "all 300 multiplexed over one connection");
+    CHECK(after.streams == before.streams + 300, "one stream per request");
+    CHECK(server->last_block < server->first_block,
+          "repeated request headers compress against the dynamic table");
+
+    /* A blocking send picks up the session the loop parked */
+    response = request->send();
+    NetworkHttp2GetStats(&after);
+    CHECK(response->statusCode() == 200 &&
+          strncmp(response->body(), "stream ", 7) == 0,
+          "blocking send over HTTP/2");
+    CHECK(response->timing()->reused && response->timing()->bytes_sent > 0 &&
+          response->timing()->bytes_received > 0 &&
+          response->timing()->first_byte >= response->timing()->request_sent,
+          "HTTP/2 stream timed on its session");
+    CHECK(server->connections == 1 &&
+          after.sessions_reused > before.sessions_reused,
+          "parked session reused by the blocking send");
+    response->free();
+
+    /* A body larger than the server's 64KB windows needs its updates */
+    big = malloc(200001);
+    memset(big, 'y', 200000);
+    big[200000] = '\0';
+    request->setMethod(HTTP_POST);
+    request->setBody(big);
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strstr(response->body(), "got 200000") != NULL,
+          "request body sent within flow control windows");
+    response->free();
+    free(big);
+
+    request->free();
+    loop->free();
+    NetworkHttp2ClearSessions();
+    NetworkPoolClear();
+    h2_server_stop(server);
+
+    /* A server that only speaks HTTP/1.1 fails the prior-knowledge attempt */
+    {
+        LoopbackServer* plain = start(16, 0, 1);
+        NetworkRequest* old = request_for(plain, "/h1");
+
+        old->setHttpVersion(HTTP_VERSION_2);
+        old->setTimeout(5);
+        response = old->send();
+        CHECK(response->statusCode() == 502, "HTTP/1.1-only server reported");
+        response->free();
+        old->free();
+        NetworkPoolClear();
+        loopback_server_stop(plain);
+    }
+}
+
+/* ======================================================================== */
+/* Timing and metrics                                                       */
+/* ======================================================================== */
+
+static void keep_timing(NetworkResponse* response, void* context) {
+    NetworkTiming* timing = (NetworkTiming*)context;
+
+    *timing = *response->timing();
+    response->free();
+}
+
+static void test_timing_metrics(void) {
+    LoopbackServer* server = start(4096, 0, 1);
+    NetworkRequest* request = request_for(server, "/timed");
+    NetworkLoop* loop = NetworkLoopMake();
+    NetworkResponse* response;
+    NetworkTiming first;
+    NetworkTiming again;
+    NetworkTiming async;
+    Json* metrics;
+    char* text;
+    char key[64];
+    char* host;
+    int port;
+    int fd;
+
+    printf("\n=== Timing and metrics ===\n");
+    NetworkPoolClear();
+    NetworkMetricsReset();
+
+    response = request->send();
+    first = *response->timing();
+    CHECK(response->statusCode() == 200 && !first.reused,
+          "first request opens a connection");
+    CHECK(first.start > 0 && first.dns_start >= first.start &&
+          first.dns_end >= first.dns_start &&
+          first.connect_start >= first.dns_end &&
+          first.connect_end >= first.connect_start &&
+          first.request_sent >= first.connect_end &&
+          first.first_byte >= first.request_sent &&
+          first.end >= first.first_byte,
+          "phases recorded in order");
+    CHECK(first.tls_start == 0 && first.tls_end == 0, "no TLS phase over http");
+    CHECK(first.bytes_sent > 0 && first.bytes_received > 4096,
+          "bytes counted both ways");
+    response->free();
+
+    response = request->send();
+    again = *response->timing();
+    CHECK(again.reused && again.dns_start == 0 && again.connect_start == 0 &&
+          again.first_byte >= again.request_sent && again.end > 0,
+          "pooled connection reported as reused, without setup phases");
+    response->free();
+
+    memset(&async, 0, sizeof(async));
+    request->sendAsync(loop, keep_timing, &async);
+    loop->run();
+    CHECK(async.reused && async.start > 0 &&
+          async.first_byte >= async.request_sent && async.end >= async.first_byte,
+          "loop requests are timed too");
+
+    response = NetworkResponseMake(200, "OK", "made");
+    CHECK(response->timing()->start == 0 && response->timing()->end == 0,
+          "made responses have no timing");
+    response->free();
+
+    /* Nothing listens here any more, so the request gets no response */
+    fd = silent_listener(&port);
+    close(fd);
+    {
+        char url[64];
+        NetworkRequest* refused;
+
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/", port);
+        refused = NetworkRequestMake(url, HTTP_GET);
+        response = refused->send();
+        CHECK(response->statusCode() == 502 && response->timing()->end > 0 &&
+              response->timing()->first_byte == 0,
+              "failed request timed up to the failure");
+        response->free();
+        refused->free();
+    }
+
+    metrics = NetworkMetricsJson();
+    text = metrics ? metrics->stringify() : NULL;
+    snprintf(key, sizeof(key), "\"127.0.0.1:%d\":{", loopback_server_port(server));
+    host = text ? strstr(text, key) : NULL;
+    CHECK(host && strncmp(host + strlen(key),
+                          "\"requests\":3,\"failed\":0,\"reused\":2,", 35) == 0,
+          "per-host counts exported as JSON");
+    CHECK(host && strstr(host, "\"2xx\":3") && strstr(host, "\"total\":{\"count\":3") &&
+          strstr(host, "\"connect\":{\"count\":1"),
+          "histograms only count phases that happened");
+    snprintf(key, sizeof(key), "\"127.0.0.1:%d\":{\"requests\":1,\"failed\":1", port);
+    CHECK(text && strstr(text, key), "failures counted per host");
+    CHECK(text && strncmp(text, "{\"bounds_ms\":[0.1", 17) == 0,
+          "bucket bounds exported");
+    free(text);
+    if (metrics) metrics->free();
+
+    NetworkMetricsReset();
+    metrics = NetworkMetricsJson();
+    text = metrics ? metrics->stringify() : NULL;
+    CHECK(text && strstr(text, "\"hosts\":{}"), "reset forgets every host");
+    free(text);
+    if (metrics) metrics->free();
+
+    loop->free();
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+}
+
+/* ======================================================================== */
+/* Compressed bodies                                                        */
+/* ======================================================================== */
+
+#ifndef NO_ZLIB_SUPPORT
+typedef struct ByteServer {
+    int listener;
+    const char* reply;
+    size_t length;
+    char head[4096];
+} ByteServer;
+
+/* Answers one request with fixed bytes, then closes */
+static void* byte_server(void* arg) {
+    ByteServer* server = (ByteServer*)arg;
+    size_t used = 0;
+    size_t sent = 0;
+    int fd = accept(server->listener, NULL, NULL);
+
+    if (fd < 0) return NULL;
+    server->head[0] = '\0';
+    while (!strstr(server->head, "\r\n\r\n")) {
+        ssize_t n = recv(fd, server->head + used, sizeof(server->head) - used - 1, 0);
+        if (n <= 0) break;
+        used += (size_t)n;
+        server->head[used] = '\0';
+    }
+    while (sent < server->length) {
+        ssize_t n = send(fd, server->reply + sent, server->length - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += (size_t)n;
+    }
+    close(fd);
+    return NULL;
+}
+
+/* Compress with zlib window bits: 31 gzip, 15 zlib, -15 raw deflate */
+static size_t squeeze(const char* data, size_t length, int bits,
+                      char* out, size_t capacity) {
+    z_stream z;
+    size_t produced;
+
+    memset(&z, 0, sizeof(z));
+    deflateInit2(&z, 6, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY);
+    z.next_in = (Bytef*)data;
+    z.avail_in = (uInt)length;
+    z.next_out = (Bytef*)out;
+    z.avail_out = (uInt)capacity;
+    deflate(&z, Z_FINISH);
+    produced = capacity - z.avail_out;
+    deflateEnd(&z);
+    return produced;
+}
+
+/* Serve head followed by body and fetch it, with an optional body handler */
+static NetworkResponse* fetch_bytes(const char* head, const char* body,
+                                    size_t length, NetworkBodyHandler handler,
+                                    void* context, char* sent_head) {
+    ByteServer server;
+    NetworkResponse* response;
+    NetworkRequest* request;
+    pthread_t thread;
+    char url[128];
+    char* reply = malloc(strlen(head) + length);
+    int port = 0;
+
+    memcpy(reply, head, strlen(head));
+    memcpy(reply + strlen(head), body, length);
+    server.listener = silent_listener(&port);
+    server.reply = reply;
+    server.length = strlen(head) + length;
+    pthread_create(&thread, NULL, byte_server, &server);
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/packed", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setKeepAlive(0);
+    request->setTimeout(5);
+    if (handler) request->setBodyHandler(handler, context);
+    response = request->send();
+
+    pthread_join(thread, NULL);
+    if (sent_head) strcpy(sent_head, server.head);
+    close(server.listener);
+    request->free();
+    free(reply);
+    return response;
+}
+
+static int count_calls(const char* data, size_t length, void* context) {
+    (void)data;
+    (void)length;
+    (*(int*)context)++;
+    return 1;
+}
+
+static void test_compressed_bodies(void) {
+    NetworkResponse* response;
+    size_t plain_length = 0;
+    size_t packed_length;
+    size_t chunked_length = 0;
+    size_t offset;
+    char* plain = malloc(256 * 1024);
+    char* packed = malloc(256 * 1024);
+    char* chunked = malloc(300 * 1024);
+    char* twice = malloc(512 * 1024);
+    char head[256];
+    char sent[4096];
+    int calls = 0;
+    int i;
+
+    printf("\n=== Compressed bodies ===\n");
+    for (i = 0; plain_length < 200000; i++) {
+        plain_length += (size_t)sprintf(plain + plain_length,
+                                        "{\"id\":%d,\"name\":\"item %d\",\"ok\":true},", i, i);
+    }
+
+    packed_length = squeeze(plain, plain_length, 31, packed, 256 * 1024);
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+             "Content-Length: %zu\r\n\r\n", packed_length);
+    response = fetch_bytes(head, packed, packed_length, NULL, NULL, sent);
+    CHECK(strstr(sent, "Accept-Encoding: gzip, deflate") != NULL,
+          "requests advertise gzip and deflate");
+    CHECK(response->statusCode() == 200 && response->bodyLength() == plain_length &&
+          memcmp(response->body(), plain, plain_length) == 0 &&
+          strcmp(response->header("Content-Encoding"), "gzip") == 0,
+          "gzip body decoded, headers left as sent");
+    printf("  (%zu bytes on the wire for %zu of JSON)\n", packed_length, plain_length);
+    response->free();
+
+    /* The same stream cut into 1000 byte chunks */
+    for (offset = 0; offset < packed_length; offset += 1000) {
+        size_t take = packed_length - offset < 1000 ? packed_length - offset : 1000;
+        chunked_length += (size_t)sprintf(chunked + chunked_length, "%zx\r\n", take);
+        memcpy(chunked + chunked_length, packed + offset, take);
+        chunked_length += take;
+        memcpy(chunked + chunked_length, "\r\n", 2);
+        chunked_length += 2;
+    }
+    memcpy(chunked + chunked_length, "0\r\n\r\n", 5);
+    chunked_length += 5;
+    response = fetch_bytes("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+                           "Transfer-Encoding: chunked\r\n\r\n",
+                           chunked, chunked_length, NULL, NULL, NULL);
+    CHECK(response->bodyLength() == plain_length &&
+          memcmp(response->body(), plain, plain_length) == 0,
+          "chunked gzip body decoded");
+    response->free();
+
+    response = fetch_bytes("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+                           "Transfer-Encoding: chunked\r\n\r\n",
+                           chunked, chunked_length, count_calls, &calls, NULL);
+    CHECK(response->statusCode() == 200 && response->bodyLength() == plain_length &&
+          calls > 1, "body handler fed decoded bytes as they inflate");
+    response->free();
+
+    packed_length = squeeze(plain, plain_length, 15, packed, 256 * 1024);
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Encoding: deflate\r\n"
+             "Content-Length: %zu\r\n\r\n", packed_length);
+    response = fetch_bytes(head, packed, packed_length, NULL, NULL, NULL);
+    CHECK(response->bodyLength() == plain_length &&
+          memcmp(response->body(), plain, plain_length) == 0,
+          "zlib deflate body decoded");
+    response->free();
+
+    /* Raw deflate without the zlib wrapper, delimited by close */
+    packed_length = squeeze(plain, plain_length, -15, packed, 256 * 1024);
+    response = fetch_bytes("HTTP/1.1 200 OK\r\nContent-Encoding: deflate\r\n"
+                           "Connection: close\r\n\r\n",
+                           packed, packed_length, NULL, NULL, NULL);
+    CHECK(response->bodyLength() == plain_length &&
+          memcmp(response->body(), plain, plain_length) == 0,
+          "raw deflate body decoded");
+    response->free();
+
+    /* Two gzip members back to back decode as one body */
+    packed_length = squeeze(plain, 1000, 31, twice, 512 * 1024);
+    packed_length += squeeze(plain + 1000, plain_length - 1000, 31,
+                             twice + packed_length, 512 * 1024 - packed_length);
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+             "Content-Length: %zu\r\n\r\n", packed_length);
+    response = fetch_bytes(head, twice, packed_length, NULL, NULL, NULL);
+    CHECK(response->bodyLength() == plain_length &&
+          memcmp(response->body(), plain, plain_length) == 0,
+          "concatenated gzip members decoded");
+    response->free();
+
+    /* Encodings we do not know pass through untouched */
+    response = fetch_bytes("HTTP/1.1 200 OK\r\nContent-Encoding: br\r\n"
+                           "Content-Length: 4\r\n\r\n", "\x0b\x01\x80\x03", 4,
+                           NULL, NULL, NULL);
+    CHECK(response->bodyLength() == 4 && memcmp(response->body(), "\x0b\x01\x80\x03", 4) == 0,
+          "unknown encoding left as received");
+    response->free();
+
+    packed_length = squeeze(plain, plain_length, 31, packed, 256 * 1024);
+    memset(packed + 20, 0xff, 64);
+    snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+             "Content-Length: %zu\r\n\r\n", packed_length);
+    response = fetch_bytes(head, packed, packed_length, NULL, NULL, NULL);
+    CHECK(response->statusCode() == 502, "corrupt gzip body fails the request");
+    response->free();
+
+    free(plain);
+    free(packed);
+    free(chunked);
+    free(twice);
+}
+#endif
+
+/* ======================================================================== */
+/* Redirects                                                                */
+/* ======================================================================== */
+
+typedef struct RedirectRoute {
+    int status;
+    const char* location;
+    int calls;
+} RedirectRoute;
+
+static NetworkResponse* redirect_handler(const HttpServerRequest* request,
+                                         void* context) {
+    RedirectRoute* route = (RedirectRoute*)context;
+    char reply[512];
+
+    (void)request;
+    __atomic_add_fetch(&route->calls, 1, __ATOMIC_SEQ_CST);
+    snprintf(reply, sizeof(reply),
+             "HTTP/1.1 %d Redirect\r\nLocation: %s\r\n\r\nmoved",
+             route->status, route->location);
+    return NetworkResponseMake(0, NULL, reply);
+}
+
+/* Says what arrived: "METHOD path?query length auth type" */
+static NetworkResponse* landing_handler(const HttpServerRequest* request,
+                                        void* context) {
+    const char* auth = HttpServerRequestHeader(request, "authorization");
+    const char* type = HttpServerRequestHeader(request, "content-type");
+    char reply[512];
+
+    (void)context;
+    snprintf(reply, sizeof(reply), "%s %s%s%s %zu %s %s", request->method,
+             request->path, request->query ? "?" : "",
+             request->query ? request->query : "", request->body_length,
+             auth ? auth : "-", type ? type : "-");
+    return NetworkResponseMake(200, "OK", reply);
+}
+
+static void test_redirects(void) {
+    HttpServerOptions options = { 2, 5, 1024 };
+    HttpServer* server = HttpServerMake(&options);
+    HttpServer* other = HttpServerMake(&options);
+    RedirectRoute moved = { 301, "/landing", 0 };
+    RedirectRoute see_other = { 303, "/landing?done=1", 0 };
+    RedirectRoute found = { 302, "/landing", 0 };
+    RedirectRoute temporary = { 307, "/landing", 0 };
+    RedirectRoute relative = { 302, "c?x=1", 0 };
+    RedirectRoute loop = { 302, "/loop", 0 };
+    RedirectRoute away = { 302, NULL, 0 };
+    RedirectRoute bad = { 302, "ftp://127.0.0.1/file", 0 };
+    NetworkPoolStats before, after;
+    NetworkRequest* request;
+    NetworkResponse* response;
+    char location[128];
+    char url[128];
+    int port, other_port;
+
+    printf("\n=== Redirects ===\n");
+    server->route("GET", "/moved", redirect_handler, &moved);
+    server->route("POST", "/see-other", redirect_handler, &see_other);
+    server->route("POST", "/found", redirect_handler, &found);
+    server->route("POST", "/temporary", redirect_handler, &temporary);
+    server->route("GET", "/a/b", redirect_handler, &relative);
+    server->route("GET", "/loop", redirect_handler, &loop);
+    server->route("GET", "/away", redirect_handler, &away);
+    server->route("GET", "/bad", redirect_handler, &bad);
+    server->route(NULL, "/landing", landing_handler, NULL);
+    server->route(NULL, "/a/*", landing_handler, NULL);
+    other->route(NULL, "/landing", landing_handler, NULL);
+    port = server->listen("127.0.0.1", 0);
+    other_port = other->listen("127.0.0.1", 0);
+    snprintf(location, sizeof(location), "http://127.0.0.1:%d/landing",
+             other_port);
+    away.location = location;
+
+    /* Same host: the hop takes the connection the 301 came back on */
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/moved", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    NetworkPoolClear();
+    NetworkPoolGetStats(&before);
+    response = request->send();
+    NetworkPoolGetStats(&after);
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->body(), "GET /landing 0 - -") == 0,
+          "301 followed to its location");
+    CHECK(after.connections_opened - before.connections_opened == 1 &&
+          after.connections_reused - before.connections_reused == 1,
+          "same-host hop reuses the pooled connection");
+    response->free();
+
+    /* The 301 is remembered, so the old URL is not asked again */
+    response = request->send();
+    CHECK(response->statusCode() == 200 && moved.calls == 1,
+          "301 cached for the process");
+    response->free();
+    request->free();
+
+    request = NetworkRequestMake(url, HTTP_GET);
+    response = request->send();
+    CHECK(response->statusCode() == 200 && moved.calls == 1,
+          "cached 301 applies to a new request for the same URL");
+    response->free();
+    request->free();
+
+    /* 303 turns a POST into a GET without its body */
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/see-other", port);
+    request = NetworkRequestMake(url, HTTP_POST);
+    request->setHeader("Content-Type", "text/plain");
+    request->setBody("payload");
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->body(), "GET /landing?done=1 0 - -") == 0,
+          "303 continues as GET without body or Content-Type");
+    response->free();
+    CHECK(request->method() == HTTP_POST && request->bodyLength() == 7,
+          "request itself is left unchanged");
+    request->free();
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/found", port);
+    request = NetworkRequestMake(url, HTTP_POST);
+    request->setBody("payload");
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strncmp(response->body(), "GET /landing 0", 14) == 0,
+          "302 after a POST continues as GET");
+    response->free();
+    request->free();
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/temporary", port);
+    request = NetworkRequestMake(url, HTTP_POST);
+    request->setHeader("Content-Type", "text/plain");
+    request->setBody("payload");
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->body(), "POST /landing 7 - text/plain") == 0,
+          "307 resends the method and body");
+    response->free();
+    request->free();
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/a/b", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->body(), "GET /a/c?x=1 0 - -") == 0,
+          "relative location resolved against the path");
+    response->free();
+    request->free();
+
+    /* Another origin does not get the credentials */
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/away", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setHeader("Authorization", "Bearer secret");
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->body(), "GET /landing 0 - -") == 0,
+          "cross-origin hop drops Authorization");
+    response->free();
+    request->free();
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/loop", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setMaxRedirects(3);
+    response = request->send();
+    CHECK(response->statusCode() == 302 && loop.calls == 4,
+          "redirect loop stops after maxRedirects hops");
+    response->free();
+
+    request->setFollowRedirects(0);
+    response = request->send();
+    CHECK(response->statusCode() == 302 && loop.calls == 5 &&
+          !request->followRedirects(),
+          "setFollowRedirects(0) returns the 3xx");
+    response->free();
+    request->free();
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/bad", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    response = request->send();
+    CHECK(response->statusCode() == 302, "non-HTTP location is not followed");
+    response->free();
+    request->free();
+
+    server->free();
+    other->free();
+}
+
+/* ======================================================================== */
+/* Response cache                                                           */
+/* ======================================================================== */
+
+typedef struct CacheOrigin {
+    int calls;
+    int not_modified;
+    int conditional;        /* Requests that carried a validator */
+} CacheOrigin;
+
+/* /fresh: max-age; /etag: no-cache with an ETag; /dated: Last-Modified
+ * only; /private: no-store. The first two answer a matching validator
+ * with 304. */
+static NetworkResponse* cache_handler(const HttpServerRequest* request,
+                                      void* context) {
+    CacheOrigin* origin = (CacheOrigin*)context;
+    const char* match = HttpServerRequestHeader(request, "if-none-match");
+    const char* since = HttpServerRequestHeader(request, "if-modified-since");
+    const char* headers = "Cache-Control: no-store\r\n";
+    char reply[512];
+
+    __atomic_add_fetch(&origin->calls, 1, __ATOMIC_SEQ_CST);
+    if (match || since) __atomic_add_fetch(&origin->conditional, 1, __ATOMIC_SEQ_CST);
+    if (strcmp(request->path, "/fresh") == 0) {
+        headers = "Cache-Control: public, max-age=60\r\n";
+    } else if (strcmp(request->path, "/etag") == 0) {
+        headers = "Cache-Control: no-cache\r\nETag: \"v1\"\r\n";
+        if (match && strcmp(match, "\"v1\"") == 0) {
+            __atomic_add_fetch(&origin->not_modified, 1, __ATOMIC_SEQ_CST);
+            return NetworkResponseMake(0, NULL, "HTTP/1.1 304 Not Modified\r\n"
+                                       "ETag: \"v1\"\r\n\r\n");
+        }
+    } else if (strcmp(request->path, "/dated") == 0) {
+        headers = "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n";
+        if (since && strcmp(since, "Sun, 06 Nov 1994 08:49:37 GMT") == 0) {
+            __atomic_add_fetch(&origin->not_modified, 1, __ATOMIC_SEQ_CST);
+            return NetworkResponseMake(0, NULL, "HTTP/1.1 304 Not Modified\r\n\r\n");
+        }
+    }
+    snprintf(reply, sizeof(reply),
+             "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n%s\r\n"
+             "{\"path\":\"%s\",\"calls\":%d}",
+             headers, request->path, origin->calls);
+    return NetworkResponseMake(0, NULL, reply);
+}
+
+static NetworkResponse* cache_get(int port, const char* path) {
+    NetworkRequest* request;
+    NetworkResponse* response;
+    char url[128];
+
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", port, path);
+    request = NetworkRequestMake(url, HTTP_GET);
+    response = request->send();
+    request->free();
+    return response;
+}
+
+static void test_response_cache(void) {
+    HttpServerOptions server_options = { 2, 5, 1024 };
+    HttpServer* server = HttpServerMake(&server_options);
+    NetworkCacheOptions options;
+    NetworkCacheStats before, after;
+    NetworkRequest* request;
+    NetworkResponse* response;
+    NetworkResponse* again;
+    CacheOrigin origin;
+    Json* json;
+    Json* second;
+    char directory[64];
+    char url[128];
+    char* text;
+    int port;
+
+    printf("\n=== Response cache ===\n");
+    memset(&origin, 0, sizeof(origin));
+    server->route("GET", "/*", cache_handler, &origin);
+    port = server->listen("127.0.0.1", 0);
+    snprintf(directory, sizeof(directory), "/tmp/trampoline-cache-%d",
+             (int)getpid());
+    options.max_bytes = 1 << 20;
+    options.directory = directory;
+    NetworkCacheConfigure(&options);
+    NetworkCacheGetStats(&before);
+
+    /* max-age: the second request never reaches the server */
+    response = cache_get(port, "/fresh");
+    again = cache_get(port, "/fresh");
+    NetworkCacheGetStats(&after);
+    CHECK(response->statusCode() == 200 && again->statusCode() == 200 &&
+          origin.calls == 1 && after.hits - before.hits == 1 &&
+          strcmp(again->body(), response->body()) == 0 &&
+          strcmp(again->header("Content-Type"), "application/json") == 0,
+          "fresh response served from the cache");
+    response->free();
+
+    /* The tree is parsed once and cloned for each caller */
+    json = again->bodyAsJson();
+    second = again->bodyAsJson();
+    text = second ? second->stringify() : NULL;
+    CHECK(json && second && json != second && text &&
+          strstr(text, "\"path\":\"/fresh\"") != NULL,
+          "bodyAsJson clones the cached tree");
+    free(text);
+    if (json) json->free();
+    if (second) second->free();
+    again->free();
+
+    /* no-cache with an ETag: revalidated, and a 304 serves the entry */
+    response = cache_get(port, "/etag");
+    response->free();
+    response = cache_get(port, "/etag");
+    NetworkCacheGetStats(&after);
+    CHECK(response->statusCode() == 200 && origin.not_modified == 1 &&
+          after.revalidated - before.revalidated == 1 &&
+          response->bodyLength() > 0 &&
+          strstr(response->body(), "\"path\":\"/etag\"") != NULL &&
+          response->timing()->end > 0,
+          "If-None-Match answered by 304 serves the cached body");
+    response->free();
+
+    response = cache_get(port, "/dated");
+    response->free();
+    response = cache_get(port, "/dated");
+    CHECK(response->statusCode() == 200 && origin.not_modified == 2 &&
+          strstr(response->body(), "\"path\":\"/dated\"") != NULL,
+          "Last-Modified revalidated with If-Modified-Since");
+    response->free();
+
+    origin.calls = 0;
+    response = cache_get(port, "/private");
+    response->free();
+    response = cache_get(port, "/private");
+    CHECK(origin.calls == 2, "no-store responses are not kept");
+    response->free();
+
+    /* The request can insist on asking the server */
+    origin.calls = 0;
+    origin.conditional = 0;
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/fresh", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+    request->setHeader("Cache-Control", "no-cache");
+    response = request->send();
+    CHECK(origin.calls == 1 && response->statusCode() == 200,
+          "request no-cache goes to the server");
+    response->free();
+    request->setHeader("Cache-Control", "no-store");
+    response = request->send();
+    CHECK(origin.calls == 2 && origin.conditional == 0,
+          "request no-store bypasses the cache");
+    response->free();
+    request->free();
+
+    /* Memory emptied: the entry comes back from its file */
+    options.max_bytes = 0;
+    NetworkCacheConfigure(&options);
+    NetworkCacheGetStats(&after);
+    CHECK(after.entries == 0, "shrinking the cache evicts");
+    options.max_bytes = 1 << 20;
+    NetworkCacheConfigure(&options);
+    origin.calls = 0;
+    response = cache_get(port, "/fresh");
+    NetworkCacheGetStats(&after);
+    CHECK(response->statusCode() == 200 && origin.calls == 0 &&
+          after.entries == 1 &&
+          strstr(response->body(), "\"path\":\"/fresh\"") != NULL,
+          "entry mapped back in from disk");
+    response->free();
+
+    /* A budget too small for two entries keeps the newer */
+    options.max_bytes = 300;
+    NetworkCacheConfigure(&options);
+    NetworkCacheClear();
+    NetworkCacheGetStats(&before);
+    response = cache_get(port, "/fresh");
+    response->free();
+    response = cache_get(port, "/etag");
+    response->free();
+    NetworkCacheGetStats(&after);
+    CHECK(after.evicted - before.evicted == 1 && after.entries == 1 &&
+          after.bytes <= 300,
+          "least recently used entry evicted to fit");
+
+    NetworkCacheClear();
+    options.max_bytes = 0;
+    options.directory = NULL;
+    NetworkCacheConfigure(&options);
+    rmdir(directory);
+    server->free();
+}
+
+/* ======================================================================== */
+/* Header tables                                                            */
+/* ======================================================================== */
+
+/* Reports which of the headers it looks for arrived */
+static NetworkResponse* header_probe_handler(const HttpServerRequest* request,
+                                             void* context) {
+    const char* kept = HttpServerRequestHeader(request, "X-H39");
+    const char* removed = HttpServerRequestHeader(request, "x-h10");
+    const char* type = HttpServerRequestHeader(request, "CONTENT-TYPE");
+    const char* agent = HttpServerRequestHeader(request, "user-agent");
+    char reply[256];
+
+    (void)context;
+    snprintf(reply, sizeof(reply), "%s %s %s %s", kept ? kept : "-",
+             removed ? removed : "-", type ? type : "-", agent ? "agent" : "-");
+    return NetworkResponseMake(200, "OK", reply);
+}
+
+static void test_header_table(void) {
+    HttpServerOptions options = { 1, 5, 1024 };
+    HttpServer* server = HttpServerMake(&options);
+    NetworkRequest* request;
+    NetworkResponse* response;
+    char name[16], value[16];
+    char url[128];
+    int port;
+    int i;
+
+    printf("\n=== Header tables ===\n");
+    server->route("GET", "/probe", header_probe_handler, NULL);
+    port = server->listen("127.0.0.1", 0);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/probe", port);
+    request = NetworkRequestMake(url, HTTP_GET);
+
+    request->setHeader("Content-Type", "text/plain");
+    request->setHeader("content-type", "application/json");
+    CHECK(strcmp(request->header("CONTENT-TYPE"), "application/json") == 0,
+          "names match in any case and set replaces");
+    for (i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "X-H%d", i);
+        snprintf(value, sizeof(value), "v%d", i);
+        request->setHeader(name, value);
+    }
+    request->removeHeader("x-H10");
+    CHECK(request->header("X-H10") == NULL &&
+          strcmp(request->header("x-h39"), "v39") == 0 &&
+          strcmp(request->header("Content-Type"), "application/json") == 0,
+          "remove keeps the rest findable");
+
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          strcmp(response->body(), "v39 - application/json agent") == 0,
+          "table serialized into the request head");
+    CHECK(response->header("content-length") != NULL &&
+          response->header("CONTENT-LENGTH") == response->header("Content-Length"),
+          "response headers found through the common-name index");
+    response->free();
+
+    request->removeHeader("Content-Type");
+    request->removeHeader("Content-Type");
+    CHECK(request->header("content-type") == NULL, "removing twice is harmless");
+    request->free();
+    server->free();
+}
+
+/* ======================================================================== */
+/* Rate and concurrency limits                                              */
+/* ======================================================================== */
+
+typedef struct LimitOrigin {
+    int current;
+    int most;               /* Most requests being handled at once */
+    int calls;
+} LimitOrigin;
+
+static NetworkResponse* limit_handler(const HttpServerRequest* request,
+                                      void* context) {
+    LimitOrigin* origin = (LimitOrigin*)context;
+    int current = __atomic_add_fetch(&origin->current, 1, __ATOMIC_SEQ_CST);
+    int most = __atomic_load_n(&origin->most, __ATOMIC_SEQ_CST);
+
+    (void)request;
+    while (current > most &&
+           !__atomic_compare_exchange_n(&origin->most, &most, current, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        /* most reloaded by the failed exchange */
+    }
+    __atomic_add_fetch(&origin->calls, 1, __ATOMIC_SEQ_CST);
+    usleep(30000);
+    __atomic_sub_fetch(&origin->current, 1, __ATOMIC_SEQ_CST);
+    return NetworkResponseMake(200, "OK", "limited");
+}
+
+typedef struct LimitWorker {
+    pthread_t thread;
+    const char* url;
+    int status;
+} LimitWorker;
+
+static void* limit_worker(void* context) {
+    LimitWorker* worker = (LimitWorker*)context;
+    NetworkRequest* request = NetworkRequestMake(worker->url, HTTP_GET);
+    NetworkResponse* response = request->send();
+
+    worker->status = response->statusCode();
+    response->free();
+    request->free();
+    return NULL;
+}
+
+static void test_request_limits(void) {
+    HttpServerOptions server_options = { 8, 5, 1024 };
+    HttpServer* server = HttpServerMake(&server_options);
+    NetworkLimitOptions options;
+    NetworkLimitOptions current;
+    NetworkLimitStats before, after;
+    NetworkLoop* loop;
+    NetworkRequest* request;
+    NetworkResponse* response;
+    LimitWorker workers[6];
+    LimitOrigin origin;
+    AsyncResults results;
+    Json* metrics;
+    char* text;
+    char url[128];
+    char key[64];
+    double started;
+    int all_ok = 1;
+    int port;
+    int i;
+
+    printf("\n=== Rate and concurrency limits ===\n");
+    memset(&origin, 0, sizeof(origin));
+    server->route("GET", "/*", limit_handler, &origin);
+    port = server->listen("127.0.0.1", 0);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/limited", port);
+    NetworkMetricsReset();
+
+    memset(&options, 0, sizeof(options));
+    options.max_in_flight = 2;
+    CHECK(NetworkLimitConfigure("127.0.0.1", port, &options),
+          "per-origin limits accepted");
+    NetworkLimitGetOptions("127.0.0.1", port, &current);
+    CHECK(current.max_in_flight == 2 && current.requests_per_second == 0,
+          "limits read back");
+    options.burst = -1;
+    CHECK(!NetworkLimitConfigure("127.0.0.1", port, &options),
+          "negative limits refused");
+    options.burst = 0;
+
+    /* Six blocking senders, at most two of them on the wire */
+    NetworkLimitGetStats(&before);
+    for (i = 0; i < 6; i++) {
+        workers[i].url = url;
+        workers[i].status = 0;
+        pthread_create(&workers[i].thread, NULL, limit_worker, &workers[i]);
+    }
+    for (i = 0; i < 6; i++) {
+        pthread_join(workers[i].thread, NULL);
+        all_ok = all_ok && workers[i].status == 200;
+    }
+    NetworkLimitGetStats(&after);
+    CHECK(all_ok && origin.calls == 6 && origin.most == 2,
+          "blocking sends held to max_in_flight");
+    CHECK(after.admitted - before.admitted == 6 && after.delayed > before.delayed &&
+          after.wait_ms_max > 0,
+          "waiting counted in the stats");
+
+    /* The same limit holds on a loop */
+    origin.most = 0;
+    loop = NetworkLoopMake();
+    request = NetworkRequestMake(url, HTTP_GET);
+    memset(&results, 0, sizeof(results));
+    for (i = 0; i < 6; i++) request->sendAsync(loop, collect, &results);
+    loop->run();
+    CHECK(results.responses == 6 && results.last_status == 200 && origin.most == 2,
+          "asynchronous requests held to max_in_flight");
+
+    /* Only one may wait: the third is refused at once */
+    options.max_in_flight = 1;
+    options.max_queued = 1;
+    NetworkLimitConfigure("127.0.0.1", port, &options);
+    memset(&results, 0, sizeof(results));
+    NetworkLimitGetStats(&before);
+    for (i = 0; i < 3; i++) request->sendAsync(loop, collect, &results);
+    loop->run();
+    NetworkLimitGetStats(&after);
+    CHECK(results.responses == 3 && after.rejected - before.rejected == 1 &&
+          after.admitted - before.admitted == 2,
+          "queue beyond max_queued refused with 503");
+
+    /* 20 per second with no burst: five sends span four intervals */
+    memset(&options, 0, sizeof(options));
+    options.requests_per_second = 20;
+    NetworkLimitConfigure("127.0.0.1", port, &options);
+    started = now_seconds();
+    for (i = 0; i < 5; i++) {
+        response = request->send();
+        all_ok = all_ok && response->statusCode() == 200;
+        response->free();
+    }
+    CHECK(all_ok && now_seconds() - started >= 0.19,
+          "token bucket spaces requests to the rate");
+
+    /* A token a second away is past max_wait_ms: refused, not slept on */
+    options.requests_per_second = 1;
+    options.max_wait_ms = 100;
+    NetworkLimitConfigure("127.0.0.1", port, &options);
+    response = request->send();
+    response->free();
+    started = now_seconds();
+    response = request->send();
+    CHECK(response->statusCode() == 503 && now_seconds() - started < 0.05 &&
+          strstr(response->body(), "deadline") != NULL,
+          "wait past the deadline refused immediately");
+    response->free();
+
+    metrics = NetworkMetricsJson();
+    text = metrics ? metrics->stringify() : NULL;
+    snprintf(key, sizeof(key), "\"127.0.0.1:%d\":{", port);
+    CHECK(text && strstr(text, key) && strstr(strstr(text, key), "\"queue\":{\"count\":"),
+          "time spent waiting is a metrics phase");
+    free(text);
+    if (metrics) metrics->free();
+
+    /* Removed: back to the (empty) default */
+    NetworkLimitConfigure("127.0.0.1", port, NULL);
+    NetworkLimitGetOptions("127.0.0.1", port, &current);
+    started = now_seconds();
+    for (i = 0; i < 3; i++) {
+        response = request->send();
+        response->free();
+    }
+    CHECK(current.requests_per_second == 0 && now_seconds() - started < 0.5,
+          "removing the limits lets requests through");
+
+    request->free();
+    loop->free();
+    server->free();
+}
+
+/* ======================================================================== */
+/* Loopback fixture                                                         */
+/* ======================================================================== */
+
+static void test_loopback_fixture(void) {
+    LoopbackOptions options;
+    LoopbackServer* server;
+    NetworkRequest* request;
+    NetworkResponse* response;
+    unsigned long before;
+    double started;
+
+    printf("\n=== Loopback fixture ===\n");
+    server = start(64, 0, 1);
+
+    request = request_for(server, "/bytes/3000000");
+    response = request->send();
+    CHECK(response->statusCode() == 200 && response->bodyLength() == 3000000 &&
+          all_x(response->body(), response->bodyLength()),
+          "/bytes/N streams a large body");
+    response->free();
+    request->free();
+
+    before = loopback_server_requests(server);
+    request = request_for(server, "/redirect/3");
+    response = request->send();
+    CHECK(response->statusCode() == 200 && response->bodyLength() == 64 &&
+          loopback_server_requests(server) - before == 4,
+          "/redirect/N chains N redirects");
+    response->free();
+    request->free();
+
+    request = request_for(server, "/status/503");
+    response = request->send();
+    CHECK(response->statusCode() == 503 && response->bodyLength() == 64,
+          "/status/N answers with N");
+    response->free();
+    request->free();
+
+    NetworkPoolClear();
+    before = loopback_server_connections(server);
+    request = request_for(server, "/close");
+    request->setKeepAlive(0);
+    response = request->send();
+    response->free();
+    response = request->send();
+    CHECK(response->statusCode() == 200 &&
+          loopback_server_connections(server) - before == 2,
+          "Connection: close gets a connection per request");
+    response->free();
+    request->free();
+    NetworkPoolClear();
+    loopback_server_stop(server);
+
+    memset(&options, 0, sizeof(options));
+    options.body_size = 32768;
+    options.chunk_size = 1000;
+    options.keep_alive = 1;
+    options.latency_ms = 30;
+    options.gzip = 1;
+    server = loopback_server_start(&options);
+    if (server) {
+        request = request_for(server, "/delay/20");
+        started = now_seconds();
+        response = request->send();
+        CHECK(response->statusCode() == 200 && response->bodyLength() == 32768 &&
+              all_x(response->body(), response->bodyLength()) &&
+              now_seconds() - started >= 0.05,
+              "latency and delay add up; chunked gzip decodes");
+        response->free();
+        request->free();
+        NetworkPoolClear();
+        loopback_server_stop(server);
+    } else {
+        printf("  SKIP: gzip not built in\n");
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.body_size = 1000;
+    options.keep_alive = 1;
+    options.tls = 1;
+    server = loopback_server_start(&options);
+    if (server) {
+        char url[128];
+
+        snprintf(url, sizeof(url), "https://127.0.0.1:%d/tls",
+                 loopback_server_port(server));
+        request = NetworkRequestMake(url, HTTP_GET);
+        response = request->send();
+        CHECK(response->statusCode() == 200 && response->bodyLength() == 1000 &&
+              all_x(response->body(), response->bodyLength()),
+              "HTTPS with the generated certificate");
+        response->free();
+        response = request->send();
+        CHECK(response->statusCode() == 200 &&
+              loopback_server_connections(server) == 1,
+              "HTTPS connection kept alive");
+        response->free();
+        request->free();
+        NetworkPoolClear();
+        loopback_server_stop(server);
+    } else {
+        printf("  SKIP: TLS not built in\n");
+    }
+}
+
+/* ======================================================================== */
+/* WebSocket                                                                */
+/* ======================================================================== */
+
+#ifndef NO_SSL_SUPPORT
+/* A scripted WebSocket server: echoes messages, and a few words ask it
+ * for fragments, a large frame or a close. Two connections, then done. */
+typedef struct WsServer {
+    pthread_t thread;
+    int listen_fd;
+    int unmasked;           /* Client frames that were not masked */
+    int saw_header;         /* The extra handshake header arrived */
+    char pong[16];          /* Payload of the client's pong */
+    int close_code;         /* Code of the client's close frames, last one */
+    size_t biggest;         /* Longest message received */
+} WsServer;
+
+static int ws_read_exact(int fd, unsigned char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = recv(fd, data, length, 0);
+        if (n <= 0) return 0;
+        data += n;
+        length -= (size_t)n;
+    }
+    return 1;
+}
+
+/* One client frame, unmasked, into payload (NUL terminated); 0 at EOF */
+static int ws_read_frame(WsServer* server, int fd, int* opcode,
+                         unsigned char* payload, size_t* length) {
+    unsigned char head[14];
+    unsigned char* key = head + 2;
+    size_t size;
+    size_t i;
+
+    if (!ws_read_exact(fd, head, 2)) return 0;
+    *opcode = head[0] & 0x0f;
+    size = head[1] & 0x7f;
+    if (size == 126) {
+        if (!ws_read_exact(fd, head + 2, 2)) return 0;
+        size = (size_t)head[2] << 8 | head[3];
+        key = head + 4;
+    } else if (size == 127) {
+        if (!ws_read_exact(fd, head + 2, 8)) return 0;
+        size = 0;
+        for (i = 2; i < 10; i++) size = size << 8 | head[i];
+        key = head + 10;
+    }
+    if (!(head[1] & 0x80)) {
+        server->unmasked++;
+        key = NULL;
+    } else if (!ws_read_exact(fd, key, 4)) {
+        return 0;
+    }
+    if (!ws_read_exact(fd, payload, size)) return 0;
+    for (i = 0; key && i < size; i++) payload[i] ^= key[i & 3];
+    payload[size] = '\0';
+    *length = size;
+    return 1;
+}
+
+static void ws_write_frame(int fd, int fin, int opcode, const void* data,
+                           size_t length) {
+    unsigned char head[10];
+    size_t header = 2;
+
+    head[0] = (unsigned char)((fin ? 0x80 : 0) | opcode);
+    if (length < 126) {
+        head[1] = (unsigned char)length;
+    } else if (length <= 0xffff) {
+        head[1] = 126;
+        head[2] = (unsigned char)(length >> 8);
+        head[3] = (unsigned char)length;
+        header = 4;
+    } else {
+        int i;
+        head[1] = 127;
+        for (i = 0; i < 8; i++) head[2 + i] = (unsigned char)((unsigned long long)length >> (56 - i * 8));
+        header = 10;
+    }
+    send(fd, head, header, 0);
+    if (length > 0) send(fd, data, length, 0);
+}
+
+static void ws_serve(WsServer* server, int fd) {
+    static unsigned char payload[200000];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    char request[4096];
+    char seeded[128];
+    char accept[64];
+    char reply[512];
+    const char* key;
+    size_t length = 0;
+    size_t size;
+    int opcode;
+    int n;
+
+    request[0] = '\0';
+    while (!strstr(request, "\r\n\r\n")) {
+        ssize_t got = recv(fd, request + length, sizeof(request) - length - 1, 0);
+        if (got <= 0) return;
+        length += (size_t)got;
+        request[length] = '\0';
+    }
+    server->saw_header |= strstr(request, "\r\nX-Token: abc\r\n") != NULL;
+    key = strstr(request, "Sec-WebSocket-Key: ");
+    if (!key) return;
+    snprintf(seeded, sizeof(seeded), "%.24s258EAFA5-E914-47DA-95CA-C5AB0DC85B11",
+             key + 19);
+    SHA1((const unsigned char*)seeded, strlen(seeded), digest);
+    EVP_EncodeBlock((unsigned char*)accept, digest, SHA_DIGEST_LENGTH);
+    n = snprintf(reply, sizeof(reply),
+                 "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                 "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n%s\r\n"
+                 "\x81\x05hello", accept,
+                 strstr(request, "Sec-WebSocket-Protocol: chat, json\r\n")
+                     ? "Sec-WebSocket-Protocol: json\r\n" : "");
+    /* The first frame goes out in the same write as the head */
+    send(fd, reply, (size_t)n, 0);
+
+    while (ws_read_frame(server, fd, &opcode, payload, &size)) {
+        if (size > server->biggest) server->biggest = size;
+        if (opcode == 0x8) {
+            server->close_code = size >= 2 ? (payload[0] << 8 | payload[1]) : 0;
+            ws_write_frame(fd, 1, 0x8, payload, size >= 2 ? 2 : 0);
+            return;
+        } else if (opcode == 0x9) {
+            ws_write_frame(fd, 1, 0xA, payload, size);
+        } else if (opcode == 0xA) {
+            snprintf(server->pong, sizeof(server->pong), "%.15s", (char*)payload);
+        } else if (opcode == 0x1 && strcmp((char*)payload, "fragments") == 0) {
+            ws_write_frame(fd, 0, 0x1, "{\"parts\":", 9);
+            ws_write_frame(fd, 1, 0x9, "p", 1);
+            ws_write_frame(fd, 0, 0x0, "[1,2,", 5);
+            ws_write_frame(fd, 1, 0x0, "3]}", 3);
+        } else if (opcode == 0x1 && strcmp((char*)payload, "big") == 0) {
+            memset(payload, 'x', 70000);
+            ws_write_frame(fd, 1, 0x2, payload, 70000);
+            ws_write_frame(fd, 1, 0x1, "after", 5);
+        } else if (opcode == 0x1 && strcmp((char*)payload, "bye") == 0) {
+            ws_write_frame(fd, 1, 0x8, "\x0f\xa0" "done", 6);
+        } else {
+            ws_write_frame(fd, 1, opcode, payload, size);
+        }
+    }
+}
+
+static void* ws_server_thread(void* context) {
+    WsServer* server = (WsServer*)context;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) break;
+        ws_serve(server, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void test_websocket(void) {
+    WsServer server;
+    WebSocket* ws;
+    LoopbackServer* http;
+    Json* json;
+    char url[128];
+    char* text;
+    unsigned char data[300];
+    size_t i;
+    int port = 0;
+    int ok;
+
+    printf("\n=== WebSocket ===\n");
+    memset(&server, 0, sizeof(server));
+    server.listen_fd = silent_listener(&port);
+    pthread_create(&server.thread, NULL, ws_server_thread, &server);
+
+    CHECK(WebSocketMake("ftp://127.0.0.1/") == NULL, "non-WebSocket URL refused");
+
+    snprintf(url, sizeof(url), "ws://127.0.0.1:%d/chat?room=1", port);
+    ws = WebSocketMake(url);
+    ws->setHeader("X-Token", "abc");
+    ws->setProtocol("chat, json");
+    CHECK(ws->connect() && ws->isOpen() && ws->protocol() &&
+          strcmp(ws->protocol(), "json") == 0,
+          "handshake accepted, subprotocol chosen");
+
+    CHECK(ws->receive(1000) == 1 && ws->messageIsText() &&
+          strcmp(ws->message(), "hello") == 0,
+          "frame sent with the handshake reply is received");
+
+    ws->sendText("{\"n\":7}");
+    json = ws->receive(1000) == 1 ? ws->messageJson() : NULL;
+    text = json && json->isObject() ? json->stringify() : NULL;
+    CHECK(text && strstr(text, "\"n\":7"), "text message parsed as JSON");
+    free(text);
+    if (json) json->free();
+
+    for (i = 0; i < sizeof(data); i++) data[i] = (unsigned char)i;
+    ws->sendBinary(data, sizeof(data));
+    CHECK(ws->receive(1000) == 1 && !ws->messageIsText() &&
+          ws->messageLength() == sizeof(data) &&
+          memcmp(ws->message(), data, sizeof(data)) == 0,
+          "binary message with zero bytes echoed");
+
+    ws->sendText("fragments");
+    CHECK(ws->receive(1000) == 1 &&
+          strcmp(ws->message(), "{\"parts\":[1,2,3]}") == 0,
+          "fragments joined around a ping");
+
+    ws->sendText("big");
+    ok = ws->receive(1000) == 1 && ws->messageLength() == 70000 &&
+         all_x(ws->message(), 70000);
+    CHECK(ok && ws->receive(1000) == 1 && strcmp(ws->message(), "after") == 0,
+          "64-bit length frame, then the frame behind it");
+
+    text = malloc(100001);
+    memset(text, 'y', 100000);
+    text[100000] = '\0';
+    ws->sendText(text);
+    CHECK(ws->receive(1000) == 1 && ws->messageLength() == 100000 &&
+          strcmp(ws->message(), text) == 0,
+          "large masked message round trip");
+    free(text);
+
+    ws->ping("hi");
+    CHECK(ws->receive(200) == 0 && ws->pongs() == 1, "ping answered with a pong");
+
+    ws->sendText("bye");
+    CHECK(ws->receive(1000) == -1 && ws->closeCode() == 4000 && !ws->isOpen() &&
+          ws->error() != NULL && !ws->sendText("late"),
+          "close from the server echoed and reported");
+    ws->free();
+
+    ws = WebSocketMake(url);
+    ok = ws->connect() && ws->receive(1000) == 1;
+    CHECK(ok && ws->close(WEBSOCKET_CLOSE_NORMAL, "done") &&
+          ws->closeCode() == WEBSOCKET_CLOSE_NORMAL && ws->error() == NULL,
+          "close handshake started by the client");
+    ws->free();
+
+    pthread_join(server.thread, NULL);
+    close(server.listen_fd);
+    CHECK(server.unmasked == 0 && server.saw_header && strcmp(server.pong, "p") == 0 &&
+          server.close_code == WEBSOCKET_CLOSE_NORMAL && server.biggest == 100000,
+          "server saw masked frames, the header, our pong and close");
+
+    http = start(16, 0, 1);
+    snprintf(url, sizeof(url), "ws://127.0.0.1:%d/", loopback_server_port(http));
+    ws = WebSocketMake(url);
+    CHECK(!ws->connect() && ws->error() && strstr(ws->error(), "HTTP 200"),
+          "non-upgrade reply refused");
+    ws->free();
+    loopback_server_stop(http);
+}
+#else
+static void test_websocket(void) {
+    printf("\n=== WebSocket ===\n  SKIP: the test server needs OpenSSL\n");
+}
+#endif
+
+int main(void) {
+    printf("=== Local Network Tests ===\n");
+
+    test_keep_alive_reuse();
+    test_large_body();
+    test_chunked_body();
+    test_streaming_handler();
+    test_async_requests();
+    test_async_timeout();
+    test_resolver_cache();
+    test_resolver_ipv6();
+    test_happy_eyeballs();
+    test_binary_body();
+    test_file_body();
+    test_response_parsing();
+    test_http_server();
+    test_request_batch();
+    test_request_template();
+    test_request_policy();
+    test_http2();
+    test_timing_metrics();
+#ifndef NO_ZLIB_SUPPORT
+    test_compressed_bodies();
+#endif
+    test_redirects();
+    test_response_cache();
+    test_header_table();
+    test_request_limits();
+    test_loopback_fixture();
+    test_websocket();
+
+    printf("\n%s (%d failure%s)\n", failures ? "FAILED" : "All tests passed",
+           failures, failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
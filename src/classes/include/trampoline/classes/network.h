@@ -26,6 +26,18 @@ typedef enum HttpMethod {
   HTTP_OPTIONS
 } HttpMethod;
 
+/*
+ * HTTP_VERSION_2 sends requests as streams of a shared HTTP/2 connection.
+ * Over https it is offered with ALPN alongside HTTP/1.1, and servers that
+ * choose HTTP/1.1 are remembered and get plain HTTP/1.1 requests from then
+ * on. Over http it is spoken from the first byte (h2c with prior
+ * knowledge), so the server must expect it.
+ */
+typedef enum HttpVersion {
+  HTTP_VERSION_1_1,
+  HTTP_VERSION_2
+} HttpVersion;
+
 typedef enum HttpStatus {
   HTTP_CONTINUE = 100,
   HTTP_OK = 200,
@@ -46,6 +58,32 @@ typedef enum HttpStatus {
   HTTP_SERVICE_UNAVAILABLE = 503
 } HttpStatus;
 
+/*
+ * Where one request's time went. Times are seconds on the monotonic clock
+ * (the same one as every other timeout here), so subtract to get phase
+ * lengths. Setup phases are 0 when the connection was reused; a lookup
+ * answered from the resolver cache shows up as a very short one. Byte
+ * counts are what the request and response took on the wire before any
+ * decoding; over HTTP/2 they are the frame payloads of its stream.
+ */
+typedef struct NetworkTiming {
+  double start;           /* Sent, or queued on a loop or batch */
+  double admitted;        /* Let past the host's rate and concurrency
+                           * limits; 0 when it has none */
+  double dns_start;
+  double dns_end;
+  double connect_start;
+  double connect_end;
+  double tls_start;
+  double tls_end;
+  double request_sent;    /* Last request byte written */
+  double first_byte;      /* First response byte received */
+  double end;             /* Response complete, or the request failed */
+  size_t bytes_sent;
+  size_t bytes_received;
+  int reused;             /* The connection had carried a request before */
+} NetworkTiming;
+
 /* ======================================================================== */
 /* NetworkResponse Class                                                    */
 /* ======================================================================== */
@@ -74,14 +112,88 @@ typedef struct NetworkResponse {
   TDUnary(int, hasHeader, const char*);
   TDGetter(isJson, int);
 
+  /* How long each phase of the request took; all zero for responses that
+   * were made rather than received */
+  TDGetter(timing, const NetworkTiming*);
+
   /* Memory management */
   TDNullary(free);
 } NetworkResponse;
 
+/* ======================================================================== */
+/* NetworkLoop Class                                                        */
+/* ======================================================================== */
+
+/*
+ * Called on the loop's thread when an asynchronous request finishes. The
+ * callback owns the response and must free it. Failures arrive as
+ * synthetic responses: 502 when the connection failed, 504 when the
+ * request timed out and 503 when the loop was freed first.
+ */
+typedef void (*NetworkResponseCallback)(NetworkResponse* response, void* context);
+
+/*
+ * A single-threaded event loop (epoll on Linux, poll elsewhere) that drives
+ * many requests at once over non-blocking connections from the shared pool.
+ * Timeouts live on a hashed timer wheel, so each tick costs O(1) no matter
+ * how many requests are in flight. A loop must only be used from one thread.
+ */
+typedef struct NetworkLoop {
+  /* Run until no requests are pending or stop() is called; returns the
+   * number of requests completed */
+  TDGetter(run, size_t);
+
+  /* Wait up to timeout_ms for activity and process it once */
+  TDUnary(size_t, runOnce, int);
+
+  /* Requests queued, in flight or waiting to be retried */
+  TDGetter(pending, size_t);
+
+  /* Make run() return after the current iteration */
+  TDNullary(stop);
+
+  /* Completes outstanding requests with 503 before freeing */
+  TDNullary(free);
+} NetworkLoop;
+
 /* ======================================================================== */
 /* NetworkRequest Class                                                     */
 /* ======================================================================== */
 
+/*
+ * Receives response body bytes as they arrive, already de-chunked. Return
+ * non-zero to keep going or 0 to abort the transfer. When a handler is set
+ * the response's body() is NULL and bodyLength() is the number of bytes
+ * delivered, so downloads of any size never have to fit in memory.
+ *
+ * Requests send "Accept-Encoding: gzip, deflate" by default, and a body
+ * with either Content-Encoding is inflated as it is received: handlers,
+ * body() and bodyLength() all see the decoded bytes while the headers stay
+ * as sent. Remove the header to receive bodies as-is. Built with
+ * NO_ZLIB_SUPPORT, no encoding is asked for or decoded.
+ */
+typedef int (*NetworkBodyHandler)(const char* data, size_t length, void* context);
+
+/* Hedge after the origin's recent 95th percentile latency */
+#define NETWORK_HEDGE_P95 (-1)
+
+/*
+ * How hard a request tries to finish on time. Fields left 0 are off.
+ * Retries and hedges apply only to idempotent methods (GET, HEAD, PUT,
+ * DELETE, OPTIONS), and retries only follow a 502, 503 or 504, whether
+ * from the server or synthetic. A hedge is a second copy of the request
+ * sent when the first has not answered after a delay; whichever answers
+ * first wins and the other is cancelled. With NETWORK_HEDGE_P95 the delay
+ * is the origin's recent p95, once 20 responses have been timed.
+ */
+typedef struct NetworkRequestPolicy {
+  int deadline_ms;        /* Whole request, retries included; then 504 */
+  int max_retries;        /* Attempts after the first */
+  int backoff_ms;         /* Retry n waits a random 0..backoff_ms * 2^n */
+  int max_backoff_ms;     /* Cap on that wait, 0 = none */
+  int hedge_after_ms;     /* Milliseconds, or NETWORK_HEDGE_P95 */
+} NetworkRequestPolicy;
+
 typedef struct NetworkRequest {
   /* URL and method */
   TDGetter(url, const char*);
@@ -98,22 +210,528 @@ typedef struct NetworkRequest {
   TDGetter(body, const char*);
   TDSetter(setBody, const char*);
   TDGetter(bodyLength, size_t);
+  /* Binary-safe body of length bytes (copied) */
+  TDDyadic(void, setBodyData, const void*, size_t);
+  /* Stream the file at path as the body; its bytes are sent from the page
+   * cache with sendfile rather than read in. body() is NULL meanwhile.
+   * Returns 0 if the file cannot be opened. */
+  TDUnary(int, setBodyFile, const char*);
   TDUnary(void, setBodyString, String*);
   TDUnary(void, setBodyJson, Json*);
+  TDDyadic(void, setBodyHandler, NetworkBodyHandler, void*);
 
   /* Connection settings */
   TDGetter(port, int);
   TDSetter(setPort, int);
   TDGetter(timeout, int);
   TDSetter(setTimeout, int);
+  TDGetter(keepAlive, int);
+  TDSetter(setKeepAlive, int);
+  /* Protocol for send() and sendAsync() (default HTTP_VERSION_1_1) */
+  TDGetter(httpVersion, HttpVersion);
+  TDSetter(setHttpVersion, HttpVersion);
+
+  /* Deadline, retries and hedging for send() and sendAsync(); copied,
+   * NULL removes it */
+  TDUnary(void, setPolicy, const NetworkRequestPolicy*);
+
+  /* Redirects send() follows (default on, at most 5). Hops to the same
+   * host reuse its pooled connection. 303, and 301 or 302 after a POST,
+   * continue as a body-less GET; 307 and 308 resend method and body.
+   * Credentials are dropped when the host changes. A 301 or 308 is
+   * remembered for the process, so later sends of that URL go straight
+   * to its new place. A body handler also receives the short bodies of
+   * the 3xx responses followed. sendAsync() delivers the 3xx as it is. */
+  TDGetter(followRedirects, int);
+  TDSetter(setFollowRedirects, int);
+  TDGetter(maxRedirects, int);
+  TDSetter(setMaxRedirects, int);
 
   /* Send the request */
   TDGetter(send, NetworkResponse*);
 
+  /* Queue the request on loop (NULL for the default loop) and return at
+   * once; callback receives the response. The request may be changed or
+   * freed after this returns. Returns 0 if it could not be queued. */
+  TDTriadic(int, sendAsync, NetworkLoop*, NetworkResponseCallback, void*);
+
   /* Memory management */
   TDNullary(free);
 } NetworkRequest;
 
+/* ======================================================================== */
+/* NetworkRequestBatch Class                                                */
+/* ======================================================================== */
+
+/*
+ * Sends a burst of requests together. Requests to the same origin share
+ * pooled connections, and once a server has answered with HTTP/1.1
+ * keep-alive the rest are pipelined: written back to back, with as many
+ * requests per send call as fit, and the responses read back in order.
+ * Only idempotent requests (GET, HEAD, PUT, DELETE, OPTIONS) are
+ * pipelined; a POST or PATCH waits for the connection to be quiet and
+ * holds everything behind it until it is answered. Batches always use
+ * HTTP/1.1; for HTTP/2, sendAsync() requests on one loop share a
+ * connection anyway.
+ */
+typedef struct NetworkRequestBatch {
+  /* Capture the request's URL, method, headers, body and body handler;
+   * the request may be changed or freed afterwards. Returns 0 if the
+   * request has no valid URL. */
+  TDUnary(int, add, NetworkRequest*);
+
+  /* Requests added since the last send */
+  TDGetter(count, size_t);
+
+  /* Connections per origin the batch may spread over (default 1) */
+  TDGetter(connections, int);
+  TDSetter(setConnections, int);
+
+  /* Pipeline where the server allows it (default on) */
+  TDGetter(pipelining, int);
+  TDSetter(setPipelining, int);
+
+  /* Send everything and wait. Returns count() responses in the order the
+   * requests were added, or NULL if there were none; free each response
+   * and then the array with free(). Failures arrive as synthetic
+   * responses, 502 or 504, as with sendAsync. The batch is left empty and
+   * may be reused. */
+  TDGetter(send, NetworkResponse**);
+
+  /* Memory management */
+  TDNullary(free);
+} NetworkRequestBatch;
+
+/* ======================================================================== */
+/* NetworkRequestTemplate Class                                             */
+/* ======================================================================== */
+
+/*
+ * A request prepared once for an endpoint that is called over and over
+ * with only the query or body changing. The URL, method, headers, timeout,
+ * keep-alive, body handler and policy are taken from a NetworkRequest when
+ * the template is made, and the head is serialized then; each send only
+ * fills in the query and Content-Length. Later changes to the prototype do
+ * not reach the template. Sends do not change the template, so it may be
+ * used from several threads at once.
+ */
+typedef struct NetworkRequestTemplate {
+  /* Send query (NULL for the URL's own, "" for none) and length bytes of
+   * body, and wait for the response */
+  TDTriadic(NetworkResponse*, send, const char*, const void*, size_t);
+
+  /* As send with a NUL terminated body (NULL for none), completing on
+   * loop (NULL for the default loop) like NetworkRequest's sendAsync.
+   * Returns 0 if the request was not queued. */
+  TDPentadic(int, sendAsync, NetworkLoop*, const char*, const char*,
+             NetworkResponseCallback, void*);
+
+  /* Memory management */
+  TDNullary(free);
+} NetworkRequestTemplate;
+
+/* ======================================================================== */
+/* HttpServer Class                                                         */
+/* ======================================================================== */
+
+/*
+ * A request as a route handler sees it. The strings point into the
+ * connection's receive buffer and are only valid until the handler
+ * returns.
+ */
+typedef struct HttpServerRequest {
+  const char* method;       /* "GET", "POST", ... */
+  const char* path;         /* Target up to any '?' */
+  const char* query;        /* After the '?', or NULL */
+  const char* body;         /* NULL when there is none */
+  size_t body_length;
+} HttpServerRequest;
+
+/* Value of the request header called name (any case), or NULL */
+const char* HttpServerRequestHeader(const HttpServerRequest* request,
+                                    const char* name);
+
+/*
+ * Runs on a worker thread and returns the reply, which the server sends and
+ * frees; NULL sends a 500. Reply headers come from the response's head, so
+ * a handler can return NetworkResponseMake(0, NULL, "HTTP/1.1 200 OK\r\n"
+ * "Content-Type: application/json\r\n\r\n{...}"). Content-Length and
+ * Connection are always set by the server.
+ */
+typedef NetworkResponse* (*HttpServerHandler)(const HttpServerRequest* request,
+                                              void* context);
+
+typedef struct HttpServerOptions {
+  int threads;                /* Worker threads running handlers */
+  int idle_timeout_seconds;   /* Keep-alive connections idle longer are closed */
+  size_t max_body;            /* Larger request bodies are refused with 413 */
+} HttpServerOptions;
+
+/*
+ * A small HTTP/1.1 server for metrics and health endpoints. One thread
+ * accepts connections and reads requests with epoll (poll elsewhere);
+ * complete requests go to a pool of worker threads that run the handler
+ * and write the reply. Keep-alive and pipelined requests are supported.
+ */
+typedef struct HttpServer {
+  /* Send requests for path to handler. method NULL matches any method; a
+   * path ending in '*' matches every path with that prefix. Routes are
+   * tried in the order added and must be added before listen(). Returns 0
+   * if the route could not be added. */
+  TDTetradic(int, route, const char*, const char*, HttpServerHandler, void*);
+
+  /* Answer method and path with the same reply every time. The server
+   * takes ownership of response and never frees it per request, which
+   * suits health checks. Returns 0 if the route could not be added. */
+  TDTriadic(int, routeResponse, const char*, const char*, NetworkResponse*);
+
+  /* Bind host (NULL for all interfaces) and port (0 picks a free one) and
+   * serve from background threads. Returns the bound port, or -1. */
+  TDDyadic(int, listen, const char*, int);
+
+  /* Port being served, or -1 */
+  TDGetter(port, int);
+
+  /* Stop accepting, let running handlers finish and close connections */
+  TDNullary(stop);
+
+  /* Memory management; stops the server first */
+  TDNullary(free);
+} HttpServer;
+
+/* ======================================================================== */
+/* WebSocket Class                                                          */
+/* ======================================================================== */
+
+/* Close codes (RFC 6455 section 7.4) */
+#define WEBSOCKET_CLOSE_NORMAL 1000
+#define WEBSOCKET_CLOSE_GOING_AWAY 1001
+#define WEBSOCKET_CLOSE_PROTOCOL_ERROR 1002
+#define WEBSOCKET_CLOSE_TOO_BIG 1009
+
+/*
+ * The client end of a WebSocket (RFC 6455) on a connection of its own,
+ * for long-lived push channels. The URL is ws://, wss://, http:// or
+ * https://. Frames are parsed in the receive buffer where they land; a
+ * message made of fragments is joined in the same buffer, so once the
+ * buffers have grown to the largest message nothing is allocated per
+ * frame. Outgoing frames are masked; a masked frame from the server is a
+ * protocol error. Pings are answered as they are read and a close from
+ * the server is echoed. One thread at a time may use a socket.
+ */
+typedef struct WebSocket {
+  /* Handshake settings, before connect(). setProtocol offers a comma
+   * separated list of subprotocols. */
+  TDDyadic(void, setHeader, const char*, const char*);
+  TDSetter(setProtocol, const char*);
+  /* Seconds for the connect, the handshake and each send (default 30) */
+  TDGetter(timeout, int);
+  TDSetter(setTimeout, int);
+  /* Largest message accepted; bigger ones close the socket with
+   * WEBSOCKET_CLOSE_TOO_BIG (default 16 MiB) */
+  TDGetter(maxMessage, size_t);
+  TDSetter(setMaxMessage, size_t);
+
+  /* Connect and upgrade. Returns 0 on failure (see error()). */
+  TDGetter(connect, int);
+  /* Subprotocol the server chose, or NULL */
+  TDGetter(protocol, const char*);
+
+  /* Send one message, or a ping with an optional payload (NULL for none).
+   * Return 0 if the socket is not open or the send failed. */
+  TDUnary(int, sendText, const char*);
+  TDDyadic(int, sendBinary, const void*, size_t);
+  TDUnary(int, ping, const char*);
+
+  /* Wait up to timeout_ms (negative waits forever) for the next message.
+   * Returns 1 with a message, 0 if none came in time, -1 once the socket
+   * is closed or failed. */
+  TDUnary(int, receive, int);
+  /* The message receive() returned, NUL terminated. It is borrowed from
+   * the receive buffer and valid until the next receive(). */
+  TDGetter(message, const char*);
+  TDGetter(messageLength, size_t);
+  TDGetter(messageIsText, int);
+  /* The message parsed as JSON (caller frees), or NULL */
+  TDGetter(messageJson, Json*);
+  /* Pongs received so far */
+  TDGetter(pongs, unsigned long);
+
+  /* Send a close frame with code and reason (may be NULL) and wait, up to
+   * the timeout, for the server's; then the connection is closed.
+   * Returns 0 if it was not open. */
+  TDDyadic(int, close, int, const char*);
+  TDGetter(isOpen, int);
+  /* Code of the close frame received, or 0 */
+  TDGetter(closeCode, int);
+  /* Why connect() failed or the socket closed, or NULL */
+  TDGetter(error, const char*);
+
+  /* Memory management; closes the socket first if it is open */
+  TDNullary(free);
+} WebSocket;
+
+/* ======================================================================== */
+/* Connection Pool                                                          */
+/* ======================================================================== */
+
+/*
+ * Requests with keepAlive() set (the default) return their connection to a
+ * process-wide pool keyed by scheme, host and port, so the TCP connect and
+ * TLS handshake are paid once per connection rather than once per request.
+ */
+typedef struct NetworkPoolOptions {
+  int max_per_host;          /* Open connections per origin, 0 = no limit */
+  int max_idle_per_host;     /* Idle connections parked per origin */
+  int idle_timeout_seconds;  /* Idle connections older than this are closed */
+} NetworkPoolOptions;
+
+typedef struct NetworkPoolStats {
+  unsigned long connections_opened;
+  unsigned long connections_reused;
+  unsigned long connections_discarded;
+  size_t idle_connections;
+} NetworkPoolStats;
+
+void NetworkPoolConfigure(const NetworkPoolOptions* options);
+void NetworkPoolGetOptions(NetworkPoolOptions* options);
+void NetworkPoolGetStats(NetworkPoolStats* stats);
+void NetworkPoolClear(void);
+
+/* ======================================================================== */
+/* Response Cache                                                           */
+/* ======================================================================== */
+
+/*
+ * An HTTP cache in front of NetworkRequest's send() (RFC 9111, as a private
+ * cache), off until given a size. Only 200 responses to GET requests
+ * without a body handler or Authorization header are kept, keyed by URL.
+ * Cache-Control max-age, or else Expires, says how long an entry is fresh
+ * and served without asking the server; no-store keeps a response out and
+ * no-cache makes every use a revalidation. A stale entry with an ETag or
+ * Last-Modified is revalidated with If-None-Match or If-Modified-Since,
+ * and a 304 serves it again without the body crossing the wire. A request
+ * sending its own "Cache-Control: no-store" or "no-cache" bypasses or
+ * revalidates. Responses with a Vary other than Accept-Encoding are not
+ * kept.
+ *
+ * Responses served from an entry share its body, and the tree the first
+ * bodyAsJson() parses is cloned for the rest. With a directory, entries
+ * are also written there and mapped back in (mmap) when a later process
+ * asks for the same URL.
+ */
+typedef struct NetworkCacheOptions {
+  size_t max_bytes;          /* Heads and bodies kept in memory, 0 = off */
+  const char* directory;     /* Where entries persist (copied), NULL = none */
+} NetworkCacheOptions;
+
+typedef struct NetworkCacheStats {
+  unsigned long hits;           /* Served fresh, without asking the server */
+  unsigned long revalidated;    /* Served after a 304 */
+  unsigned long misses;         /* Fetched in full */
+  unsigned long stored;
+  unsigned long evicted;        /* To stay within max_bytes */
+  size_t entries;
+  size_t bytes;
+} NetworkCacheStats;
+
+void NetworkCacheConfigure(const NetworkCacheOptions* options);
+void NetworkCacheGetOptions(NetworkCacheOptions* options);
+void NetworkCacheGetStats(NetworkCacheStats* stats);
+/* Drops every entry, including those written to the directory */
+void NetworkCacheClear(void);
+
+/* ======================================================================== */
+/* DNS Resolver                                                             */
+/* ======================================================================== */
+
+/*
+ * Host names are resolved with getaddrinfo (IPv4 and IPv6) and cached, so
+ * DNS is paid once per TTL rather than once per connection. Entries near
+ * expiry are refreshed in the background. When a host has several
+ * addresses they are raced happy-eyeballs style (RFC 8305).
+ */
+typedef struct NetworkResolverOptions {
+  int cache_ttl_seconds;        /* How long a lookup is reused */
+  int negative_ttl_seconds;     /* How long a failed lookup is remembered */
+  int happy_eyeballs_delay_ms;  /* Head start before the next address races */
+  int resolver_threads;         /* Threads serving asynchronous lookups */
+} NetworkResolverOptions;
+
+typedef struct NetworkResolverStats {
+  unsigned long lookups;
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+  unsigned long failures;
+  size_t cached_entries;
+} NetworkResolverStats;
+
+void NetworkResolverConfigure(const NetworkResolverOptions* options);
+void NetworkResolverGetOptions(NetworkResolverOptions* options);
+void NetworkResolverGetStats(NetworkResolverStats* stats);
+
+/*
+ * Pin hostname to a numeric address, like an /etc/hosts line. Call again
+ * to add more addresses; they are tried in the order added. Returns 0 if
+ * address is not a numeric IPv4 or IPv6 address.
+ */
+int NetworkResolverAddHost(const char* hostname, const char* address);
+
+/* Forget cached lookups and pinned hosts */
+void NetworkResolverClear(void);
+
+/* ======================================================================== */
+/* TLS Sessions                                                             */
+/* ======================================================================== */
+
+/*
+ * HTTPS connections share one process-wide TLS context. Sessions servers
+ * issue are cached per host:port and offered on the next connection, so
+ * repeat connections resume (TLS 1.2 tickets, TLS 1.3 PSK) instead of
+ * paying for a full handshake.
+ */
+typedef struct NetworkTlsOptions {
+  int session_cache;    /* Non-zero to resume sessions (default on) */
+  int max_hosts;        /* Hosts whose sessions are kept */
+} NetworkTlsOptions;
+
+typedef struct NetworkTlsStats {
+  unsigned long handshakes;
+  unsigned long resumed;        /* Handshakes that skipped key exchange */
+  size_t cached_sessions;
+} NetworkTlsStats;
+
+void NetworkTlsConfigure(const NetworkTlsOptions* options);
+void NetworkTlsGetOptions(NetworkTlsOptions* options);
+void NetworkTlsGetStats(NetworkTlsStats* stats);
+
+/* Forget every cached session */
+void NetworkTlsClearSessions(void);
+
+/* ======================================================================== */
+/* HTTP/2 Sessions                                                          */
+/* ======================================================================== */
+
+/*
+ * Requests set to HTTP_VERSION_2 share one connection per origin and loop,
+ * with up to the server's stream limit in flight on it at once. A
+ * connection left with no streams is kept, holding its pool slot, and
+ * taken back by the next HTTP/2 request to the origin from any loop or
+ * thread, for as long as the pool's idle timeout.
+ */
+typedef struct NetworkHttp2Stats {
+  unsigned long sessions_opened;    /* HTTP/2 connections established */
+  unsigned long sessions_reused;    /* Idle sessions taken back */
+  unsigned long streams;            /* Requests sent as streams */
+  unsigned long fallbacks;          /* TLS servers that chose HTTP/1.1 */
+  size_t idle_sessions;
+} NetworkHttp2Stats;
+
+void NetworkHttp2GetStats(NetworkHttp2Stats* stats);
+
+/* Close idle sessions and forget which servers chose HTTP/1.1 */
+void NetworkHttp2ClearSessions(void);
+
+/* ======================================================================== */
+/* Request Metrics                                                          */
+/* ======================================================================== */
+
+/*
+ * Every request's NetworkTiming is also added to process-wide histograms
+ * kept per host:port: queue (held back by NetworkLimitConfigure), dns,
+ * connect, tls, wait (request sent to first byte), transfer (first byte to
+ * end) and total. Buckets run 1-2-5 from 0.1 ms to 60 s; percentiles are
+ * the upper bound of the bucket they fall in. The JSON looks like
+ *
+ *   { "bounds_ms": [0.1, 0.2, ...],
+ *     "hosts": { "example.com:443": {
+ *         "requests": 12, "failed": 0, "reused": 11,
+ *         "bytes_sent": 1024, "bytes_received": 40960,
+ *         "status": { "2xx": 12, "3xx": 0, "4xx": 0, "5xx": 0 },
+ *         "total": { "count": 12, "mean_ms": 3.1, "max_ms": 9.8,
+ *                    "p50_ms": 2, "p90_ms": 5, "p99_ms": 10,
+ *                    "buckets": [0, 0, ...] },
+ *         ... } } }
+ *
+ * "failed" counts requests that got no response at all. Phases that did
+ * not happen are left out of their histogram, so "dns" counts only the
+ * lookups actually made. The least recently used host makes way once 256
+ * are tracked.
+ */
+Json* NetworkMetricsJson(void);
+
+/* Forget every host's histograms */
+void NetworkMetricsReset(void);
+
+/* ======================================================================== */
+/* Request Policies                                                         */
+/* ======================================================================== */
+
+typedef struct NetworkPolicyStats {
+  unsigned long requests;           /* Sent under a policy */
+  unsigned long retries;
+  unsigned long hedges;             /* Second copies sent */
+  unsigned long hedges_won;         /* ... that answered first */
+  unsigned long deadlines_missed;   /* Ended with the policy's 504 */
+} NetworkPolicyStats;
+
+void NetworkPolicyGetStats(NetworkPolicyStats* stats);
+
+/* The hedge delay NETWORK_HEDGE_P95 would use for host:port now, in
+ * milliseconds, or -1 while too few responses have been timed */
+int NetworkPolicyHedgeDelay(const char* host, int port);
+
+/* ======================================================================== */
+/* Rate and Concurrency Limits                                              */
+/* ======================================================================== */
+
+/*
+ * Limits on what this process sends to one host:port, so a burst from
+ * many threads or loops does not land on a backend all at once. Every
+ * send(), sendAsync(), template and policy request passes through them.
+ * A request over max_in_flight, or finding the token bucket empty, waits
+ * its turn: a blocking send sleeps, an asynchronous one stays queued on
+ * its loop. It is refused with a 503 instead when max_queued requests are
+ * already waiting, when it has waited max_wait_ms, or as soon as the
+ * next token would come after its deadline (deadline_ms or the timeout),
+ * rather than timing out later with a 504.
+ *
+ * Admission takes no lock: the in-flight count and the bucket are single
+ * atomic words. The time spent waiting is the "queue" phase of
+ * NetworkMetricsJson.
+ */
+typedef struct NetworkLimitOptions {
+  int max_in_flight;            /* Requests on the wire at once, 0 = no limit */
+  double requests_per_second;   /* Sustained rate, 0 = no limit */
+  int burst;                    /* Sent back to back after a lull, at least 1 */
+  int max_queued;               /* Waiting before more are refused, 0 = no limit */
+  int max_wait_ms;              /* Longest wait, 0 = until the deadline */
+} NetworkLimitOptions;
+
+typedef struct NetworkLimitStats {
+  unsigned long admitted;       /* Let through, at once or after waiting */
+  unsigned long delayed;        /* ... after waiting */
+  unsigned long rejected;       /* Refused with a 503 */
+  double wait_ms_total;         /* Time admitted requests spent waiting */
+  double wait_ms_max;
+} NetworkLimitStats;
+
+/*
+ * Set the limits for host:port, or with host NULL the default for every
+ * origin without its own. options NULL removes them; the origin goes back
+ * to the default. Requests already admitted keep their places. Up to 256
+ * origins are tracked; past that the rest share the default's counters.
+ * Returns 0 if the options are invalid or out of memory.
+ */
+int NetworkLimitConfigure(const char* host, int port,
+                          const NetworkLimitOptions* options);
+
+/* The limits in force for host:port (the default for host NULL) */
+void NetworkLimitGetOptions(const char* host, int port,
+                            NetworkLimitOptions* options);
+
+void NetworkLimitGetStats(NetworkLimitStats* stats);
+
 /* ======================================================================== */
 /* Creation Functions                                                       */
 /* ======================================================================== */
@@ -121,5 +739,17 @@ typedef struct NetworkRequest {
 NetworkRequest* NetworkRequestMake(const char* url, HttpMethod method);
 NetworkRequest* NetworkRequestMakeWithString(String* url, HttpMethod method);
 NetworkResponse* NetworkResponseMake(int status_code, const char* status_text, const char* body);
+NetworkLoop* NetworkLoopMake(void);
+NetworkRequestBatch* NetworkRequestBatchMake(void);
+NetworkRequestTemplate* NetworkRequestTemplateMake(NetworkRequest* prototype);
+
+/* options may be NULL for the defaults */
+HttpServer* HttpServerMake(const HttpServerOptions* options);
+
+/* Not connected until connect(); NULL if url is not ws, wss, http or https */
+WebSocket* WebSocketMake(const char* url);
+
+/* Lazily created loop shared by sendAsync(NULL, ...) calls */
+NetworkLoop* NetworkLoopDefault(void);
 
 #endif /* TRAMPOLINES_NETWORK_H */
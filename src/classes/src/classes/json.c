@@ -60,6 +60,7 @@ typedef struct {
 
 static JsonValue* json_value_create(JsonType type);
 static void json_value_free(JsonValue* value);
+static Json* json_make_with_value(JsonValue* value);
 static JsonValue* json_value_clone(JsonValue* value);
 static bool json_value_equals(JsonValue* a, JsonValue* b);
 static char* json_value_stringify(JsonValue* value, int indent, int current_depth);
@@ -1075,10 +1076,7 @@ static TF_Getter(json_clone, Json, JsonPrivate, Json*)
   JsonValue* cloned = json_value_clone(private->value);
   if (!cloned) return NULL;
 
-  /* Need to create a full Json object with trampolines */
-  /* For now, return NULL */
-  json_value_free(cloned);
-  return NULL;
+  return json_make_with_value(cloned);
 }
 
 static TF_1ArgFunc(bool, json_equals, Json, JsonPrivate, Json*, other)
@@ -0,0 +1,679 @@
+/**
+ * @file network_batch.c
+ * @brief Send a burst of requests over shared, pipelined connections
+ *
+ * Requests are grouped by origin. Each origin gets a queue and up to
+ * connections() lanes, each lane one pooled connection that pulls the next
+ * request off the queue as soon as it may send it. A lane sends one request
+ * and waits until the server has shown it speaks persistent HTTP/1.1; after
+ * that it keeps up to BATCH_PIPELINE_DEPTH idempotent requests in flight,
+ * writing as many of them per sendmsg as fit and reading the responses back
+ * in order. Bytes of the next response that arrive with the current one are
+ * carried over to the next reader rather than received again.
+ *
+ * When a server closes a connection after a response, the requests still
+ * in flight behind it were never answered and go back on the queue. When
+ * a connection fails, idempotent requests that saw no response byte are
+ * retried once on a new connection; the rest get a synthetic 502.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <poll.h>
+
+/* Requests written ahead of their responses on one connection */
+#define BATCH_PIPELINE_DEPTH 16
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct BatchItem {
+    HttpExchange exchange;
+    int attempts;
+    NetworkResponse* response;
+    NetworkTiming timing;
+} BatchItem;
+
+typedef struct BatchOrigin {
+    const char* hostname;       /* Borrowed from its first item */
+    int port;
+    bool use_ssl;
+    size_t* queue;              /* Items waiting to be sent: [next, count) */
+    size_t next;
+    size_t count;
+    int lanes;                  /* Lanes with a connection open */
+    bool no_pipeline;           /* Server closes after each response */
+} BatchOrigin;
+
+typedef struct BatchLane {
+    BatchOrigin* origin;
+    Connection* conn;
+    size_t inflight[BATCH_PIPELINE_DEPTH];  /* Items sent or sending, oldest first */
+    size_t count;
+    size_t written;             /* Leading inflight items fully sent */
+    HttpResponseReader reader;  /* Reads inflight[0] while count > 0 */
+    double last_active;
+    bool dead;                  /* Could not open a connection; stay shut */
+    bool used;                  /* Has taken a request since it opened */
+} BatchLane;
+
+typedef struct NetworkRequestBatchPrivate {
+    NetworkRequestBatch public;  /* Public interface MUST be first */
+
+    BatchItem* items;
+    size_t count;
+    size_t capacity;
+    int connections;
+    bool pipelining;
+} NetworkRequestBatchPrivate;
+
+/* Working state for one send() */
+typedef struct BatchRun {
+    BatchItem* items;
+    BatchOrigin* origins;
+    size_t origin_count;
+    BatchLane* lanes;
+    size_t lane_count;
+    size_t remaining;           /* Items still without a response */
+    bool pipelining;
+} BatchRun;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+/* May go behind other requests on a connection: repeatable, and not the
+ * last thing the connection will carry */
+static bool item_pipelinable(const BatchItem* item) {
+    return item->exchange.idempotent && item->exchange.keep_alive;
+}
+
+static void item_finish(BatchRun* run, size_t index, NetworkResponse* response) {
+    BatchItem* item = &run->items[index];
+
+    network_timing_deliver(response, &item->exchange, &item->timing);
+    item->response = response;
+    run->remaining--;
+}
+
+static void origin_fail(BatchRun* run, BatchOrigin* origin, const char* error) {
+    while (origin->next < origin->count) {
+        item_finish(run, origin->queue[origin->next++],
+                    NetworkResponseMake(502, "Bad Gateway", error));
+    }
+}
+
+/* Put an item back at the front of its origin's queue. There is always
+ * room: it was taken from there. */
+static void origin_requeue(BatchOrigin* origin, size_t index) {
+    origin->queue[--origin->next] = index;
+}
+
+static bool lane_open(BatchRun* run, BatchLane* lane, char* error,
+                      size_t error_size) {
+    BatchOrigin* origin = lane->origin;
+    int timeout = run->items[origin->queue[origin->next]].exchange.timeout_seconds;
+    Connection* conn;
+
+    if (origin->lanes == 0) {
+        /* The first connection may wait for a slot under the host limit */
+        conn = connection_pool_acquire(origin->hostname, origin->port,
+                                       origin->use_ssl, timeout,
+                                       error, error_size);
+    } else {
+        /* Extra connections are only opened if a slot is free now */
+        conn = connection_pool_take_idle(origin->hostname, origin->port,
+                                         origin->use_ssl);
+        if (!conn && connection_pool_reserve(origin->hostname, origin->port,
+                                             origin->use_ssl)) {
+            conn = connection_create(origin->hostname, origin->port,
+                                     origin->use_ssl);
+            if (conn) {
+                conn->timeout_seconds = timeout;
+                if (!connection_connect(conn)) {
+                    snprintf(error, error_size, "%s", connection_error(conn));
+                    connection_free(conn);
+                    conn = NULL;
+                }
+            }
+            if (!conn) {
+                connection_pool_unreserve(origin->hostname, origin->port,
+                                          origin->use_ssl);
+            }
+        }
+    }
+    if (!conn) return false;
+
+    conn->timeout_seconds = timeout;
+    connection_set_blocking(conn, false);
+    lane->conn = conn;
+    lane->count = lane->written = 0;
+    lane->used = false;
+    lane->last_active = network_now();
+    origin->lanes++;
+    return true;
+}
+
+static void lane_close(BatchLane* lane, bool keep_alive) {
+    if (!lane->conn) return;
+    connection_pool_release(lane->conn, keep_alive);
+    lane->conn = NULL;
+    lane->origin->lanes--;
+}
+
+static void lane_start_reader(BatchRun* run, BatchLane* lane,
+                              HttpResponseReader* reader) {
+    HttpExchange* exchange = &run->items[lane->inflight[0]].exchange;
+
+    http_reader_init(reader, exchange->no_body, exchange->sink,
+                     exchange->sink_context);
+    reader->pipelined = true;
+}
+
+/* Take requests off the origin's queue while this lane may send them */
+static void lane_fill(BatchRun* run, BatchLane* lane) {
+    BatchOrigin* origin = lane->origin;
+
+    while (origin->next < origin->count && lane->count < BATCH_PIPELINE_DEPTH) {
+        size_t index = origin->queue[origin->next];
+        BatchItem* item = &run->items[index];
+
+        if (lane->count > 0) {
+            /* Only behind a request the server has shown it will answer
+             * and keep the connection open after */
+            if (!run->pipelining || origin->no_pipeline ||
+                !lane->conn->persistent || !item_pipelinable(item) ||
+                !item_pipelinable(&run->items[lane->inflight[0]])) {
+                break;
+            }
+        }
+
+        origin->next++;
+        http_writer_rewind(&item->exchange.writer);
+        network_timing_connection(&item->timing, lane->used ? NULL : lane->conn);
+        lane->used = true;
+        lane->inflight[lane->count++] = index;
+        if (lane->count == 1) {
+            lane_start_reader(run, lane, &lane->reader);
+            lane->last_active = network_now();
+        }
+    }
+}
+
+/* The connection failed: retry what may be retried, fail the rest */
+static void lane_error(BatchRun* run, BatchLane* lane, const char* error) {
+    char message[256];
+    size_t i;
+
+    /* The connection owns the error text, copy it before releasing */
+    snprintf(message, sizeof(message), "%s", error);
+
+    for (i = lane->count; i-- > 0;) {
+        size_t index = lane->inflight[i];
+        BatchItem* item = &run->items[index];
+        bool answered = i == 0 && lane->reader.bytes_received > 0;
+
+        if (!answered && item->attempts == 0 &&
+            (item->exchange.idempotent || (i == 0 && lane->conn->reused))) {
+            item->attempts++;
+            origin_requeue(lane->origin, index);
+        } else {
+            item_finish(run, index,
+                        NetworkResponseMake(502, "Bad Gateway", message));
+        }
+    }
+    if (lane->count > 0) http_reader_free(&lane->reader);
+    lane->count = lane->written = 0;
+    lane_close(lane, false);
+}
+
+/* inflight[0]'s response is complete. Returns the state of the next
+ * response if bytes of it had already arrived (1 complete, 0 partial,
+ * -1 malformed), or 0 if the lane was closed. */
+static int lane_complete(BatchRun* run, BatchLane* lane) {
+    HttpResponseReader next;
+    HttpResponseData data;
+    const char* excess;
+    size_t excess_length = http_reader_excess(&lane->reader, &excess);
+    size_t index = lane->inflight[0];
+    /* Answered before the request was fully written, as servers may do
+     * for an error; the rest of it is still owed */
+    bool early = lane->written == 0;
+    bool keep;
+    int result = 0;
+
+    lane->count--;
+    memmove(lane->inflight, lane->inflight + 1, lane->count * sizeof(size_t));
+    if (lane->written > 0) lane->written--;
+
+    /* Excess bytes are the start of the next response; read them before
+     * the finished reader hands its buffer over */
+    if (lane->count > 0) {
+        lane_start_reader(run, lane, &next);
+        result = http_reader_feed(&next, excess, excess_length);
+    }
+
+    http_reader_finish(&lane->reader, &data);
+    network_timing_received(&run->items[index].timing, &data);
+    keep = data.keep_alive && run->items[index].exchange.keep_alive && !early &&
+           (lane->count > 0 || excess_length == 0);
+    if (data.keep_alive && data.fields.minor_version >= 1) {
+        lane->conn->persistent = true;
+    }
+    item_finish(run, index, network_response_adopt(&data));
+
+    if (lane->count > 0) lane->reader = next;
+    if (keep) return result;
+
+    /* The server will answer nothing more on this connection: whatever is
+     * still in flight goes back on the queue for another one */
+    if (!data.keep_alive) lane->origin->no_pipeline = true;
+    if (lane->count > 0) http_reader_free(&lane->reader);
+    while (lane->count > 0) {
+        origin_requeue(lane->origin, lane->inflight[--lane->count]);
+    }
+    lane->written = 0;
+    lane_close(lane, false);
+    return 0;
+}
+
+static void lane_write(BatchRun* run, BatchLane* lane) {
+    HttpRequestWriter* writers[BATCH_PIPELINE_DEPTH];
+    size_t pending = lane->count - lane->written;
+    size_t i;
+    ssize_t sent;
+
+    if (pending == 0) return;
+    for (i = 0; i < pending; i++) {
+        writers[i] = &run->items[lane->inflight[lane->written + i]].exchange.writer;
+    }
+
+    sent = http_writer_send_many(lane->conn, writers, pending);
+    if (sent < 0) {
+        lane_error(run, lane, connection_error(lane->conn));
+        return;
+    }
+    if (sent > 0) lane->last_active = network_now();
+    for (i = 0; i < (size_t)sent; i++) {
+        network_timing_sent(&run->items[lane->inflight[lane->written + i]].timing,
+                            writers[i]);
+    }
+    lane->written += (size_t)sent;
+}
+
+/* Receive until the socket would block */
+static void lane_read(BatchRun* run, BatchLane* lane) {
+    while (lane->conn && lane->count > 0) {
+        size_t space;
+        char* into = http_reader_space(&lane->reader, &space);
+        ssize_t n;
+        int result;
+
+        if (!into) {
+            lane_error(run, lane, "Out of memory");
+            return;
+        }
+
+        n = connection_recv(lane->conn, into, space);
+        if (n > 0) {
+            lane->last_active = network_now();
+            result = http_reader_received(&lane->reader, (size_t)n);
+        } else if (n == 0) {
+            result = http_reader_eof(&lane->reader);
+        } else if (connection_would_block(lane->conn)) {
+            return;
+        } else {
+            lane_error(run, lane, connection_error(lane->conn));
+            return;
+        }
+
+        while (result > 0 && lane->conn && lane->count > 0) {
+            result = lane_complete(run, lane);
+        }
+        if (result < 0) {
+            lane_error(run, lane, lane->reader.error ? lane->reader.error
+                                                      : "Connection closed mid-response");
+            return;
+        }
+        if (n == 0 && lane->conn) {
+            /* Closed after a complete response: nothing more comes */
+            lane_error(run, lane, "Connection closed mid-response");
+            return;
+        }
+    }
+}
+
+/* Open, refill and write; called every round before waiting */
+static void lane_prepare(BatchRun* run, BatchLane* lane) {
+    BatchOrigin* origin = lane->origin;
+    bool queued = origin->next < origin->count;
+    char error[256];
+
+    if (!lane->conn) {
+        if (!queued || lane->dead) return;
+        if (!lane_open(run, lane, error, sizeof(error))) {
+            if (origin->lanes == 0) {
+                origin_fail(run, origin, error);
+            } else {
+                lane->dead = true;
+            }
+            return;
+        }
+    }
+
+    if (lane->count == 0 && !queued) {
+        /* Nothing left for this connection; park it for the next user */
+        lane_close(lane, true);
+        return;
+    }
+
+    lane_fill(run, lane);
+    lane_write(run, lane);
+}
+
+static void lane_expire(BatchRun* run, BatchLane* lane, double now) {
+    int timeout = run->items[lane->inflight[0]].exchange.timeout_seconds;
+    char error[128];
+    size_t i;
+
+    if (now - lane->last_active < timeout) return;
+
+    snprintf(error, sizeof(error), "Request timed out after %d seconds",
+             timeout);
+    for (i = 0; i < lane->count; i++) {
+        item_finish(run, lane->inflight[i],
+                    NetworkResponseMake(504, "Gateway Timeout", error));
+    }
+    http_reader_free(&lane->reader);
+    lane->count = lane->written = 0;
+    lane_close(lane, false);
+}
+
+/* Group items by origin and give each origin its queue and lanes */
+static bool run_setup(BatchRun* run, NetworkRequestBatchPrivate* batch,
+                      size_t* queue_space) {
+    size_t i;
+    size_t offset = 0;
+    size_t lanes = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        HttpExchange* exchange = &batch->items[i].exchange;
+        BatchOrigin* origin = NULL;
+        size_t j;
+
+        for (j = 0; j < run->origin_count; j++) {
+            BatchOrigin* candidate = &run->origins[j];
+            if (candidate->port == exchange->port &&
+                candidate->use_ssl == exchange->use_ssl &&
+                strcmp(candidate->hostname, exchange->hostname) == 0) {
+                origin = candidate;
+                break;
+            }
+        }
+        if (!origin) {
+            origin = &run->origins[run->origin_count++];
+            origin->hostname = exchange->hostname;
+            origin->port = exchange->port;
+            origin->use_ssl = exchange->use_ssl;
+        }
+        origin->count++;
+    }
+
+    /* No origin needs more lanes than it has requests */
+    for (i = 0; i < run->origin_count; i++) {
+        size_t count = run->origins[i].count;
+        lanes += count < (size_t)batch->connections ? count
+                                                    : (size_t)batch->connections;
+    }
+    run->lanes = calloc(lanes, sizeof(BatchLane));
+    if (!run->lanes) return false;
+
+    /* Lay the queues out back to back in one allocation */
+    for (i = 0; i < run->origin_count; i++) {
+        BatchOrigin* origin = &run->origins[i];
+        size_t j;
+
+        origin->queue = queue_space + offset;
+        offset += origin->count;
+        origin->next = origin->count;   /* Filled below */
+
+        for (j = 0; j < origin->count && j < (size_t)batch->connections; j++) {
+            run->lanes[run->lane_count++].origin = origin;
+        }
+    }
+
+    for (i = batch->count; i-- > 0;) {
+        HttpExchange* exchange = &batch->items[i].exchange;
+        size_t j;
+
+        for (j = 0; j < run->origin_count; j++) {
+            BatchOrigin* origin = &run->origins[j];
+            if (origin->port == exchange->port &&
+                origin->use_ssl == exchange->use_ssl &&
+                strcmp(origin->hostname, exchange->hostname) == 0) {
+                origin_requeue(origin, i);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+static void run_loop(BatchRun* run) {
+    struct pollfd* fds = calloc(run->lane_count, sizeof(struct pollfd));
+    BatchLane** polled = calloc(run->lane_count, sizeof(BatchLane*));
+    size_t i;
+
+    if (!fds || !polled) {
+        free(fds);
+        free(polled);
+        for (i = 0; i < run->origin_count; i++) {
+            origin_fail(run, &run->origins[i], "Out of memory");
+        }
+        return;
+    }
+
+    while (run->remaining > 0) {
+        double now = network_now();
+        double wait = -1;
+        nfds_t count = 0;
+        int ready;
+
+        for (i = 0; i < run->lane_count; i++) {
+            BatchLane* lane = &run->lanes[i];
+            double left;
+
+            lane_prepare(run, lane);
+            if (!lane->conn || lane->count == 0) continue;
+
+            fds[count].fd = lane->conn->socket_fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            if (lane->written < lane->count ||
+                (connection_would_block(lane->conn) && lane->conn->want_write)) {
+                fds[count].events |= POLLOUT;
+            }
+            polled[count++] = lane;
+
+            left = lane->last_active +
+                   run->items[lane->inflight[0]].exchange.timeout_seconds - now;
+            if (wait < 0 || left < wait) wait = left > 0 ? left : 0;
+        }
+        if (count == 0) continue;
+
+        ready = poll(fds, count, (int)(wait * 1000) + 1);
+        now = network_now();
+
+        for (i = 0; i < count; i++) {
+            BatchLane* lane = polled[i];
+
+            if (ready > 0 && fds[i].revents) {
+                if (fds[i].revents & POLLOUT) lane_write(run, lane);
+                if (lane->conn) lane_read(run, lane);
+            }
+            if (lane->conn && lane->count > 0) lane_expire(run, lane, now);
+        }
+    }
+
+    /* Connections still open carried their last response cleanly */
+    for (i = 0; i < run->lane_count; i++) {
+        if (run->lanes[i].conn && run->lanes[i].count == 0) {
+            lane_close(&run->lanes[i], true);
+        }
+    }
+    free(fds);
+    free(polled);
+}
+
+static void free_items(NetworkRequestBatchPrivate* batch) {
+    size_t i;
+
+    for (i = 0; i < batch->count; i++) {
+        free(batch->items[i].exchange.hostname);
+        http_writer_free(&batch->items[i].exchange.writer);
+    }
+    batch->count = 0;
+}
+
+/* ======================================================================== */
+/* Trampoline Functions using TF_ macros                                    */
+/* ======================================================================== */
+
+static TF_Unary(int, networkrequestbatch_add, NetworkRequestBatch,
+                NetworkRequestBatchPrivate, NetworkRequest*, request)
+    BatchItem* item;
+
+    if (!request) return 0;
+
+    if (private->count == private->capacity) {
+        size_t capacity = private->capacity ? private->capacity * 2 : 16;
+        BatchItem* grown = realloc(private->items, capacity * sizeof(BatchItem));
+        if (!grown) return 0;
+        private->items = grown;
+        private->capacity = capacity;
+    }
+
+    item = &private->items[private->count];
+    memset(item, 0, sizeof(*item));
+    if (!network_request_exchange(request, &item->exchange)) {
+        free(item->exchange.hostname);
+        http_writer_free(&item->exchange.writer);
+        return 0;
+    }
+    private->count++;
+    return 1;
+}
+
+static TF_Getter(networkrequestbatch_count, NetworkRequestBatch,
+                 NetworkRequestBatchPrivate, size_t)
+    return private->count;
+}
+
+static TF_Getter(networkrequestbatch_connections, NetworkRequestBatch,
+                 NetworkRequestBatchPrivate, int)
+    return private->connections;
+}
+
+static TF_Setter(networkrequestbatch_setConnections, NetworkRequestBatch,
+                 NetworkRequestBatchPrivate, int)
+    private->connections = newValue > 0 ? newValue : 1;
+}
+
+static TF_Getter(networkrequestbatch_pipelining, NetworkRequestBatch,
+                 NetworkRequestBatchPrivate, int)
+    return private->pipelining;
+}
+
+static TF_Setter(networkrequestbatch_setPipelining, NetworkRequestBatch,
+                 NetworkRequestBatchPrivate, int)
+    private->pipelining = newValue != 0;
+}
+
+static TF_Getter(networkrequestbatch_send, NetworkRequestBatch,
+                 NetworkRequestBatchPrivate, NetworkResponse**)
+    BatchRun run;
+    NetworkResponse** responses;
+    size_t* queue_space;
+    size_t i;
+
+    if (private->count == 0) return NULL;
+
+    memset(&run, 0, sizeof(run));
+    for (i = 0; i < private->count; i++) {
+        network_timing_start(&private->items[i].timing);
+    }
+    run.items = private->items;
+    run.remaining = private->count;
+    run.pipelining = private->pipelining;
+    run.origins = calloc(private->count, sizeof(BatchOrigin));
+    queue_space = malloc(private->count * sizeof(size_t));
+    responses = malloc(private->count * sizeof(NetworkResponse*));
+
+    if (!run.origins || !queue_space || !responses ||
+        !run_setup(&run, private, queue_space)) {
+        free(run.origins);
+        free(run.lanes);
+        free(queue_space);
+        free(responses);
+        free_items(private);
+        return NULL;
+    }
+
+    run_loop(&run);
+
+    for (i = 0; i < private->count; i++) {
+        responses[i] = private->items[i].response;
+    }
+    free(run.origins);
+    free(run.lanes);
+    free(queue_space);
+    free_items(private);
+    return responses;
+}
+
+static TF_Nullary(networkrequestbatch_free, NetworkRequestBatch,
+                  NetworkRequestBatchPrivate)
+    if (private) {
+        free_items(private);
+        free(private->items);
+        trampoline_tracker_free_by_context(self);
+        free(private);
+    }
+}
+
+/* ======================================================================== */
+/* Creation Functions                                                        */
+/* ======================================================================== */
+
+NetworkRequestBatch* NetworkRequestBatchMake(void) {
+    TA_Allocate(NetworkRequestBatch, NetworkRequestBatchPrivate);
+
+    if (!private) return NULL;
+
+    private->connections = 1;
+    private->pipelining = true;
+
+    /* Create trampoline functions */
+    public->add = trampoline_monitor(networkrequestbatch_add, public, 1, &tracker);
+    public->count = trampoline_monitor(networkrequestbatch_count, public, 0, &tracker);
+    public->connections = trampoline_monitor(networkrequestbatch_connections, public, 0, &tracker);
+    public->setConnections = trampoline_monitor(networkrequestbatch_setConnections, public, 1, &tracker);
+    public->pipelining = trampoline_monitor(networkrequestbatch_pipelining, public, 0, &tracker);
+    public->setPipelining = trampoline_monitor(networkrequestbatch_setPipelining, public, 1, &tracker);
+    public->send = trampoline_monitor(networkrequestbatch_send, public, 0, &tracker);
+    public->free = trampoline_monitor(networkrequestbatch_free, public, 0, &tracker);
+
+    /* Validate all trampolines */
+    if (!trampoline_validate(tracker)) {
+        free(private);
+        return NULL;
+    }
+
+    return public;
+}
@@ -0,0 +1,679 @@
+/**
+ * @file network_cache.c
+ * @brief Client-side HTTP response cache
+ *
+ * Entries are keyed by absolute URL and hold one block with the response
+ * head (as network_response_head writes it) followed by the decoded body.
+ * Responses served from an entry point at that body rather than copying
+ * it, and hold a reference so eviction never pulls it from under them.
+ * The table is a fixed set of hash chains with one least-recently-used
+ * list through every entry, all under one mutex; freshness is judged on
+ * the wall clock so that entries written to disk stay meaningful in the
+ * next process. On disk an entry is a single file, read back with mmap so
+ * its body is served straight from the page cache.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/json.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_BUCKETS 256
+#define CACHE_MAGIC "TRCACHE1"
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+struct CacheEntry {
+    char* url;
+    const char* head;       /* Into storage or mapping */
+    size_t head_length;
+    const char* body;       /* Follows the head, NUL terminated */
+    size_t body_length;
+    char* storage;
+    void* mapping;          /* Read back from disk */
+    size_t mapping_length;
+
+    char* etag;
+    char* last_modified;
+    time_t expires;         /* Fresh until then */
+    long lifetime;          /* Seconds it was fresh for when stored */
+    bool no_cache;          /* Revalidate on every use */
+    Json* json;             /* The body parsed, once asked for */
+
+    unsigned int refs;      /* The table's, plus one per holder */
+    bool listed;
+    unsigned long hash;
+    struct CacheEntry* chain;
+    struct CacheEntry* newer;
+    struct CacheEntry* older;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static NetworkCacheOptions cache_options = { 0, NULL };
+static NetworkCacheStats cache_stats;
+static CacheEntry* buckets[CACHE_BUCKETS];
+static CacheEntry* newest = NULL;
+static CacheEntry* oldest = NULL;
+
+/* ======================================================================== */
+/* Header Rules                                                             */
+/* ======================================================================== */
+
+/* FNV-1a, for the chains and the file names */
+static unsigned long url_hash(const char* url) {
+    unsigned long long hash = 14695981039346656037ULL;
+    while (*url) {
+        hash ^= (unsigned char)*url++;
+        hash *= 1099511628211ULL;
+    }
+    return (unsigned long)hash;
+}
+
+/* Whether a Cache-Control value has directive name; a "=n" argument goes
+ * into *seconds when asked for */
+static bool cache_directive(const char* value, const char* name, long* seconds) {
+    size_t length = strlen(name);
+    const char* p = value;
+
+    while (p && *p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (strncasecmp(p, name, length) == 0 &&
+            strchr(" \t,=", p[length]) != NULL) {
+            if (p[length] == '=' && seconds) {
+                const char* argument = p + length + 1;
+                if (*argument == '"') argument++;
+                *seconds = strtol(argument, NULL, 10);
+            }
+            return true;
+        }
+        p = strchr(p, ',');
+    }
+    return false;
+}
+
+/* An IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") as seconds since the
+ * epoch, or -1. Without strptime and timegm, which not every libc offers
+ * in strict modes, the day count is worked out directly. */
+static time_t http_date(const char* value) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month_name[4];
+    const char* found;
+    long days;
+    int day, year, hour, minute, second, month;
+
+    if (!value ||
+        sscanf(value, "%*3s, %d %3s %d %d:%d:%d", &day, month_name, &year,
+               &hour, &minute, &second) != 6 ||
+        strlen(month_name) != 3 ||
+        (found = strstr(months, month_name)) == NULL ||
+        (found - months) % 3 != 0) {
+        return -1;
+    }
+    month = (int)(found - months) / 3 + 1;
+
+    /* Days from 1970-01-01 to year-month-day in the proleptic calendar */
+    if (month <= 2) year--;
+    days = 365L * year + year / 4 - year / 100 + year / 400 +
+           (153L * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1 - 719468L;
+    return (time_t)(days * 86400L + hour * 3600L + minute * 60L + second);
+}
+
+/*
+ * When a response stops being fresh, from max-age or else Expires less
+ * Date (RFC 9111 section 4.2.1), less any Age it already had. Returns
+ * false if it must not be stored at all.
+ */
+static bool response_freshness(NetworkResponse* response, time_t now,
+                               time_t* expires, bool* no_cache) {
+    const char* control = response->header("Cache-Control");
+    const char* vary = response->header("Vary");
+    const char* age = response->header("Age");
+    long lifetime = 0;
+
+    if (control && cache_directive(control, "no-store", NULL)) return false;
+    /* Every request sends the same Accept-Encoding, so that Vary is moot */
+    if (vary && strcasecmp(vary, "Accept-Encoding") != 0) return false;
+
+    *no_cache = control && cache_directive(control, "no-cache", NULL);
+    if (!control || !cache_directive(control, "max-age", &lifetime)) {
+        time_t until = http_date(response->header("Expires"));
+        time_t date = http_date(response->header("Date"));
+
+        lifetime = until < 0 ? 0 : (long)(until - (date < 0 ? now : date));
+    }
+    if (age) lifetime -= strtol(age, NULL, 10);
+    *expires = now + (lifetime > 0 ? lifetime : 0);
+    return true;
+}
+
+/* ETag and Last-Modified from the entry's head, parsed from a copy */
+static void entry_validators(CacheEntry* entry) {
+    HttpHead fields;
+    const char* value;
+    char* copy = malloc(entry->head_length + 1);
+
+    if (!copy) return;
+    memcpy(copy, entry->head, entry->head_length);
+    copy[entry->head_length] = '\0';
+    http_head_init(&fields);
+    if (http_head_parse(&fields, copy, entry->head_length) == 1) {
+        if ((value = http_head_find(&fields, copy, "etag")) != NULL) {
+            entry->etag = strdup(value);
+        }
+        if ((value = http_head_find(&fields, copy, "last-modified")) != NULL) {
+            entry->last_modified = strdup(value);
+        }
+    }
+    http_head_free(&fields);
+    free(copy);
+}
+
+/* ======================================================================== */
+/* Entries                                                                  */
+/* ======================================================================== */
+
+static size_t entry_size(const CacheEntry* entry) {
+    return entry->head_length + entry->body_length + strlen(entry->url);
+}
+
+static void entry_free(CacheEntry* entry) {
+    free(entry->url);
+    free(entry->storage);
+    if (entry->mapping) munmap(entry->mapping, entry->mapping_length);
+    free(entry->etag);
+    free(entry->last_modified);
+    if (entry->json) entry->json->free();
+    free(entry);
+}
+
+/* Caller holds cache_lock */
+static void entry_release_locked(CacheEntry* entry) {
+    if (--entry->refs == 0) entry_free(entry);
+}
+
+/* Caller holds cache_lock */
+static void entry_unlink(CacheEntry* entry) {
+    CacheEntry** link = &buckets[entry->hash % CACHE_BUCKETS];
+
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    if (entry->newer) entry->newer->older = entry->older;
+    else newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else oldest = entry->newer;
+
+    cache_stats.entries--;
+    cache_stats.bytes -= entry_size(entry);
+    entry->listed = false;
+    entry_release_locked(entry);
+}
+
+/* Caller holds cache_lock */
+static void entry_touch(CacheEntry* entry) {
+    if (entry == newest) return;
+    entry->newer->older = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else oldest = entry->newer;
+    entry->older = newest;
+    entry->newer = NULL;
+    newest->newer = entry;
+    newest = entry;
+}
+
+/* Caller holds cache_lock */
+static CacheEntry* entry_find(const char* url, unsigned long hash) {
+    CacheEntry* entry = buckets[hash % CACHE_BUCKETS];
+
+    while (entry && (entry->hash != hash || strcmp(entry->url, url) != 0)) {
+        entry = entry->chain;
+    }
+    return entry;
+}
+
+/* Caller holds cache_lock. The table takes a reference; one for the same
+ * URL is replaced, and the oldest make way to stay within max_bytes. */
+static void entry_insert(CacheEntry* entry) {
+    CacheEntry* existing = entry_find(entry->url, entry->hash);
+    CacheEntry** bucket = &buckets[entry->hash % CACHE_BUCKETS];
+
+    if (existing) entry_unlink(existing);
+    entry->refs++;
+    entry->listed = true;
+    entry->chain = *bucket;
+    *bucket = entry;
+    entry->older = newest;
+    entry->newer = NULL;
+    if (newest) newest->newer = entry;
+    else oldest = entry;
+    newest = entry;
+    cache_stats.entries++;
+    cache_stats.bytes += entry_size(entry);
+
+    while (cache_stats.bytes > cache_options.max_bytes && oldest) {
+        entry_unlink(oldest);
+        cache_stats.evicted++;
+    }
+}
+
+/* ======================================================================== */
+/* Disk                                                                     */
+/* ======================================================================== */
+
+/*
+ * One file per URL: a line "TRCACHE1 expires lifetime no_cache" and the
+ * url, head and body lengths, then the URL, head and body bytes and a
+ * NUL, so the mapped body can be handed out as a C string.
+ */
+static char* disk_path(const char* directory, unsigned long hash,
+                       const char* suffix) {
+    size_t size = strlen(directory) + 32;
+    char* path = malloc(size);
+
+    if (path) {
+        snprintf(path, size, "%s/%016lx.cache%s", directory, hash, suffix);
+    }
+    return path;
+}
+
+static bool write_all(int fd, const void* data, size_t length) {
+    const char* p = data;
+    ssize_t n;
+
+    while (length > 0) {
+        n = write(fd, p, length);
+        if (n <= 0) return false;
+        p += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+/* Written beside its final name and renamed over it, so readers (and
+ * existing mappings) only ever see whole files */
+static void disk_write(const char* directory, const CacheEntry* entry,
+                       time_t expires, long lifetime, bool no_cache) {
+    char* path = disk_path(directory, entry->hash, "");
+    char* temporary = disk_path(directory, entry->hash, ".tmp");
+    char line[128];
+    int length;
+    int fd = -1;
+    bool ok;
+
+    if (path && temporary) {
+        fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    if (fd >= 0) {
+        length = snprintf(line, sizeof(line), CACHE_MAGIC " %lld %ld %d %zu %zu %zu\n",
+                          (long long)expires, lifetime, no_cache ? 1 : 0,
+                          strlen(entry->url), entry->head_length,
+                          entry->body_length);
+        ok = write_all(fd, line, (size_t)length) &&
+             write_all(fd, entry->url, strlen(entry->url)) &&
+             write_all(fd, entry->head, entry->head_length) &&
+             write_all(fd, entry->body, entry->body_length + 1);
+        close(fd);
+        if (!ok || rename(temporary, path) < 0) unlink(temporary);
+    }
+    free(path);
+    free(temporary);
+}
+
+/* The entry for url from its file, or NULL; its body stays in the mapping */
+static CacheEntry* disk_read(const char* directory, const char* url,
+                             unsigned long hash) {
+    char* path = disk_path(directory, hash, "");
+    CacheEntry* entry = NULL;
+    struct stat info;
+    const char* newline;
+    const char* data;
+    char line[128];
+    long long expires;
+    long lifetime;
+    size_t url_length, head_length, body_length, line_length;
+    void* mapping;
+    int no_cache;
+    int fd;
+
+    fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &info) < 0 || info.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    data = mapping;
+    newline = memchr(data, '\n', (size_t)info.st_size < sizeof(line) ?
+                                 (size_t)info.st_size : sizeof(line));
+    if (newline) {
+        line_length = (size_t)(newline - data) + 1;
+        memcpy(line, data, line_length - 1);
+        line[line_length - 1] = '\0';
+    }
+    if (!newline ||
+        sscanf(line, CACHE_MAGIC " %lld %ld %d %zu %zu %zu", &expires, &lifetime,
+               &no_cache, &url_length, &head_length, &body_length) != 6 ||
+        line_length + url_length + head_length + body_length + 1 !=
+            (size_t)info.st_size ||
+        url_length != strlen(url) ||
+        memcmp(data + line_length, url, url_length) != 0 ||
+        data[info.st_size - 1] != '\0' ||
+        (entry = calloc(1, sizeof(CacheEntry))) == NULL ||
+        (entry->url = strdup(url)) == NULL) {
+        free(entry);
+        munmap(mapping, (size_t)info.st_size);
+        return NULL;
+    }
+
+    entry->mapping = mapping;
+    entry->mapping_length = (size_t)info.st_size;
+    entry->head = data + line_length + url_length;
+    entry->head_length = head_length;
+    entry->body = entry->head + head_length;
+    entry->body_length = body_length;
+    entry->expires = (time_t)expires;
+    entry->lifetime = lifetime;
+    entry->no_cache = no_cache != 0;
+    entry->hash = hash;
+    entry->refs = 1;
+    entry_validators(entry);
+    return entry;
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+bool network_cache_enabled(void) {
+    return __atomic_load_n(&cache_options.max_bytes, __ATOMIC_RELAXED) > 0;
+}
+
+CacheEntry* network_cache_lookup(const char* url, bool revalidate, bool* fresh) {
+    unsigned long hash = url_hash(url);
+    CacheEntry* entry;
+    CacheEntry* loaded;
+    char* directory = NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_options.max_bytes == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    entry = entry_find(url, hash);
+    if (entry) {
+        entry_touch(entry);
+        entry->refs++;
+    } else if (cache_options.directory) {
+        directory = strdup(cache_options.directory);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    /* Read from disk outside the lock; another thread may have won */
+    if (directory) {
+        loaded = disk_read(directory, url, hash);
+        free(directory);
+        if (loaded) {
+            pthread_mutex_lock(&cache_lock);
+            entry = entry_find(url, hash);
+            if (entry) {
+                entry_touch(entry);
+                entry->refs++;
+                entry_release_locked(loaded);
+            } else if (cache_options.max_bytes > 0) {
+                entry = loaded;
+                entry_insert(entry);
+            } else {
+                entry_release_locked(loaded);
+            }
+            pthread_mutex_unlock(&cache_lock);
+        }
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (entry) {
+        *fresh = !revalidate && !entry->no_cache && time(NULL) < entry->expires;
+        if (!*fresh && !entry->etag && !entry->last_modified) {
+            entry_release_locked(entry);
+            entry = NULL;
+        }
+    }
+    if (!entry) cache_stats.misses++;
+    else if (*fresh) cache_stats.hits++;
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+}
+
+const char* network_cache_etag(const CacheEntry* entry) {
+    return entry->etag;
+}
+
+const char* network_cache_last_modified(const CacheEntry* entry) {
+    return entry->last_modified;
+}
+
+NetworkResponse* network_cache_respond(CacheEntry* entry) {
+    return network_response_cached(entry->head, entry->head_length,
+                                   entry->body, entry->body_length, entry);
+}
+
+NetworkResponse* network_cache_revalidated(CacheEntry* entry,
+                                           NetworkResponse* not_modified) {
+    NetworkTiming timing = *not_modified->timing();
+    NetworkResponse* response;
+    char* directory = NULL;
+    time_t now = time(NULL);
+    time_t expires;
+    long lifetime;
+    bool no_cache = entry->no_cache;
+    bool keep = true;
+
+    /* RFC 9111 section 4.3.4: freshness the 304 states replaces the
+     * entry's; without any, the entry is fresh for as long as before */
+    if (not_modified->header("Cache-Control") || not_modified->header("Expires")) {
+        keep = response_freshness(not_modified, now, &expires, &no_cache);
+        lifetime = keep ? (long)(expires - now) : 0;
+    } else {
+        lifetime = entry->lifetime;
+        expires = now + lifetime;
+    }
+    not_modified->free();
+
+    pthread_mutex_lock(&cache_lock);
+    cache_stats.revalidated++;
+    if (!keep && entry->listed) {
+        entry_unlink(entry);
+    } else if (keep) {
+        entry->expires = expires;
+        entry->lifetime = lifetime;
+        entry->no_cache = no_cache;
+        if (entry->listed && cache_options.directory) {
+            directory = strdup(cache_options.directory);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (directory) {
+        disk_write(directory, entry, expires, lifetime, no_cache);
+        free(directory);
+    }
+    response = network_cache_respond(entry);
+    if (response) network_response_set_timing(response, &timing);
+    return response;
+}
+
+void network_cache_release(CacheEntry* entry) {
+    pthread_mutex_lock(&cache_lock);
+    entry_release_locked(entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void network_cache_store(const char* url, NetworkResponse* response) {
+    CacheEntry* entry;
+    char* directory = NULL;
+    char* head;
+    size_t head_length;
+    size_t body_length = response->bodyLength();
+    const char* body = response->body();
+    time_t now = time(NULL);
+    time_t expires;
+    bool no_cache = false;
+
+    if (response->statusCode() != 200 || (!body && body_length > 0) ||
+        !response_freshness(response, now, &expires, &no_cache)) {
+        return;
+    }
+    if ((no_cache || expires <= now) && !response->header("ETag") &&
+        !response->header("Last-Modified")) {
+        return;     /* Could never be used */
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_options.max_bytes == 0 ||
+        body_length + strlen(url) > cache_options.max_bytes) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    /* One block: head, body and a NUL */
+    head = network_response_head(response, true, &head_length);
+    entry = calloc(1, sizeof(CacheEntry));
+    if (!head || !entry ||
+        (entry->url = strdup(url)) == NULL ||
+        (entry->storage = malloc(head_length + body_length + 1)) == NULL) {
+        free(head);
+        if (entry) free(entry->url);
+        free(entry);
+        return;
+    }
+    memcpy(entry->storage, head, head_length);
+    if (body_length > 0) memcpy(entry->storage + head_length, body, body_length);
+    entry->storage[head_length + body_length] = '\0';
+    free(head);
+
+    entry->head = entry->storage;
+    entry->head_length = head_length;
+    entry->body = entry->storage + head_length;
+    entry->body_length = body_length;
+    entry->expires = expires;
+    entry->lifetime = (long)(expires - now);
+    entry->no_cache = no_cache;
+    entry->hash = url_hash(url);
+    entry->refs = 1;
+    entry_validators(entry);
+
+    pthread_mutex_lock(&cache_lock);
+    entry_insert(entry);
+    cache_stats.stored++;
+    if (entry->listed && cache_options.directory) {
+        directory = strdup(cache_options.directory);
+        entry->refs++;
+    }
+    entry_release_locked(entry);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (directory) {
+        disk_write(directory, entry, expires, entry->lifetime, no_cache);
+        free(directory);
+        network_cache_release(entry);
+    }
+}
+
+Json* network_cache_json(CacheEntry* entry) {
+    Json* parsed = NULL;
+    Json* tree;
+
+    /* Parsed outside the lock; if two threads race, one tree is kept */
+    pthread_mutex_lock(&cache_lock);
+    tree = entry->json;
+    pthread_mutex_unlock(&cache_lock);
+    if (!tree) {
+        parsed = JsonParse(entry->body);
+        if (!parsed) return NULL;
+        pthread_mutex_lock(&cache_lock);
+        if (!entry->json) {
+            entry->json = parsed;
+            parsed = NULL;
+        }
+        tree = entry->json;
+        pthread_mutex_unlock(&cache_lock);
+        if (parsed) parsed->free();
+    }
+    return tree->clone();
+}
+
+/* ======================================================================== */
+/* Public API                                                               */
+/* ======================================================================== */
+
+void NetworkCacheConfigure(const NetworkCacheOptions* options) {
+    char* directory;
+
+    if (!options) return;
+    directory = options->directory ? strdup(options->directory) : NULL;
+    if (directory) mkdir(directory, 0700);
+
+    pthread_mutex_lock(&cache_lock);
+    free((char*)cache_options.directory);
+    __atomic_store_n(&cache_options.max_bytes, options->max_bytes, __ATOMIC_RELAXED);
+    cache_options.directory = directory;
+    while (cache_stats.bytes > cache_options.max_bytes && oldest) {
+        entry_unlink(oldest);
+        cache_stats.evicted++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void NetworkCacheGetOptions(NetworkCacheOptions* options) {
+    pthread_mutex_lock(&cache_lock);
+    *options = cache_options;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void NetworkCacheGetStats(NetworkCacheStats* stats) {
+    pthread_mutex_lock(&cache_lock);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void NetworkCacheClear(void) {
+    char* directory = NULL;
+    struct dirent* item;
+    DIR* dir;
+    char path[4096];
+    size_t length;
+
+    pthread_mutex_lock(&cache_lock);
+    while (oldest) entry_unlink(oldest);
+    if (cache_options.directory) directory = strdup(cache_options.directory);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (!directory) return;
+    dir = opendir(directory);
+    while (dir && (item = readdir(dir)) != NULL) {
+        length = strlen(item->d_name);
+        if (length > 6 && strcmp(item->d_name + length - 6, ".cache") == 0) {
+            snprintf(path, sizeof(path), "%s/%s", directory, item->d_name);
+            unlink(path);
+        }
+    }
+    if (dir) closedir(dir);
+    free(directory);
+}
@@ -3,12 +3,30 @@
  * @brief Common network utilities implementation
  */
 
+#include <trampoline/classes/network.h>
 #include "network_common.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <signal.h>
+#include <pthread.h>
+#endif
+
+/* Below this, a TLS gather-send joins its pieces into one record */
+#define SEND_COALESCE_MAX 16384
+
+/* Most buffers one pipelined gather-send hands to sendmsg */
+#define SEND_IOV_MAX 64
 
 /* ======================================================================== */
 /* SSL Initialization                                                       */
@@ -28,6 +46,7 @@ void network_init_ssl(void) {
 
 void network_cleanup_ssl(void) {
     if (ssl_initialized) {
+        network_tls_cleanup();
         EVP_cleanup();
         ERR_free_strings();
         ssl_initialized = false;
@@ -55,27 +74,18 @@ Connection* connection_create(const char* hostname, int port, bool use_ssl) {
     conn->port = port;
     conn->timeout_seconds = 30;
     conn->socket_fd = -1;
+    conn->race_count = 0;
     
 #if SSL_SUPPORT
     if (use_ssl) {
         conn->type = CONN_TYPE_SSL;
-        network_init_ssl();
-        
-        /* Create SSL context */
-        const SSL_METHOD* method = SSLv23_client_method();
-        conn->ssl_ctx = SSL_CTX_new(method);
-        
-        if (!conn->ssl_ctx) {
-            snprintf(conn->error_buffer, sizeof(conn->error_buffer),
-                    "Failed to create SSL context");
+
+        /* Every connection shares one configured context */
+        if (!network_tls_available()) {
             free(conn->hostname);
             free(conn);
             return NULL;
         }
-        
-        /* Set SSL options for better compatibility */
-        SSL_CTX_set_options(conn->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-        SSL_CTX_set_verify(conn->ssl_ctx, SSL_VERIFY_NONE, NULL);
     } else {
         conn->type = CONN_TYPE_PLAIN;
     }
@@ -93,88 +103,329 @@ Connection* connection_create(const char* hostname, int port, bool use_ssl) {
     return conn;
 }
 
-bool connection_connect(Connection* conn) {
-    if (!conn) return false;
-    
-    /* Resolve hostname */
-    struct hostent* host_info = gethostbyname(conn->hostname);
-    if (!host_info) {
-        snprintf(conn->error_buffer, sizeof(conn->error_buffer),
-                "Failed to resolve hostname: %s", conn->hostname);
+/* Makes sure the connection has addresses to try */
+static bool connection_resolve(Connection* conn) {
+    char error[192];
+
+    if (conn->addresses.count > 0) return true;
+
+    conn->dns_start = network_now();
+    if (!network_resolve(conn->hostname, conn->port, &conn->addresses,
+                         error, sizeof(error))) {
+        snprintf(conn->error_buffer, sizeof(conn->error_buffer), "%s", error);
         return false;
     }
-    
-    /* Create socket */
-    conn->socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (conn->socket_fd < 0) {
+    conn->dns_end = network_now();
+    conn->next_address = 0;
+    return true;
+}
+
+/* Starts a non-blocking connect to one address. Returns the socket, with
+ * *done set if it connected at once, or -1 with the error recorded. */
+static int connect_address(Connection* conn, const NetworkAddress* address,
+                           bool* done) {
+    int fd = socket(address->addr.ss_family, SOCK_STREAM, 0);
+    int flags;
+    int one = 1;
+
+    *done = false;
+    if (fd < 0) {
         snprintf(conn->error_buffer, sizeof(conn->error_buffer),
                 "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    /* Requests and handshake flights are written whole; don't let Nagle
+     * hold the last segment back waiting for a delayed ACK */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (const struct sockaddr*)&address->addr,
+                address->length) == 0) {
+        *done = true;
+        return fd;
+    }
+    if (errno == EINPROGRESS) return fd;
+
+    snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+            "Failed to connect: %s", strerror(errno));
+    close(fd);
+    return -1;
+}
+
+/* Blocking wrapper around the non-blocking race */
+static bool connection_race(Connection* conn) {
+    struct pollfd fds[CONNECT_MAX_RACE];
+    double deadline = network_now() +
+                      (conn->timeout_seconds > 0 ? conn->timeout_seconds : 30);
+    int result = connection_connect_start(conn);
+
+    while (result == 0) {
+        double now = network_now();
+        double wait = deadline - now;
+        int i;
+
+        if (wait <= 0) {
+            snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                    "Failed to connect: %s", strerror(ETIMEDOUT));
+            return false;
+        }
+        if (conn->next_address < conn->addresses.count &&
+            conn->race_next - now < wait) {
+            wait = conn->race_next - now;
+        }
+
+        for (i = 0; i < conn->race_count; i++) {
+            fds[i].fd = conn->race_fds[i];
+            fds[i].events = POLLOUT;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, (nfds_t)conn->race_count, (int)(wait * 1000) + 1) < 0 &&
+            errno != EINTR) {
+            snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                    "Failed to connect: %s", strerror(errno));
+            return false;
+        }
+        result = connection_connect_step(conn);
+    }
+    return result > 0;
+}
+
+bool connection_connect(Connection* conn) {
+    int result;
+
+    if (!conn) return false;
+    
+    /* Connect, racing addresses if there are several */
+    if (!connection_race(conn)) {
         return false;
     }
     
     /* Set timeout */
-    struct timeval tv;
-    tv.tv_sec = conn->timeout_seconds;
-    tv.tv_usec = 0;
-    setsockopt(conn->socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(conn->socket_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-    
-    /* Connect to server */
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(conn->port);
-    memcpy(&server_addr.sin_addr, host_info->h_addr_list[0], host_info->h_length);
+    connection_set_blocking(conn, true);
     
-    if (connect(conn->socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        snprintf(conn->error_buffer, sizeof(conn->error_buffer),
-                "Failed to connect: %s", strerror(errno));
+    /* The same handshake the event loop drives; on a blocking socket it
+     * only comes back unfinished when the timeout runs out */
+    result = connection_handshake(conn);
+    if (result <= 0) {
+        if (result == 0) {
+            snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                    "SSL handshake failed: %s", strerror(ETIMEDOUT));
+        }
+#if SSL_SUPPORT
+        if (conn->ssl) {
+            SSL_free(conn->ssl);
+            conn->ssl = NULL;
+        }
+#endif
         close(conn->socket_fd);
         conn->socket_fd = -1;
         return false;
     }
     
-#if SSL_SUPPORT
-    /* Setup SSL if needed */
-    if (conn->type == CONN_TYPE_SSL) {
-        conn->ssl = SSL_new(conn->ssl_ctx);
-        if (!conn->ssl) {
-            snprintf(conn->error_buffer, sizeof(conn->error_buffer),
-                    "Failed to create SSL structure");
-            close(conn->socket_fd);
-            conn->socket_fd = -1;
-            return false;
+    return true;
+}
+
+void connection_set_addresses(Connection* conn, NetworkAddressList* addresses) {
+    if (!conn || !addresses) return;
+
+    network_address_list_free(&conn->addresses);
+    conn->addresses = *addresses;
+    conn->next_address = 0;
+    if (conn->dns_start > 0) conn->dns_end = network_now();
+    addresses->items = NULL;
+    addresses->count = 0;
+}
+
+/* Abandon every attempt still in flight */
+static void race_close(Connection* conn) {
+    int i;
+    for (i = 0; i < conn->race_count; i++) close(conn->race_fds[i]);
+    conn->race_count = 0;
+}
+
+/* The winning attempt becomes the connection's socket */
+static int race_won(Connection* conn, int fd) {
+    int i;
+    for (i = 0; i < conn->race_count; i++) {
+        if (conn->race_fds[i] != fd) close(conn->race_fds[i]);
+    }
+    conn->race_count = 0;
+    conn->socket_fd = fd;
+    conn->connect_end = network_now();
+    return 1;
+}
+
+int connection_connect_start(Connection* conn) {
+    if (!conn || !connection_resolve(conn)) return -1;
+
+    conn->connect_start = network_now();
+    race_close(conn);
+    conn->race_next = 0;
+    return connection_connect_step(conn);
+}
+
+/* Happy eyeballs (RFC 8305): each address gets a short head start, after
+ * which the next one is tried alongside it. The first to connect wins and
+ * the rest are abandoned, so an unreachable IPv6 route costs the head
+ * start rather than a full connect timeout. */
+int connection_connect_step(Connection* conn) {
+    struct pollfd fds[CONNECT_MAX_RACE];
+    double now = network_now();
+    int i;
+
+    /* Collect attempts that have finished, one way or the other */
+    for (i = 0; i < conn->race_count; i++) {
+        fds[i].fd = conn->race_fds[i];
+        fds[i].events = POLLOUT;
+        fds[i].revents = 0;
+    }
+    if (conn->race_count > 0 &&
+        poll(fds, (nfds_t)conn->race_count, 0) > 0) {
+        int kept = 0;
+        int winner = -1;
+
+        for (i = 0; i < conn->race_count; i++) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (!fds[i].revents) {
+                conn->race_fds[kept++] = fds[i].fd;
+                continue;
+            }
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+                err = errno;
+            }
+            if (err == 0 && winner < 0) {
+                winner = fds[i].fd;
+                conn->race_fds[kept++] = fds[i].fd;
+                continue;
+            }
+            if (err != 0) {
+                snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                        "Failed to connect: %s", strerror(err));
+            }
+            close(fds[i].fd);
+            /* A refused address lets the next one start right away */
+            conn->race_next = now;
         }
-        
-        SSL_set_fd(conn->ssl, conn->socket_fd);
-        
-        /* Perform SSL handshake */
-        if (SSL_connect(conn->ssl) <= 0) {
-            unsigned long err = ERR_get_error();
+        conn->race_count = kept;
+        if (winner >= 0) return race_won(conn, winner);
+    }
+
+    /* Start the next address when nothing is in flight or the newest
+     * attempt has used up its head start */
+    while (conn->next_address < conn->addresses.count &&
+           conn->race_count < CONNECT_MAX_RACE &&
+           (conn->race_count == 0 || now >= conn->race_next)) {
+        bool done;
+        int fd = connect_address(conn,
+                                 &conn->addresses.items[conn->next_address++],
+                                 &done);
+        if (fd < 0) continue;
+
+        conn->race_fds[conn->race_count++] = fd;
+        if (done) return race_won(conn, fd);
+        conn->race_next = now + network_resolver_happy_eyeballs_delay() / 1000.0;
+    }
+
+    if (conn->race_count == 0) return -1;
+    conn->want_write = true;
+    return 0;
+}
+
+int connection_handshake(Connection* conn) {
+#if SSL_SUPPORT
+    int ret;
+
+    if (conn->type != CONN_TYPE_SSL) {
+        /* Plain HTTP/2 is spoken with prior knowledge */
+        conn->h2 = conn->offer_h2;
+        return 1;
+    }
+
+    if (!conn->ssl && !network_tls_attach(conn)) return -1;
+
+    ret = SSL_connect(conn->ssl);
+    if (ret == 1) {
+        network_tls_handshake_done(conn);
+        return 1;
+    }
+
+    switch (SSL_get_error(conn->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            conn->want_write = false;
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            conn->want_write = true;
+            return 0;
+        default: {
             char err_buf[256];
-            ERR_error_string_n(err, err_buf, sizeof(err_buf));
+            ERR_error_string_n(ERR_get_error(), err_buf, sizeof(err_buf));
             snprintf(conn->error_buffer, sizeof(conn->error_buffer),
-                    "SSL handshake failed: %s", err_buf);
-            SSL_free(conn->ssl);
-            conn->ssl = NULL;
-            close(conn->socket_fd);
-            conn->socket_fd = -1;
-            return false;
+                    "SSL handshake failed: %.200s", err_buf);
+            return -1;
         }
     }
+#else
+    conn->h2 = conn->offer_h2;
+    return 1;
 #endif
-    
-    return true;
+}
+
+void connection_set_blocking(Connection* conn, bool blocking) {
+    int flags;
+
+    if (!conn || conn->socket_fd < 0) return;
+
+    flags = fcntl(conn->socket_fd, F_GETFL, 0);
+    if (flags < 0) return;
+    fcntl(conn->socket_fd, F_SETFL,
+          blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+
+    if (blocking) {
+        struct timeval tv;
+        tv.tv_sec = conn->timeout_seconds;
+        tv.tv_usec = 0;
+        setsockopt(conn->socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn->socket_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+}
+
+bool connection_would_block(Connection* conn) {
+    return conn && conn->last_error == EAGAIN;
+}
+
+/* Shared bookkeeping for a failed plain send */
+static void send_failed(Connection* conn, const char* what) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        conn->last_error = EAGAIN;
+        conn->want_write = true;
+    } else {
+        snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                "%s failed: %s", what, strerror(errno));
+    }
 }
 
 ssize_t connection_send(Connection* conn, const void* data, size_t length) {
+    ssize_t sent;
+
     if (!conn || conn->socket_fd < 0) return -1;
+    conn->last_error = 0;
     
 #if SSL_SUPPORT
     if (conn->type == CONN_TYPE_SSL && conn->ssl) {
         int ret = SSL_write(conn->ssl, data, (int)length);
         if (ret <= 0) {
             int ssl_error = SSL_get_error(conn->ssl, ret);
+            if (ssl_error == SSL_ERROR_WANT_READ ||
+                ssl_error == SSL_ERROR_WANT_WRITE) {
+                conn->last_error = EAGAIN;
+                conn->want_write = (ssl_error == SSL_ERROR_WANT_WRITE);
+                return -1;
+            }
             snprintf(conn->error_buffer, sizeof(conn->error_buffer),
                     "SSL write error: %d", ssl_error);
             return -1;
@@ -183,11 +434,116 @@ ssize_t connection_send(Connection* conn, const void* data, size_t length) {
     }
 #endif
     
-    return send(conn->socket_fd, data, length, 0);
+#ifdef MSG_NOSIGNAL
+    /* A peer that closed a pooled connection must not kill us with SIGPIPE */
+    sent = send(conn->socket_fd, data, length, MSG_NOSIGNAL);
+#else
+    sent = send(conn->socket_fd, data, length, 0);
+#endif
+    if (sent < 0) send_failed(conn, "Send");
+    return sent;
+}
+
+ssize_t connection_sendv(Connection* conn, const struct iovec* iov, int count,
+                         bool more) {
+    struct msghdr message;
+    ssize_t sent;
+    int flags = 0;
+
+    if (!conn || conn->socket_fd < 0 || count <= 0) return -1;
+
+#if SSL_SUPPORT
+    if (conn->type == CONN_TYPE_SSL && conn->ssl) {
+        /* Encryption copies anyway; small pieces share one record rather
+         * than each paying for its own */
+        char joined[SEND_COALESCE_MAX];
+        size_t total = 0;
+        int i;
+
+        for (i = 0; i < count; i++) total += iov[i].iov_len;
+        if (count == 1 || total > sizeof(joined)) {
+            return connection_send(conn, iov[0].iov_base, iov[0].iov_len);
+        }
+        total = 0;
+        for (i = 0; i < count; i++) {
+            memcpy(joined + total, iov[i].iov_base, iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+        return connection_send(conn, joined, total);
+    }
+#endif
+
+    conn->last_error = 0;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = (struct iovec*)iov;
+    message.msg_iovlen = (size_t)count;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_MORE
+    if (more) flags |= MSG_MORE;
+#else
+    (void)more;
+#endif
+
+    sent = sendmsg(conn->socket_fd, &message, flags);
+    if (sent < 0) send_failed(conn, "Send");
+    return sent;
+}
+
+ssize_t connection_sendfile(Connection* conn, int fd, off_t offset,
+                            size_t count) {
+    char buffer[SEND_COALESCE_MAX];
+    ssize_t got;
+
+    if (!conn || conn->socket_fd < 0) return -1;
+    conn->last_error = 0;
+
+#ifdef __linux__
+    if (conn->type == CONN_TYPE_PLAIN) {
+        /* sendfile takes no MSG_NOSIGNAL; hold back the SIGPIPE a closed
+         * peer raises and discard it, so it can't kill the process */
+        sigset_t pipe_set, old_set;
+        struct timespec zero = { 0, 0 };
+        ssize_t sent;
+        int saved;
+
+        sigemptyset(&pipe_set);
+        sigaddset(&pipe_set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+        sent = sendfile(conn->socket_fd, fd, &offset, count);
+        saved = errno;
+        if (sent < 0 && saved == EPIPE && !sigismember(&old_set, SIGPIPE)) {
+            sigtimedwait(&pipe_set, NULL, &zero);
+        }
+        pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+        errno = saved;
+        if (sent < 0) send_failed(conn, "sendfile");
+        return sent;
+    }
+#endif
+
+    /* Otherwise (and always for TLS, which encrypts in user space) read a
+     * record's worth at a time */
+    if (count > sizeof(buffer)) count = sizeof(buffer);
+    got = pread(fd, buffer, count, offset);
+    if (got <= 0) {
+        if (got < 0) {
+            snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                    "Failed to read request body: %s", strerror(errno));
+        }
+        return got;
+    }
+    return connection_send(conn, buffer, (size_t)got);
 }
 
 ssize_t connection_recv(Connection* conn, void* buffer, size_t buffer_size) {
+    ssize_t received;
+
     if (!conn || conn->socket_fd < 0) return -1;
+    conn->last_error = 0;
     
 #if SSL_SUPPORT
     if (conn->type == CONN_TYPE_SSL && conn->ssl) {
@@ -198,6 +554,12 @@ ssize_t connection_recv(Connection* conn, void* buffer, size_t buffer_size) {
                 /* Clean shutdown */
                 return 0;
             }
+            if (ssl_error == SSL_ERROR_WANT_READ ||
+                ssl_error == SSL_ERROR_WANT_WRITE) {
+                conn->last_error = EAGAIN;
+                conn->want_write = (ssl_error == SSL_ERROR_WANT_WRITE);
+                return -1;
+            }
             snprintf(conn->error_buffer, sizeof(conn->error_buffer),
                     "SSL read error: %d", ssl_error);
             return -1;
@@ -206,7 +568,17 @@ ssize_t connection_recv(Connection* conn, void* buffer, size_t buffer_size) {
     }
 #endif
     
-    return recv(conn->socket_fd, buffer, buffer_size, 0);
+    received = recv(conn->socket_fd, buffer, buffer_size, 0);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn->last_error = EAGAIN;
+            conn->want_write = false;
+        } else {
+            snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                    "Receive failed: %s", strerror(errno));
+        }
+    }
+    return received;
 }
 
 void connection_free(Connection* conn) {
@@ -217,18 +589,17 @@ void connection_free(Connection* conn) {
         SSL_shutdown(conn->ssl);
         SSL_free(conn->ssl);
     }
-    if (conn->ssl_ctx) {
-        SSL_CTX_free(conn->ssl_ctx);
-    }
 #endif
     
     if (conn->socket_fd >= 0) {
         close(conn->socket_fd);
     }
+    race_close(conn);
     
     if (conn->hostname) {
         free(conn->hostname);
     }
+    network_address_list_free(&conn->addresses);
     
     free(conn);
 }
@@ -237,17 +608,71 @@ const char* connection_error(Connection* conn) {
     return conn ? conn->error_buffer : "NULL connection";
 }
 
+bool connection_is_alive(Connection* conn) {
+    char probe;
+    ssize_t peeked;
+
+    if (!conn || conn->socket_fd < 0) return false;
+
+#if SSL_SUPPORT
+    /* Buffered TLS records on an idle connection mean we lost sync */
+    if (conn->ssl && SSL_pending(conn->ssl) > 0) return false;
+#endif
+
+    /* An idle socket must have nothing to read: EOF means the server
+     * closed it, data means a stray response (or a TLS close_notify). */
+    peeked = recv(conn->socket_fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+    return false;
+}
+
+double network_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 /* ======================================================================== */
 /* HTTP Utilities                                                           */
 /* ======================================================================== */
 
-char* http_build_request(const char* method, const char* path,
-                         const char* host, const char* headers,
-                         const char* body, size_t body_length) {
+const char* http_reason_phrase(int status) {
+    switch (status) {
+        case HTTP_CONTINUE: return "Continue";
+        case HTTP_OK: return "OK";
+        case HTTP_CREATED: return "Created";
+        case HTTP_ACCEPTED: return "Accepted";
+        case HTTP_NO_CONTENT: return "No Content";
+        case HTTP_MOVED_PERMANENTLY: return "Moved Permanently";
+        case HTTP_FOUND: return "Found";
+        case HTTP_NOT_MODIFIED: return "Not Modified";
+        case HTTP_BAD_REQUEST: return "Bad Request";
+        case HTTP_UNAUTHORIZED: return "Unauthorized";
+        case HTTP_FORBIDDEN: return "Forbidden";
+        case HTTP_NOT_FOUND: return "Not Found";
+        case HTTP_METHOD_NOT_ALLOWED: return "Method Not Allowed";
+        case 411: return "Length Required";
+        case 413: return "Content Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case HTTP_INTERNAL_SERVER_ERROR: return "Internal Server Error";
+        case HTTP_NOT_IMPLEMENTED: return "Not Implemented";
+        case HTTP_BAD_GATEWAY: return "Bad Gateway";
+        case HTTP_SERVICE_UNAVAILABLE: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "Unknown";
+    }
+}
+
+char* http_build_request_head(const char* method, const char* path,
+                              const char* host, const char* headers,
+                              size_t body_length, bool keep_alive,
+                              size_t* head_length) {
     /* Calculate size needed */
     size_t size = strlen(method) + strlen(path) + strlen(host) + 100;
     if (headers) size += strlen(headers);
-    if (body) size += body_length + 50;
+    if (body_length > 0) size += 50;
     
     char* request = malloc(size);
     if (!request) return NULL;
@@ -255,11 +680,14 @@ char* http_build_request(const char* method, const char* path,
     /* Build request line */
     int offset = snprintf(request, size, "%s %s HTTP/1.1\r\n", method, path);
     
-    /* Add Host header */
-    offset += snprintf(request + offset, size - offset, "Host: %s\r\n", host);
+    /* Add Host header, bracketing IPv6 literals */
+    offset += snprintf(request + offset, size - offset,
+                       strchr(host, ':') ? "Host: [%s]\r\n" : "Host: %s\r\n",
+                       host);
     
     /* Add Connection header */
-    offset += snprintf(request + offset, size - offset, "Connection: close\r\n");
+    offset += snprintf(request + offset, size - offset, "Connection: %s\r\n",
+                       keep_alive ? "keep-alive" : "close");
     
     /* Add user headers */
     if (headers && strlen(headers) > 0) {
@@ -267,7 +695,7 @@ char* http_build_request(const char* method, const char* path,
     }
     
     /* Add Content-Length if body present */
-    if (body && body_length > 0) {
+    if (body_length > 0) {
         offset += snprintf(request + offset, size - offset,
                           "Content-Length: %zu\r\n", body_length);
     }
@@ -275,90 +703,744 @@ char* http_build_request(const char* method, const char* path,
     /* End headers */
     offset += snprintf(request + offset, size - offset, "\r\n");
     
-    /* Add body */
-    if (body && body_length > 0) {
-        memcpy(request + offset, body, body_length);
-        offset += body_length;
-    }
-    
-    request[offset] = '\0';
+    *head_length = (size_t)offset;
     return request;
 }
 
-bool http_parse_status_line(const char* line, int* status_code, char** status_text) {
-    char version[16];
-    int code;
-    char* text_start;
-    
-    /* Parse: HTTP/1.1 200 OK */
-    if (sscanf(line, "%15s %d", version, &code) != 2) {
-        return false;
+/* ======================================================================== */
+/* Request Bodies and Writer                                                */
+/* ======================================================================== */
+
+HttpBody* http_body_from_memory(const void* data, size_t length) {
+    HttpBody* body = malloc(sizeof(HttpBody) + length + 1);
+    if (!body) return NULL;
+
+    body->refs = 1;
+    body->fd = -1;
+    body->offset = 0;
+    body->length = length;
+    if (length > 0) memcpy(body->data, data, length);
+    body->data[length] = '\0';
+    return body;
+}
+
+HttpBody* http_body_from_file(int fd, off_t offset, size_t length) {
+    HttpBody* body = malloc(sizeof(HttpBody) + 1);
+    if (!body) return NULL;
+
+    body->refs = 1;
+    body->fd = fd;
+    body->offset = offset;
+    body->length = length;
+    body->data[0] = '\0';
+    return body;
+}
+
+HttpBody* http_body_retain(HttpBody* body) {
+    if (body) __atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+    return body;
+}
+
+void http_body_release(HttpBody* body) {
+    if (!body || __atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
     }
-    
-    /* Find status text */
-    text_start = strchr(line, ' ');
-    if (text_start) {
-        text_start++; /* Skip first space */
-        text_start = strchr(text_start, ' ');
-        if (text_start) {
-            text_start++; /* Skip second space */
-            
-            /* Remove trailing whitespace */
-            size_t len = strlen(text_start);
-            while (len > 0 && isspace(text_start[len - 1])) {
-                len--;
+    if (body->fd >= 0) close(body->fd);
+    free(body);
+}
+
+void http_writer_init(HttpRequestWriter* writer, char* head, size_t head_length,
+                      HttpBody* body) {
+    writer->head = head;
+    writer->head_length = head_length;
+    writer->body = http_body_retain(body);
+    writer->sent = 0;
+}
+
+int http_writer_send(Connection* conn, HttpRequestWriter* writer) {
+    HttpBody* body = writer->body;
+    size_t body_length = body ? body->length : 0;
+    size_t total = writer->head_length + body_length;
+
+    while (writer->sent < total) {
+        size_t done = writer->sent > writer->head_length
+                      ? writer->sent - writer->head_length : 0;
+        ssize_t n;
+
+        if (writer->sent < writer->head_length) {
+            /* Head plus an in-memory body in one call; a file body is
+             * announced with MSG_MORE so the head isn't sent alone */
+            struct iovec iov[2];
+            int count = 1;
+
+            iov[0].iov_base = writer->head + writer->sent;
+            iov[0].iov_len = writer->head_length - writer->sent;
+            if (body_length > 0 && body->fd < 0) {
+                iov[1].iov_base = body->data;
+                iov[1].iov_len = body_length;
+                count = 2;
             }
-            
-            if (status_text) {
-                *status_text = malloc(len + 1);
-                if (*status_text) {
-                    strncpy(*status_text, text_start, len);
-                    (*status_text)[len] = '\0';
-                }
+            n = connection_sendv(conn, iov, count,
+                                 body_length > 0 && body->fd >= 0);
+        } else if (body->fd >= 0) {
+            n = connection_sendfile(conn, body->fd, body->offset + (off_t)done,
+                                    body_length - done);
+            if (n == 0) {
+                snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                        "Request body file is shorter than its length");
+                return -1;
             }
+        } else {
+            n = connection_send(conn, body->data + done, body_length - done);
         }
+
+        if (n < 0) return connection_would_block(conn) ? 0 : -1;
+        writer->sent += (size_t)n;
     }
-    
-    if (status_code) {
-        *status_code = code;
+    return 1;
+}
+
+/* Queue what is left of an in-memory request on iov */
+static int writer_gather(HttpRequestWriter* writer, struct iovec* iov) {
+    size_t body_length = writer->body ? writer->body->length : 0;
+    int count = 0;
+
+    if (writer->sent < writer->head_length) {
+        iov[count].iov_base = writer->head + writer->sent;
+        iov[count].iov_len = writer->head_length - writer->sent;
+        count++;
     }
-    
-    return true;
+    if (body_length > 0 && writer->sent < writer->head_length + body_length) {
+        size_t done = writer->sent > writer->head_length
+                      ? writer->sent - writer->head_length : 0;
+        iov[count].iov_base = writer->body->data + done;
+        iov[count].iov_len = body_length - done;
+        count++;
+    }
+    return count;
 }
 
-bool http_parse_header(const char* line, char** key, char** value) {
-    const char* colon = strchr(line, ':');
-    if (!colon) return false;
-    
-    /* Extract key */
-    size_t key_len = colon - line;
-    if (key) {
-        *key = malloc(key_len + 1);
-        if (*key) {
-            strncpy(*key, line, key_len);
-            (*key)[key_len] = '\0';
+ssize_t http_writer_send_many(Connection* conn, HttpRequestWriter* const* writers,
+                              size_t count) {
+    size_t done = 0;
+
+    while (done < count) {
+        struct iovec iov[SEND_IOV_MAX];
+        int parts = 0;
+        size_t i;
+        ssize_t n;
+
+        /* File bodies go out on their own with sendfile */
+        if (writers[done]->body && writers[done]->body->fd >= 0) {
+            int result = http_writer_send(conn, writers[done]);
+            if (result <= 0) return result < 0 ? -1 : (ssize_t)done;
+            done++;
+            continue;
+        }
+
+        for (i = done; i < count && parts + 2 <= SEND_IOV_MAX; i++) {
+            HttpRequestWriter* writer = writers[i];
+            if (writer->body && writer->body->fd >= 0) break;
+            parts += writer_gather(writer, iov + parts);
+        }
+
+        n = parts > 0 ? connection_sendv(conn, iov, parts, false) : 0;
+        if (n < 0) return connection_would_block(conn) ? (ssize_t)done : -1;
+
+        /* Credit the bytes written to each request in turn */
+        while (done < count) {
+            HttpRequestWriter* writer = writers[done];
+            size_t left = writer->head_length + (writer->body ? writer->body->length : 0)
+                          - writer->sent;
+
+            if ((size_t)n < left) {
+                writer->sent += (size_t)n;
+                break;
+            }
+            writer->sent += left;
+            n -= (ssize_t)left;
+            done++;
         }
     }
-    
-    /* Extract value (skip colon and whitespace) */
-    const char* val_start = colon + 1;
-    while (*val_start && isspace(*val_start)) {
-        val_start++;
+    return (ssize_t)done;
+}
+
+void http_writer_rewind(HttpRequestWriter* writer) {
+    writer->sent = 0;
+}
+
+void http_writer_free(HttpRequestWriter* writer) {
+    free(writer->head);
+    http_body_release(writer->body);
+    writer->head = NULL;
+    writer->body = NULL;
+}
+
+bool http_exchange_copy(const HttpExchange* from, HttpExchange* to) {
+    char* head = malloc(from->writer.head_length);
+
+    *to = *from;
+    to->hostname = strdup(from->hostname);
+    if (head) memcpy(head, from->writer.head, from->writer.head_length);
+    http_writer_init(&to->writer, head, from->writer.head_length,
+                     from->writer.body);
+    if (!to->hostname || !head) {
+        free(to->hostname);
+        http_writer_free(&to->writer);
+        return false;
     }
-    
-    /* Remove trailing whitespace */
-    size_t val_len = strlen(val_start);
-    while (val_len > 0 && isspace(val_start[val_len - 1])) {
-        val_len--;
+    return true;
+}
+
+static const char* find_crlf(const char* data, const char* end) {
+    const char* p = data;
+    while (p + 1 < end) {
+        p = memchr(p, '\r', (size_t)(end - p - 1));
+        if (!p) return NULL;
+        if (p[1] == '\n') return p;
+        p++;
     }
-    
-    if (value) {
-        *value = malloc(val_len + 1);
-        if (*value) {
-            strncpy(*value, val_start, val_len);
-            (*value)[val_len] = '\0';
+    return NULL;
+}
+
+/* The digits in [p, end) as a size, in base 10 or 16. False if there are
+ * none, anything else is among them, or the value does not fit. */
+static bool parse_size(const char* p, const char* end, int base, size_t* out) {
+    size_t value = 0;
+
+    if (p == end) return false;
+    for (; p < end; p++) {
+        size_t digit;
+
+        if (*p >= '0' && *p <= '9') digit = (size_t)(*p - '0');
+        else if (base == 16 && *p >= 'a' && *p <= 'f') digit = (size_t)(*p - 'a' + 10);
+        else if (base == 16 && *p >= 'A' && *p <= 'F') digit = (size_t)(*p - 'A' + 10);
+        else return false;
+        if (value > (SIZE_MAX - digit) / (size_t)base) return false;
+        value = value * (size_t)base + digit;
+    }
+    *out = value;
+    return true;
+}
+
+static bool body_reserve(HttpBodyBuffer* w, size_t extra) {
+    size_t needed;
+    size_t capacity;
+    char* grown;
+
+    if (extra > SIZE_MAX - 1 - w->length) return false;
+    needed = w->length + extra + 1;
+    if (needed <= w->capacity) return true;
+    capacity = w->capacity ? w->capacity : 4096;
+    while (capacity < needed) {
+        if (capacity > SIZE_MAX / 2) {
+            capacity = needed;
+            break;
         }
+        capacity *= 2;
     }
-    
+
+    grown = realloc(w->data, capacity);
+    if (!grown) return false;
+    w->data = grown;
+    w->capacity = capacity;
+    return true;
+}
+
+static bool body_write(HttpBodyBuffer* w, const char* data, size_t length) {
+    if (length == 0) return true;
+    if (w->sink) {
+        if (!w->sink(data, length, w->context)) {
+            w->aborted = true;
+            return false;
+        }
+        w->length += length;
+        return true;
+    }
+    if (!body_reserve(w, length)) return false;
+    memcpy(w->data + w->length, data, length);
+    w->length += length;
+    w->data[w->length] = '\0';
     return true;
-}
\ No newline at end of file
+}
+
+/* A sized body is reserved up front only up to HTTP_MAX_RESERVE; past
+ * that it grows as the bytes arrive, so a bogus Content-Length costs
+ * nothing until the peer actually sends that much */
+enum {
+    HTTP_RECV_CHUNK = 16384,
+    HTTP_MAX_HEAD = 1024 * 1024,
+    HTTP_MAX_RESERVE = 8 * 1024 * 1024
+};
+
+void http_reader_init(HttpResponseReader* reader, bool no_body,
+                      HttpBodySink sink, void* context) {
+    memset(reader, 0, sizeof(*reader));
+    reader->state = HTTP_READ_HEAD;
+    http_head_init(&reader->head);
+    reader->no_body = no_body;
+    reader->body.sink = sink;
+    reader->body.context = context;
+}
+
+char* http_reader_space(HttpResponseReader* reader, size_t* space) {
+    HttpBodyBuffer* body = &reader->body;
+
+    /* Nothing buffered, no sink and nothing to decode: receive straight
+     * into the body */
+    reader->direct = !body->sink && reader->pos == reader->used &&
+                     (reader->state == HTTP_READ_SIZED ||
+                      reader->state == HTTP_READ_UNTIL_CLOSE);
+#if ZLIB_SUPPORT
+    if (reader->inflater) reader->direct = false;
+#endif
+    if (reader->direct) {
+        if (reader->state == HTTP_READ_SIZED) {
+            /* Usually reserved in full when the head was parsed; never
+             * receive past the body into a pipelined response */
+            if (!body_reserve(body, reader->remaining < HTTP_RECV_CHUNK
+                                    ? reader->remaining : HTTP_RECV_CHUNK)) {
+                return NULL;
+            }
+            *space = body->capacity - body->length - 1;
+            if (*space > reader->remaining) *space = reader->remaining;
+        } else {
+            if (!body_reserve(body, HTTP_RECV_CHUNK)) return NULL;
+            *space = body->capacity - body->length - 1;
+        }
+        return body->data + body->length;
+    }
+
+    /* Reclaim consumed framing bytes before growing */
+    if (reader->pos > reader->base) {
+        memmove(reader->buffer + reader->base, reader->buffer + reader->pos,
+                reader->used - reader->pos);
+        reader->used -= reader->pos - reader->base;
+        reader->pos = reader->base;
+    }
+    if (reader->capacity - reader->used < HTTP_RECV_CHUNK) {
+        size_t capacity = reader->capacity ? reader->capacity * 2
+                                           : HTTP_RECV_CHUNK;
+        char* grown = realloc(reader->buffer, capacity + 1);
+        if (!grown) return NULL;
+        reader->buffer = grown;
+        reader->capacity = capacity;
+    }
+    *space = reader->capacity - reader->used;
+    return reader->buffer + reader->used;
+}
+
+static int reader_fail(HttpResponseReader* reader, const char* error) {
+    reader->state = HTTP_READ_FAILED;
+    reader->keep_alive = false;
+    reader->error = error;
+    return -1;
+}
+
+#if ZLIB_SUPPORT
+/* Start decoding a gzip or deflate body. Other codings (and stacked ones)
+ * are left as they are for the caller to deal with. */
+static int reader_inflate_start(HttpResponseReader* reader, const char* encoding) {
+    bool gzip;
+    z_stream* z;
+
+    if (!encoding) return 0;
+    if (strcasecmp(encoding, "gzip") == 0 || strcasecmp(encoding, "x-gzip") == 0) {
+        gzip = true;
+    } else if (strcasecmp(encoding, "deflate") == 0) {
+        gzip = false;
+    } else {
+        return 0;
+    }
+
+    z = calloc(1, sizeof(z_stream));
+    if (!z) return reader_fail(reader, "Out of memory");
+    /* 16 + MAX_WBITS reads the gzip wrapper, MAX_WBITS the zlib one */
+    if (inflateInit2(z, gzip ? 16 + MAX_WBITS : MAX_WBITS) != Z_OK) {
+        free(z);
+        return reader_fail(reader, "Out of memory");
+    }
+    reader->inflater = z;
+    reader->inflate_gzip = gzip;
+    reader->inflate_probe = !gzip;
+    return 0;
+}
+
+static void reader_inflate_end(HttpResponseReader* reader) {
+    if (!reader->inflater) return;
+    inflateEnd(reader->inflater);
+    free(reader->inflater);
+    reader->inflater = NULL;
+}
+
+/* Decode length framed body bytes into the body buffer or sink */
+static int reader_inflate(HttpResponseReader* reader, const char* data,
+                          size_t length) {
+    z_stream* z = reader->inflater;
+    char out[HTTP_RECV_CHUNK];
+
+    if (length == 0) return 0;
+
+    if (reader->inflate_probe) {
+        /* "deflate" should be zlib-wrapped (RFC 7230 section 4.2.2), but
+         * some servers send a raw stream; a zlib header names method 8 */
+        reader->inflate_probe = false;
+        if ((data[0] & 0x0f) != 8) inflateReset2(z, -MAX_WBITS);
+    }
+    if (reader->inflate_ended) {
+        /* Another gzip member may follow; anything else is padding */
+        if (!reader->inflate_gzip || (unsigned char)data[0] != 0x1f) return 0;
+        inflateReset(z);
+        reader->inflate_ended = false;
+    }
+
+    z->next_in = (Bytef*)data;
+    z->avail_in = (uInt)length;
+    for (;;) {
+        int status;
+        size_t produced;
+
+        z->next_out = (Bytef*)out;
+        z->avail_out = sizeof(out);
+        status = inflate(z, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            return reader_fail(reader, "Malformed compressed body");
+        }
+
+        produced = sizeof(out) - z->avail_out;
+        if (!body_write(&reader->body, out, produced)) {
+            return reader_fail(reader, reader->body.aborted ?
+                               "Body handler aborted the transfer" : "Out of memory");
+        }
+
+        if (status == Z_STREAM_END) {
+            if (z->avail_in == 0 || !reader->inflate_gzip ||
+                *z->next_in != 0x1f) {
+                reader->inflate_ended = true;
+                return 0;
+            }
+            inflateReset(z);
+            continue;
+        }
+        if (status == Z_BUF_ERROR || (z->avail_in == 0 && z->avail_out > 0)) {
+            return 0;
+        }
+    }
+}
+#endif
+
+static int reader_body(HttpResponseReader* reader, size_t length) {
+#if ZLIB_SUPPORT
+    if (reader->inflater) {
+        if (reader_inflate(reader, reader->buffer + reader->pos, length) < 0) {
+            return -1;
+        }
+        reader->pos += length;
+        return 0;
+    }
+#endif
+    if (body_write(&reader->body, reader->buffer + reader->pos, length)) {
+        reader->pos += length;
+        return 0;
+    }
+    return reader_fail(reader, reader->body.aborted ?
+                       "Body handler aborted the transfer" : "Out of memory");
+}
+
+/* Parse what has arrived of the head; once it is complete, pick the
+ * body framing from its headers */
+static int reader_head(HttpResponseReader* reader) {
+    HttpHead* head = &reader->head;
+    const char* length;
+    const char* encoding;
+    const char* connection;
+    int result = http_head_parse(head, reader->buffer, reader->used);
+
+    if (result < 0) return reader_fail(reader, "Malformed response head");
+    if (result == 0) {
+        if (reader->used > HTTP_MAX_HEAD) {
+            return reader_fail(reader, "Response headers too large");
+        }
+        return 0;
+    }
+
+    reader->head_length = head->length;
+    reader->base = reader->pos = head->length;
+    reader->status = head->status;
+
+    /* HTTP/1.1 connections persist unless told otherwise, 1.0 the reverse */
+    connection = http_head_find(head, reader->buffer, "connection");
+    reader->keep_alive = head->minor_version >= 1;
+    if (http_head_has_token(connection, "close")) reader->keep_alive = false;
+    else if (http_head_has_token(connection, "keep-alive")) reader->keep_alive = true;
+
+    encoding = http_head_find(head, reader->buffer, "transfer-encoding");
+    length = http_head_find(head, reader->buffer, "content-length");
+
+    if (reader->no_body || (head->status >= 100 && head->status < 200) ||
+        head->status == 204 || head->status == 304) {
+        reader->state = HTTP_READ_DONE;
+    } else if (encoding && http_head_has_token(encoding, "chunked")) {
+        reader->state = HTTP_READ_CHUNK_SIZE;
+    } else if (length) {
+        if (!parse_size(length, length + strlen(length), 10, &reader->remaining)) {
+            return reader_fail(reader, "Malformed Content-Length");
+        }
+        reader->state = reader->remaining ? HTTP_READ_SIZED : HTTP_READ_DONE;
+    } else {
+        /* Body runs until the server closes the connection */
+        reader->keep_alive = false;
+        reader->state = HTTP_READ_UNTIL_CLOSE;
+    }
+
+#if ZLIB_SUPPORT
+    if (reader->state != HTTP_READ_DONE &&
+        reader_inflate_start(reader, http_head_find(head, reader->buffer,
+                                                    "content-encoding")) < 0) {
+        return -1;
+    }
+    if (reader->inflater) return 0;
+#endif
+
+    /* Size the body once, unless the peer claims more than is sane to
+     * reserve before any of it arrives */
+    if (reader->state == HTTP_READ_SIZED && !reader->body.sink &&
+        !body_reserve(&reader->body, reader->remaining < HTTP_MAX_RESERVE
+                                     ? reader->remaining : HTTP_MAX_RESERVE)) {
+        return reader_fail(reader, "Out of memory");
+    }
+    return 0;
+}
+
+/* Consume as much of the buffered bytes as the current state allows */
+static int reader_process(HttpResponseReader* reader) {
+    for (;;) {
+        size_t available = reader->used - reader->pos;
+        const char* cursor = reader->buffer + reader->pos;
+        const char* eol;
+        const char* size_end;
+        size_t take;
+
+        switch (reader->state) {
+            case HTTP_READ_HEAD:
+                if (reader_head(reader) < 0) return -1;
+                if (reader->state == HTTP_READ_HEAD) return 0;
+                break;
+
+            case HTTP_READ_SIZED:
+            case HTTP_READ_CHUNK_DATA:
+                take = available < reader->remaining ? available
+                                                     : reader->remaining;
+                if (reader_body(reader, take) < 0) return -1;
+                reader->remaining -= take;
+                if (reader->remaining > 0) return 0;
+                reader->state = reader->state == HTTP_READ_SIZED ?
+                                HTTP_READ_DONE : HTTP_READ_CHUNK_END;
+                break;
+
+            case HTTP_READ_UNTIL_CLOSE:
+                return reader_body(reader, available);
+
+            case HTTP_READ_CHUNK_SIZE:
+                eol = find_crlf(cursor, reader->buffer + reader->used);
+                if (!eol) {
+                    if (available > HTTP_MAX_HEAD) {
+                        return reader_fail(reader, "Malformed chunk size");
+                    }
+                    return 0;
+                }
+                /* Hex digits, then optional whitespace and ;extensions */
+                size_end = memchr(cursor, ';', (size_t)(eol - cursor));
+                if (!size_end) size_end = eol;
+                while (size_end > cursor && (size_end[-1] == ' ' || size_end[-1] == '\t')) {
+                    size_end--;
+                }
+                if (!parse_size(cursor, size_end, 16, &reader->remaining)) {
+                    return reader_fail(reader, "Malformed chunk size");
+                }
+                reader->pos = (size_t)(eol - reader->buffer) + 2;
+                reader->state = reader->remaining ? HTTP_READ_CHUNK_DATA
+                                                  : HTTP_READ_TRAILERS;
+                break;
+
+            case HTTP_READ_CHUNK_END:
+                if (available < 2) return 0;
+                if (cursor[0] != '\r' || cursor[1] != '\n') {
+                    return reader_fail(reader, "Missing CRLF after chunk");
+                }
+                reader->pos += 2;
+                reader->state = HTTP_READ_CHUNK_SIZE;
+                break;
+
+            case HTTP_READ_TRAILERS:
+                /* Optional trailers end with an empty line */
+                eol = find_crlf(cursor, reader->buffer + reader->used);
+                if (!eol) return 0;
+                reader->pos = (size_t)(eol - reader->buffer) + 2;
+                if (eol == cursor) reader->state = HTTP_READ_DONE;
+                break;
+
+            case HTTP_READ_DONE:
+                /* Anything past the message means we lost track of the
+                 * stream, unless it is the next pipelined response */
+                if (reader->pos != reader->used && !reader->pipelined) {
+                    reader->keep_alive = false;
+                }
+                return 1;
+
+            case HTTP_READ_FAILED:
+                return -1;
+        }
+    }
+}
+
+int http_reader_received(HttpResponseReader* reader, size_t length) {
+    HttpBodyBuffer* body = &reader->body;
+
+    if (reader->bytes_received == 0) reader->first_byte = network_now();
+    reader->bytes_received += length;
+
+    if (reader->direct) {
+        body->length += length;
+        body->data[body->length] = '\0';
+        if (reader->state == HTTP_READ_UNTIL_CLOSE) return 0;
+        reader->remaining -= length;
+        if (reader->remaining > 0) return 0;
+        reader->state = HTTP_READ_DONE;
+        return 1;
+    }
+
+    reader->used += length;
+    reader->buffer[reader->used] = '\0';
+    return reader_process(reader);
+}
+
+int http_reader_eof(HttpResponseReader* reader) {
+    switch (reader->state) {
+        case HTTP_READ_UNTIL_CLOSE:
+            reader->state = HTTP_READ_DONE;
+            /* fall through */
+        case HTTP_READ_DONE:
+            reader->keep_alive = false;
+            return 1;
+        case HTTP_READ_FAILED:
+            return -1;
+        default:
+            return reader_fail(reader, reader->bytes_received == 0 ?
+                               "Connection closed before response" :
+                               "Connection closed mid-response");
+    }
+}
+
+size_t http_reader_excess(HttpResponseReader* reader, const char** data) {
+    if (reader->state != HTTP_READ_DONE || !reader->buffer) {
+        *data = NULL;
+        return 0;
+    }
+    *data = reader->buffer + reader->pos;
+    return reader->used - reader->pos;
+}
+
+int http_reader_feed(HttpResponseReader* reader, const char* data, size_t length) {
+    size_t capacity = reader->capacity ? reader->capacity : HTTP_RECV_CHUNK;
+    char* grown;
+
+    if (length == 0) return 0;
+    while (capacity - reader->used < length) capacity *= 2;
+    if (capacity != reader->capacity || !reader->buffer) {
+        grown = realloc(reader->buffer, capacity + 1);
+        if (!grown) return reader_fail(reader, "Out of memory");
+        reader->buffer = grown;
+        reader->capacity = capacity;
+    }
+    memcpy(reader->buffer + reader->used, data, length);
+    if (reader->bytes_received == 0) reader->first_byte = network_now();
+    reader->bytes_received += length;
+    reader->used += length;
+    reader->buffer[reader->used] = '\0';
+    return reader_process(reader);
+}
+
+void http_reader_finish(HttpResponseReader* reader, HttpResponseData* out) {
+    memset(out, 0, sizeof(*out));
+    out->bytes_received = reader->bytes_received;
+    out->first_byte = reader->first_byte;
+    out->keep_alive = reader->state == HTTP_READ_DONE && reader->keep_alive;
+
+    /* The head keeps the receive buffer; trim it to the head alone */
+    if (reader->head_length > 0) {
+        reader->buffer[reader->head_length] = '\0';
+        out->head = reader->buffer;
+        out->head_length = reader->head_length;
+        out->fields = reader->head;
+        out->body = reader->body.data;
+        out->body_length = reader->body.length;
+    } else {
+        free(reader->buffer);
+        free(reader->body.data);
+        http_head_free(&reader->head);
+    }
+    reader->buffer = NULL;
+    reader->body.data = NULL;
+    http_head_init(&reader->head);
+#if ZLIB_SUPPORT
+    reader_inflate_end(reader);
+#endif
+}
+
+void http_reader_free(HttpResponseReader* reader) {
+    if (!reader) return;
+    free(reader->buffer);
+    free(reader->body.data);
+    http_head_free(&reader->head);
+#if ZLIB_SUPPORT
+    reader_inflate_end(reader);
+#endif
+    reader->buffer = NULL;
+    reader->body.data = NULL;
+}
+
+bool http_read_response(Connection* conn, bool no_body, HttpBodySink sink,
+                        void* context, HttpResponseData* out) {
+    HttpResponseReader reader;
+    int result = 0;
+
+    http_reader_init(&reader, no_body, sink, context);
+    conn->error_buffer[0] = '\0';
+
+    while (result == 0) {
+        size_t space;
+        char* into = http_reader_space(&reader, &space);
+        ssize_t n;
+
+        if (!into) {
+            result = reader_fail(&reader, "Out of memory");
+            break;
+        }
+        n = connection_recv(conn, into, space);
+        if (n > 0) {
+            result = http_reader_received(&reader, (size_t)n);
+        } else if (n == 0) {
+            result = http_reader_eof(&reader);
+        } else {
+            result = reader_fail(&reader, connection_would_block(conn) ?
+                                 "Timed out waiting for response" :
+                                 "Connection closed mid-response");
+        }
+    }
+
+    if (result < 0 && (reader.body.aborted || conn->error_buffer[0] == '\0')) {
+        snprintf(conn->error_buffer, sizeof(conn->error_buffer), "%s",
+                 reader.error);
+    }
+    http_reader_finish(&reader, out);
+    return result > 0;
+}
+
+void http_response_data_free(HttpResponseData* data) {
+    if (!data) return;
+    free(data->head);
+    free(data->body);
+    http_head_free(&data->fields);
+    memset(data, 0, sizeof(*data));
+}
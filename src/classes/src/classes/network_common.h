@@ -22,6 +22,7 @@
     #include <unistd.h>
     #include <fcntl.h>
     #include <sys/select.h>
+    #include <sys/uio.h>
 #endif
 
 /* SSL Support - can be disabled at compile time */
@@ -34,10 +35,70 @@
     #define SSL_SUPPORT 0
 #endif
 
+/* Content-Encoding decoding - can be disabled at compile time */
+#ifndef NO_ZLIB_SUPPORT
+    #include <zlib.h>
+    #define ZLIB_SUPPORT 1
+#else
+    #define ZLIB_SUPPORT 0
+#endif
+
+/* ======================================================================== */
+/* DNS Resolution (see network_resolve.c)                                   */
+/* ======================================================================== */
+
+typedef struct NetworkAddress {
+    struct sockaddr_storage addr;
+    socklen_t length;
+} NetworkAddress;
+
+typedef struct NetworkAddressList {
+    NetworkAddress* items;  /* In connect order, families interleaved */
+    size_t count;
+} NetworkAddressList;
+
+/* Receives a resolved list (ownership passes to the callback) or an error.
+ * May run on a resolver thread. */
+typedef void (*NetworkResolveCallback)(NetworkAddressList* addresses,
+                                       const char* error, void* context);
+
+/**
+ * Resolve hostname with port applied, serving from the cache when
+ * possible. Blocks only on a cache miss.
+ */
+bool network_resolve(const char* hostname, int port, NetworkAddressList* out,
+                     char* error, size_t error_size);
+
+/**
+ * Cache-only lookup. Returns 1 on a hit, -1 for a cached failure (error is
+ * filled in) and 0 on a miss.
+ */
+int network_resolve_cached(const char* hostname, int port,
+                           NetworkAddressList* out, char* error,
+                           size_t error_size);
+
+/**
+ * Resolve on the resolver threads. On a cache hit the callback runs before
+ * this returns. Returns false if the lookup could not be started.
+ */
+bool network_resolve_async(const char* hostname, int port,
+                           NetworkResolveCallback callback, void* context);
+
+void network_address_list_free(NetworkAddressList* list);
+
+/**
+ * Head start, in milliseconds, each address gets before the next one is
+ * tried in parallel
+ */
+int network_resolver_happy_eyeballs_delay(void);
+
 /* ======================================================================== */
 /* Connection Abstraction                                                   */
 /* ======================================================================== */
 
+/* Most connect attempts a happy-eyeballs race keeps in flight at once */
+#define CONNECT_MAX_RACE 4
+
 typedef enum {
     CONN_TYPE_PLAIN,
     CONN_TYPE_SSL
@@ -48,18 +109,45 @@ typedef struct Connection {
     int socket_fd;
     
 #if SSL_SUPPORT
-    SSL_CTX* ssl_ctx;
-    SSL* ssl;
+    SSL* ssl;               /* From the shared context (network_tls.c) */
 #endif
     
     /* Connection info */
     char* hostname;
     int port;
     int timeout_seconds;
+    NetworkAddressList addresses;   /* Resolved lazily, tried in order */
+    size_t next_address;
+
+    /* Connect attempts in flight while racing addresses */
+    int race_fds[CONNECT_MAX_RACE];
+    int race_count;
+    double race_next;               /* When the next address may join */
     
     /* Error handling */
     char error_buffer[256];
-    int last_error;
+    int last_error;         /* EAGAIN when a non-blocking call would block */
+    bool want_write;        /* Direction a blocked call is waiting for */
+
+    /* Keep-alive pool bookkeeping (see network_pool.c) */
+    struct Connection* pool_next;
+    double idle_since;
+    unsigned int requests_served;
+    bool reused;
+    bool persistent;        /* Has answered with HTTP/1.1 keep-alive, so
+                             * requests may be pipelined on it */
+
+    /* HTTP/2: offered through ALPN on TLS, assumed on plain connections */
+    bool offer_h2;
+    bool h2;                /* Set by the handshake when it was chosen */
+
+    /* When each setup phase ran, for the first request's NetworkTiming */
+    double dns_start;
+    double dns_end;
+    double connect_start;
+    double connect_end;
+    double tls_start;
+    double tls_end;
 } Connection;
 
 /* ======================================================================== */
@@ -76,21 +164,105 @@ void network_init_ssl(void);
  */
 void network_cleanup_ssl(void);
 
+#if SSL_SUPPORT
+/* ======================================================================== */
+/* Shared TLS Context (see network_tls.c)                                   */
+/* ======================================================================== */
+
+/**
+ * Create the shared client context if needed; false if OpenSSL cannot
+ */
+bool network_tls_available(void);
+
+/**
+ * Give the connection an SSL on its socket from the shared context, with
+ * SNI set and a cached session for the host offered for resumption
+ */
+bool network_tls_attach(Connection* conn);
+
+/**
+ * Record a completed handshake (full or resumed) in the TLS stats, and
+ * whether ALPN chose h2
+ */
+void network_tls_handshake_done(Connection* conn);
+
+/**
+ * Free the shared context and every cached session
+ */
+void network_tls_cleanup(void);
+#endif
+
 /**
  * Create a new connection
  */
 Connection* connection_create(const char* hostname, int port, bool use_ssl);
 
 /**
- * Connect to the server
+ * Connect to the server, racing its addresses happy-eyeballs style when
+ * it has more than one
  */
 bool connection_connect(Connection* conn);
 
+/**
+ * Hand the connection a resolved address list (ownership is taken), so a
+ * later connect does not have to resolve
+ */
+void connection_set_addresses(Connection* conn, NetworkAddressList* addresses);
+
+/**
+ * Start a non-blocking connect. Returns 1 when connected immediately,
+ * 0 while attempts are in progress (wait for any of race_fds to become
+ * writable, or until race_next), -1 on error.
+ */
+int connection_connect_start(Connection* conn);
+
+/**
+ * Advance a non-blocking connect: collect finished attempts and, once the
+ * newest attempt's head start has passed, start the next address beside
+ * it. Returns 1 when one attempt has won (it becomes socket_fd), 0 while
+ * still racing, -1 once every address has failed.
+ */
+int connection_connect_step(Connection* conn);
+
+/**
+ * Advance the TLS handshake on a non-blocking connection. Returns 1 when
+ * done (always for plain connections), 0 when it must wait for the
+ * direction in conn->want_write, -1 on error.
+ */
+int connection_handshake(Connection* conn);
+
+/**
+ * Switch between blocking (with timeout_seconds socket timeouts) and
+ * non-blocking mode
+ */
+void connection_set_blocking(Connection* conn, bool blocking);
+
+/**
+ * True when the last send/recv failed only because it would block
+ */
+bool connection_would_block(Connection* conn);
+
 /**
  * Send data over the connection
  */
 ssize_t connection_send(Connection* conn, const void* data, size_t length);
 
+/**
+ * Gather-send several buffers with one call. more hints that further data
+ * follows at once (MSG_MORE), so a short head is not sent on its own.
+ * Returns bytes written, which may stop part way through the vector.
+ */
+ssize_t connection_sendv(Connection* conn, const struct iovec* iov, int count,
+                         bool more);
+
+/**
+ * Send up to count bytes of fd starting at offset, without copying them
+ * through user space where the platform allows (sendfile). Returns bytes
+ * written, 0 if the file ended early.
+ */
+ssize_t connection_sendfile(Connection* conn, int fd, off_t offset,
+                            size_t count);
+
 /**
  * Receive data from the connection
  */
@@ -106,25 +278,824 @@ void connection_free(Connection* conn);
  */
 const char* connection_error(Connection* conn);
 
+/**
+ * Check that an idle connection has not been closed or sent stray data
+ */
+bool connection_is_alive(Connection* conn);
+
+/**
+ * Monotonic clock in seconds
+ */
+double network_now(void);
+
+/* ======================================================================== */
+/* Connection Pool                                                          */
+/* ======================================================================== */
+
+/**
+ * Get a connected connection for the origin, reusing an idle keep-alive
+ * connection when a healthy one is parked. Waits up to timeout_seconds
+ * when the per-host limit is reached. Returns NULL and fills error on
+ * failure.
+ */
+Connection* connection_pool_acquire(const char* hostname, int port,
+                                    bool use_ssl, int timeout_seconds,
+                                    char* error, size_t error_size);
+
+/**
+ * Return a connection to the pool. It is parked for reuse when keep_alive
+ * is true and the pool has room for it, otherwise it is closed.
+ */
+void connection_pool_release(Connection* conn, bool keep_alive);
+
+/**
+ * Non-blocking counterparts for the event loop: take a healthy idle
+ * connection if one is parked, or reserve a slot under the per-host limit
+ * for a connection the caller will open itself. unreserve gives back a
+ * slot whose connection was never created.
+ */
+Connection* connection_pool_take_idle(const char* hostname, int port,
+                                      bool use_ssl);
+bool connection_pool_reserve(const char* hostname, int port, bool use_ssl);
+void connection_pool_unreserve(const char* hostname, int port, bool use_ssl);
+
 /* ======================================================================== */
 /* HTTP Utilities                                                           */
 /* ======================================================================== */
 
 /**
- * Build HTTP request headers
+ * Request body shared by a NetworkRequest and every exchange sending it,
+ * so queuing a request never copies the body. Either bytes in memory or a
+ * range of an open file. Reference counted; safe to release from any
+ * thread.
+ */
+typedef struct HttpBody {
+    int refs;
+    int fd;                 /* File-backed when >= 0, closed with the body */
+    off_t offset;           /* Start of the range within the file */
+    size_t length;
+    char data[];            /* In-memory bytes, NUL terminated */
+} HttpBody;
+
+/** Copy length bytes into a new body */
+HttpBody* http_body_from_memory(const void* data, size_t length);
+
+/** Body backed by length bytes of fd from offset; takes ownership of fd */
+HttpBody* http_body_from_file(int fd, off_t offset, size_t length);
+
+HttpBody* http_body_retain(HttpBody* body);
+void http_body_release(HttpBody* body);
+
+/** Standard reason phrase for status, or "Unknown" */
+const char* http_reason_phrase(int status);
+
+/**
+ * Build the request line and headers, up to and including the blank line.
+ * The body is not included; send it after the head with an
+ * HttpRequestWriter.
+ */
+char* http_build_request_head(const char* method, const char* path,
+                              const char* host, const char* headers,
+                              size_t body_length, bool keep_alive,
+                              size_t* head_length);
+
+/* Writes a request head and its body without joining them in one buffer:
+ * the head and an in-memory body go out in one sendmsg, file bodies with
+ * sendfile. Resumable, so the event loop can drive it on a non-blocking
+ * socket. */
+typedef struct HttpRequestWriter {
+    char* head;             /* Owned */
+    size_t head_length;
+    HttpBody* body;         /* Retained, or NULL */
+    size_t sent;            /* Bytes of head and body written so far */
+} HttpRequestWriter;
+
+/**
+ * Takes ownership of head and a reference to body (which may be NULL)
+ */
+void http_writer_init(HttpRequestWriter* writer, char* head, size_t head_length,
+                      HttpBody* body);
+
+/**
+ * Write as much as the socket accepts. Returns 1 once everything is sent,
+ * 0 if it would block (see connection_would_block), -1 on error.
+ */
+int http_writer_send(Connection* conn, HttpRequestWriter* writer);
+
+/**
+ * Write several requests back to back, gathering in-memory heads and
+ * bodies into one sendmsg. Returns how many of the writers are now fully
+ * sent (fewer than count if the socket would block), -1 on error.
+ */
+ssize_t http_writer_send_many(Connection* conn, HttpRequestWriter* const* writers,
+                              size_t count);
+
+/** Start over, for a retry on another connection */
+void http_writer_rewind(HttpRequestWriter* writer);
+
+void http_writer_free(HttpRequestWriter* writer);
+
+/* ======================================================================== */
+/* Header Names and Tables (see network_headers.c)                          */
+/* ======================================================================== */
+
+/* FNV-1a over the lowercased name, the hash every header lookup compares */
+#define HTTP_HEADER_FNV_OFFSET 2166136261u
+#define HTTP_HEADER_FNV_PRIME 16777619u
+
+/* Header names common enough to be looked up by number */
+typedef enum HttpHeaderId {
+    HTTP_HEADER_OTHER = 0,
+    HTTP_HEADER_ACCEPT,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_ACCEPT_LANGUAGE,
+    HTTP_HEADER_AGE,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_ENCODING,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_COOKIE,
+    HTTP_HEADER_DATE,
+    HTTP_HEADER_ETAG,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_EXPIRES,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_KEEP_ALIVE,
+    HTTP_HEADER_LAST_MODIFIED,
+    HTTP_HEADER_LOCATION,
+    HTTP_HEADER_PROXY_AUTHORIZATION,
+    HTTP_HEADER_RETRY_AFTER,
+    HTTP_HEADER_SERVER,
+    HTTP_HEADER_SET_COOKIE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_VARY,
+    HTTP_HEADER_WWW_AUTHENTICATE,
+    HTTP_HEADER_COUNT
+} HttpHeaderId;
+
+/* A set of common headers, for leaving them out of a head */
+#define HTTP_HEADER_BIT(id) (1ULL << (id))
+
+/** Case-folded hash of name[0..length) */
+unsigned int http_header_hash(const char* name, size_t length);
+
+/** The ID of name[0..length) (any case) given its hash, or HTTP_HEADER_OTHER */
+HttpHeaderId http_header_id(const char* name, size_t length, unsigned int hash);
+
+/* One header a request sends; name keeps the case it was set with */
+typedef struct HttpHeaderEntry {
+    char* name;
+    char* value;
+    size_t name_length;
+    size_t value_length;
+    unsigned int hash;
+    HttpHeaderId id;
+} HttpHeaderEntry;
+
+/**
+ * Headers to send, in the order they were first set, at most one per name
+ * (any case). Common names are found through first[] without a scan;
+ * others compare the hash before any bytes. text_length is kept as
+ * entries change, so a head is formatted into one exact allocation.
+ */
+typedef struct HttpHeaderTable {
+    HttpHeaderEntry* entries;
+    size_t count;
+    size_t capacity;
+    size_t text_length;         /* All entries as "Name: value\r\n" lines */
+    unsigned short first[HTTP_HEADER_COUNT];   /* Position + 1, or 0 */
+} HttpHeaderTable;
+
+void http_headers_init(HttpHeaderTable* table);
+void http_headers_free(HttpHeaderTable* table);
+
+/** The entry called name (any case), or NULL */
+const HttpHeaderEntry* http_headers_find(const HttpHeaderTable* table,
+                                         const char* name);
+
+/** Set name to value, replacing the value of one already set. Returns
+ * false if memory runs out. */
+bool http_headers_set(HttpHeaderTable* table, const char* name,
+                      const char* value);
+
+void http_headers_remove(HttpHeaderTable* table, const char* name);
+
+/**
+ * The entries as header lines, leaving out the common headers in skip,
+ * followed by extra (lines already formatted, may be NULL). NULL when
+ * there is nothing to write or memory runs out.
+ */
+char* http_headers_format(const HttpHeaderTable* table, unsigned long long skip,
+                          const char* extra);
+
+/* ======================================================================== */
+/* HTTP Head Parser (see network_parse.c)                                   */
+/* ======================================================================== */
+
+/* One header line, as offsets into the head buffer. The name has been
+ * lowercased in place and the value NUL terminated in place. */
+typedef struct HttpHeaderField {
+    size_t name;
+    size_t value;
+    size_t name_length;
+    size_t value_length;
+    unsigned int hash;      /* Of the lowercased name */
+    HttpHeaderId id;
+} HttpHeaderField;
+
+/**
+ * Parse state for a message head: a response status line or a request
+ * line, then headers. Feed it the same growing buffer after each receive;
+ * bytes already scanned are skipped.
+ */
+typedef struct HttpHead {
+    int state;
+    size_t offset;          /* Next byte to scan */
+    size_t line;            /* Start of the line being scanned */
+    size_t length;          /* Whole head, blank line included, once done */
+
+    int minor_version;      /* x in HTTP/1.x */
+    int status;
+    size_t reason;          /* Reason phrase offset, NUL terminated */
+    size_t reason_length;
+    size_t method;          /* Request method offset, NUL terminated */
+    size_t method_length;
+    size_t target;          /* Request target offset, NUL terminated */
+    size_t target_length;
+
+    HttpHeaderField* fields;
+    size_t count;
+    size_t capacity;
+    unsigned short first[HTTP_HEADER_COUNT];   /* Position + 1 of each common field */
+} HttpHead;
+
+/** Start a head that opens with a status line (a response) */
+void http_head_init(HttpHead* head);
+
+/** Start a head that opens with a request line */
+void http_head_init_request(HttpHead* head);
+
+/**
+ * Continue parsing buffer[0..length). The buffer may move between calls
+ * (offsets are kept, not pointers) but earlier bytes must not change.
+ * Returns 1 once the blank line ending the head is parsed, 0 if more bytes
+ * are needed, -1 if the head is malformed.
+ */
+int http_head_parse(HttpHead* head, char* buffer, size_t length);
+
+/** Value of the first header called name (any case), or NULL */
+const char* http_head_find(const HttpHead* head, const char* buffer,
+                           const char* name);
+
+/** Whether a comma separated header value lists token (any case) */
+bool http_head_has_token(const char* value, const char* token);
+
+void http_head_free(HttpHead* head);
+
+/* ======================================================================== */
+/* HTTP Response Reading                                                    */
+/* ======================================================================== */
+
+/**
+ * Receives body bytes as they are decoded. Return 0 to abort the transfer.
+ */
+typedef int (*HttpBodySink)(const char* data, size_t length, void* context);
+
+typedef struct HttpResponseData {
+    char* head;             /* Status line and headers, parsed in place */
+    size_t head_length;
+    HttpHead fields;        /* Parse of head */
+    char* body;             /* Decoded body, NUL terminated, NULL if streamed */
+    size_t body_length;     /* Bytes in body, or bytes handed to the sink */
+    size_t bytes_received;  /* Raw bytes read while waiting for the head */
+    double first_byte;      /* When the first of them arrived */
+    bool keep_alive;        /* Connection may carry another request */
+} HttpResponseData;
+
+typedef enum HttpReadState {
+    HTTP_READ_HEAD,
+    HTTP_READ_SIZED,
+    HTTP_READ_CHUNK_SIZE,
+    HTTP_READ_CHUNK_DATA,
+    HTTP_READ_CHUNK_END,
+    HTTP_READ_TRAILERS,
+    HTTP_READ_UNTIL_CLOSE,
+    HTTP_READ_DONE,
+    HTTP_READ_FAILED
+} HttpReadState;
+
+/* Destination for decoded body bytes: a growable buffer that ends up owned
+ * by the response, or the caller's streaming sink */
+typedef struct HttpBodyBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+    HttpBodySink sink;
+    void* context;
+    bool aborted;
+} HttpBodyBuffer;
+
+/**
+ * Resumable response reader. Ask it where to receive with
+ * http_reader_space(), receive into that space, then report the byte
+ * count with http_reader_received(). It works the same whether the bytes
+ * come from a blocking loop or an event loop.
+ */
+typedef struct HttpResponseReader {
+    HttpReadState state;
+    bool no_body;
+    bool direct;            /* Last space handed out was the body buffer */
+
+    char* buffer;           /* Head plus framing bytes */
+    size_t base;            /* Bytes kept at the front (the parsed head) */
+    size_t pos;
+    size_t used;
+    size_t capacity;
+    HttpHead head;          /* Parsed incrementally as bytes arrive */
+
+    HttpBodyBuffer body;
+    size_t remaining;       /* In the sized body or current chunk */
+    size_t head_length;
+    size_t bytes_received;
+    double first_byte;
+    int status;
+    bool keep_alive;
+    bool pipelined;         /* Bytes past the message start the next one */
+    const char* error;
+
+#if ZLIB_SUPPORT
+    /* Decoder for a gzip or deflate Content-Encoding, or NULL. Framed
+     * body bytes pass through it on their way to the body buffer or sink. */
+    z_stream* inflater;
+    bool inflate_gzip;
+    bool inflate_probe;     /* deflate: zlib wrapper or raw, not yet seen */
+    bool inflate_ended;     /* Stream (or gzip member) finished */
+#endif
+} HttpResponseReader;
+
+void http_reader_init(HttpResponseReader* reader, bool no_body,
+                      HttpBodySink sink, void* context);
+
+/**
+ * Where the next receive should go. Returns NULL if out of memory.
+ */
+char* http_reader_space(HttpResponseReader* reader, size_t* space);
+
+/**
+ * Account for length bytes received into the last space. Returns 1 when
+ * the response is complete, 0 when more is needed, -1 on a framing error.
+ */
+int http_reader_received(HttpResponseReader* reader, size_t length);
+
+/**
+ * The peer closed the connection. Returns 1 if that completes the
+ * response (close-delimited body), -1 if the response was cut short.
+ */
+int http_reader_eof(HttpResponseReader* reader);
+
+/**
+ * Bytes received past the end of a complete response, which on a
+ * pipelined connection belong to the next one. Valid until
+ * http_reader_finish().
+ */
+size_t http_reader_excess(HttpResponseReader* reader, const char** data);
+
+/**
+ * Hand a fresh reader bytes that were received by another (its excess).
+ * Returns as http_reader_received().
+ */
+int http_reader_feed(HttpResponseReader* reader, const char* data, size_t length);
+
+/**
+ * Move the head and body buffers into out
+ */
+void http_reader_finish(HttpResponseReader* reader, HttpResponseData* out);
+
+void http_reader_free(HttpResponseReader* reader);
+
+/**
+ * Read one response, honoring Content-Length, chunked encoding and
+ * close-delimited bodies. The body is received into a buffer sized from
+ * Content-Length when known, or handed to sink when one is given. A gzip
+ * or deflate Content-Encoding is decoded as the bytes arrive.
+ * Returns false on a transport error (see connection_error).
+ */
+bool http_read_response(Connection* conn, bool no_body, HttpBodySink sink,
+                        void* context, HttpResponseData* out);
+
+/**
+ * Release buffers owned by an HttpResponseData
+ */
+void http_response_data_free(HttpResponseData* data);
+
+/**
+ * Build a NetworkResponse that takes ownership of the head, its parse and
+ * the body. data is left empty.
+ */
+struct NetworkResponse* network_response_adopt(HttpResponseData* data);
+
+/**
+ * Serialize a response's status line and headers for sending, with
+ * Content-Length and Connection set by the caller's framing rather than
+ * copied from the response. The body is sent separately.
+ */
+char* network_response_head(struct NetworkResponse* response, bool keep_alive,
+                            size_t* head_length);
+
+/* ======================================================================== */
+/* Response Cache (see network_cache.c)                                     */
+/* ======================================================================== */
+
+typedef struct CacheEntry CacheEntry;
+
+/** Whether a cache is configured; lock-free, so requests can skip it cheaply */
+bool network_cache_enabled(void);
+
+/**
+ * The entry for url, referenced for the caller, or NULL if the cache is
+ * off, has none, or has only a stale one that cannot be revalidated.
+ * *fresh says whether it may be served without asking the server, which
+ * is never when revalidate is set.
  */
-char* http_build_request(const char* method, const char* path, 
-                         const char* host, const char* headers,
-                         const char* body, size_t body_length);
+CacheEntry* network_cache_lookup(const char* url, bool revalidate, bool* fresh);
+
+/** Validators for a conditional request; either may be NULL */
+const char* network_cache_etag(const CacheEntry* entry);
+const char* network_cache_last_modified(const CacheEntry* entry);
+
+/** A response served from entry, taking over the caller's reference */
+struct NetworkResponse* network_cache_respond(CacheEntry* entry);
 
 /**
- * Parse HTTP response status line
+ * entry was revalidated by not_modified (a 304): refresh it from those
+ * headers, free the 304 and respond from entry with the 304's timing.
  */
-bool http_parse_status_line(const char* line, int* status_code, char** status_text);
+struct NetworkResponse* network_cache_revalidated(CacheEntry* entry,
+                                                  struct NetworkResponse* not_modified);
+
+void network_cache_release(CacheEntry* entry);
+
+/** Keep a copy of response for url if its headers allow */
+void network_cache_store(const char* url, struct NetworkResponse* response);
+
+/** A clone of the entry's body parsed as JSON, parsed on first use */
+struct Json* network_cache_json(CacheEntry* entry);
 
 /**
- * Parse a single HTTP header
+ * A response whose head is a copy of head and whose body is entry's,
+ * holding a reference to entry (see network_response.c)
  */
-bool http_parse_header(const char* line, char** key, char** value);
+struct NetworkResponse* network_response_cached(const char* head, size_t head_length,
+                                                const char* body, size_t body_length,
+                                                CacheEntry* entry);
+
+/* ======================================================================== */
+/* Event Loop                                                               */
+/* ======================================================================== */
+
+/* Everything the loop needs to perform one request/response exchange */
+typedef struct HttpExchange {
+    char* hostname;
+    int port;
+    bool use_ssl;
+    int timeout_seconds;
+    int deadline_ms;            /* Whole exchange, instead of timeout_seconds */
+    HttpRequestWriter writer;   /* Request to send, owned by the exchange */
+    bool no_body;           /* HEAD request */
+    bool idempotent;        /* Safe to send again after a failure */
+    bool keep_alive;
+    bool http2;             /* Send as an HTTP/2 stream where possible */
+    HttpBodySink sink;
+    void* sink_context;
+} HttpExchange;
+
+/**
+ * Copy an exchange with its own hostname and head; the body is shared.
+ * Returns false, leaving nothing to free, if memory runs out.
+ */
+bool http_exchange_copy(const HttpExchange* from, HttpExchange* to);
+
+/**
+ * Capture a request's target, head, body and body handler as an exchange.
+ * Returns false if the request has no valid URL or memory runs out.
+ */
+struct NetworkRequest;
+bool network_request_exchange(struct NetworkRequest* request,
+                              HttpExchange* exchange);
+
+/**
+ * Send an exchange and wait for the response, retrying once on a fresh
+ * connection if a pooled one turns out to be dead. The exchange is not
+ * freed; its writer is left sent.
+ */
+struct NetworkResponse* network_exchange_send(HttpExchange* exchange);
+
+/**
+ * A request's head without its query, Content-Length or final blank line,
+ * for NetworkRequestTemplate. The query goes in at split (just before
+ * " HTTP/1.1") and fields are appended at length. head and query (NULL
+ * if the URL has none) are malloc'd. Returns false if the request has no
+ * valid URL or memory runs out.
+ */
+bool network_request_head_parts(struct NetworkRequest* request, char** head,
+                                size_t* split, size_t* length, char** query);
+
+/**
+ * Queue an exchange on a loop. The loop takes ownership of the exchange's
+ * hostname and writer whether or not this succeeds.
+ */
+struct NetworkLoop;
+bool network_loop_submit(struct NetworkLoop* loop, HttpExchange* exchange,
+                         void (*callback)(struct NetworkResponse*, void*),
+                         void* context);
+
+/**
+ * As network_loop_submit, returning the queued op so it can be cancelled,
+ * or NULL if it was not queued.
+ */
+struct AsyncOp;
+struct AsyncOp* network_loop_start(struct NetworkLoop* loop, HttpExchange* exchange,
+                                   void (*callback)(struct NetworkResponse*, void*),
+                                   void* context);
+
+/**
+ * Run alarm(context) from the loop once milliseconds have passed (to the
+ * wheel's 10ms resolution). Pending alarms keep run() going and are run
+ * early, from free(), if the loop goes away first. Returns NULL if the
+ * loop is closing or memory runs out.
+ */
+struct AsyncOp* network_loop_after(struct NetworkLoop* loop, int milliseconds,
+                                   void (*alarm)(void*), void* context);
+
+/**
+ * Drop an op or alarm that has not completed: its callback never runs and
+ * its connection is closed. Safe to call from any loop callback.
+ */
+void network_loop_cancel(struct NetworkLoop* loop, struct AsyncOp* op);
+
+/* ======================================================================== */
+/* Request Policies (see network_policy.c)                                  */
+/* ======================================================================== */
+
+/**
+ * Run an exchange on loop under policy: deadline, retries and hedging.
+ * The exchange is copied for each attempt and left to the caller. The
+ * callback gets the winning response, or the last failure.
+ */
+struct NetworkRequestPolicy;
+bool network_policy_submit(struct NetworkLoop* loop, const HttpExchange* exchange,
+                           const struct NetworkRequestPolicy* policy,
+                           void (*callback)(struct NetworkResponse*, void*),
+                           void* context);
+
+/** Blocking form of network_policy_submit, on a loop of its own */
+struct NetworkResponse* network_policy_send(const HttpExchange* exchange,
+                                            const struct NetworkRequestPolicy* policy);
+
+/** The request's policy, or NULL if it has none */
+const struct NetworkRequestPolicy* network_request_policy(struct NetworkRequest* request);
+
+/* ======================================================================== */
+/* Rate and Concurrency Limits (see network_limit.c)                        */
+/* ======================================================================== */
+
+typedef struct NetworkLimiter NetworkLimiter;
+
+/** The limits for host:port, or NULL if it has none */
+NetworkLimiter* network_limit_find(const char* hostname, int port);
+
+/**
+ * Take an in-flight slot and a token without waiting. When the bucket is
+ * empty retry_in is set to the seconds until its next token; when the
+ * slots are all taken it is set to 0.
+ */
+bool network_limit_try(NetworkLimiter* limiter, double* retry_in);
+
+/** Join the waiting requests; false if max_queued are already waiting */
+bool network_limit_enqueue(NetworkLimiter* limiter);
+
+/** Leave the waiting requests, admitted or not */
+void network_limit_dequeue(NetworkLimiter* limiter);
+
+/**
+ * When a request that started waiting at since must give up: the sooner
+ * of deadline and since + max_wait_ms. 0 means it never does.
+ */
+double network_limit_deadline(NetworkLimiter* limiter, double since,
+                              double deadline);
+
+/**
+ * Block until admitted, as a blocking send does. Fails, with the reason
+ * in error, when the queue is full or the wait would pass the deadline
+ * (see network_limit_deadline).
+ */
+bool network_limit_acquire(NetworkLimiter* limiter, double since,
+                           double deadline, char* error, size_t error_size);
+
+/** Give back the in-flight slot of an admitted request */
+void network_limit_release(NetworkLimiter* limiter);
+
+/** Count a request admitted after waiting seconds, or refused */
+void network_limit_admitted(double waited);
+void network_limit_rejected(void);
+
+/* ======================================================================== */
+/* Request Timing (see network_metrics.c)                                   */
+/* ======================================================================== */
+
+struct NetworkTiming;
+
+/** Clear timing and start it now */
+void network_timing_start(struct NetworkTiming* timing);
+
+/**
+ * The request goes out on conn: take the setup phases it paid for, or
+ * mark it reused if conn has carried a request before. Pass NULL for a
+ * connection the caller knows has.
+ */
+void network_timing_connection(struct NetworkTiming* timing, const Connection* conn);
+
+/** The writer has sent all of the request */
+void network_timing_sent(struct NetworkTiming* timing, const HttpRequestWriter* writer);
+
+/** Take the first byte time and byte count of a finished read */
+void network_timing_received(struct NetworkTiming* timing,
+                             const HttpResponseData* data);
+
+/**
+ * Stop the clock, give response its timing and add it to the histograms
+ * of exchange's host. response may be NULL (out of memory), which is
+ * counted as a failure.
+ */
+void network_timing_deliver(struct NetworkResponse* response,
+                            const HttpExchange* exchange,
+                            struct NetworkTiming* timing);
+
+/** Store a copy of timing in response (see network_response.c) */
+void network_response_set_timing(struct NetworkResponse* response,
+                                 const struct NetworkTiming* timing);
+
+/* ======================================================================== */
+/* HPACK Header Compression (see network_hpack.c)                           */
+/* ======================================================================== */
+
+/* Growable byte buffer for encoded header blocks and outgoing frames */
+typedef struct H2Buffer {
+    unsigned char* data;
+    size_t length;
+    size_t capacity;
+} H2Buffer;
+
+bool h2_buffer_reserve(H2Buffer* buffer, size_t extra);
+bool h2_buffer_append(H2Buffer* buffer, const void* data, size_t length);
+void h2_buffer_free(H2Buffer* buffer);
+
+/* One dynamic table entry; name and value share one allocation */
+typedef struct HpackEntry {
+    char* name;
+    char* value;
+    size_t name_length;
+    size_t value_length;
+} HpackEntry;
+
+/* Dynamic table (RFC 7541 section 2.3.2): a ring, newest entry first */
+typedef struct HpackTable {
+    HpackEntry* entries;
+    size_t capacity;
+    size_t first;           /* Slot of the newest entry */
+    size_t count;
+    size_t size;            /* Octets as RFC 7541 counts them */
+    size_t max_size;
+} HpackTable;
+
+void hpack_table_init(HpackTable* table, size_t max_size);
+void hpack_table_free(HpackTable* table);
+
+/* Receives each decoded field; name and value are NUL terminated */
+typedef void (*HpackFieldSink)(const char* name, size_t name_length,
+                               const char* value, size_t value_length,
+                               void* context);
+
+/**
+ * Decode a complete header block into sink, updating table. limit is the
+ * table size we advertised, which size updates may not exceed. Returns
+ * false on a compression error, after which the connection is unusable.
+ */
+bool hpack_decode(HpackTable* table, size_t limit, const unsigned char* data,
+                  size_t length, HpackFieldSink sink, void* context);
+
+/* How a literal field is sent (RFC 7541 section 6.2) */
+typedef enum HpackIndexing {
+    HPACK_INDEX,            /* Added to the table for later blocks */
+    HPACK_NO_INDEX,         /* Values that change on every request */
+    HPACK_NEVER_INDEX       /* Credentials; intermediaries must not index */
+} HpackIndexing;
+
+/* Encoder state: the table the peer's decoder mirrors */
+typedef struct HpackEncoder {
+    HpackTable table;
+    size_t pending_size;    /* Size update owed at the next block */
+    bool resized;
+} HpackEncoder;
+
+void hpack_encoder_init(HpackEncoder* encoder);
+
+/** The peer's SETTINGS_HEADER_TABLE_SIZE changed */
+void hpack_encoder_set_max(HpackEncoder* encoder, size_t size);
+
+/** Start a header block, emitting any table size update that is owed */
+bool hpack_encode_begin(HpackEncoder* encoder, H2Buffer* out);
+
+/**
+ * Append one field, as a table reference when the static or dynamic table
+ * already holds it and otherwise as a literal, Huffman coded when shorter.
+ */
+bool hpack_encode_field(HpackEncoder* encoder, H2Buffer* out,
+                        const char* name, size_t name_length,
+                        const char* value, size_t value_length,
+                        HpackIndexing indexing);
+
+/* ======================================================================== */
+/* HTTP/2 Sessions (see network_h2.c)                                       */
+/* ======================================================================== */
+
+/* One HTTP/2 connection carrying many streams */
+typedef struct H2Session H2Session;
+
+/**
+ * A stream ended: result 1 when its reader holds the response, 0 when the
+ * server did not process it (GOAWAY or REFUSED_STREAM, safe to send
+ * again), -1 on failure with error set.
+ */
+typedef void (*H2StreamDone)(void* owner, void* context, int result,
+                             const char* error);
+
+/**
+ * Start HTTP/2 on a connected, non-blocking connection whose handshake
+ * chose it (conn->h2). The session takes the connection and its pool slot.
+ */
+H2Session* h2_session_create(Connection* conn);
+
+/** Who hears about finished streams; set again whenever a session is taken */
+void h2_session_bind(H2Session* session, H2StreamDone done, void* owner);
+
+/** Whether another stream may be opened now */
+bool h2_session_can_open(H2Session* session);
+
+/** Whether no stream will ever be opened on it again */
+bool h2_session_closing(H2Session* session);
+
+/**
+ * Open a stream sending exchange's request (its HTTP/1.1 head is
+ * translated) and feeding the response into reader. timing, unless NULL,
+ * is given the request's bytes and when its last frame was queued. Both
+ * must stay put until the stream ends or is reset. Frames go out on the
+ * next advance. Returns the stream id, or 0 if the stream could not be
+ * opened.
+ */
+unsigned int h2_session_open(H2Session* session, const HttpExchange* exchange,
+                             HttpResponseReader* reader,
+                             struct NetworkTiming* timing, void* context);
+
+/** Abandon a stream; its done callback never runs */
+void h2_session_reset(H2Session* session, unsigned int stream_id);
+
+/**
+ * Write and read as far as the socket allows, running done callbacks for
+ * streams that finished. Returns false once the session has failed; every
+ * stream has then been told.
+ */
+bool h2_session_advance(H2Session* session);
+
+/** The session has frames waiting for the socket to become writable */
+bool h2_session_wants_write(H2Session* session);
+
+size_t h2_session_streams(H2Session* session);
+Connection* h2_session_connection(H2Session* session);
+
+/** Keep an idle session for reuse, or close it if it cannot take more */
+void h2_session_park(H2Session* session);
+
+/** A parked session for the origin that is still usable, or NULL */
+H2Session* h2_session_take(const char* hostname, int port, bool use_ssl);
+
+/** Say goodbye and close the connection; streams are dropped untold */
+void h2_session_close(H2Session* session);
+
+/**
+ * Whether a TLS server chose HTTP/1.1 when offered h2, so requests to it
+ * go straight to the HTTP/1.1 path. note records that.
+ */
+bool h2_origin_declined(const char* hostname, int port, bool use_ssl);
+void h2_origin_note_declined(const char* hostname, int port, bool use_ssl);
+
+/** Blocking send of an HTTP/2 exchange, on a loop of its own */
+struct NetworkResponse* network_h2_send(const HttpExchange* exchange);
 
 #endif /* NETWORK_COMMON_H */
\ No newline at end of file
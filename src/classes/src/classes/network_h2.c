@@ -0,0 +1,1423 @@
+/**
+ * @file network_h2.c
+ * @brief HTTP/2 sessions multiplexing many requests over one connection
+ *
+ * A session owns one connection and speaks RFC 9113 on it: the connection
+ * preface, SETTINGS, HPACK-compressed header blocks, DATA under both the
+ * connection's and each stream's flow-control window, PING, RST_STREAM and
+ * GOAWAY. Requests arrive as HttpExchanges whose HTTP/1.1 head is
+ * translated into pseudo-headers and fields. Responses are handed back as
+ * an equivalent HTTP/1.1 head followed by the DATA payloads, fed through
+ * the stream's HttpResponseReader, so content decoding, body handlers and
+ * NetworkResponse building are the same for both protocols.
+ *
+ * Sessions are driven without blocking by whoever holds them, normally an
+ * event loop. One that goes idle is parked in a process-wide list, still
+ * holding its pool slot, so the next request for the origin, on any loop
+ * or thread, takes it back instead of connecting again. TLS servers that
+ * answer the ALPN offer with http/1.1 are remembered, and later requests
+ * to them go straight to HTTP/1.1.
+ */
+
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384          /* Largest frame we accept (the default) */
+#define H2_DEFAULT_WINDOW 65535
+#define H2_STREAM_WINDOW (1 << 20)  /* Advertised per stream */
+#define H2_CONNECTION_WINDOW (1 << 24)
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_STREAM_ID 0x7fffffffu
+#define H2_DEFAULT_STREAMS 100      /* Until the server's SETTINGS say */
+#define H2_OUT_HIGH 65536           /* Stop filling DATA frames past this */
+#define H2_STREAM_BUCKETS 64
+#define H2_MAX_PARKED 64
+
+enum {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9
+};
+
+enum {
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20
+};
+
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5
+};
+
+enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9
+};
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct H2Stream {
+    uint32_t id;
+    void* context;
+    HttpResponseReader* reader;
+    NetworkTiming* timing;      /* Or NULL */
+
+    HttpBody* body;             /* Request body still to send, or NULL */
+    size_t body_sent;
+    int64_t send_window;
+    int64_t recv_window;
+    size_t recv_unacked;        /* Received since our last WINDOW_UPDATE */
+
+    bool headers_done;          /* Final (non-1xx) head fed to the reader */
+    bool complete;              /* Reader has the whole response */
+    int result;
+    char error[160];
+
+    struct H2Stream* next;      /* Bucket chain, or the finished list */
+    struct H2Stream* send_next; /* Streams with body left to send */
+} H2Stream;
+
+struct H2Session {
+    Connection* conn;
+    H2StreamDone done;
+    void* owner;
+
+    HpackEncoder encoder;
+    HpackTable decoder;
+
+    H2Stream* buckets[H2_STREAM_BUCKETS];
+    size_t streams;
+    H2Stream* sending;
+    H2Stream* sending_tail;
+    H2Stream* finished;
+    H2Stream* finished_tail;
+    uint32_t next_id;
+
+    /* What the server allows us */
+    uint32_t max_streams;
+    int64_t initial_window;
+    size_t max_frame;
+    int64_t send_window;
+
+    /* What we allow the server */
+    int64_t recv_window;
+    size_t recv_unacked;
+
+    unsigned char* in;
+    size_t in_used;
+    size_t in_capacity;
+    bool settings_seen;
+
+    /* Header block being gathered from HEADERS and CONTINUATION frames */
+    H2Buffer block;
+    uint32_t block_stream;
+    bool block_end_stream;
+    bool in_block;
+
+    /* Response head being rebuilt from a decoded block */
+    H2Buffer fields;
+    H2Buffer head;
+    int status;
+    bool malformed;
+
+    H2Buffer out;
+    size_t out_sent;
+
+    bool goaway;
+    uint32_t goaway_last;
+    bool failed;
+    char error[160];
+
+    double idle_since;
+    struct H2Session* next;     /* Parked list */
+};
+
+typedef struct DeclinedOrigin {
+    char* hostname;
+    int port;
+    struct DeclinedOrigin* next;
+} DeclinedOrigin;
+
+static pthread_mutex_t h2_mutex = PTHREAD_MUTEX_INITIALIZER;
+static H2Session* parked = NULL;
+static size_t parked_count = 0;
+static DeclinedOrigin* declined = NULL;
+static NetworkHttp2Stats h2_stats;
+
+/* ======================================================================== */
+/* Frames                                                                   */
+/* ======================================================================== */
+
+static void put_u32(unsigned char* p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static bool frame_start(H2Session* session, size_t length, int type,
+                        int flags, uint32_t stream) {
+    unsigned char header[H2_FRAME_HEADER];
+
+    header[0] = (unsigned char)(length >> 16);
+    header[1] = (unsigned char)(length >> 8);
+    header[2] = (unsigned char)length;
+    header[3] = (unsigned char)type;
+    header[4] = (unsigned char)flags;
+    put_u32(header + 5, stream & H2_MAX_STREAM_ID);
+    return h2_buffer_append(&session->out, header, sizeof(header));
+}
+
+static bool frame_u32(H2Session* session, int type, uint32_t stream,
+                      uint32_t value) {
+    unsigned char payload[4];
+
+    put_u32(payload, value);
+    return frame_start(session, 4, type, 0, stream) &&
+           h2_buffer_append(&session->out, payload, 4);
+}
+
+static bool send_goaway(H2Session* session, uint32_t code) {
+    unsigned char payload[8];
+
+    /* With push disabled the server never opens a stream of its own */
+    put_u32(payload, 0);
+    put_u32(payload + 4, code);
+    return frame_start(session, 8, H2_GOAWAY, 0, 0) &&
+           h2_buffer_append(&session->out, payload, 8);
+}
+
+/* ======================================================================== */
+/* Streams                                                                  */
+/* ======================================================================== */
+
+static H2Stream** stream_link(H2Session* session, uint32_t id) {
+    H2Stream** link = &session->buckets[(id >> 1) % H2_STREAM_BUCKETS];
+
+    while (*link && (*link)->id != id) link = &(*link)->next;
+    return link;
+}
+
+static H2Stream* stream_find(H2Session* session, uint32_t id) {
+    return *stream_link(session, id);
+}
+
+static void sending_remove(H2Session* session, H2Stream* stream) {
+    H2Stream** link = &session->sending;
+    H2Stream* previous = NULL;
+
+    while (*link && *link != stream) {
+        previous = *link;
+        link = &(*link)->send_next;
+    }
+    if (!*link) return;
+    *link = stream->send_next;
+    if (session->sending_tail == stream) session->sending_tail = previous;
+    stream->send_next = NULL;
+}
+
+/* Take the stream out of the session and queue it to be told */
+static void stream_finish(H2Session* session, H2Stream* stream, int result,
+                          const char* error) {
+    H2Stream** link = stream_link(session, stream->id);
+
+    if (*link == stream) {
+        *link = stream->next;
+        session->streams--;
+    }
+    if (stream->body) {
+        sending_remove(session, stream);
+        http_body_release(stream->body);
+        stream->body = NULL;
+    }
+
+    stream->result = result;
+    snprintf(stream->error, sizeof(stream->error), "%s", error ? error : "");
+    stream->next = NULL;
+    if (session->finished_tail) {
+        session->finished_tail->next = stream;
+    } else {
+        session->finished = stream;
+    }
+    session->finished_tail = stream;
+}
+
+/* Reset the stream (a stream error) and fail it */
+static void stream_abort(H2Session* session, H2Stream* stream, uint32_t code,
+                         const char* error) {
+    frame_u32(session, H2_RST_STREAM, stream->id, code);
+    stream_finish(session, stream, -1, error);
+}
+
+/* END_STREAM from the server: the reader decides whether that completes
+ * the response (a body without Content-Length ends here) */
+static void stream_end(H2Session* session, H2Stream* stream) {
+    if (!stream->headers_done) {
+        stream_finish(session, stream, -1, "Stream ended without a response");
+    } else if (stream->complete || http_reader_eof(stream->reader) > 0) {
+        stream_finish(session, stream, 1, NULL);
+    } else {
+        stream_finish(session, stream, -1, stream->reader->error);
+    }
+}
+
+/* Tell the owner about finished streams. The list is detached first, as
+ * the callbacks may reset or open streams. */
+static void session_dispatch(H2Session* session) {
+    while (session->finished) {
+        H2Stream* stream = session->finished;
+
+        session->finished = stream->next;
+        if (!session->finished) session->finished_tail = NULL;
+        if (session->done) {
+            session->done(session->owner, stream->context, stream->result,
+                          stream->error);
+        }
+        free(stream);
+    }
+}
+
+/* A connection error: every stream fails, and the server is told why */
+static bool session_fail(H2Session* session, uint32_t code, const char* error) {
+    size_t i;
+
+    if (session->failed) return false;
+    session->failed = true;
+    snprintf(session->error, sizeof(session->error), "%s", error);
+    if (code != H2_NO_ERROR) send_goaway(session, code);
+
+    for (i = 0; i < H2_STREAM_BUCKETS; i++) {
+        while (session->buckets[i]) {
+            stream_finish(session, session->buckets[i], -1, session->error);
+        }
+    }
+    return false;
+}
+
+/* ======================================================================== */
+/* Requests                                                                 */
+/* ======================================================================== */
+
+/* Fields HTTP/2 forbids (RFC 9113 section 8.2.2) or carries as
+ * pseudo-headers */
+static bool connection_specific(const char* name, size_t length) {
+    static const char* const names[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+        "upgrade", "host"
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == length && memcmp(names[i], name, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static HpackIndexing field_indexing(const char* name, size_t length,
+                                    size_t value_length) {
+    /* Credentials are never indexed, so intermediaries cannot probe the
+     * table for them (RFC 7541 section 7.1.3) */
+    if ((length == 13 && memcmp(name, "authorization", 13) == 0) ||
+        (length == 19 && memcmp(name, "proxy-authorization", 19) == 0) ||
+        (length == 6 && memcmp(name, "cookie", 6) == 0 && value_length < 20)) {
+        return HPACK_NEVER_INDEX;
+    }
+    if (length == 14 && memcmp(name, "content-length", 14) == 0) {
+        return HPACK_NO_INDEX;
+    }
+    return HPACK_INDEX;
+}
+
+/* Translate the exchange's HTTP/1.1 head into a header block */
+static bool encode_request(H2Session* session, const HttpExchange* exchange,
+                           H2Buffer* block) {
+    HpackEncoder* encoder = &session->encoder;
+    const char* scheme = exchange->use_ssl ? "https" : "http";
+    const char* authority;
+    HttpHead head;
+    char* text = malloc(exchange->writer.head_length + 1);
+    bool ok;
+    size_t i;
+
+    if (!text) return false;
+    memcpy(text, exchange->writer.head, exchange->writer.head_length);
+    text[exchange->writer.head_length] = '\0';
+
+    http_head_init_request(&head);
+    ok = http_head_parse(&head, text, exchange->writer.head_length) == 1;
+    authority = ok ? http_head_find(&head, text, "host") : NULL;
+    if (!authority) authority = exchange->hostname;
+
+    ok = ok && hpack_encode_begin(encoder, block) &&
+         hpack_encode_field(encoder, block, ":method", 7, text + head.method,
+                            head.method_length, HPACK_INDEX) &&
+         hpack_encode_field(encoder, block, ":scheme", 7, scheme,
+                            strlen(scheme), HPACK_INDEX) &&
+         hpack_encode_field(encoder, block, ":authority", 10, authority,
+                            strlen(authority), HPACK_INDEX) &&
+         hpack_encode_field(encoder, block, ":path", 5, text + head.target,
+                            head.target_length, HPACK_NO_INDEX);
+
+    for (i = 0; ok && i < head.count; i++) {
+        const HttpHeaderField* field = &head.fields[i];
+        const char* name = text + field->name;
+        const char* value = text + field->value;
+
+        if (connection_specific(name, field->name_length)) continue;
+        /* TE may only offer trailers */
+        if (field->name_length == 2 && memcmp(name, "te", 2) == 0 &&
+            strcasecmp(value, "trailers") != 0) {
+            continue;
+        }
+        ok = hpack_encode_field(encoder, block, name, field->name_length,
+                                value, field->value_length,
+                                field_indexing(name, field->name_length,
+                                               field->value_length));
+    }
+
+    http_head_free(&head);
+    free(text);
+    return ok;
+}
+
+/* Count a frame payload of length toward the stream's timing */
+static void stream_received(H2Stream* stream, size_t length) {
+    if (!stream || !stream->timing) return;
+    if (stream->timing->first_byte == 0) stream->timing->first_byte = network_now();
+    stream->timing->bytes_received += length;
+}
+
+/* Queue a header block as HEADERS plus as many CONTINUATIONs as the
+ * server's frame size needs */
+static bool queue_headers(H2Session* session, uint32_t id,
+                          const H2Buffer* block, bool end_stream) {
+    size_t offset = 0;
+    bool first = true;
+
+    do {
+        size_t chunk = block->length - offset;
+        int flags = 0;
+
+        if (chunk > session->max_frame) chunk = session->max_frame;
+        if (offset + chunk == block->length) flags |= H2_FLAG_END_HEADERS;
+        if (first && end_stream) flags |= H2_FLAG_END_STREAM;
+        if (!frame_start(session, chunk, first ? H2_HEADERS : H2_CONTINUATION,
+                         flags, id) ||
+            !h2_buffer_append(&session->out, block->data + offset, chunk)) {
+            return false;
+        }
+        offset += chunk;
+        first = false;
+    } while (offset < block->length);
+    return true;
+}
+
+/* Copy length body bytes from offset into frame data at dest */
+static bool body_copy(HttpBody* body, size_t offset, unsigned char* dest,
+                      size_t length) {
+    if (body->fd < 0) {
+        memcpy(dest, body->data + offset, length);
+        return true;
+    }
+    while (length > 0) {
+        ssize_t got = pread(body->fd, dest, length,
+                            body->offset + (off_t)offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        dest += got;
+        offset += (size_t)got;
+        length -= (size_t)got;
+    }
+    return true;
+}
+
+/* Fill DATA frames from streams with body left, round robin, as far as
+ * the windows allow and until enough is queued to keep the socket busy */
+static void session_pump(H2Session* session) {
+    bool progress = true;
+
+    while (progress && session->sending && session->send_window > 0 &&
+           session->out.length - session->out_sent < H2_OUT_HIGH) {
+        H2Stream* stream = session->sending;
+
+        progress = false;
+        while (stream && session->send_window > 0) {
+            H2Stream* next = stream->send_next;
+            size_t left = stream->body->length - stream->body_sent;
+            size_t chunk = left;
+            bool last;
+
+            if (stream->send_window <= 0) {
+                stream = next;
+                continue;
+            }
+            if (chunk > (size_t)stream->send_window) chunk = (size_t)stream->send_window;
+            if (chunk > (size_t)session->send_window) chunk = (size_t)session->send_window;
+            if (chunk > session->max_frame) chunk = session->max_frame;
+            last = chunk == left;
+
+            /* The payload is read in first, so a failed read sends
+             * nothing but the reset */
+            if (!h2_buffer_reserve(&session->out, H2_FRAME_HEADER + chunk)) {
+                session_fail(session, H2_NO_ERROR, "Out of memory");
+                return;
+            }
+            if (!body_copy(stream->body, stream->body_sent,
+                           session->out.data + session->out.length +
+                           H2_FRAME_HEADER, chunk)) {
+                stream_abort(session, stream, H2_CANCEL,
+                             "Failed to read request body");
+                stream = next;
+                continue;
+            }
+            frame_start(session, chunk, H2_DATA,
+                        last ? H2_FLAG_END_STREAM : 0, stream->id);
+            session->out.length += chunk;
+            stream->body_sent += chunk;
+            if (stream->timing) {
+                stream->timing->bytes_sent += chunk;
+                if (last) stream->timing->request_sent = network_now();
+            }
+            stream->send_window -= (int64_t)chunk;
+            session->send_window -= (int64_t)chunk;
+            progress = true;
+
+            if (last) {
+                sending_remove(session, stream);
+                http_body_release(stream->body);
+                stream->body = NULL;
+            }
+            stream = next;
+        }
+    }
+}
+
+/* ======================================================================== */
+/* Responses                                                                */
+/* ======================================================================== */
+
+/* Rebuild the block as an HTTP/1.1 head, rejecting what could not be
+ * written as one (RFC 9113 section 8.2.1) */
+static void head_field(const char* name, size_t name_length, const char* value,
+                       size_t value_length, void* context) {
+    H2Session* session = (H2Session*)context;
+    size_t i;
+
+    if (name_length > 0 && name[0] == ':') {
+        if (name_length == 7 && memcmp(name, ":status", 7) == 0 &&
+            value_length == 3 && session->status == 0 &&
+            session->fields.length == 0) {
+            session->status = atoi(value);
+        } else {
+            session->malformed = true;
+        }
+        return;
+    }
+    for (i = 0; i < name_length; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (c <= ' ' || c == ':' || (c >= 'A' && c <= 'Z') || c >= 0x7f) {
+            session->malformed = true;
+        }
+    }
+    for (i = 0; i < value_length; i++) {
+        if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0') {
+            session->malformed = true;
+        }
+    }
+    if (name_length == 0 || session->malformed ||
+        connection_specific(name, name_length)) {
+        return;
+    }
+    if (!h2_buffer_reserve(&session->fields, name_length + value_length + 4)) {
+        session->malformed = true;
+        return;
+    }
+    h2_buffer_append(&session->fields, name, name_length);
+    h2_buffer_append(&session->fields, ": ", 2);
+    h2_buffer_append(&session->fields, value, value_length);
+    h2_buffer_append(&session->fields, "\r\n", 2);
+}
+
+/* A complete header block for stream_id */
+static bool on_header_block(H2Session* session) {
+    H2Stream* stream = stream_find(session, session->block_stream);
+    char status_line[64];
+    int length;
+    int result;
+
+    session->fields.length = 0;
+    session->status = 0;
+    session->malformed = false;
+
+    /* Decoded even for streams we no longer want, to keep the table in
+     * step with the server's */
+    if (!hpack_decode(&session->decoder, 4096, session->block.data,
+                      session->block.length, head_field, session)) {
+        return session_fail(session, H2_COMPRESSION_ERROR,
+                            "HTTP/2 header compression error");
+    }
+    if (!stream) return true;
+
+    if (stream->headers_done) {
+        /* Trailers: they must end the stream, and are not kept */
+        if (!session->block_end_stream) {
+            stream_abort(session, stream, H2_PROTOCOL_ERROR,
+                         "Malformed HTTP/2 response");
+        } else {
+            stream_end(session, stream);
+        }
+        return true;
+    }
+    if (session->malformed || session->status < 100 || session->status > 999) {
+        stream_abort(session, stream, H2_PROTOCOL_ERROR,
+                     "Malformed HTTP/2 response headers");
+        return true;
+    }
+    if (session->status < 200) {
+        /* Interim response; the final one follows */
+        if (session->block_end_stream) {
+            stream_abort(session, stream, H2_PROTOCOL_ERROR,
+                         "Malformed HTTP/2 response");
+        }
+        return true;
+    }
+
+    length = snprintf(status_line, sizeof(status_line), "HTTP/1.1 %d %s\r\n",
+                      session->status, http_reason_phrase(session->status));
+    session->head.length = 0;
+    if (!h2_buffer_append(&session->head, status_line, (size_t)length) ||
+        !h2_buffer_append(&session->head, session->fields.data,
+                          session->fields.length) ||
+        !h2_buffer_append(&session->head, "\r\n", 2)) {
+        stream_abort(session, stream, H2_CANCEL, "Out of memory");
+        return true;
+    }
+
+    stream->headers_done = true;
+    result = http_reader_feed(stream->reader, (const char*)session->head.data,
+                              session->head.length);
+    if (result < 0) {
+        stream_abort(session, stream, H2_CANCEL, stream->reader->error);
+        return true;
+    }
+    stream->complete = result > 0;
+    if (session->block_end_stream) stream_end(session, stream);
+    return true;
+}
+
+/* Account for flow-controlled bytes received and give the window back
+ * once half of it is used */
+static bool receive_window(H2Session* session, H2Stream* stream, size_t length) {
+    if ((int64_t)length > session->recv_window) {
+        return session_fail(session, H2_FLOW_CONTROL_ERROR,
+                            "HTTP/2 flow control error");
+    }
+    session->recv_window -= (int64_t)length;
+    session->recv_unacked += length;
+    if (session->recv_unacked >= H2_CONNECTION_WINDOW / 2) {
+        frame_u32(session, H2_WINDOW_UPDATE, 0, (uint32_t)session->recv_unacked);
+        session->recv_window += (int64_t)session->recv_unacked;
+        session->recv_unacked = 0;
+    }
+
+    if (!stream) return true;
+    if ((int64_t)length > stream->recv_window) {
+        stream_abort(session, stream, H2_FLOW_CONTROL_ERROR,
+                     "HTTP/2 flow control error");
+        return true;
+    }
+    stream->recv_window -= (int64_t)length;
+    stream->recv_unacked += length;
+    if (stream->recv_unacked >= H2_STREAM_WINDOW / 2) {
+        frame_u32(session, H2_WINDOW_UPDATE, stream->id,
+                  (uint32_t)stream->recv_unacked);
+        stream->recv_window += (int64_t)stream->recv_unacked;
+        stream->recv_unacked = 0;
+    }
+    return true;
+}
+
+/* Strip padding from a DATA or HEADERS payload */
+static bool unpad(int flags, const unsigned char** payload, size_t* length) {
+    size_t pad;
+
+    if (!(flags & H2_FLAG_PADDED)) return true;
+    if (*length < 1) return false;
+    pad = (*payload)[0];
+    if (pad >= *length) return false;
+    *payload += 1;
+    *length -= 1 + pad;
+    return true;
+}
+
+static bool on_data(H2Session* session, int flags, uint32_t id,
+                    const unsigned char* payload, size_t length) {
+    H2Stream* stream;
+    size_t full = length;
+    int result;
+
+    if (id == 0 || id >= session->next_id) {
+        return session_fail(session, H2_PROTOCOL_ERROR,
+                            "HTTP/2 DATA on an idle stream");
+    }
+    stream = stream_find(session, id);
+    if (!receive_window(session, stream, full)) return false;
+    if (!unpad(flags, &payload, &length)) {
+        return session_fail(session, H2_PROTOCOL_ERROR, "Malformed HTTP/2 frame");
+    }
+    /* Streams we reset may still have data in flight */
+    stream = stream_find(session, id);
+    if (!stream) return true;
+    stream_received(stream, full);
+
+    if (!stream->headers_done) {
+        stream_abort(session, stream, H2_PROTOCOL_ERROR,
+                     "HTTP/2 DATA before response headers");
+        return true;
+    }
+    if (!stream->complete && length > 0) {
+        result = http_reader_feed(stream->reader, (const char*)payload, length);
+        if (result < 0) {
+            stream_abort(session, stream, H2_CANCEL, stream->reader->error);
+            return true;
+        }
+        stream->complete = result > 0;
+    }
+    if (flags & H2_FLAG_END_STREAM) stream_end(session, stream);
+    return true;
+}
+
+static bool on_headers(H2Session* session, int type, int flags, uint32_t id,
+                       const unsigned char* payload, size_t length) {
+    stream_received(stream_find(session, id), length);
+    if (type == H2_HEADERS) {
+        if (id == 0 || !(id & 1) || id >= session->next_id) {
+            return session_fail(session, H2_PROTOCOL_ERROR,
+                                "HTTP/2 HEADERS on an unexpected stream");
+        }
+        if (!unpad(flags, &payload, &length)) {
+            return session_fail(session, H2_PROTOCOL_ERROR,
+                                "Malformed HTTP/2 frame");
+        }
+        if (flags & H2_FLAG_PRIORITY) {
+            if (length < 5) {
+                return session_fail(session, H2_PROTOCOL_ERROR,
+                                    "Malformed HTTP/2 frame");
+            }
+            payload += 5;
+            length -= 5;
+        }
+        session->block.length = 0;
+        session->block_stream = id;
+        session->block_end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+        session->in_block = true;
+    } else if (!session->in_block || id != session->block_stream) {
+        return session_fail(session, H2_PROTOCOL_ERROR,
+                            "Unexpected HTTP/2 CONTINUATION");
+    }
+
+    if (!h2_buffer_append(&session->block, payload, length)) {
+        return session_fail(session, H2_NO_ERROR, "Out of memory");
+    }
+    if (!(flags & H2_FLAG_END_HEADERS)) return true;
+    session->in_block = false;
+    return on_header_block(session);
+}
+
+static bool on_settings(H2Session* session, int flags,
+                        const unsigned char* payload, size_t length) {
+    size_t i;
+
+    if (flags & H2_FLAG_ACK) return true;
+    if (length % 6 != 0) {
+        return session_fail(session, H2_FRAME_SIZE_ERROR,
+                            "Malformed HTTP/2 SETTINGS");
+    }
+
+    for (i = 0; i < length; i += 6) {
+        int id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get_u32(payload + i + 2);
+        size_t b;
+
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_encoder_set_max(&session->encoder, value);
+                break;
+            case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+                session->max_streams = value;
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_MAX_WINDOW) {
+                    return session_fail(session, H2_FLOW_CONTROL_ERROR,
+                                        "HTTP/2 flow control error");
+                }
+                /* Applies to open streams as a delta (section 6.9.2) */
+                for (b = 0; b < H2_STREAM_BUCKETS; b++) {
+                    H2Stream* stream;
+                    for (stream = session->buckets[b]; stream; stream = stream->next) {
+                        stream->send_window += (int64_t)value - session->initial_window;
+                    }
+                }
+                session->initial_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < 16384 || value > 16777215) {
+                    return session_fail(session, H2_PROTOCOL_ERROR,
+                                        "Malformed HTTP/2 SETTINGS");
+                }
+                session->max_frame = value;
+                break;
+            default:
+                /* Unknown settings are ignored */
+                break;
+        }
+    }
+    session->settings_seen = true;
+    return frame_start(session, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+}
+
+static bool on_window_update(H2Session* session, uint32_t id,
+                             const unsigned char* payload, size_t length) {
+    uint32_t increment;
+    H2Stream* stream;
+
+    if (length != 4) {
+        return session_fail(session, H2_FRAME_SIZE_ERROR,
+                            "Malformed HTTP/2 WINDOW_UPDATE");
+    }
+    increment = get_u32(payload) & H2_MAX_WINDOW;
+
+    if (id == 0) {
+        if (increment == 0 || session->send_window + increment > H2_MAX_WINDOW) {
+            return session_fail(session, H2_FLOW_CONTROL_ERROR,
+                                "HTTP/2 flow control error");
+        }
+        session->send_window += increment;
+        return true;
+    }
+    stream = stream_find(session, id);
+    if (!stream) return true;
+    if (increment == 0 || stream->send_window + increment > H2_MAX_WINDOW) {
+        stream_abort(session, stream, H2_FLOW_CONTROL_ERROR,
+                     "HTTP/2 flow control error");
+        return true;
+    }
+    stream->send_window += increment;
+    return true;
+}
+
+static bool on_rst_stream(H2Session* session, uint32_t id,
+                          const unsigned char* payload, size_t length) {
+    H2Stream* stream;
+    uint32_t code;
+    char error[96];
+
+    if (length != 4 || id == 0) {
+        return session_fail(session, H2_PROTOCOL_ERROR,
+                            "Malformed HTTP/2 RST_STREAM");
+    }
+    stream = stream_find(session, id);
+    if (!stream) return true;
+
+    code = get_u32(payload);
+    if (code == H2_REFUSED_STREAM) {
+        stream_finish(session, stream, 0, "Stream refused by server");
+    } else if (code == H2_NO_ERROR && stream->complete) {
+        /* The server has said all it will; the response is whole */
+        stream_finish(session, stream, 1, NULL);
+    } else {
+        snprintf(error, sizeof(error), "HTTP/2 stream reset by server (code %u)",
+                 (unsigned int)code);
+        stream_finish(session, stream, -1, error);
+    }
+    return true;
+}
+
+static bool on_goaway(H2Session* session, const unsigned char* payload,
+                      size_t length) {
+    size_t i;
+
+    if (length < 8) {
+        return session_fail(session, H2_FRAME_SIZE_ERROR,
+                            "Malformed HTTP/2 GOAWAY");
+    }
+    session->goaway = true;
+    session->goaway_last = get_u32(payload) & H2_MAX_STREAM_ID;
+
+    /* Streams past the last one the server processed were never seen by
+     * it and may be sent again elsewhere */
+    for (i = 0; i < H2_STREAM_BUCKETS; i++) {
+        H2Stream* stream = session->buckets[i];
+
+        while (stream) {
+            H2Stream* next = stream->next;
+            if (stream->id > session->goaway_last) {
+                stream_finish(session, stream, 0, "Server is going away");
+            }
+            stream = next;
+        }
+    }
+    return true;
+}
+
+static bool on_frame(H2Session* session, int type, int flags, uint32_t id,
+                     const unsigned char* payload, size_t length) {
+    if (!session->settings_seen && type != H2_SETTINGS) {
+        return session_fail(session, H2_PROTOCOL_ERROR,
+                            "Server did not start HTTP/2 with SETTINGS");
+    }
+    if (session->in_block && type != H2_CONTINUATION) {
+        return session_fail(session, H2_PROTOCOL_ERROR,
+                            "Interrupted HTTP/2 header block");
+    }
+
+    switch (type) {
+        case H2_DATA:
+            return on_data(session, flags, id, payload, length);
+        case H2_HEADERS:
+        case H2_CONTINUATION:
+            return on_headers(session, type, flags, id, payload, length);
+        case H2_RST_STREAM:
+            return on_rst_stream(session, id, payload, length);
+        case H2_SETTINGS:
+            if (id != 0) {
+                return session_fail(session, H2_PROTOCOL_ERROR,
+                                    "Malformed HTTP/2 SETTINGS");
+            }
+            return on_settings(session, flags, payload, length);
+        case H2_PUSH_PROMISE:
+            /* Disabled in our SETTINGS */
+            return session_fail(session, H2_PROTOCOL_ERROR,
+                                "Unexpected HTTP/2 PUSH_PROMISE");
+        case H2_PING:
+            if (length != 8 || id != 0) {
+                return session_fail(session, H2_FRAME_SIZE_ERROR,
+                                    "Malformed HTTP/2 PING");
+            }
+            if (flags & H2_FLAG_ACK) return true;
+            return frame_start(session, 8, H2_PING, H2_FLAG_ACK, 0) &&
+                   h2_buffer_append(&session->out, payload, 8);
+        case H2_GOAWAY:
+            return on_goaway(session, payload, length);
+        case H2_WINDOW_UPDATE:
+            return on_window_update(session, id, payload, length);
+        default:
+            /* PRIORITY and unknown frame types are ignored */
+            return true;
+    }
+}
+
+/* Handle every complete frame in the receive buffer */
+static bool session_process(H2Session* session) {
+    size_t offset = 0;
+
+    /* A server that does not speak HTTP/2 answers the preface as a bad
+     * HTTP/1.1 request */
+    if (!session->settings_seen && session->in_used >= 5 &&
+        memcmp(session->in, "HTTP/", 5) == 0) {
+        return session_fail(session, H2_NO_ERROR,
+                            "Server does not speak HTTP/2");
+    }
+
+    while (!session->failed && session->in_used - offset >= H2_FRAME_HEADER) {
+        const unsigned char* frame = session->in + offset;
+        size_t length = ((size_t)frame[0] << 16) | ((size_t)frame[1] << 8) |
+                        frame[2];
+
+        if (length > H2_MAX_FRAME) {
+            return session_fail(session, H2_FRAME_SIZE_ERROR,
+                                "HTTP/2 frame too large");
+        }
+        if (session->in_used - offset < H2_FRAME_HEADER + length) break;
+        if (!on_frame(session, frame[3], frame[4],
+                      get_u32(frame + 5) & H2_MAX_STREAM_ID,
+                      frame + H2_FRAME_HEADER, length)) {
+            return false;
+        }
+        offset += H2_FRAME_HEADER + length;
+    }
+
+    memmove(session->in, session->in + offset, session->in_used - offset);
+    session->in_used -= offset;
+    return !session->failed;
+}
+
+/* ======================================================================== */
+/* Socket I/O                                                               */
+/* ======================================================================== */
+
+static bool session_flush(H2Session* session) {
+    Connection* conn = session->conn;
+
+    while (session->out_sent < session->out.length) {
+        size_t chunk = session->out.length - session->out_sent;
+        ssize_t sent;
+
+        /* A TLS write that would block must be retried with at least as
+         * many bytes; capping every write keeps that true */
+        if (conn->type == CONN_TYPE_SSL && chunk > H2_MAX_FRAME) {
+            chunk = H2_MAX_FRAME;
+        }
+        sent = connection_send(conn, session->out.data + session->out_sent, chunk);
+        if (sent < 0) {
+            if (connection_would_block(conn)) return true;
+            return session_fail(session, H2_NO_ERROR, connection_error(conn));
+        }
+        session->out_sent += (size_t)sent;
+    }
+    session->out.length = 0;
+    session->out_sent = 0;
+    return true;
+}
+
+static bool session_read(H2Session* session) {
+    Connection* conn = session->conn;
+
+    for (;;) {
+        ssize_t received;
+
+        if (session->in_capacity - session->in_used < H2_FRAME_HEADER + H2_MAX_FRAME) {
+            size_t capacity = session->in_used + 2 * (H2_FRAME_HEADER + H2_MAX_FRAME);
+            unsigned char* grown = realloc(session->in, capacity);
+
+            if (!grown) return session_fail(session, H2_NO_ERROR, "Out of memory");
+            session->in = grown;
+            session->in_capacity = capacity;
+        }
+
+        received = connection_recv(conn, session->in + session->in_used,
+                                   session->in_capacity - session->in_used);
+        if (received > 0) {
+            session->in_used += (size_t)received;
+            if (!session_process(session)) return false;
+        } else if (received == 0) {
+            return session_fail(session, H2_NO_ERROR, session->goaway
+                                ? "Server closed the HTTP/2 connection"
+                                : "Connection closed by server");
+        } else if (connection_would_block(conn)) {
+            return true;
+        } else {
+            return session_fail(session, H2_NO_ERROR, connection_error(conn));
+        }
+    }
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+H2Session* h2_session_create(Connection* conn) {
+    H2Session* session = calloc(1, sizeof(H2Session));
+    unsigned char settings[12];
+
+    if (!session) return NULL;
+
+    session->conn = conn;
+    session->next_id = 1;
+    session->max_streams = H2_DEFAULT_STREAMS;
+    session->initial_window = H2_DEFAULT_WINDOW;
+    session->max_frame = 16384;
+    session->send_window = H2_DEFAULT_WINDOW;
+    session->recv_window = H2_CONNECTION_WINDOW;
+    hpack_encoder_init(&session->encoder);
+    hpack_table_init(&session->decoder, 4096);
+
+    /* Preface, no server push, a 1 MB window per stream and the
+     * connection's window raised to match many of them */
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_ENABLE_PUSH;
+    put_u32(settings + 2, 0);
+    settings[6] = 0;
+    settings[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    put_u32(settings + 8, H2_STREAM_WINDOW);
+    if (!h2_buffer_append(&session->out, H2_PREFACE, strlen(H2_PREFACE)) ||
+        !frame_start(session, sizeof(settings), H2_SETTINGS, 0, 0) ||
+        !h2_buffer_append(&session->out, settings, sizeof(settings)) ||
+        !frame_u32(session, H2_WINDOW_UPDATE, 0,
+                   H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW)) {
+        session->conn = NULL;
+        h2_session_close(session);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&h2_mutex);
+    h2_stats.sessions_opened++;
+    pthread_mutex_unlock(&h2_mutex);
+    return session;
+}
+
+void h2_session_bind(H2Session* session, H2StreamDone done, void* owner) {
+    session->done = done;
+    session->owner = owner;
+}
+
+bool h2_session_can_open(H2Session* session) {
+    return !session->failed && !session->goaway &&
+           session->streams < session->max_streams &&
+           session->next_id <= H2_MAX_STREAM_ID;
+}
+
+bool h2_session_closing(H2Session* session) {
+    return session->failed || session->goaway ||
+           session->next_id > H2_MAX_STREAM_ID;
+}
+
+unsigned int h2_session_open(H2Session* session, const HttpExchange* exchange,
+                             HttpResponseReader* reader,
+                             NetworkTiming* timing, void* context) {
+    H2Buffer block = { NULL, 0, 0 };
+    H2Stream* stream;
+    HttpBody* body = exchange->writer.body;
+    bool has_body = body && body->length > 0;
+    H2Stream** link;
+
+    if (!h2_session_can_open(session)) return 0;
+
+    stream = calloc(1, sizeof(H2Stream));
+    if (!stream) return 0;
+
+    /* The encoder's table changes as it goes, so a block that fails part
+     * way leaves the server's copy out of step: the session is done */
+    if (!encode_request(session, exchange, &block) ||
+        !queue_headers(session, session->next_id, &block, !has_body)) {
+        h2_buffer_free(&block);
+        free(stream);
+        session_fail(session, H2_NO_ERROR, "Failed to encode HTTP/2 request");
+        return 0;
+    }
+    if (timing) {
+        timing->bytes_sent += block.length;
+        if (!has_body) timing->request_sent = network_now();
+    }
+    h2_buffer_free(&block);
+
+    stream->id = session->next_id;
+    stream->context = context;
+    stream->reader = reader;
+    stream->timing = timing;
+    stream->send_window = session->initial_window;
+    stream->recv_window = H2_STREAM_WINDOW;
+    session->next_id += 2;
+
+    link = stream_link(session, stream->id);
+    stream->next = *link;
+    *link = stream;
+    session->streams++;
+
+    if (has_body) {
+        stream->body = http_body_retain(body);
+        if (session->sending_tail) {
+            session->sending_tail->send_next = stream;
+        } else {
+            session->sending = stream;
+        }
+        session->sending_tail = stream;
+    }
+
+    pthread_mutex_lock(&h2_mutex);
+    h2_stats.streams++;
+    pthread_mutex_unlock(&h2_mutex);
+    return stream->id;
+}
+
+void h2_session_reset(H2Session* session, unsigned int stream_id) {
+    H2Stream** link = stream_link(session, stream_id);
+    H2Stream* stream = *link;
+    H2Stream* previous = NULL;
+
+    if (stream) {
+        *link = stream->next;
+        session->streams--;
+        if (stream->body) {
+            sending_remove(session, stream);
+            http_body_release(stream->body);
+        }
+        if (!session->failed) frame_u32(session, H2_RST_STREAM, stream_id, H2_CANCEL);
+        free(stream);
+        return;
+    }
+
+    /* Finished but not yet told */
+    for (stream = session->finished; stream; stream = stream->next) {
+        if (stream->id == stream_id) {
+            if (previous) {
+                previous->next = stream->next;
+            } else {
+                session->finished = stream->next;
+            }
+            if (session->finished_tail == stream) session->finished_tail = previous;
+            free(stream);
+            return;
+        }
+        previous = stream;
+    }
+}
+
+bool h2_session_advance(H2Session* session) {
+    if (!session->failed) {
+        session_pump(session);
+        if (session_flush(session) && session_read(session)) {
+            session_pump(session);
+            session_flush(session);
+        }
+        /* Let a failed session's GOAWAY out if the socket allows */
+        if (session->failed) session_flush(session);
+    }
+    session_dispatch(session);
+    return !session->failed;
+}
+
+bool h2_session_wants_write(H2Session* session) {
+    return session->out_sent < session->out.length;
+}
+
+size_t h2_session_streams(H2Session* session) {
+    return session->streams;
+}
+
+Connection* h2_session_connection(H2Session* session) {
+    return session->conn;
+}
+
+void h2_session_park(H2Session* session) {
+    H2Session* evicted = NULL;
+
+    if (session->failed || session->goaway || session->streams > 0 ||
+        session->next_id > H2_MAX_STREAM_ID) {
+        h2_session_close(session);
+        return;
+    }
+
+    session->done = NULL;
+    session->owner = NULL;
+    session->idle_since = network_now();
+
+    pthread_mutex_lock(&h2_mutex);
+    session->next = parked;
+    parked = session;
+    parked_count++;
+    if (parked_count > H2_MAX_PARKED) {
+        /* Close the one idle longest, at the end of the list */
+        H2Session** link = &parked;
+        while ((*link)->next) link = &(*link)->next;
+        evicted = *link;
+        *link = NULL;
+        parked_count--;
+    }
+    pthread_mutex_unlock(&h2_mutex);
+
+    if (evicted) h2_session_close(evicted);
+}
+
+H2Session* h2_session_take(const char* hostname, int port, bool use_ssl) {
+    NetworkPoolOptions options;
+    double now = network_now();
+
+    NetworkPoolGetOptions(&options);
+
+    for (;;) {
+        H2Session** link;
+        H2Session* session = NULL;
+
+        pthread_mutex_lock(&h2_mutex);
+        for (link = &parked; *link; link = &(*link)->next) {
+            Connection* conn = (*link)->conn;
+
+            if (conn->port == port && (conn->type == CONN_TYPE_SSL) == use_ssl &&
+                strcasecmp(conn->hostname, hostname) == 0) {
+                session = *link;
+                *link = session->next;
+                session->next = NULL;
+                parked_count--;
+                break;
+            }
+        }
+        if (session) h2_stats.sessions_reused++;
+        pthread_mutex_unlock(&h2_mutex);
+
+        if (!session) return NULL;
+
+        /* Catch up on what arrived while it was parked: PINGs, SETTINGS,
+         * a GOAWAY or the server closing it */
+        if (now - session->idle_since <= options.idle_timeout_seconds &&
+            h2_session_advance(session) && h2_session_can_open(session)) {
+            return session;
+        }
+        h2_session_close(session);
+    }
+}
+
+void h2_session_close(H2Session* session) {
+    size_t i;
+
+    if (!session) return;
+
+    if (session->conn) {
+        if (!session->failed) {
+            /* Best effort; the socket is not waited for */
+            send_goaway(session, H2_NO_ERROR);
+            session_flush(session);
+        }
+        connection_pool_release(session->conn, false);
+    }
+
+    for (i = 0; i < H2_STREAM_BUCKETS; i++) {
+        while (session->buckets[i]) {
+            H2Stream* stream = session->buckets[i];
+            session->buckets[i] = stream->next;
+            http_body_release(stream->body);
+            free(stream);
+        }
+    }
+    while (session->finished) {
+        H2Stream* stream = session->finished;
+        session->finished = stream->next;
+        free(stream);
+    }
+
+    hpack_table_free(&session->encoder.table);
+    hpack_table_free(&session->decoder);
+    h2_buffer_free(&session->block);
+    h2_buffer_free(&session->fields);
+    h2_buffer_free(&session->head);
+    h2_buffer_free(&session->out);
+    free(session->in);
+    free(session);
+}
+
+bool h2_origin_declined(const char* hostname, int port, bool use_ssl) {
+    DeclinedOrigin* origin;
+    bool found = false;
+
+    /* Only TLS negotiates; plain connections assume HTTP/2 */
+    if (!use_ssl) return false;
+
+    pthread_mutex_lock(&h2_mutex);
+    for (origin = declined; origin && !found; origin = origin->next) {
+        found = origin->port == port && strcasecmp(origin->hostname, hostname) == 0;
+    }
+    pthread_mutex_unlock(&h2_mutex);
+    return found;
+}
+
+void h2_origin_note_declined(const char* hostname, int port, bool use_ssl) {
+    DeclinedOrigin* origin;
+
+    if (!use_ssl || h2_origin_declined(hostname, port, use_ssl)) return;
+
+    origin = calloc(1, sizeof(DeclinedOrigin));
+    if (!origin) return;
+    origin->hostname = strdup(hostname);
+    if (!origin->hostname) {
+        free(origin);
+        return;
+    }
+    origin->port = port;
+
+    pthread_mutex_lock(&h2_mutex);
+    origin->next = declined;
+    declined = origin;
+    h2_stats.fallbacks++;
+    pthread_mutex_unlock(&h2_mutex);
+}
+
+static void keep_response(NetworkResponse* response, void* context) {
+    *(NetworkResponse**)context = response;
+}
+
+struct NetworkResponse* network_h2_send(const HttpExchange* exchange) {
+    NetworkLoop* loop = NetworkLoopMake();
+    NetworkResponse* response = NULL;
+    HttpExchange copy;
+
+    if (!loop) {
+        return NetworkResponseMake(500, "Internal Server Error",
+                                   "Failed to create event loop");
+    }
+    /* The loop owns what it is given; a blocking send only borrows */
+    if (http_exchange_copy(exchange, &copy) &&
+        network_loop_submit(loop, &copy, keep_response, &response)) {
+        loop->run();
+    }
+    loop->free();
+
+    if (!response) {
+        response = NetworkResponseMake(500, "Internal Server Error",
+                                       "Failed to build request");
+    }
+    return response;
+}
+
+/* ======================================================================== */
+/* Public API                                                               */
+/* ======================================================================== */
+
+void NetworkHttp2GetStats(NetworkHttp2Stats* stats) {
+    if (!stats) return;
+
+    pthread_mutex_lock(&h2_mutex);
+    *stats = h2_stats;
+    stats->idle_sessions = parked_count;
+    pthread_mutex_unlock(&h2_mutex);
+}
+
+void NetworkHttp2ClearSessions(void) {
+    H2Session* sessions;
+    DeclinedOrigin* origins;
+
+    pthread_mutex_lock(&h2_mutex);
+    sessions = parked;
+    parked = NULL;
+    parked_count = 0;
+    origins = declined;
+    declined = NULL;
+    pthread_mutex_unlock(&h2_mutex);
+
+    while (sessions) {
+        H2Session* next = sessions->next;
+        h2_session_close(sessions);
+        sessions = next;
+    }
+    while (origins) {
+        DeclinedOrigin* next = origins->next;
+        free(origins->hostname);
+        free(origins);
+        origins = next;
+    }
+}
@@ -0,0 +1,240 @@
+/**
+ * @file network_headers.c
+ * @brief Common header names as IDs, and the table a request's headers live in
+ *
+ * Header names are case-insensitive, so every lookup works from one
+ * case-folded hash. About thirty names cover nearly every header a client
+ * sends or reads; each has a number, found from the hash through a small
+ * open-addressed index built once. Parsed heads (network_parse.c) and
+ * request header tables both keep the position of the first field with
+ * each number, so finding a common header is a single array read, and
+ * only uncommon names fall back to scanning for the hash.
+ */
+
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define HEADER_INDEX_SLOTS 128      /* Power of two, over four times the names */
+
+/* Lowercase, in HttpHeaderId order */
+static const char* const header_names[HTTP_HEADER_COUNT] = {
+    NULL,
+    "accept", "accept-encoding", "accept-language", "age", "authorization",
+    "cache-control", "connection", "content-encoding", "content-length",
+    "content-type", "cookie", "date", "etag", "expect", "expires", "host",
+    "if-modified-since", "if-none-match", "keep-alive", "last-modified",
+    "location", "proxy-authorization", "retry-after", "server", "set-cookie",
+    "transfer-encoding", "upgrade", "user-agent", "vary", "www-authenticate"
+};
+
+static unsigned char header_index[HEADER_INDEX_SLOTS];     /* ID, 0 = empty */
+static unsigned int header_hashes[HTTP_HEADER_COUNT];
+static pthread_once_t header_index_once = PTHREAD_ONCE_INIT;
+
+static void header_index_build(void) {
+    unsigned int slot;
+    int id;
+
+    for (id = 1; id < HTTP_HEADER_COUNT; id++) {
+        header_hashes[id] = http_header_hash(header_names[id],
+                                             strlen(header_names[id]));
+        slot = header_hashes[id] & (HEADER_INDEX_SLOTS - 1);
+        while (header_index[slot]) slot = (slot + 1) & (HEADER_INDEX_SLOTS - 1);
+        header_index[slot] = (unsigned char)id;
+    }
+}
+
+/* ======================================================================== */
+/* Header Names                                                             */
+/* ======================================================================== */
+
+unsigned int http_header_hash(const char* name, size_t length) {
+    unsigned int hash = HTTP_HEADER_FNV_OFFSET;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)name[i]);
+        hash *= HTTP_HEADER_FNV_PRIME;
+    }
+    return hash;
+}
+
+HttpHeaderId http_header_id(const char* name, size_t length, unsigned int hash) {
+    unsigned int slot = hash & (HEADER_INDEX_SLOTS - 1);
+    int id;
+
+    pthread_once(&header_index_once, header_index_build);
+    while ((id = header_index[slot]) != 0) {
+        if (header_hashes[id] == hash && strlen(header_names[id]) == length &&
+            strncasecmp(header_names[id], name, length) == 0) {
+            return (HttpHeaderId)id;
+        }
+        slot = (slot + 1) & (HEADER_INDEX_SLOTS - 1);
+    }
+    return HTTP_HEADER_OTHER;
+}
+
+/* ======================================================================== */
+/* Header Tables                                                            */
+/* ======================================================================== */
+
+static size_t entry_text_length(const HttpHeaderEntry* entry) {
+    return entry->name_length + entry->value_length + 4;    /* ": \r\n" */
+}
+
+/* Position of the entry called name[0..length), or count */
+static size_t table_position(const HttpHeaderTable* table, const char* name,
+                             size_t length, unsigned int hash, HttpHeaderId id) {
+    size_t i;
+
+    if (id != HTTP_HEADER_OTHER) {
+        return table->first[id] ? table->first[id] - 1u : table->count;
+    }
+    for (i = 0; i < table->count; i++) {
+        const HttpHeaderEntry* entry = &table->entries[i];
+        if (entry->hash == hash && entry->name_length == length &&
+            strncasecmp(entry->name, name, length) == 0) {
+            return i;
+        }
+    }
+    return table->count;
+}
+
+void http_headers_init(HttpHeaderTable* table) {
+    memset(table, 0, sizeof(*table));
+}
+
+void http_headers_free(HttpHeaderTable* table) {
+    size_t i;
+
+    for (i = 0; i < table->count; i++) {
+        free(table->entries[i].name);
+        free(table->entries[i].value);
+    }
+    free(table->entries);
+    http_headers_init(table);
+}
+
+const HttpHeaderEntry* http_headers_find(const HttpHeaderTable* table,
+                                         const char* name) {
+    size_t length = strlen(name);
+    unsigned int hash = http_header_hash(name, length);
+    size_t position = table_position(table, name, length, hash,
+                                     http_header_id(name, length, hash));
+
+    return position < table->count ? &table->entries[position] : NULL;
+}
+
+bool http_headers_set(HttpHeaderTable* table, const char* name,
+                      const char* value) {
+    size_t length = strlen(name);
+    unsigned int hash = http_header_hash(name, length);
+    HttpHeaderId id = http_header_id(name, length, hash);
+    size_t position = table_position(table, name, length, hash, id);
+    HttpHeaderEntry* entry;
+    char* copy = strdup(value);
+
+    if (!copy) return false;
+    if (position < table->count) {
+        entry = &table->entries[position];
+        table->text_length -= entry->value_length;
+        free(entry->value);
+        entry->value = copy;
+        entry->value_length = strlen(copy);
+        table->text_length += entry->value_length;
+        return true;
+    }
+
+    /* first[] holds positions in an unsigned short */
+    if (table->count == 0xffff) {
+        free(copy);
+        return false;
+    }
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 8;
+        HttpHeaderEntry* grown = realloc(table->entries,
+                                         capacity * sizeof(HttpHeaderEntry));
+        if (!grown) {
+            free(copy);
+            return false;
+        }
+        table->entries = grown;
+        table->capacity = capacity;
+    }
+    entry = &table->entries[table->count];
+    entry->name = strdup(name);
+    if (!entry->name) {
+        free(copy);
+        return false;
+    }
+    entry->value = copy;
+    entry->name_length = length;
+    entry->value_length = strlen(copy);
+    entry->hash = hash;
+    entry->id = id;
+    table->text_length += entry_text_length(entry);
+    table->count++;
+    if (id != HTTP_HEADER_OTHER) table->first[id] = (unsigned short)table->count;
+    return true;
+}
+
+void http_headers_remove(HttpHeaderTable* table, const char* name) {
+    size_t length = strlen(name);
+    unsigned int hash = http_header_hash(name, length);
+    size_t position = table_position(table, name, length, hash,
+                                     http_header_id(name, length, hash));
+    HttpHeaderEntry* entry;
+    size_t i;
+
+    if (position >= table->count) return;
+    entry = &table->entries[position];
+    table->text_length -= entry_text_length(entry);
+    free(entry->name);
+    free(entry->value);
+
+    /* Later entries move up to keep the order headers were set in */
+    table->count--;
+    memmove(entry, entry + 1, (table->count - position) * sizeof(HttpHeaderEntry));
+    memset(table->first, 0, sizeof(table->first));
+    for (i = 0; i < table->count; i++) {
+        if (table->entries[i].id != HTTP_HEADER_OTHER) {
+            table->first[table->entries[i].id] = (unsigned short)(i + 1);
+        }
+    }
+}
+
+char* http_headers_format(const HttpHeaderTable* table, unsigned long long skip,
+                          const char* extra) {
+    size_t extra_length = extra ? strlen(extra) : 0;
+    char* text;
+    char* p;
+    size_t i;
+
+    if (table->text_length + extra_length == 0) return NULL;
+    text = malloc(table->text_length + extra_length + 1);
+    if (!text) return NULL;
+
+    p = text;
+    for (i = 0; i < table->count; i++) {
+        const HttpHeaderEntry* entry = &table->entries[i];
+
+        if (entry->id != HTTP_HEADER_OTHER && (skip & HTTP_HEADER_BIT(entry->id))) {
+            continue;
+        }
+        memcpy(p, entry->name, entry->name_length);
+        p += entry->name_length;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy(p, entry->value, entry->value_length);
+        p += entry->value_length;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    memcpy(p, extra ? extra : "", extra_length);
+    p[extra_length] = '\0';
+    return text;
+}
@@ -0,0 +1,635 @@
+/**
+ * @file network_hpack.c
+ * @brief HPACK header compression for HTTP/2 (RFC 7541)
+ *
+ * Header blocks are sequences of references into a static table of common
+ * fields and a dynamic table both ends build as blocks go by, plus literals
+ * that may be Huffman coded. The decoder keeps the table the server's
+ * encoder fills; the encoder keeps its own, so a header repeated on every
+ * request is sent as a single byte after the first time. The Huffman code
+ * is canonical, so decoding needs only the count of codes of each length
+ * and the symbols in code order rather than a tree.
+ */
+
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* RFC 7541 section 4.1: each entry costs its lengths plus this */
+#define HPACK_ENTRY_OVERHEAD 32
+
+#define HPACK_STATIC_COUNT 61
+
+/* ======================================================================== */
+/* Tables (RFC 7541 appendices A and B)                                     */
+/* ======================================================================== */
+
+typedef struct HpackStatic {
+    const char* name;
+    const char* value;
+} HpackStatic;
+
+static const uint32_t huffman_codes[257] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+    0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+    0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+    0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+    0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+    0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+    0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+    0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+    0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+    0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+    0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+    0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+    0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+    0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+    0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+    0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+    0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+    0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+    0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+    0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+    0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+    0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+    0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+    0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+    0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+    0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+    0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+    0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+    0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+    0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+    0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+    0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+    0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee, 0x3fffffff
+};
+
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static const uint16_t huffman_counts[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256
+};
+
+static const HpackStatic static_table[61] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/* ======================================================================== */
+/* Buffers                                                                  */
+/* ======================================================================== */
+
+bool h2_buffer_reserve(H2Buffer* buffer, size_t extra) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    unsigned char* grown;
+
+    if (buffer->capacity - buffer->length >= extra && buffer->data) return true;
+    while (capacity - buffer->length < extra) capacity *= 2;
+    grown = realloc(buffer->data, capacity);
+    if (!grown) return false;
+    buffer->data = grown;
+    buffer->capacity = capacity;
+    return true;
+}
+
+bool h2_buffer_append(H2Buffer* buffer, const void* data, size_t length) {
+    if (!h2_buffer_reserve(buffer, length)) return false;
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+void h2_buffer_free(H2Buffer* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = buffer->capacity = 0;
+}
+
+/* ======================================================================== */
+/* Dynamic Table                                                            */
+/* ======================================================================== */
+
+void hpack_table_init(HpackTable* table, size_t max_size) {
+    memset(table, 0, sizeof(*table));
+    table->max_size = max_size;
+}
+
+void hpack_table_free(HpackTable* table) {
+    size_t i;
+
+    for (i = 0; i < table->count; i++) {
+        free(table->entries[(table->first + i) % table->capacity].name);
+    }
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+/* Entry i, 0 being the newest */
+static HpackEntry* table_entry(HpackTable* table, size_t i) {
+    return &table->entries[(table->first + i) % table->capacity];
+}
+
+static size_t entry_size(size_t name_length, size_t value_length) {
+    return name_length + value_length + HPACK_ENTRY_OVERHEAD;
+}
+
+/* Drop the oldest entries until size more octets fit under max_size */
+static void table_evict(HpackTable* table, size_t size) {
+    while (table->count > 0 && table->size + size > table->max_size) {
+        HpackEntry* oldest = table_entry(table, table->count - 1);
+
+        table->size -= entry_size(oldest->name_length, oldest->value_length);
+        free(oldest->name);
+        table->count--;
+    }
+}
+
+static void table_resize(HpackTable* table, size_t max_size) {
+    table->max_size = max_size;
+    table_evict(table, 0);
+}
+
+/* Section 4.4: an entry larger than the table empties it and is dropped */
+static bool table_add(HpackTable* table, const char* name, size_t name_length,
+                      const char* value, size_t value_length) {
+    size_t size = entry_size(name_length, value_length);
+    HpackEntry* entry;
+    char* copy;
+
+    table_evict(table, size);
+    if (size > table->max_size) return true;
+
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 16;
+        HpackEntry* entries = malloc(capacity * sizeof(HpackEntry));
+        size_t i;
+
+        if (!entries) return false;
+        for (i = 0; i < table->count; i++) entries[i] = *table_entry(table, i);
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+        table->first = 0;
+    }
+
+    copy = malloc(name_length + value_length + 2);
+    if (!copy) return false;
+    memcpy(copy, name, name_length);
+    copy[name_length] = '\0';
+    memcpy(copy + name_length + 1, value, value_length);
+    copy[name_length + 1 + value_length] = '\0';
+
+    table->first = (table->first + table->capacity - 1) % table->capacity;
+    entry = table_entry(table, 0);
+    entry->name = copy;
+    entry->name_length = name_length;
+    entry->value = copy + name_length + 1;
+    entry->value_length = value_length;
+    table->count++;
+    table->size += size;
+    return true;
+}
+
+/* ======================================================================== */
+/* Primitives (RFC 7541 section 5)                                          */
+/* ======================================================================== */
+
+static bool put_integer(H2Buffer* out, unsigned char flags, int prefix,
+                        size_t value) {
+    size_t max = ((size_t)1 << prefix) - 1;
+    unsigned char bytes[16];
+    size_t n = 0;
+
+    if (value < max) {
+        bytes[n++] = (unsigned char)(flags | value);
+    } else {
+        bytes[n++] = (unsigned char)(flags | max);
+        value -= max;
+        while (value >= 128) {
+            bytes[n++] = (unsigned char)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        bytes[n++] = (unsigned char)value;
+    }
+    return h2_buffer_append(out, bytes, n);
+}
+
+static bool get_integer(const unsigned char** p, const unsigned char* end,
+                        int prefix, size_t* value) {
+    size_t max = ((size_t)1 << prefix) - 1;
+    unsigned int shift = 0;
+
+    if (*p >= end) return false;
+    *value = *(*p)++ & max;
+    if (*value < max) return true;
+
+    for (;;) {
+        unsigned char byte;
+
+        /* Anything past 2^28 is an attack rather than a header */
+        if (*p >= end || shift > 21) return false;
+        byte = *(*p)++;
+        *value += (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) return true;
+    }
+}
+
+static size_t huffman_length(const char* data, size_t length) {
+    size_t bits = 0;
+    size_t i;
+
+    for (i = 0; i < length; i++) bits += huffman_lengths[(unsigned char)data[i]];
+    return (bits + 7) / 8;
+}
+
+static bool huffman_encode(H2Buffer* out, const char* data, size_t length) {
+    uint64_t pending = 0;
+    int bits = 0;
+    size_t i;
+
+    if (!h2_buffer_reserve(out, huffman_length(data, length))) return false;
+    for (i = 0; i < length; i++) {
+        unsigned char symbol = (unsigned char)data[i];
+
+        pending = (pending << huffman_lengths[symbol]) | huffman_codes[symbol];
+        bits += huffman_lengths[symbol];
+        while (bits >= 8) {
+            bits -= 8;
+            out->data[out->length++] = (unsigned char)(pending >> bits);
+        }
+        pending &= ((uint64_t)1 << bits) - 1;
+    }
+    /* Pad with the most significant bits of EOS, which are all ones */
+    if (bits > 0) {
+        out->data[out->length++] = (unsigned char)((pending << (8 - bits)) |
+                                                   (0xff >> bits));
+    }
+    return true;
+}
+
+/* Canonical decode, one bit at a time: within each length the codes are
+ * consecutive, so a code of len bits is valid when it falls among that
+ * length's count codes */
+static bool huffman_decode(const unsigned char* data, size_t length,
+                           H2Buffer* out) {
+    int code = 0, first = 0, index = 0, len = 0;
+    bool ones = true;   /* Every bit of the partial code so far was 1 */
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        int bit;
+
+        for (bit = 7; bit >= 0; bit--) {
+            int set = (data[i] >> bit) & 1;
+            int count;
+
+            code |= set;
+            ones = ones && set;
+            count = huffman_counts[++len];
+            if (code - count < first) {
+                int symbol = huffman_symbols[index + (code - first)];
+
+                /* EOS inside a string is an error (section 5.2) */
+                if (symbol == 256) return false;
+                if (!h2_buffer_reserve(out, 1)) return false;
+                out->data[out->length++] = (unsigned char)symbol;
+                code = first = index = len = 0;
+                ones = true;
+                continue;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+            if (len == 30) return false;
+        }
+    }
+    /* Padding is at most 7 bits, all of them ones */
+    return len <= 7 && ones;
+}
+
+static bool put_string(H2Buffer* out, const char* data, size_t length) {
+    size_t coded = huffman_length(data, length);
+
+    if (coded < length) {
+        return put_integer(out, 0x80, 7, coded) &&
+               huffman_encode(out, data, length);
+    }
+    return put_integer(out, 0x00, 7, length) &&
+           h2_buffer_append(out, data, length);
+}
+
+/* Decode a string into out, NUL terminated */
+static bool get_string(const unsigned char** p, const unsigned char* end,
+                       H2Buffer* out) {
+    bool huffman;
+    size_t length;
+
+    out->length = 0;
+    if (*p >= end) return false;
+    huffman = (**p & 0x80) != 0;
+    if (!get_integer(p, end, 7, &length) || length > (size_t)(end - *p)) {
+        return false;
+    }
+    if (huffman) {
+        if (!huffman_decode(*p, length, out)) return false;
+    } else if (!h2_buffer_append(out, *p, length)) {
+        return false;
+    }
+    *p += length;
+    if (!h2_buffer_reserve(out, 1)) return false;
+    out->data[out->length] = '\0';
+    return true;
+}
+
+/* ======================================================================== */
+/* Decoder                                                                  */
+/* ======================================================================== */
+
+/* Field at index (1-based across both tables), or false if out of range */
+static bool lookup(HpackTable* table, size_t index, const char** name,
+                   size_t* name_length, const char** value,
+                   size_t* value_length) {
+    if (index == 0) return false;
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = static_table[index - 1].name;
+        *value = static_table[index - 1].value;
+        *name_length = strlen(*name);
+        *value_length = strlen(*value);
+        return true;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= table->count) return false;
+    *name = table_entry(table, index)->name;
+    *name_length = table_entry(table, index)->name_length;
+    *value = table_entry(table, index)->value;
+    *value_length = table_entry(table, index)->value_length;
+    return true;
+}
+
+bool hpack_decode(HpackTable* table, size_t limit, const unsigned char* data,
+                  size_t length, HpackFieldSink sink, void* context) {
+    const unsigned char* p = data;
+    const unsigned char* end = data + length;
+    H2Buffer name = { NULL, 0, 0 };
+    H2Buffer value = { NULL, 0, 0 };
+    bool fields_seen = false;
+    bool ok = true;
+
+    while (ok && p < end) {
+        unsigned char byte = *p;
+        const char* found_name;
+        const char* found_value;
+        size_t found_name_length, found_value_length;
+        size_t index;
+        int prefix;
+
+        if (byte & 0x80) {
+            /* Indexed field */
+            ok = get_integer(&p, end, 7, &index) &&
+                 lookup(table, index, &found_name, &found_name_length,
+                        &found_value, &found_value_length);
+            if (ok) {
+                sink(found_name, found_name_length, found_value,
+                     found_value_length, context);
+            }
+            fields_seen = true;
+            continue;
+        }
+        if ((byte & 0xe0) == 0x20) {
+            /* Size updates only open a block (section 4.2) */
+            ok = !fields_seen && get_integer(&p, end, 5, &index) &&
+                 index <= limit;
+            if (ok) table_resize(table, index);
+            continue;
+        }
+
+        /* Literal: with incremental indexing (01), without (0000) or
+         * never indexed (0001) */
+        prefix = (byte & 0x40) ? 6 : 4;
+        ok = get_integer(&p, end, prefix, &index);
+        if (ok && index > 0) {
+            ok = lookup(table, index, &found_name, &found_name_length,
+                        &found_value, &found_value_length) &&
+                 h2_buffer_append(&name, found_name, found_name_length + 1);
+            name.length = found_name_length;
+        } else if (ok) {
+            ok = get_string(&p, end, &name);
+        }
+        ok = ok && get_string(&p, end, &value);
+        if (ok) {
+            sink((const char*)name.data, name.length, (const char*)value.data,
+                 value.length, context);
+            if (byte & 0x40) {
+                ok = table_add(table, (const char*)name.data, name.length,
+                               (const char*)value.data, value.length);
+            }
+        }
+        name.length = 0;
+        fields_seen = true;
+    }
+
+    h2_buffer_free(&name);
+    h2_buffer_free(&value);
+    return ok;
+}
+
+/* ======================================================================== */
+/* Encoder                                                                  */
+/* ======================================================================== */
+
+void hpack_encoder_init(HpackEncoder* encoder) {
+    hpack_table_init(&encoder->table, 4096);
+    encoder->pending_size = 4096;
+    encoder->resized = false;
+}
+
+void hpack_encoder_set_max(HpackEncoder* encoder, size_t size) {
+    /* Tables larger than the default only cost memory; stay at 4096 */
+    if (size > 4096) size = 4096;
+    if (size == encoder->table.max_size && !encoder->resized) return;
+    table_resize(&encoder->table, size);
+    encoder->pending_size = size;
+    encoder->resized = true;
+}
+
+bool hpack_encode_begin(HpackEncoder* encoder, H2Buffer* out) {
+    if (!encoder->resized) return true;
+    encoder->resized = false;
+    return put_integer(out, 0x20, 5, encoder->pending_size);
+}
+
+bool hpack_encode_field(HpackEncoder* encoder, H2Buffer* out,
+                        const char* name, size_t name_length,
+                        const char* value, size_t value_length,
+                        HpackIndexing indexing) {
+    HpackTable* table = &encoder->table;
+    size_t name_index = 0;
+    size_t i;
+
+    for (i = 0; i < HPACK_STATIC_COUNT; i++) {
+        const HpackStatic* field = &static_table[i];
+
+        if (strlen(field->name) != name_length ||
+            memcmp(field->name, name, name_length) != 0) {
+            continue;
+        }
+        if (indexing != HPACK_NEVER_INDEX &&
+            strlen(field->value) == value_length &&
+            memcmp(field->value, value, value_length) == 0) {
+            return put_integer(out, 0x80, 7, i + 1);
+        }
+        if (!name_index) name_index = i + 1;
+    }
+    for (i = 0; i < table->count; i++) {
+        HpackEntry* entry = table_entry(table, i);
+
+        if (entry->name_length != name_length ||
+            memcmp(entry->name, name, name_length) != 0) {
+            continue;
+        }
+        if (indexing != HPACK_NEVER_INDEX &&
+            entry->value_length == value_length &&
+            memcmp(entry->value, value, value_length) == 0) {
+            return put_integer(out, 0x80, 7, HPACK_STATIC_COUNT + 1 + i);
+        }
+        if (!name_index) name_index = HPACK_STATIC_COUNT + 1 + i;
+    }
+
+    /* A field too big for half the table would only flush it */
+    if (indexing == HPACK_INDEX &&
+        entry_size(name_length, value_length) > table->max_size / 2) {
+        indexing = HPACK_NO_INDEX;
+    }
+
+    switch (indexing) {
+        case HPACK_INDEX:
+            if (!put_integer(out, 0x40, 6, name_index)) return false;
+            break;
+        case HPACK_NO_INDEX:
+            if (!put_integer(out, 0x00, 4, name_index)) return false;
+            break;
+        case HPACK_NEVER_INDEX:
+            if (!put_integer(out, 0x10, 4, name_index)) return false;
+            break;
+    }
+    if (!name_index && !put_string(out, name, name_length)) return false;
+    if (!put_string(out, value, value_length)) return false;
+    return indexing != HPACK_INDEX ||
+           table_add(table, name, name_length, value, value_length);
+}
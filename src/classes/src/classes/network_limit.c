@@ -0,0 +1,435 @@
+/**
+ * @file network_limit.c
+ * @brief Per-origin concurrency and rate limits on outgoing requests
+ *
+ * Each limited host:port has a semaphore (a count of requests in flight)
+ * and a token bucket. The bucket is kept as the time its next token is
+ * due, the generic cell rate algorithm: a request may go while that time
+ * is no more than burst - 1 intervals ahead of now, and going moves it an
+ * interval on. Both are single words changed by compare-and-swap, so
+ * admitting a request takes no lock. Only blocking sends that have to
+ * wait for an in-flight slot sleep on a condition variable, which
+ * releases signal while anyone is asleep on it.
+ *
+ * Origins live in an open-addressed table that is read without locking
+ * and only added to under config_lock. Entries stay for the life of the
+ * process, so a request can hold on to its limiter without a reference.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LIMIT_MAX_ORIGINS 256
+#define LIMIT_SLOTS 512             /* Power of two, twice the origins */
+#define LIMIT_SLEEP_SLICE 0.1       /* Longest a blocking send sleeps unchecked */
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+struct NetworkLimiter {
+    char* hostname;             /* NULL for the default */
+    int port;
+    unsigned int hash;
+    bool own;                   /* Configured itself rather than defaulted */
+    NetworkLimitOptions options;    /* As configured, under config_lock */
+
+    /* Read by every request */
+    int max_in_flight;
+    int max_queued;
+    int max_wait_ms;
+    long long interval_ns;      /* Between tokens, 0 = no rate limit */
+    long long tolerance_ns;     /* (burst - 1) intervals */
+
+    /* Changed by every request */
+    long long due_ns;           /* When the next token is due */
+    int in_flight;
+    int queued;
+    int sleepers;               /* Blocking sends waiting on released */
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+};
+
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static NetworkLimiter* limiters[LIMIT_SLOTS];
+static size_t limiter_count = 0;
+static NetworkLimiter default_limiter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .released = PTHREAD_COND_INITIALIZER
+};
+static bool limits_used = false;        /* Anything was ever limited */
+static bool default_limited = false;
+
+static unsigned long stat_admitted = 0;
+static unsigned long stat_delayed = 0;
+static unsigned long stat_rejected = 0;
+static unsigned long long stat_wait_ns = 0;
+static unsigned long long stat_wait_max_ns = 0;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+static long long now_ns(void) {
+    return (long long)(network_now() * 1e9);
+}
+
+static unsigned int origin_hash(const char* hostname, int port) {
+    unsigned int hash = HTTP_HEADER_FNV_OFFSET;
+
+    for (; *hostname; hostname++) {
+        hash ^= (unsigned char)tolower((unsigned char)*hostname);
+        hash *= HTTP_HEADER_FNV_PRIME;
+    }
+    return (hash ^ (unsigned int)port) * HTTP_HEADER_FNV_PRIME;
+}
+
+static bool options_limit(const NetworkLimitOptions* options) {
+    return options->max_in_flight > 0 || options->requests_per_second > 0;
+}
+
+static void limiter_apply(NetworkLimiter* limiter, const NetworkLimitOptions* options) {
+    long long interval = 0;
+    int burst = options->burst > 1 ? options->burst : 1;
+
+    if (options->requests_per_second > 0) {
+        interval = (long long)(1e9 / options->requests_per_second);
+        if (interval < 1) interval = 1;
+    }
+    limiter->options = *options;
+    __atomic_store_n(&limiter->max_in_flight, options->max_in_flight, __ATOMIC_RELAXED);
+    __atomic_store_n(&limiter->max_queued, options->max_queued, __ATOMIC_RELAXED);
+    __atomic_store_n(&limiter->max_wait_ms, options->max_wait_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&limiter->tolerance_ns, interval * (burst - 1), __ATOMIC_RELAXED);
+    __atomic_store_n(&limiter->interval_ns, interval, __ATOMIC_RELAXED);
+}
+
+static bool limiter_active(NetworkLimiter* limiter) {
+    return __atomic_load_n(&limiter->max_in_flight, __ATOMIC_RELAXED) > 0 ||
+           __atomic_load_n(&limiter->interval_ns, __ATOMIC_RELAXED) > 0;
+}
+
+/* Lock-free; entries are published whole and never move */
+static NetworkLimiter* table_find(const char* hostname, int port, unsigned int hash) {
+    size_t slot = hash & (LIMIT_SLOTS - 1);
+    NetworkLimiter* limiter;
+
+    while ((limiter = __atomic_load_n(&limiters[slot], __ATOMIC_ACQUIRE)) != NULL) {
+        if (limiter->hash == hash && limiter->port == port &&
+            strcasecmp(limiter->hostname, hostname) == 0) {
+            return limiter;
+        }
+        slot = (slot + 1) & (LIMIT_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/* The entry for host:port, made with options if new; config_lock held.
+ * NULL when the table is full or out of memory. */
+static NetworkLimiter* table_add(const char* hostname, int port,
+                                 const NetworkLimitOptions* options) {
+    unsigned int hash = origin_hash(hostname, port);
+    NetworkLimiter* limiter = table_find(hostname, port, hash);
+    size_t slot;
+
+    if (limiter) return limiter;
+    if (limiter_count >= LIMIT_MAX_ORIGINS) return NULL;
+
+    limiter = calloc(1, sizeof(NetworkLimiter));
+    if (!limiter) return NULL;
+    limiter->hostname = strdup(hostname);
+    if (!limiter->hostname) {
+        free(limiter);
+        return NULL;
+    }
+    limiter->port = port;
+    limiter->hash = hash;
+    pthread_mutex_init(&limiter->lock, NULL);
+    pthread_cond_init(&limiter->released, NULL);
+    limiter_apply(limiter, options);
+
+    slot = hash & (LIMIT_SLOTS - 1);
+    while (limiters[slot]) slot = (slot + 1) & (LIMIT_SLOTS - 1);
+    __atomic_store_n(&limiters[slot], limiter, __ATOMIC_RELEASE);
+    limiter_count++;
+    return limiter;
+}
+
+static void slot_give(NetworkLimiter* limiter) {
+    __atomic_sub_fetch(&limiter->in_flight, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&limiter->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&limiter->lock);
+        pthread_cond_broadcast(&limiter->released);
+        pthread_mutex_unlock(&limiter->lock);
+    }
+}
+
+static bool slot_take(NetworkLimiter* limiter) {
+    int max = __atomic_load_n(&limiter->max_in_flight, __ATOMIC_RELAXED);
+    int current = __atomic_load_n(&limiter->in_flight, __ATOMIC_SEQ_CST);
+
+    /* Counted even without a limit, so one set later sees the truth */
+    if (max <= 0) {
+        __atomic_add_fetch(&limiter->in_flight, 1, __ATOMIC_SEQ_CST);
+        return true;
+    }
+    do {
+        if (current >= max) return false;
+    } while (!__atomic_compare_exchange_n(&limiter->in_flight, &current, current + 1,
+                                          true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    return true;
+}
+
+static bool token_take(NetworkLimiter* limiter, double* retry_in) {
+    long long interval = __atomic_load_n(&limiter->interval_ns, __ATOMIC_RELAXED);
+    long long tolerance = __atomic_load_n(&limiter->tolerance_ns, __ATOMIC_RELAXED);
+    long long now;
+    long long due;
+    long long next;
+
+    if (interval <= 0) return true;
+    now = now_ns();
+    due = __atomic_load_n(&limiter->due_ns, __ATOMIC_RELAXED);
+    do {
+        next = due > now ? due : now;
+        if (next - now > tolerance) {
+            *retry_in = (double)(next - tolerance - now) / 1e9;
+            return false;
+        }
+        next += interval;
+    } while (!__atomic_compare_exchange_n(&limiter->due_ns, &due, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/* Sleep until a slot is released, or a slice of the wait has passed */
+static bool await_release(NetworkLimiter* limiter, double deadline,
+                          double* retry_in) {
+    double slice = LIMIT_SLEEP_SLICE;
+    struct timespec until;
+    bool admitted;
+
+    if (deadline > 0 && deadline - network_now() < slice) {
+        slice = deadline - network_now();
+    }
+    clock_gettime(CLOCK_REALTIME, &until);
+    if (slice > 0) {
+        long long ns = until.tv_nsec + (long long)(slice * 1e9);
+        until.tv_sec += (time_t)(ns / 1000000000LL);
+        until.tv_nsec = (long)(ns % 1000000000LL);
+    }
+
+    /* Counted as asleep before trying again, so a release in between
+     * either lets the try through or signals the wait */
+    pthread_mutex_lock(&limiter->lock);
+    __atomic_add_fetch(&limiter->sleepers, 1, __ATOMIC_SEQ_CST);
+    admitted = network_limit_try(limiter, retry_in);
+    if (!admitted && *retry_in == 0 && slice > 0) {
+        pthread_cond_timedwait(&limiter->released, &limiter->lock, &until);
+        admitted = network_limit_try(limiter, retry_in);
+    }
+    __atomic_sub_fetch(&limiter->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&limiter->lock);
+    return admitted;
+}
+
+static bool await_token(NetworkLimiter* limiter, double* retry_in) {
+    struct timespec pause;
+
+    pause.tv_sec = (time_t)*retry_in;
+    pause.tv_nsec = (long)((*retry_in - (double)pause.tv_sec) * 1e9);
+    nanosleep(&pause, NULL);
+    return network_limit_try(limiter, retry_in);
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+NetworkLimiter* network_limit_find(const char* hostname, int port) {
+    NetworkLimiter* limiter;
+
+    if (!hostname || !__atomic_load_n(&limits_used, __ATOMIC_ACQUIRE)) return NULL;
+
+    limiter = table_find(hostname, port, origin_hash(hostname, port));
+    if (!limiter) {
+        if (!__atomic_load_n(&default_limited, __ATOMIC_ACQUIRE)) return NULL;
+        pthread_mutex_lock(&config_lock);
+        limiter = table_add(hostname, port, &default_limiter.options);
+        pthread_mutex_unlock(&config_lock);
+        if (!limiter) limiter = &default_limiter;
+    }
+    return limiter_active(limiter) ? limiter : NULL;
+}
+
+bool network_limit_try(NetworkLimiter* limiter, double* retry_in) {
+    *retry_in = 0;
+    if (!slot_take(limiter)) return false;
+    if (!token_take(limiter, retry_in)) {
+        /* The caller may hold limiter->lock, so sleepers are woken
+         * without it; one that misses this finds the slot next slice */
+        __atomic_sub_fetch(&limiter->in_flight, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&limiter->sleepers, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_broadcast(&limiter->released);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool network_limit_enqueue(NetworkLimiter* limiter) {
+    int max = __atomic_load_n(&limiter->max_queued, __ATOMIC_RELAXED);
+
+    if (__atomic_add_fetch(&limiter->queued, 1, __ATOMIC_SEQ_CST) > max && max > 0) {
+        __atomic_sub_fetch(&limiter->queued, 1, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    return true;
+}
+
+void network_limit_dequeue(NetworkLimiter* limiter) {
+    __atomic_sub_fetch(&limiter->queued, 1, __ATOMIC_SEQ_CST);
+}
+
+double network_limit_deadline(NetworkLimiter* limiter, double since,
+                              double deadline) {
+    int max_wait = __atomic_load_n(&limiter->max_wait_ms, __ATOMIC_RELAXED);
+    double limit = since + max_wait / 1000.0;
+
+    if (max_wait > 0 && (deadline <= 0 || limit < deadline)) return limit;
+    return deadline;
+}
+
+bool network_limit_acquire(NetworkLimiter* limiter, double since,
+                           double deadline, char* error, size_t error_size) {
+    double retry_in;
+    bool admitted;
+
+    if (network_limit_try(limiter, &retry_in)) {
+        network_limit_admitted(0);
+        return true;
+    }
+    if (!network_limit_enqueue(limiter)) {
+        network_limit_rejected();
+        snprintf(error, error_size, "Request limit: too many requests waiting");
+        return false;
+    }
+
+    deadline = network_limit_deadline(limiter, since, deadline);
+    for (;;) {
+        /* Refuse now rather than sleep through the deadline */
+        if (deadline > 0 && network_now() + retry_in > deadline) {
+            admitted = false;
+            break;
+        }
+        admitted = retry_in > 0 ? await_token(limiter, &retry_in)
+                                : await_release(limiter, deadline, &retry_in);
+        if (admitted) break;
+    }
+    network_limit_dequeue(limiter);
+
+    if (!admitted) {
+        network_limit_rejected();
+        snprintf(error, error_size, "Request limit: %s would outlast the deadline",
+                 retry_in > 0 ? "waiting for the rate" : "waiting for a slot");
+        return false;
+    }
+    network_limit_admitted(network_now() - since);
+    return true;
+}
+
+void network_limit_release(NetworkLimiter* limiter) {
+    slot_give(limiter);
+}
+
+void network_limit_admitted(double waited) {
+    unsigned long long ns = waited > 0 ? (unsigned long long)(waited * 1e9) : 0;
+    unsigned long long max = __atomic_load_n(&stat_wait_max_ns, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&stat_admitted, 1, __ATOMIC_RELAXED);
+    if (ns == 0) return;
+    __atomic_add_fetch(&stat_delayed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat_wait_ns, ns, __ATOMIC_RELAXED);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&stat_wait_max_ns, &max, ns, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        /* max reloaded by the failed exchange */
+    }
+}
+
+void network_limit_rejected(void) {
+    __atomic_add_fetch(&stat_rejected, 1, __ATOMIC_RELAXED);
+}
+
+/* ======================================================================== */
+/* Public API                                                               */
+/* ======================================================================== */
+
+int NetworkLimitConfigure(const char* host, int port,
+                          const NetworkLimitOptions* options) {
+    NetworkLimitOptions none;
+    NetworkLimiter* limiter;
+    size_t i;
+
+    memset(&none, 0, sizeof(none));
+    if (options && (options->max_in_flight < 0 || options->requests_per_second < 0 ||
+                    options->burst < 0 || options->max_queued < 0 ||
+                    options->max_wait_ms < 0)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&config_lock);
+    if (!host) {
+        limiter_apply(&default_limiter, options ? options : &none);
+        for (i = 0; i < LIMIT_SLOTS; i++) {
+            if (limiters[i] && !limiters[i]->own) {
+                limiter_apply(limiters[i], &default_limiter.options);
+            }
+        }
+        __atomic_store_n(&default_limited, options && options_limit(options),
+                         __ATOMIC_RELEASE);
+    } else {
+        limiter = table_add(host, port, options ? options : &default_limiter.options);
+        if (!limiter) {
+            pthread_mutex_unlock(&config_lock);
+            return 0;
+        }
+        limiter->own = options != NULL;
+        limiter_apply(limiter, options ? options : &default_limiter.options);
+    }
+    if (options && options_limit(options)) {
+        __atomic_store_n(&limits_used, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&config_lock);
+    return 1;
+}
+
+void NetworkLimitGetOptions(const char* host, int port,
+                            NetworkLimitOptions* options) {
+    NetworkLimiter* limiter = NULL;
+
+    if (!options) return;
+    pthread_mutex_lock(&config_lock);
+    if (host) limiter = table_find(host, port, origin_hash(host, port));
+    *options = limiter ? limiter->options : default_limiter.options;
+    pthread_mutex_unlock(&config_lock);
+}
+
+void NetworkLimitGetStats(NetworkLimitStats* stats) {
+    if (!stats) return;
+
+    stats->admitted = __atomic_load_n(&stat_admitted, __ATOMIC_RELAXED);
+    stats->delayed = __atomic_load_n(&stat_delayed, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&stat_rejected, __ATOMIC_RELAXED);
+    stats->wait_ms_total = (double)__atomic_load_n(&stat_wait_ns, __ATOMIC_RELAXED) / 1e6;
+    stats->wait_ms_max = (double)__atomic_load_n(&stat_wait_max_ns, __ATOMIC_RELAXED) / 1e6;
+}
@@ -0,0 +1,1444 @@
+/**
+ * @file network_loop.c
+ * @brief Event loop driving many HTTP exchanges over non-blocking sockets
+ *
+ * Each submitted exchange becomes an AsyncOp that walks through name
+ * resolution, connect, TLS handshake, send and receive as its socket
+ * becomes ready. Connections come from the shared keep-alive pool; when a
+ * host is at its connection limit the op waits in a FIFO queue until a
+ * slot frees up; it waits there too while the host's rate or in-flight
+ * limit (network_limit.c) holds it back. Cache misses are resolved on the
+ * resolver threads, which post results back through a wake-up pipe so the
+ * loop never blocks on DNS. Deadlines are kept on a hashed timer wheel so
+ * arming, cancelling and expiring a timer are all O(1). The same wheel
+ * runs plain timed callbacks for layers built on the loop, such as request
+ * retry and hedging.
+ *
+ * HTTP/2 exchanges do not hold a connection of their own. The first one
+ * for an origin starts a carrier op that connects and then drives an
+ * H2Session; exchanges become streams riding it, and the rest wait queued
+ * until it is ready or has room. A carrier left without streams at the
+ * end of a round parks its session for whichever loop wants it next.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define LOOP_USE_EPOLL 1
+#else
+#define LOOP_USE_EPOLL 0
+#endif
+
+/* 512 slots of 10ms cover 5.12 seconds per revolution; longer timeouts
+ * wait out whole revolutions in the rounds counter */
+#define LOOP_WHEEL_SLOTS 512
+#define LOOP_TICK_SECONDS 0.01
+#define LOOP_MAX_EVENTS 256
+
+enum { LOOP_READ = 1, LOOP_WRITE = 2 };
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef enum AsyncState {
+    ASYNC_QUEUED,
+    ASYNC_RESOLVING,
+    ASYNC_CONNECTING,
+    ASYNC_HANDSHAKE,
+    ASYNC_SENDING,
+    ASYNC_RECEIVING,
+    ASYNC_CARRYING,             /* Carrier driving its HTTP/2 session */
+    ASYNC_STREAMING             /* Exchange sent as a stream of a carrier */
+} AsyncState;
+
+struct ResolveTicket;
+
+typedef struct AsyncOp {
+    HttpExchange exchange;
+    NetworkResponseCallback callback;
+    void* context;
+
+    AsyncState state;
+    Connection* conn;
+    int attempts;
+    HttpResponseReader reader;
+    int events;                 /* LOOP_READ / LOOP_WRITE being watched */
+    int race_fds[CONNECT_MAX_RACE]; /* Connect attempts being watched */
+    int race_watched;
+    struct ResolveTicket* ticket;   /* Lookup in flight */
+    bool cancelled;             /* Waiting to be freed; ignore its events */
+    NetworkTiming timing;
+
+    /* The host's rate and concurrency limits */
+    NetworkLimiter* limiter;
+    bool limit_queued;          /* Counted among those waiting since limit_since */
+    bool limit_held;            /* Admitted, holding an in-flight slot */
+    double limit_since;
+
+    /* A timed callback rather than an exchange */
+    void (*alarm)(void* context);
+
+    /* HTTP/2: a carrier owns the connection and session its streams ride */
+    bool carrier;
+    H2Session* session;
+    struct AsyncOp* rides;      /* Stream: the carrier it was sent on */
+    unsigned int stream_id;
+
+    /* Timer wheel slot list */
+    struct AsyncOp* timer_next;
+    struct AsyncOp* timer_prev;
+    size_t timer_slot;
+    unsigned long rounds;
+    bool timer_armed;
+
+    /* Either the queued or the active list */
+    struct AsyncOp* next;
+    struct AsyncOp* prev;
+} AsyncOp;
+
+/* Where resolver threads leave finished lookups. Reference counted, since
+ * a lookup may outlive the loop that asked for it. */
+typedef struct LoopMailbox {
+    pthread_mutex_t lock;
+    int wake_read;
+    int wake_write;
+    struct ResolveTicket* done;
+    int refs;
+    bool closed;
+} LoopMailbox;
+
+typedef struct ResolveTicket {
+    LoopMailbox* mailbox;
+    AsyncOp* op;                /* NULL once the op gave up; loop thread only */
+    NetworkAddressList addresses;
+    bool ok;
+    char error[192];
+    struct ResolveTicket* next;
+} ResolveTicket;
+
+typedef struct OpList {
+    AsyncOp* head;
+    AsyncOp* tail;
+    size_t count;
+} OpList;
+
+typedef struct NetworkLoopPrivate {
+    NetworkLoop public;     /* Public interface MUST be first */
+
+    OpList queued;          /* Waiting for a connection slot */
+    OpList active;          /* Own a connection */
+    OpList alarms;          /* Timed callbacks not yet due */
+    OpList carriers;        /* HTTP/2 connections, not counted as pending */
+    OpList cancelled;       /* Freed once nothing can still refer to them */
+    size_t completed;
+    size_t connecting;      /* Active ops racing connect attempts */
+    bool stopping;
+    bool closing;
+
+    /* Timer wheel */
+    AsyncOp* wheel[LOOP_WHEEL_SLOTS];
+    unsigned long tick;
+    double origin;
+    size_t timers;
+
+    LoopMailbox* mailbox;
+
+#if LOOP_USE_EPOLL
+    int epoll_fd;
+#else
+    struct pollfd* poll_fds;
+    AsyncOp** poll_ops;
+    size_t poll_capacity;
+#endif
+} NetworkLoopPrivate;
+
+static NetworkLoop* default_loop = NULL;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+static void list_push(OpList* list, AsyncOp* op) {
+    op->next = NULL;
+    op->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = op;
+    } else {
+        list->head = op;
+    }
+    list->tail = op;
+    list->count++;
+}
+
+static void list_remove(OpList* list, AsyncOp* op) {
+    if (op->prev) {
+        op->prev->next = op->next;
+    } else {
+        list->head = op->next;
+    }
+    if (op->next) {
+        op->next->prev = op->prev;
+    } else {
+        list->tail = op->prev;
+    }
+    op->next = op->prev = NULL;
+    list->count--;
+}
+
+static unsigned long loop_ticks_now(NetworkLoopPrivate* loop) {
+    return (unsigned long)((network_now() - loop->origin) / LOOP_TICK_SECONDS);
+}
+
+static void timer_arm(NetworkLoopPrivate* loop, AsyncOp* op, int milliseconds) {
+    unsigned long ticks;
+
+    if (milliseconds <= 0) milliseconds = 30000;
+    /* The current tick is already partly gone; one more means a timer
+     * never fires early */
+    ticks = (unsigned long)(milliseconds / 1000.0 / LOOP_TICK_SECONDS) + 1;
+
+    op->timer_slot = (size_t)((loop->tick + ticks) % LOOP_WHEEL_SLOTS);
+    op->rounds = (ticks - 1) / LOOP_WHEEL_SLOTS;
+    op->timer_prev = NULL;
+    op->timer_next = loop->wheel[op->timer_slot];
+    if (op->timer_next) op->timer_next->timer_prev = op;
+    loop->wheel[op->timer_slot] = op;
+    op->timer_armed = true;
+    loop->timers++;
+}
+
+static void timer_cancel(NetworkLoopPrivate* loop, AsyncOp* op) {
+    if (!op->timer_armed) return;
+
+    if (op->timer_prev) {
+        op->timer_prev->timer_next = op->timer_next;
+    } else {
+        loop->wheel[op->timer_slot] = op->timer_next;
+    }
+    if (op->timer_next) op->timer_next->timer_prev = op->timer_prev;
+    op->timer_next = op->timer_prev = NULL;
+    op->timer_armed = false;
+    loop->timers--;
+}
+
+static LoopMailbox* mailbox_create(void) {
+    LoopMailbox* mailbox = calloc(1, sizeof(LoopMailbox));
+    int fds[2];
+
+    if (!mailbox) return NULL;
+    if (pipe(fds) < 0) {
+        free(mailbox);
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    pthread_mutex_init(&mailbox->lock, NULL);
+    mailbox->wake_read = fds[0];
+    mailbox->wake_write = fds[1];
+    mailbox->refs = 1;
+    return mailbox;
+}
+
+static void mailbox_unref(LoopMailbox* mailbox) {
+    bool last;
+
+    pthread_mutex_lock(&mailbox->lock);
+    last = --mailbox->refs == 0;
+    pthread_mutex_unlock(&mailbox->lock);
+    if (!last) return;
+
+    close(mailbox->wake_read);
+    close(mailbox->wake_write);
+    pthread_mutex_destroy(&mailbox->lock);
+    free(mailbox);
+}
+
+static void ticket_free(ResolveTicket* ticket) {
+    LoopMailbox* mailbox = ticket->mailbox;
+
+    network_address_list_free(&ticket->addresses);
+    free(ticket);
+    mailbox_unref(mailbox);
+}
+
+/* Runs on a resolver thread (or inline on a cache hit): park the result
+ * and wake the loop */
+static void loop_resolved(NetworkAddressList* addresses, const char* error,
+                          void* context) {
+    ResolveTicket* ticket = (ResolveTicket*)context;
+    LoopMailbox* mailbox = ticket->mailbox;
+
+    if (addresses) {
+        ticket->addresses = *addresses;
+        ticket->ok = true;
+    } else {
+        snprintf(ticket->error, sizeof(ticket->error), "%s",
+                 error ? error : "Failed to resolve hostname");
+    }
+
+    pthread_mutex_lock(&mailbox->lock);
+    if (mailbox->closed) {
+        pthread_mutex_unlock(&mailbox->lock);
+        ticket_free(ticket);
+        return;
+    }
+    ticket->next = mailbox->done;
+    mailbox->done = ticket;
+    if (write(mailbox->wake_write, "r", 1) < 0) {
+        /* Pipe already full means a wake-up is already pending */
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+}
+
+/* ======================================================================== */
+/* Poller                                                                   */
+/* ======================================================================== */
+
+static void loop_watch(NetworkLoopPrivate* loop, AsyncOp* op, int events) {
+#if LOOP_USE_EPOLL
+    struct epoll_event ev;
+
+    if (op->events == events || !op->conn) return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & LOOP_READ) ? EPOLLIN : 0) |
+                ((events & LOOP_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = op;
+
+    if (events == 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, op->conn->socket_fd, &ev);
+    } else if (op->events == 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, op->conn->socket_fd, &ev);
+    } else {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, op->conn->socket_fd, &ev);
+    }
+#else
+    (void)loop;
+#endif
+    op->events = events;
+}
+
+/* While connecting, every attempt in the race is watched for the op.
+ * Unwatch before stepping the race: a finished attempt is closed there and
+ * its descriptor number may be reused straight away. */
+static void loop_watch_race(NetworkLoopPrivate* loop, AsyncOp* op, bool on) {
+#if LOOP_USE_EPOLL
+    struct epoll_event ev;
+    int i;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = op;
+
+    for (i = 0; i < op->race_watched; i++) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, op->race_fds[i], &ev);
+    }
+    op->race_watched = 0;
+    if (!on) return;
+
+    for (i = 0; i < op->conn->race_count; i++) {
+        op->race_fds[i] = op->conn->race_fds[i];
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, op->race_fds[i], &ev);
+    }
+    op->race_watched = op->conn->race_count;
+#else
+    /* The poll set is rebuilt from the connection's race every wait */
+    (void)loop;
+    op->race_watched = on ? op->conn->race_count : 0;
+#endif
+}
+
+/* Watch whichever direction the connection's last blocked call needs */
+static void loop_watch_blocked(NetworkLoopPrivate* loop, AsyncOp* op) {
+    loop_watch(loop, op, op->conn->want_write ? LOOP_WRITE : LOOP_READ);
+}
+
+/* ======================================================================== */
+/* Operation Lifecycle                                                      */
+/* ======================================================================== */
+
+static void op_advance(NetworkLoopPrivate* loop, AsyncOp* op);
+static void op_start(NetworkLoopPrivate* loop, AsyncOp* op);
+
+/* Leave the host's queue, or give back the slot the op was admitted to */
+static void op_unlimit(AsyncOp* op) {
+    if (op->limit_queued) network_limit_dequeue(op->limiter);
+    if (op->limit_held) network_limit_release(op->limiter);
+    op->limit_queued = false;
+    op->limit_held = false;
+}
+
+/* Detach the op from the loop and hand its response to the callback */
+static void op_finish(NetworkLoopPrivate* loop, AsyncOp* op,
+                      NetworkResponse* response) {
+    NetworkResponseCallback callback = op->callback;
+    void* context = op->context;
+
+    network_timing_deliver(response, &op->exchange, &op->timing);
+    op_unlimit(op);
+    timer_cancel(loop, op);
+    if (op->ticket) op->ticket->op = NULL;
+    if (op->state == ASYNC_CONNECTING) loop->connecting--;
+    list_remove(op->state == ASYNC_QUEUED ? &loop->queued : &loop->active, op);
+    http_reader_free(&op->reader);
+    free(op->exchange.hostname);
+    http_writer_free(&op->exchange.writer);
+    free(op);
+
+    loop->completed++;
+    callback(response, context);
+}
+
+/* Take a due timed callback off the loop and run it */
+static void alarm_fire(NetworkLoopPrivate* loop, AsyncOp* op) {
+    void (*alarm)(void*) = op->alarm;
+    void* context = op->context;
+
+    timer_cancel(loop, op);
+    list_remove(&loop->alarms, op);
+    free(op);
+    alarm(context);
+}
+
+/* Free cancelled ops once no event or list walk can still reach them */
+static void loop_reap(NetworkLoopPrivate* loop) {
+    while (loop->cancelled.head) {
+        AsyncOp* op = loop->cancelled.head;
+
+        list_remove(&loop->cancelled, op);
+        http_reader_free(&op->reader);
+        free(op->exchange.hostname);
+        http_writer_free(&op->exchange.writer);
+        free(op);
+    }
+}
+
+/* Give up the connection; it goes back to the pool only if keep is set.
+ * A stream is reset instead, and the carrier carries on. */
+static void op_release(NetworkLoopPrivate* loop, AsyncOp* op, bool keep) {
+    if (op->rides) {
+        h2_session_reset(op->rides->session, op->stream_id);
+        loop_watch(loop, op->rides, LOOP_READ | LOOP_WRITE);
+        op->rides = NULL;
+        op->stream_id = 0;
+        return;
+    }
+    if (!op->conn) return;
+    loop_watch(loop, op, 0);
+    loop_watch_race(loop, op, false);
+    connection_pool_release(op->conn, keep);
+    op->conn = NULL;
+}
+
+static void carrier_fail(NetworkLoopPrivate* loop, AsyncOp* carrier,
+                         const char* error);
+
+static void op_fail(NetworkLoopPrivate* loop, AsyncOp* op, int status,
+                    const char* status_text, const char* error) {
+    char message[256];
+
+    if (op->carrier) {
+        carrier_fail(loop, op, error);
+        return;
+    }
+
+    /* The connection owns the error text, copy it before releasing */
+    snprintf(message, sizeof(message), "%s", error);
+    op_release(loop, op, false);
+    op_finish(loop, op, NetworkResponseMake(status, status_text, message));
+}
+
+/* A pooled connection may have been closed by the server while it sat
+ * idle; if it fails before any response byte arrives, retry once on a
+ * fresh connection */
+static void op_error(NetworkLoopPrivate* loop, AsyncOp* op, const char* error) {
+    if (op->conn && op->conn->reused && op->attempts == 0 &&
+        op->reader.bytes_received == 0) {
+        op_release(loop, op, false);
+        http_reader_free(&op->reader);
+        op->attempts++;
+        list_remove(&loop->active, op);
+        op->state = ASYNC_QUEUED;
+        list_push(&loop->queued, op);
+        op_start(loop, op);
+        return;
+    }
+    op_fail(loop, op, 502, "Bad Gateway", error);
+}
+
+static void op_complete(NetworkLoopPrivate* loop, AsyncOp* op) {
+    HttpResponseData data;
+
+    http_reader_finish(&op->reader, &data);
+    network_timing_received(&op->timing, &data);
+    op_release(loop, op, data.keep_alive && op->exchange.keep_alive);
+
+    /* The response takes ownership of the received buffers */
+    op_finish(loop, op, network_response_adopt(&data));
+}
+
+/* Start connecting once the connection has its addresses */
+static void op_connect(NetworkLoopPrivate* loop, AsyncOp* op) {
+    int result = connection_connect_start(op->conn);
+
+    if (result < 0) {
+        op_fail(loop, op, 502, "Bad Gateway", connection_error(op->conn));
+        return;
+    }
+    if (result == 0) {
+        op->state = ASYNC_CONNECTING;
+        loop->connecting++;
+        loop_watch_race(loop, op, true);
+    } else {
+        op->state = ASYNC_HANDSHAKE;
+        op_advance(loop, op);
+    }
+}
+
+/* Look the host up without blocking: straight from the cache when
+ * possible, otherwise on the resolver threads */
+static void op_resolve(NetworkLoopPrivate* loop, AsyncOp* op) {
+    HttpExchange* ex = &op->exchange;
+    NetworkAddressList addresses;
+    ResolveTicket* ticket;
+    char error[192];
+    int cached;
+
+    op->conn->dns_start = network_now();
+    cached = network_resolve_cached(ex->hostname, ex->port, &addresses,
+                                    error, sizeof(error));
+    if (cached > 0) {
+        connection_set_addresses(op->conn, &addresses);
+        op_connect(loop, op);
+        return;
+    }
+    if (cached < 0) {
+        op_fail(loop, op, 502, "Bad Gateway", error);
+        return;
+    }
+
+    ticket = calloc(1, sizeof(ResolveTicket));
+    if (!ticket) {
+        op_fail(loop, op, 502, "Bad Gateway", "Out of memory");
+        return;
+    }
+    ticket->mailbox = loop->mailbox;
+    ticket->op = op;
+    pthread_mutex_lock(&loop->mailbox->lock);
+    loop->mailbox->refs++;
+    pthread_mutex_unlock(&loop->mailbox->lock);
+
+    op->ticket = ticket;
+    op->state = ASYNC_RESOLVING;
+    if (!network_resolve_async(ex->hostname, ex->port, loop_resolved, ticket)) {
+        op->ticket = NULL;
+        ticket_free(ticket);
+        op_fail(loop, op, 502, "Bad Gateway", "Failed to start name lookup");
+    }
+}
+
+/* ======================================================================== */
+/* HTTP/2 Carriers                                                          */
+/* ======================================================================== */
+
+static bool same_origin(const HttpExchange* a, const HttpExchange* b) {
+    return a->port == b->port && a->use_ssl == b->use_ssl &&
+           strcasecmp(a->hostname, b->hostname) == 0;
+}
+
+static AsyncOp* carrier_make(NetworkLoopPrivate* loop, const HttpExchange* ex) {
+    AsyncOp* carrier = calloc(1, sizeof(AsyncOp));
+
+    if (!carrier) return NULL;
+    carrier->exchange.hostname = strdup(ex->hostname);
+    if (!carrier->exchange.hostname) {
+        free(carrier);
+        return NULL;
+    }
+    carrier->exchange.port = ex->port;
+    carrier->exchange.use_ssl = ex->use_ssl;
+    carrier->exchange.timeout_seconds = ex->timeout_seconds;
+    carrier->exchange.http2 = true;
+    carrier->carrier = true;
+    list_push(&loop->carriers, carrier);
+    return carrier;
+}
+
+/* Retire a carrier: an established session is parked (or closed if it is
+ * spent), a connection that turned out to be HTTP/1.1 goes back to the
+ * pool when keep is set. Freed with the cancelled ops, as events already
+ * collected this round may still name it. */
+static void carrier_free(NetworkLoopPrivate* loop, AsyncOp* carrier, bool keep) {
+    timer_cancel(loop, carrier);
+    if (carrier->ticket) carrier->ticket->op = NULL;
+    if (carrier->state == ASYNC_CONNECTING) loop->connecting--;
+    list_remove(&loop->carriers, carrier);
+
+    if (carrier->conn) {
+        loop_watch(loop, carrier, 0);
+        loop_watch_race(loop, carrier, false);
+        if (carrier->session) {
+            h2_session_park(carrier->session);
+        } else {
+            connection_pool_release(carrier->conn, keep);
+        }
+    }
+    carrier->session = NULL;
+    carrier->conn = NULL;
+    carrier->cancelled = true;
+    list_push(&loop->cancelled, carrier);
+}
+
+/* The connection failed before the session started; the exchanges
+ * waiting for it fail with it rather than each trying again */
+static void carrier_fail(NetworkLoopPrivate* loop, AsyncOp* carrier,
+                         const char* error) {
+    HttpExchange* origin = &carrier->exchange;
+    char message[256];
+    AsyncOp* op;
+
+    snprintf(message, sizeof(message), "%s", error);
+    carrier_free(loop, carrier, false);
+
+    op = loop->queued.head;
+    while (op) {
+        AsyncOp* next = op->next;
+        if (op->exchange.http2 && same_origin(&op->exchange, origin)) {
+            op_fail(loop, op, 502, "Bad Gateway", message);
+        }
+        op = next;
+    }
+}
+
+/* Write and read for the carrier's session; its streams finish from in
+ * here */
+static void carrier_drive(NetworkLoopPrivate* loop, AsyncOp* carrier) {
+    if (!h2_session_advance(carrier->session)) {
+        /* Every stream on it has been told */
+        carrier_free(loop, carrier, false);
+        return;
+    }
+    loop_watch(loop, carrier, h2_session_wants_write(carrier->session)
+               ? LOOP_READ | LOOP_WRITE : LOOP_READ);
+}
+
+/* The session is done with a stream */
+static void stream_done(void* owner, void* context, int result,
+                        const char* error) {
+    NetworkLoopPrivate* loop = (NetworkLoopPrivate*)owner;
+    AsyncOp* op = (AsyncOp*)context;
+
+    op->rides = NULL;
+    op->stream_id = 0;
+
+    if (result > 0) {
+        op_complete(loop, op);
+    } else if (result == 0 && op->attempts == 0) {
+        /* Never processed, so it may go again on another connection */
+        http_reader_free(&op->reader);
+        op->attempts++;
+        list_remove(&loop->active, op);
+        op->state = ASYNC_QUEUED;
+        list_push(&loop->queued, op);
+    } else {
+        op_fail(loop, op, 502, "Bad Gateway", error);
+    }
+}
+
+/* Connected and handshaken: start HTTP/2, unless the server chose
+ * HTTP/1.1, in which case the waiting exchanges will use the pool */
+static void carrier_ready(NetworkLoopPrivate* loop, AsyncOp* carrier) {
+    HttpExchange* ex = &carrier->exchange;
+
+    if (!carrier->conn->h2) {
+        h2_origin_note_declined(ex->hostname, ex->port, ex->use_ssl);
+        carrier_free(loop, carrier, true);
+        return;
+    }
+
+    carrier->session = h2_session_create(carrier->conn);
+    if (!carrier->session) {
+        carrier_fail(loop, carrier, "Failed to start HTTP/2");
+        return;
+    }
+    h2_session_bind(carrier->session, stream_done, loop);
+    timer_cancel(loop, carrier);
+    carrier->state = ASYNC_CARRYING;
+
+    /* The preface goes now; waiting exchanges join at the end of the
+     * round */
+    carrier_drive(loop, carrier);
+}
+
+/* Send a queued exchange as a stream of carrier */
+static void stream_start(NetworkLoopPrivate* loop, AsyncOp* op, AsyncOp* carrier) {
+    HttpExchange* ex = &op->exchange;
+
+    http_reader_init(&op->reader, ex->no_body, ex->sink, ex->sink_context);
+    network_timing_connection(&op->timing, carrier->conn);
+    carrier->conn->requests_served++;
+    op->stream_id = h2_session_open(carrier->session, ex, &op->reader,
+                                    &op->timing, op);
+    if (!op->stream_id) {
+        http_reader_free(&op->reader);
+        op_fail(loop, op, 502, "Bad Gateway", "Failed to open HTTP/2 stream");
+        return;
+    }
+
+    op->rides = carrier;
+    list_remove(&loop->queued, op);
+    op->state = ASYNC_STREAMING;
+    list_push(&loop->active, op);
+    loop_watch(loop, carrier, LOOP_READ | LOOP_WRITE);
+}
+
+/* Find or start a carrier for an HTTP/2 exchange. Returns false if the
+ * exchange should go over HTTP/1.1 instead; otherwise it is now a stream,
+ * still queued waiting for a carrier, or failed. */
+static bool op_start_h2(NetworkLoopPrivate* loop, AsyncOp* op) {
+    HttpExchange* ex = &op->exchange;
+    AsyncOp* carrier;
+    H2Session* session;
+    Connection* conn;
+    bool wait = false;
+
+    if (!ex->http2 || h2_origin_declined(ex->hostname, ex->port, ex->use_ssl)) {
+        return false;
+    }
+
+    for (carrier = loop->carriers.head; carrier; carrier = carrier->next) {
+        if (!same_origin(&carrier->exchange, ex)) continue;
+        if (carrier->state != ASYNC_CARRYING) {
+            /* Still connecting: one connection per origin, so wait */
+            wait = true;
+        } else if (h2_session_can_open(carrier->session)) {
+            stream_start(loop, op, carrier);
+            return true;
+        } else if (!h2_session_closing(carrier->session)) {
+            /* At the server's stream limit; a stream will end soon */
+            wait = true;
+        }
+    }
+    if (wait) return true;
+
+    session = h2_session_take(ex->hostname, ex->port, ex->use_ssl);
+    if (session) {
+        carrier = carrier_make(loop, ex);
+        if (!carrier) {
+            h2_session_park(session);
+            op_fail(loop, op, 502, "Bad Gateway", "Out of memory");
+            return true;
+        }
+        carrier->session = session;
+        carrier->conn = h2_session_connection(session);
+        carrier->state = ASYNC_CARRYING;
+        h2_session_bind(session, stream_done, loop);
+        stream_start(loop, op, carrier);
+        return true;
+    }
+
+    if (!connection_pool_reserve(ex->hostname, ex->port, ex->use_ssl)) {
+        return true;
+    }
+    conn = connection_create(ex->hostname, ex->port, ex->use_ssl);
+    carrier = conn ? carrier_make(loop, ex) : NULL;
+    if (!carrier) {
+        connection_free(conn);
+        connection_pool_unreserve(ex->hostname, ex->port, ex->use_ssl);
+        op_fail(loop, op, 502, "Bad Gateway", "Failed to create connection");
+        return true;
+    }
+    conn->timeout_seconds = ex->timeout_seconds;
+    conn->offer_h2 = true;
+    carrier->conn = conn;
+    carrier->state = ASYNC_RESOLVING;
+    timer_arm(loop, carrier, ex->timeout_seconds * 1000);
+    op_resolve(loop, carrier);
+    return true;
+}
+
+/* Park the sessions of carriers left without streams */
+static void loop_park_carriers(NetworkLoopPrivate* loop) {
+    AsyncOp* carrier = loop->carriers.head;
+
+    while (carrier) {
+        AsyncOp* next = carrier->next;
+        if (carrier->state == ASYNC_CARRYING &&
+            h2_session_streams(carrier->session) == 0) {
+            carrier_free(loop, carrier, false);
+        }
+        carrier = next;
+    }
+}
+
+/* Let a queued op past its host's rate and concurrency limits. It stays
+ * queued while it has to wait, and fails with a 503 as soon as the wait
+ * is bound to outlast its deadline. */
+static bool op_admit(NetworkLoopPrivate* loop, AsyncOp* op) {
+    HttpExchange* ex = &op->exchange;
+    double retry_in, now, deadline;
+    char error[160];
+
+    if (op->limit_held) return true;
+    if (!op->limiter) op->limiter = network_limit_find(ex->hostname, ex->port);
+    if (!op->limiter) return true;
+
+    if (network_limit_try(op->limiter, &retry_in)) {
+        now = network_now();
+        if (op->limit_queued) network_limit_dequeue(op->limiter);
+        network_limit_admitted(op->limit_queued ? now - op->limit_since : 0);
+        op->limit_queued = false;
+        op->limit_held = true;
+        op->timing.admitted = now;
+        return true;
+    }
+
+    now = network_now();
+    if (!op->limit_queued) {
+        if (!network_limit_enqueue(op->limiter)) {
+            network_limit_rejected();
+            op_fail(loop, op, 503, "Service Unavailable",
+                    "Request limit: too many requests waiting");
+            return false;
+        }
+        op->limit_queued = true;
+        op->limit_since = now;
+    }
+
+    /* The same deadline the op's timer was armed with */
+    deadline = op->timing.start + (ex->deadline_ms > 0 ? ex->deadline_ms / 1000.0
+                                   : ex->timeout_seconds > 0 ? ex->timeout_seconds
+                                   : 30);
+    deadline = network_limit_deadline(op->limiter, op->limit_since, deadline);
+    if (now + retry_in <= deadline) return false;
+
+    network_limit_rejected();
+    snprintf(error, sizeof(error), "Request limit: %s would outlast the deadline",
+             retry_in > 0 ? "waiting for the rate" : "waiting for a slot");
+    op_fail(loop, op, 503, "Service Unavailable", error);
+    return false;
+}
+
+/* Try to obtain a connection for a queued op. Leaves it queued if the
+ * host is at its rate, request or connection limit. */
+static void op_start(NetworkLoopPrivate* loop, AsyncOp* op) {
+    HttpExchange* ex = &op->exchange;
+    Connection* conn;
+    bool fresh = false;
+
+    if (op->cancelled) return;
+    if (!op_admit(loop, op)) return;
+    if (op_start_h2(loop, op)) return;
+
+    conn = connection_pool_take_idle(ex->hostname, ex->port, ex->use_ssl);
+    if (conn) {
+        connection_set_blocking(conn, false);
+        network_timing_connection(&op->timing, conn);
+        op->state = ASYNC_SENDING;
+    } else if (connection_pool_reserve(ex->hostname, ex->port, ex->use_ssl)) {
+        conn = connection_create(ex->hostname, ex->port, ex->use_ssl);
+        if (!conn) {
+            connection_pool_unreserve(ex->hostname, ex->port, ex->use_ssl);
+            op_fail(loop, op, 502, "Bad Gateway", "Failed to create connection");
+            return;
+        }
+        fresh = true;
+    } else {
+        return;
+    }
+
+    conn->timeout_seconds = ex->timeout_seconds;
+    op->conn = conn;
+    http_writer_rewind(&op->exchange.writer);
+    op->events = 0;
+    list_remove(&loop->queued, op);
+    op->state = fresh ? ASYNC_RESOLVING : ASYNC_SENDING;
+    list_push(&loop->active, op);
+
+    if (fresh) {
+        op_resolve(loop, op);
+    } else {
+        op_advance(loop, op);
+    }
+}
+
+/* Finish lookups the resolver threads have posted */
+static void loop_drain_mailbox(NetworkLoopPrivate* loop) {
+    LoopMailbox* mailbox = loop->mailbox;
+    ResolveTicket* tickets;
+    char scratch[64];
+
+    while (read(mailbox->wake_read, scratch, sizeof(scratch)) > 0) {
+        /* Empty the wake-up pipe */
+    }
+
+    pthread_mutex_lock(&mailbox->lock);
+    tickets = mailbox->done;
+    mailbox->done = NULL;
+    pthread_mutex_unlock(&mailbox->lock);
+
+    while (tickets) {
+        ResolveTicket* ticket = tickets;
+        AsyncOp* op = ticket->op;
+        tickets = ticket->next;
+
+        /* The op may have timed out while the lookup ran */
+        if (op) {
+            op->ticket = NULL;
+            if (ticket->ok) {
+                connection_set_addresses(op->conn, &ticket->addresses);
+                op_connect(loop, op);
+            } else {
+                op_fail(loop, op, 502, "Bad Gateway", ticket->error);
+            }
+        }
+        ticket_free(ticket);
+    }
+}
+
+/* Move the op as far along as its socket allows without blocking */
+static void op_advance(NetworkLoopPrivate* loop, AsyncOp* op) {
+    Connection* conn = op->conn;
+    HttpExchange* ex = &op->exchange;
+    int result;
+
+    if (op->cancelled) return;
+
+    switch (op->state) {
+        case ASYNC_QUEUED:
+        case ASYNC_RESOLVING:
+        case ASYNC_STREAMING:
+            return;
+
+        case ASYNC_CARRYING:
+            carrier_drive(loop, op);
+            return;
+
+        case ASYNC_CONNECTING:
+            loop_watch_race(loop, op, false);
+            result = connection_connect_step(conn);
+            if (result < 0) {
+                op_fail(loop, op, 502, "Bad Gateway", connection_error(conn));
+                return;
+            }
+            if (result == 0) {
+                loop_watch_race(loop, op, true);
+                return;
+            }
+            loop->connecting--;
+            op->state = ASYNC_HANDSHAKE;
+            /* fall through */
+
+        case ASYNC_HANDSHAKE:
+            result = connection_handshake(conn);
+            if (result < 0) {
+                op_fail(loop, op, 502, "Bad Gateway", connection_error(conn));
+                return;
+            }
+            if (result == 0) {
+                loop_watch_blocked(loop, op);
+                return;
+            }
+            if (op->carrier) {
+                carrier_ready(loop, op);
+                return;
+            }
+            network_timing_connection(&op->timing, conn);
+            op->state = ASYNC_SENDING;
+            /* fall through */
+
+        case ASYNC_SENDING:
+            result = http_writer_send(conn, &ex->writer);
+            if (result < 0) {
+                op_error(loop, op, connection_error(conn));
+                return;
+            }
+            if (result == 0) {
+                loop_watch_blocked(loop, op);
+                return;
+            }
+            network_timing_sent(&op->timing, &ex->writer);
+            http_reader_init(&op->reader, ex->no_body, ex->sink,
+                             ex->sink_context);
+            op->state = ASYNC_RECEIVING;
+            /* fall through */
+
+        case ASYNC_RECEIVING:
+            /* Drain until the socket would block, so bytes TLS has already
+             * buffered are not left waiting for a readiness event */
+            for (;;) {
+                size_t space;
+                char* into = http_reader_space(&op->reader, &space);
+                ssize_t n;
+
+                if (!into) {
+                    op_fail(loop, op, 502, "Bad Gateway", "Out of memory");
+                    return;
+                }
+                n = connection_recv(conn, into, space);
+                if (n > 0) {
+                    result = http_reader_received(&op->reader, (size_t)n);
+                } else if (n == 0) {
+                    result = http_reader_eof(&op->reader);
+                } else if (connection_would_block(conn)) {
+                    loop_watch_blocked(loop, op);
+                    return;
+                } else {
+                    op_error(loop, op, connection_error(conn));
+                    return;
+                }
+
+                if (result > 0) {
+                    op_complete(loop, op);
+                    return;
+                }
+                if (result < 0) {
+                    op_error(loop, op, op->reader.error);
+                    return;
+                }
+            }
+    }
+}
+
+/* Hand free connection slots to queued ops in submission order */
+static void loop_start_queued(NetworkLoopPrivate* loop) {
+    AsyncOp* op = loop->queued.head;
+
+    while (op) {
+        AsyncOp* next = op->next;
+        op_start(loop, op);
+        op = next;
+    }
+}
+
+/* Advance the wheel to the current tick, expiring due timers */
+static void loop_expire_timers(NetworkLoopPrivate* loop) {
+    unsigned long now = loop_ticks_now(loop);
+    AsyncOp* expired = NULL;
+
+    while (loop->tick < now && loop->timers > 0) {
+        AsyncOp* op;
+        AsyncOp* next;
+
+        loop->tick++;
+        for (op = loop->wheel[loop->tick % LOOP_WHEEL_SLOTS]; op; op = next) {
+            next = op->timer_next;
+            if (op->rounds > 0) {
+                op->rounds--;
+                continue;
+            }
+            timer_cancel(loop, op);
+            /* Collect first; failing an op may arm or cancel other timers */
+            op->timer_next = expired;
+            expired = op;
+        }
+    }
+    if (loop->timers == 0) loop->tick = now;
+
+    while (expired) {
+        AsyncOp* op = expired;
+        char error[128];
+        expired = op->timer_next;
+        op->timer_next = NULL;
+
+        /* An earlier callback in this batch may have cancelled it */
+        if (op->cancelled) continue;
+        if (op->alarm) {
+            alarm_fire(loop, op);
+            continue;
+        }
+        if (op->exchange.deadline_ms > 0) {
+            snprintf(error, sizeof(error), "Request timed out after %d ms",
+                     op->exchange.deadline_ms);
+        } else {
+            snprintf(error, sizeof(error), "Request timed out after %d seconds",
+                     op->exchange.timeout_seconds);
+        }
+        op_fail(loop, op, 504, "Gateway Timeout", error);
+    }
+}
+
+/* Let the next address join a connect race once the newest attempt has
+ * had its head start, even though none of the sockets has changed */
+static void loop_advance_races(NetworkLoopPrivate* loop) {
+    OpList* lists[2];
+    double now;
+    int i;
+
+    if (loop->connecting == 0) return;
+
+    lists[0] = &loop->active;
+    lists[1] = &loop->carriers;
+    now = network_now();
+    for (i = 0; i < 2; i++) {
+        AsyncOp* op = lists[i]->head;
+
+        while (op) {
+            AsyncOp* next = op->next;
+            Connection* conn = op->conn;
+
+            if (op->state == ASYNC_CONNECTING &&
+                conn->next_address < conn->addresses.count &&
+                conn->race_count < CONNECT_MAX_RACE && now >= conn->race_next) {
+                op_advance(loop, op);
+            }
+            op = next;
+        }
+    }
+}
+
+/* Wait for readiness and advance the ops that are ready */
+static void loop_poll(NetworkLoopPrivate* loop, int timeout_ms) {
+#if LOOP_USE_EPOLL
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int count = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, timeout_ms);
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        if (!events[i].events) continue;
+        if (events[i].data.ptr) {
+            /* Several attempts of one connect race can be ready together;
+             * advance the op once, as it may be gone afterwards */
+            for (j = i + 1; j < count; j++) {
+                if (events[j].data.ptr == events[i].data.ptr) {
+                    events[j].events = 0;
+                }
+            }
+            op_advance(loop, (AsyncOp*)events[i].data.ptr);
+        } else {
+            loop_drain_mailbox(loop);
+        }
+    }
+#else
+    OpList* lists[2];
+    AsyncOp* op;
+    size_t watched = loop->active.count + loop->carriers.count;
+    size_t count = 0;
+    size_t i;
+    int l;
+    int ready;
+
+    /* Slot 0 is the resolver wake-up pipe; a connecting op may need a slot
+     * for each attempt in its race */
+    if (loop->poll_capacity < watched * CONNECT_MAX_RACE + 1) {
+        size_t capacity = (watched * CONNECT_MAX_RACE + 1) * 2;
+        struct pollfd* fds = realloc(loop->poll_fds, capacity * sizeof(*fds));
+        AsyncOp** ops;
+        if (fds) loop->poll_fds = fds;
+        ops = realloc(loop->poll_ops, capacity * sizeof(*ops));
+        if (ops) loop->poll_ops = ops;
+        if (!fds || !ops) return;
+        loop->poll_capacity = capacity;
+    }
+
+    loop->poll_fds[0].fd = loop->mailbox->wake_read;
+    loop->poll_fds[0].events = POLLIN;
+    loop->poll_fds[0].revents = 0;
+    loop->poll_ops[0] = NULL;
+    count = 1;
+
+    lists[0] = &loop->active;
+    lists[1] = &loop->carriers;
+    for (l = 0; l < 2; l++) for (op = lists[l]->head; op; op = op->next) {
+        int r;
+
+        for (r = 0; r < op->race_watched; r++) {
+            loop->poll_fds[count].fd = op->conn->race_fds[r];
+            loop->poll_fds[count].events = POLLOUT;
+            loop->poll_fds[count].revents = 0;
+            loop->poll_ops[count] = op;
+            count++;
+        }
+        if (!op->events) continue;
+        loop->poll_fds[count].fd = op->conn->socket_fd;
+        loop->poll_fds[count].events = (short)(
+            ((op->events & LOOP_READ) ? POLLIN : 0) |
+            ((op->events & LOOP_WRITE) ? POLLOUT : 0));
+        loop->poll_fds[count].revents = 0;
+        loop->poll_ops[count] = op;
+        count++;
+    }
+
+    ready = poll(loop->poll_fds, (nfds_t)count, timeout_ms);
+    for (i = 0; ready > 0 && i < count; i++) {
+        if (!loop->poll_fds[i].revents) continue;
+        ready--;
+        if (loop->poll_ops[i]) {
+            /* A connect race's attempts sit next to each other; advance
+             * the op once, as it may be gone afterwards */
+            while (i + 1 < count && loop->poll_ops[i + 1] == loop->poll_ops[i]) {
+                if (loop->poll_fds[++i].revents) ready--;
+            }
+            op_advance(loop, loop->poll_ops[i]);
+        } else {
+            loop_drain_mailbox(loop);
+        }
+    }
+#endif
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+bool network_loop_submit(struct NetworkLoop* public, HttpExchange* exchange,
+                         void (*callback)(struct NetworkResponse*, void*),
+                         void* context) {
+    return network_loop_start(public, exchange, callback, context) != NULL;
+}
+
+struct AsyncOp* network_loop_start(struct NetworkLoop* public,
+                                   HttpExchange* exchange,
+                                   void (*callback)(struct NetworkResponse*, void*),
+                                   void* context) {
+    NetworkLoopPrivate* loop = (NetworkLoopPrivate*)public;
+    AsyncOp* op;
+
+    if (!loop || loop->closing || !callback ||
+        !exchange->hostname || !exchange->writer.head) {
+        free(exchange->hostname);
+        http_writer_free(&exchange->writer);
+        return NULL;
+    }
+
+    op = calloc(1, sizeof(AsyncOp));
+    if (!op) {
+        free(exchange->hostname);
+        http_writer_free(&exchange->writer);
+        return NULL;
+    }
+
+    op->exchange = *exchange;
+    op->callback = callback;
+    op->context = context;
+    op->state = ASYNC_QUEUED;
+    network_timing_start(&op->timing);
+
+    /* The deadline covers time spent waiting for a connection slot too.
+     * Started from the next run so callbacks never fire inside sendAsync. */
+    if (loop->timers == 0) loop->tick = loop_ticks_now(loop);
+    timer_arm(loop, op, exchange->deadline_ms > 0 ? exchange->deadline_ms
+                                                  : exchange->timeout_seconds * 1000);
+    list_push(&loop->queued, op);
+    return op;
+}
+
+struct AsyncOp* network_loop_after(struct NetworkLoop* public, int milliseconds,
+                                   void (*alarm)(void*), void* context) {
+    NetworkLoopPrivate* loop = (NetworkLoopPrivate*)public;
+    AsyncOp* op;
+
+    if (!loop || loop->closing || !alarm) return NULL;
+
+    op = calloc(1, sizeof(AsyncOp));
+    if (!op) return NULL;
+
+    op->alarm = alarm;
+    op->context = context;
+    if (loop->timers == 0) loop->tick = loop_ticks_now(loop);
+    timer_arm(loop, op, milliseconds > 0 ? milliseconds : 1);
+    list_push(&loop->alarms, op);
+    return op;
+}
+
+void network_loop_cancel(struct NetworkLoop* public, struct AsyncOp* op) {
+    NetworkLoopPrivate* loop = (NetworkLoopPrivate*)public;
+
+    if (!op || op->cancelled) return;
+
+    /* Events already collected for it this round may still name it, so
+     * it is only unlinked here and freed at the end of the round */
+    timer_cancel(loop, op);
+    if (op->alarm) {
+        list_remove(&loop->alarms, op);
+    } else {
+        if (op->ticket) op->ticket->op = NULL;
+        if (op->state == ASYNC_CONNECTING) loop->connecting--;
+        list_remove(op->state == ASYNC_QUEUED ? &loop->queued : &loop->active, op);
+        /* Part of a response may be on the wire; the connection is spent */
+        op_release(loop, op, false);
+        op_unlimit(op);
+    }
+    op->cancelled = true;
+    list_push(&loop->cancelled, op);
+}
+
+/* ======================================================================== */
+/* Trampoline Functions using TF_ macros                                    */
+/* ======================================================================== */
+
+static TF_Unary(size_t, networkloop_runOnce, NetworkLoop, NetworkLoopPrivate, int, timeout_ms)
+    size_t before = private->completed;
+    int wait = timeout_ms;
+
+    loop_start_queued(private);
+    loop_reap(private);
+
+    if (private->queued.count + private->active.count +
+        private->alarms.count == 0) {
+        return private->completed - before;
+    }
+
+    /* Wake for the next wheel tick while timers, queued ops or connect
+     * races need it */
+    if (private->timers > 0 || private->queued.count > 0 ||
+        private->connecting > 0) {
+        int tick_ms = (int)(LOOP_TICK_SECONDS * 1000);
+        if (wait < 0 || wait > tick_ms) wait = tick_ms;
+    }
+
+    if (private->completed == before) {
+        loop_poll(private, wait);
+    }
+    loop_advance_races(private);
+    loop_expire_timers(private);
+    loop_start_queued(private);
+    loop_park_carriers(private);
+    loop_reap(private);
+    return private->completed - before;
+}
+
+static TF_Getter(networkloop_run, NetworkLoop, NetworkLoopPrivate, size_t)
+    size_t before = private->completed;
+
+    private->stopping = false;
+    while (!private->stopping &&
+           private->queued.count + private->active.count +
+           private->alarms.count > 0) {
+        networkloop_runOnce(self, -1);
+    }
+    private->stopping = false;
+    return private->completed - before;
+}
+
+static TF_Getter(networkloop_pending, NetworkLoop, NetworkLoopPrivate, size_t)
+    return private->queued.count + private->active.count + private->alarms.count;
+}
+
+static TF_Nullary(networkloop_stop, NetworkLoop, NetworkLoopPrivate)
+    private->stopping = true;
+}
+
+static TF_Nullary(networkloop_free, NetworkLoop, NetworkLoopPrivate)
+    ResolveTicket* tickets;
+
+    if (private) {
+        private->closing = true;
+        while (private->active.head) {
+            op_fail(private, private->active.head, 503, "Service Unavailable",
+                    "Request cancelled");
+        }
+        while (private->queued.head) {
+            op_fail(private, private->queued.head, 503, "Service Unavailable",
+                    "Request cancelled");
+        }
+        /* Timed callbacks run now; anything they submit is refused */
+        while (private->alarms.head) {
+            alarm_fire(private, private->alarms.head);
+        }
+        while (private->carriers.head) {
+            carrier_free(private, private->carriers.head, false);
+        }
+        loop_reap(private);
+
+        /* Lookups still running will find the mailbox closed */
+        pthread_mutex_lock(&private->mailbox->lock);
+        private->mailbox->closed = true;
+        tickets = private->mailbox->done;
+        private->mailbox->done = NULL;
+        pthread_mutex_unlock(&private->mailbox->lock);
+        while (tickets) {
+            ResolveTicket* next = tickets->next;
+            ticket_free(tickets);
+            tickets = next;
+        }
+        mailbox_unref(private->mailbox);
+
+#if LOOP_USE_EPOLL
+        close(private->epoll_fd);
+#else
+        free(private->poll_fds);
+        free(private->poll_ops);
+#endif
+        if (default_loop == self) default_loop = NULL;
+        trampoline_tracker_free_by_context(self);
+        free(private);
+    }
+}
+
+/* ======================================================================== */
+/* Creation Functions                                                        */
+/* ======================================================================== */
+
+NetworkLoop* NetworkLoopMake(void) {
+    TA_Allocate(NetworkLoop, NetworkLoopPrivate);
+
+    if (!private) return NULL;
+
+    private->mailbox = mailbox_create();
+    if (!private->mailbox) {
+        free(private);
+        return NULL;
+    }
+
+#if LOOP_USE_EPOLL
+    private->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (private->epoll_fd < 0) {
+        mailbox_unref(private->mailbox);
+        free(private);
+        return NULL;
+    }
+    {
+        /* A NULL pointer marks the resolver wake-up pipe */
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(private->epoll_fd, EPOLL_CTL_ADD,
+                  private->mailbox->wake_read, &ev);
+    }
+#endif
+    private->origin = network_now();
+
+    /* Create trampoline functions */
+    public->run = trampoline_monitor(networkloop_run, public, 0, &tracker);
+    public->runOnce = trampoline_monitor(networkloop_runOnce, public, 1, &tracker);
+    public->pending = trampoline_monitor(networkloop_pending, public, 0, &tracker);
+    public->stop = trampoline_monitor(networkloop_stop, public, 0, &tracker);
+    public->free = trampoline_monitor(networkloop_free, public, 0, &tracker);
+
+    /* Validate all trampolines */
+    if (!trampoline_validate(tracker)) {
+#if LOOP_USE_EPOLL
+        close(private->epoll_fd);
+#endif
+        mailbox_unref(private->mailbox);
+        free(private);
+        return NULL;
+    }
+
+    return public;
+}
+
+NetworkLoop* NetworkLoopDefault(void) {
+    if (!default_loop) {
+        default_loop = NetworkLoopMake();
+    }
+    return default_loop;
+}
@@ -0,0 +1,362 @@
+/**
+ * @file network_metrics.c
+ * @brief Per-request timing and per-host latency histograms
+ *
+ * Each transport fills in a NetworkTiming as its request moves along. A
+ * connection remembers when its own lookup, connect and handshake ran, and
+ * the first request to go out on it takes those phases; later requests on
+ * it are marked reused instead. When a response (or a failure) is
+ * delivered, the timing is copied into it and added to its host's
+ * histograms under one mutex. Buckets are fixed, so recording is a short
+ * scan and exporting needs no sorting. The export is written as JSON text
+ * and parsed once, which is far cheaper than building it a Json node at a
+ * time.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/json.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#define METRICS_MAX_HOSTS 256
+#define METRICS_BUCKETS 19      /* One per bound, then one for slower */
+
+/* Bucket upper bounds in milliseconds, 1-2-5 from 0.1 ms to a minute */
+static const double bucket_bounds_ms[METRICS_BUCKETS - 1] = {
+    0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500,
+    1000, 2000, 5000, 10000, 20000, 60000
+};
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef enum MetricsPhase {
+    PHASE_QUEUE,        /* Held back by the host's limits */
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_WAIT,         /* Request sent to first byte */
+    PHASE_TRANSFER,     /* First byte to end */
+    PHASE_TOTAL,
+    PHASE_COUNT
+} MetricsPhase;
+
+static const char* const phase_names[PHASE_COUNT] = {
+    "queue", "dns", "connect", "tls", "wait", "transfer", "total"
+};
+
+typedef struct Histogram {
+    unsigned long buckets[METRICS_BUCKETS];
+    unsigned long count;
+    double sum_ms;
+    double max_ms;
+} Histogram;
+
+typedef struct HostMetrics {
+    char* hostname;
+    int port;
+    unsigned long requests;
+    unsigned long failed;           /* No response at all */
+    unsigned long reused;
+    unsigned long status[4];        /* 2xx, 3xx, 4xx, 5xx */
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    Histogram phases[PHASE_COUNT];
+    double last_used;
+} HostMetrics;
+
+/* Export text, grown as it is written */
+typedef struct MetricsText {
+    char* data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} MetricsText;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static HostMetrics* hosts[METRICS_MAX_HOSTS];
+static size_t host_count = 0;
+
+/* ======================================================================== */
+/* Histograms                                                               */
+/* ======================================================================== */
+
+/* Add the phase from start to end; skipped if it did not happen */
+static void histogram_add(Histogram* histogram, double start, double end) {
+    size_t i = 0;
+    double ms;
+
+    if (start <= 0 || end < start) return;
+    ms = (end - start) * 1000.0;
+    while (i < METRICS_BUCKETS - 1 && ms > bucket_bounds_ms[i]) i++;
+    histogram->buckets[i]++;
+    histogram->count++;
+    histogram->sum_ms += ms;
+    if (ms > histogram->max_ms) histogram->max_ms = ms;
+}
+
+/* Upper bound of the bucket holding the given percentile; the slowest
+ * bucket has no bound, so the maximum stands in */
+static double histogram_percentile(const Histogram* histogram, int percent) {
+    unsigned long rank = (histogram->count * (unsigned long)percent + 99) / 100;
+    unsigned long seen = 0;
+    size_t i;
+
+    if (rank == 0) rank = 1;
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) return bucket_bounds_ms[i];
+    }
+    return histogram->max_ms;
+}
+
+/* Caller holds metrics_lock. The least recently used host makes way when
+ * the table is full. */
+static HostMetrics* host_find(const char* hostname, int port) {
+    HostMetrics* oldest = NULL;
+    HostMetrics* host;
+    size_t i;
+
+    for (i = 0; i < host_count; i++) {
+        host = hosts[i];
+        if (host->hostname && host->port == port &&
+            strcmp(host->hostname, hostname) == 0) {
+            return host;
+        }
+        if (!oldest || host->last_used < oldest->last_used) oldest = host;
+    }
+
+    if (host_count < METRICS_MAX_HOSTS) {
+        host = calloc(1, sizeof(HostMetrics));
+        if (!host) return NULL;
+        hosts[host_count++] = host;
+    } else {
+        host = oldest;
+        free(host->hostname);
+        memset(host, 0, sizeof(*host));
+    }
+    /* Without a name the slot stays empty and is the next to be taken */
+    host->hostname = strdup(hostname);
+    host->port = port;
+    return host->hostname ? host : NULL;
+}
+
+static void metrics_record(const char* hostname, int port, int status,
+                           const NetworkTiming* timing) {
+    HostMetrics* host;
+
+    pthread_mutex_lock(&metrics_lock);
+    host = host_find(hostname, port);
+    if (host) {
+        host->last_used = timing->end;
+        host->requests++;
+        host->bytes_sent += timing->bytes_sent;
+        host->bytes_received += timing->bytes_received;
+        if (timing->reused) host->reused++;
+        if (timing->first_byte <= 0) {
+            host->failed++;
+        } else if (status >= 200 && status < 600) {
+            host->status[status / 100 - 2]++;
+        }
+
+        histogram_add(&host->phases[PHASE_QUEUE], timing->start, timing->admitted);
+        histogram_add(&host->phases[PHASE_DNS], timing->dns_start, timing->dns_end);
+        histogram_add(&host->phases[PHASE_CONNECT], timing->connect_start,
+                      timing->connect_end);
+        histogram_add(&host->phases[PHASE_TLS], timing->tls_start, timing->tls_end);
+        if (timing->first_byte > 0) {
+            histogram_add(&host->phases[PHASE_WAIT], timing->request_sent,
+                          timing->first_byte);
+            histogram_add(&host->phases[PHASE_TRANSFER], timing->first_byte,
+                          timing->end);
+        }
+        histogram_add(&host->phases[PHASE_TOTAL], timing->start, timing->end);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* ======================================================================== */
+/* Export                                                                   */
+/* ======================================================================== */
+
+static void text_printf(MetricsText* text, const char* format, ...) {
+    va_list args;
+    int needed;
+
+    if (text->failed) return;
+    va_start(args, format);
+    needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (needed < 0) {
+        text->failed = true;
+        return;
+    }
+
+    if (text->capacity - text->length <= (size_t)needed) {
+        size_t capacity = text->capacity ? text->capacity : 4096;
+        char* grown;
+
+        while (capacity - text->length <= (size_t)needed) capacity *= 2;
+        grown = realloc(text->data, capacity);
+        if (!grown) {
+            text->failed = true;
+            return;
+        }
+        text->data = grown;
+        text->capacity = capacity;
+    }
+    va_start(args, format);
+    vsnprintf(text->data + text->length, text->capacity - text->length,
+              format, args);
+    va_end(args);
+    text->length += (size_t)needed;
+}
+
+/* Host names are plain ASCII in practice; anything else is escaped */
+static void text_key(MetricsText* text, const char* hostname, int port) {
+    const unsigned char* c;
+
+    text_printf(text, "\"");
+    for (c = (const unsigned char*)hostname; *c; c++) {
+        if (*c == '"' || *c == '\\' || *c < 0x20 || *c >= 0x7f) {
+            text_printf(text, "\\u%04x", *c);
+        } else {
+            text_printf(text, "%c", *c);
+        }
+    }
+    text_printf(text, ":%d\"", port);
+}
+
+static void text_histogram(MetricsText* text, const char* name,
+                           const Histogram* histogram) {
+    size_t i;
+
+    text_printf(text, ",\"%s\":{\"count\":%lu", name, histogram->count);
+    if (histogram->count > 0) {
+        text_printf(text, ",\"mean_ms\":%.3f,\"max_ms\":%.3f,"
+                    "\"p50_ms\":%g,\"p90_ms\":%g,\"p99_ms\":%g",
+                    histogram->sum_ms / (double)histogram->count,
+                    histogram->max_ms,
+                    histogram_percentile(histogram, 50),
+                    histogram_percentile(histogram, 90),
+                    histogram_percentile(histogram, 99));
+    }
+    text_printf(text, ",\"buckets\":[");
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        text_printf(text, "%s%lu", i ? "," : "", histogram->buckets[i]);
+    }
+    text_printf(text, "]}");
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+void network_timing_start(NetworkTiming* timing) {
+    memset(timing, 0, sizeof(*timing));
+    timing->start = network_now();
+}
+
+void network_timing_connection(NetworkTiming* timing, const Connection* conn) {
+    double start = timing->start;
+    double admitted = timing->admitted;
+
+    /* A retry starts over on its new connection */
+    memset(timing, 0, sizeof(*timing));
+    timing->start = start;
+    timing->admitted = admitted;
+    if (!conn || conn->reused || conn->requests_served > 0) {
+        timing->reused = 1;
+        return;
+    }
+    timing->dns_start = conn->dns_start;
+    timing->dns_end = conn->dns_end;
+    timing->connect_start = conn->connect_start;
+    timing->connect_end = conn->connect_end;
+    timing->tls_start = conn->tls_start;
+    timing->tls_end = conn->tls_end;
+}
+
+void network_timing_sent(NetworkTiming* timing, const HttpRequestWriter* writer) {
+    timing->request_sent = network_now();
+    timing->bytes_sent = writer->head_length +
+                         (writer->body ? writer->body->length : 0);
+}
+
+void network_timing_received(NetworkTiming* timing, const HttpResponseData* data) {
+    /* HTTP/2 streams count their frames as they arrive */
+    if (timing->first_byte == 0) timing->first_byte = data->first_byte;
+    if (timing->bytes_received == 0) timing->bytes_received = data->bytes_received;
+}
+
+void network_timing_deliver(struct NetworkResponse* response,
+                            const HttpExchange* exchange, NetworkTiming* timing) {
+    if (timing->end == 0) timing->end = network_now();
+    if (response) network_response_set_timing(response, timing);
+    metrics_record(exchange->hostname, exchange->port,
+                   response ? response->statusCode() : 0, timing);
+}
+
+/* ======================================================================== */
+/* Public API                                                               */
+/* ======================================================================== */
+
+Json* NetworkMetricsJson(void) {
+    MetricsText text = { NULL, 0, 0, false };
+    Json* json;
+    bool first = true;
+    size_t i;
+    int phase;
+
+    pthread_mutex_lock(&metrics_lock);
+    text_printf(&text, "{\"bounds_ms\":[");
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        text_printf(&text, "%s%g", i ? "," : "", bucket_bounds_ms[i]);
+    }
+    text_printf(&text, "],\"hosts\":{");
+    for (i = 0; i < host_count; i++) {
+        const HostMetrics* host = hosts[i];
+
+        if (!host->hostname) continue;
+        if (!first) text_printf(&text, ",");
+        first = false;
+        text_key(&text, host->hostname, host->port);
+        text_printf(&text, ":{\"requests\":%lu,\"failed\":%lu,\"reused\":%lu,"
+                    "\"bytes_sent\":%llu,\"bytes_received\":%llu,"
+                    "\"status\":{\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu}",
+                    host->requests, host->failed, host->reused,
+                    host->bytes_sent, host->bytes_received,
+                    host->status[0], host->status[1], host->status[2],
+                    host->status[3]);
+        for (phase = 0; phase < PHASE_COUNT; phase++) {
+            text_histogram(&text, phase_names[phase], &host->phases[phase]);
+        }
+        text_printf(&text, "}");
+    }
+    text_printf(&text, "}}");
+    pthread_mutex_unlock(&metrics_lock);
+
+    json = text.failed ? NULL : JsonParse(text.data);
+    free(text.data);
+    return json;
+}
+
+void NetworkMetricsReset(void) {
+    size_t i;
+
+    pthread_mutex_lock(&metrics_lock);
+    for (i = 0; i < host_count; i++) {
+        free(hosts[i]->hostname);
+        free(hosts[i]);
+        hosts[i] = NULL;
+    }
+    host_count = 0;
+    pthread_mutex_unlock(&metrics_lock);
+}
@@ -0,0 +1,321 @@
+/**
+ * @file network_parse.c
+ * @brief Resumable, in-place HTTP/1.x message head parser
+ *
+ * The parser runs over the receive buffer itself: nothing is copied and no
+ * header is allocated. Each call picks up where the last one stopped, so
+ * bytes that arrived in earlier reads are never scanned again. Line ends
+ * (and any stray control byte) are found 16 bytes at a time with SSE2 where
+ * available, in the manner of picohttpparser.
+ *
+ * Headers are recorded as offsets into the buffer. Names are lowercased in
+ * place with a case-folded hash alongside, so lookups compare a hash before
+ * touching any bytes, and common names (network_headers.c) are indexed by
+ * number so finding them needs no scan at all. Values are trimmed and NUL terminated in place, and
+ * obsolete line folding is joined with a single space (RFC 7230 section 3.2.4).
+ */
+
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum { HEAD_STATUS, HEAD_REQUEST, HEAD_FIELDS, HEAD_DONE };
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+/* RFC 7230 tchar: the bytes allowed in a header name */
+static const unsigned char token_chars[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+    ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1,
+    ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1,
+    ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1,
+    ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1,
+    ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1,
+    ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1,
+    ['y'] = 1, ['z'] = 1
+};
+
+static bool is_ctl(unsigned char c) {
+    return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+/* First control byte (CR and LF included, HT excluded) at or after p */
+static const char* scan_ctl(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i below = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+        /* Unsigned b <= 0x1f is a saturating subtract that leaves 0 */
+        __m128i ctl = _mm_cmpeq_epi8(_mm_subs_epu8(bytes, below), zero);
+        int mask;
+
+        ctl = _mm_andnot_si128(_mm_cmpeq_epi8(bytes, tab), ctl);
+        ctl = _mm_or_si128(ctl, _mm_cmpeq_epi8(bytes, del));
+        mask = _mm_movemask_epi8(ctl);
+        if (mask) return p + __builtin_ctz((unsigned)mask);
+        p += 16;
+    }
+#endif
+    while (p < end && !is_ctl((unsigned char)*p)) p++;
+    return p;
+}
+
+static bool add_field(HttpHead* head, HttpHeaderField* field) {
+    if (head->count == head->capacity) {
+        size_t capacity = head->capacity ? head->capacity * 2 : 16;
+        HttpHeaderField* grown = realloc(head->fields,
+                                         capacity * sizeof(HttpHeaderField));
+        if (!grown) return false;
+        head->fields = grown;
+        head->capacity = capacity;
+    }
+    head->fields[head->count++] = *field;
+    if (field->id != HTTP_HEADER_OTHER && !head->first[field->id] &&
+        head->count <= 0xffff) {
+        head->first[field->id] = (unsigned short)head->count;
+    }
+    return true;
+}
+
+/* "HTTP/1.x SSS reason" */
+static int parse_status(HttpHead* head, char* buffer, size_t start, size_t end) {
+    char* line = buffer + start;
+    size_t length = end - start;
+
+    if (length < 12 || memcmp(line, "HTTP/1.", 7) != 0 ||
+        !isdigit((unsigned char)line[7]) || line[8] != ' ' ||
+        !isdigit((unsigned char)line[9]) || !isdigit((unsigned char)line[10]) ||
+        !isdigit((unsigned char)line[11]) || (length > 12 && line[12] != ' ')) {
+        return -1;
+    }
+
+    head->minor_version = line[7] - '0';
+    head->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+    head->reason = length > 12 ? start + 13 : end;
+    head->reason_length = end - head->reason;
+    buffer[end] = '\0';
+    return 0;
+}
+
+/* "METHOD target HTTP/1.x" */
+static int parse_request(HttpHead* head, char* buffer, size_t start, size_t end) {
+    char* line = buffer + start;
+    char* line_end = buffer + end;
+    char* p = line;
+    char* target;
+
+    while (p < line_end && token_chars[(unsigned char)*p]) p++;
+    if (p == line || p == line_end || *p != ' ') return -1;
+    head->method = start;
+    head->method_length = (size_t)(p - line);
+    *p++ = '\0';
+
+    target = p;
+    while (p < line_end && *p != ' ') p++;
+    if (p == target || line_end - p != 9 || memcmp(p + 1, "HTTP/1.", 7) != 0 ||
+        !isdigit((unsigned char)p[8])) {
+        return -1;
+    }
+    head->target = (size_t)(target - buffer);
+    head->target_length = (size_t)(p - target);
+    head->minor_version = p[8] - '0';
+    *p = '\0';
+    return 0;
+}
+
+/* One header line, or a continuation of the previous one */
+static int parse_field(HttpHead* head, char* buffer, size_t start, size_t end) {
+    HttpHeaderField field;
+    unsigned int hash = HTTP_HEADER_FNV_OFFSET;
+    char* p = buffer + start;
+    char* line_end = buffer + end;
+    char* value;
+
+    if (*p == ' ' || *p == '\t') {
+        /* obs-fold: join onto the previous value with spaces */
+        HttpHeaderField* last;
+        char* from;
+
+        if (head->count == 0) return -1;
+        last = &head->fields[head->count - 1];
+        from = buffer + last->value + last->value_length;
+        while (line_end > p && (line_end[-1] == ' ' || line_end[-1] == '\t')) {
+            line_end--;
+        }
+        while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+        if (p == line_end) return 0;
+
+        /* Slide the continuation down behind one space; the bytes it
+         * leaves behind are already scanned and never looked at again */
+        *from++ = ' ';
+        memmove(from, p, (size_t)(line_end - p));
+        from += line_end - p;
+        *from = '\0';
+        last->value_length = (size_t)(from - (buffer + last->value));
+        return 0;
+    }
+
+    /* Name: validate, lowercase and hash in one pass */
+    while (p < line_end && *p != ':') {
+        unsigned char c = (unsigned char)*p;
+        if (!token_chars[c]) return -1;
+        c = (unsigned char)tolower(c);
+        *p++ = (char)c;
+        hash ^= c;
+        hash *= HTTP_HEADER_FNV_PRIME;
+    }
+    if (p == line_end || p == buffer + start) return -1;
+
+    field.name = start;
+    field.name_length = (size_t)(p - (buffer + start));
+    field.hash = hash;
+    field.id = http_header_id(buffer + start, field.name_length, hash);
+
+    /* Value: trim surrounding whitespace */
+    value = p + 1;
+    while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+    while (line_end > value && (line_end[-1] == ' ' || line_end[-1] == '\t')) {
+        line_end--;
+    }
+    field.value = (size_t)(value - buffer);
+    field.value_length = (size_t)(line_end - value);
+    *line_end = '\0';
+
+    return add_field(head, &field) ? 0 : -1;
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+void http_head_init(HttpHead* head) {
+    memset(head, 0, sizeof(*head));
+    head->state = HEAD_STATUS;
+}
+
+void http_head_init_request(HttpHead* head) {
+    memset(head, 0, sizeof(*head));
+    head->state = HEAD_REQUEST;
+}
+
+int http_head_parse(HttpHead* head, char* buffer, size_t length) {
+    const char* end = buffer + length;
+
+    if (head->state == HEAD_DONE) return 1;
+
+    while (head->offset < length) {
+        const char* at = scan_ctl(buffer + head->offset, end);
+        size_t line_end;
+        size_t next;
+        int result;
+
+        if (at == end) {
+            /* Nothing new to look at until more bytes arrive */
+            head->offset = length;
+            return 0;
+        }
+
+        if (*at == '\r') {
+            if (at + 1 == end) {
+                head->offset = (size_t)(at - buffer);
+                return 0;
+            }
+            if (at[1] != '\n') return -1;
+            next = (size_t)(at - buffer) + 2;
+        } else if (*at == '\n') {
+            /* Tolerate bare LF line endings */
+            next = (size_t)(at - buffer) + 1;
+        } else {
+            return -1;
+        }
+        line_end = (size_t)(at - buffer);
+
+        if (head->state == HEAD_STATUS) {
+            result = parse_status(head, buffer, head->line, line_end);
+            head->state = HEAD_FIELDS;
+        } else if (head->state == HEAD_REQUEST) {
+            /* Blank lines before a request line are ignored (RFC 7230
+             * section 3.5); some clients send one after a body */
+            result = line_end == head->line ? 0 :
+                     parse_request(head, buffer, head->line, line_end);
+            if (line_end != head->line) head->state = HEAD_FIELDS;
+        } else if (line_end == head->line) {
+            head->state = HEAD_DONE;
+            head->length = next;
+            head->offset = head->line = next;
+            return 1;
+        } else {
+            result = parse_field(head, buffer, head->line, line_end);
+        }
+        if (result < 0) return -1;
+
+        head->offset = head->line = next;
+    }
+    return 0;
+}
+
+const char* http_head_find(const HttpHead* head, const char* buffer,
+                           const char* name) {
+    size_t length = strlen(name);
+    unsigned int hash = http_header_hash(name, length);
+    HttpHeaderId id = http_header_id(name, length, hash);
+    size_t i;
+
+    /* Past 65535 fields the index stops, and the scan takes over */
+    if (id != HTTP_HEADER_OTHER && head->count <= 0xffff) {
+        return head->first[id] ?
+               buffer + head->fields[head->first[id] - 1].value : NULL;
+    }
+    for (i = 0; i < head->count; i++) {
+        const HttpHeaderField* field = &head->fields[i];
+        size_t j;
+
+        if (field->hash != hash || field->name_length != length) continue;
+
+        /* Names are stored lowercased */
+        for (j = 0; j < length; j++) {
+            if (buffer[field->name + j] != tolower((unsigned char)name[j])) break;
+        }
+        if (j == length) return buffer + field->value;
+    }
+    return NULL;
+}
+
+bool http_head_has_token(const char* value, const char* token) {
+    size_t length = strlen(token);
+
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') value++;
+        if (strncasecmp(value, token, length) == 0) {
+            const char* after = value + length;
+            while (*after == ' ' || *after == '\t') after++;
+            if (*after == '\0' || *after == ',' || *after == ';') return true;
+        }
+        value = strchr(value, ',');
+    }
+    return false;
+}
+
+void http_head_free(HttpHead* head) {
+    free(head->fields);
+    head->fields = NULL;
+    head->count = head->capacity = 0;
+}
@@ -0,0 +1,429 @@
+/**
+ * @file network_policy.c
+ * @brief Deadlines, retries and hedged requests on top of the event loop
+ *
+ * A PolicyCall keeps a copy of the request's exchange and sends fresh
+ * copies of it as attempts on a NetworkLoop. Each attempt's deadline is
+ * whatever is left of the call's, so the loop's timer wheel enforces it.
+ * A failed attempt of an idempotent request is retried after a backoff
+ * with full jitter, waited out on the same wheel. A hedge timer is armed
+ * when the first attempt starts; if it fires before a response, a second
+ * copy goes out, the first good response is delivered and the other
+ * attempt is cancelled.
+ *
+ * Latencies of good responses are kept per origin in a small ring, and the
+ * ring's 95th percentile is what NETWORK_HEDGE_P95 waits before hedging.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define POLICY_SAMPLES 128      /* Latencies kept per origin */
+#define POLICY_MIN_SAMPLES 20   /* Before a p95 is trusted */
+#define POLICY_MAX_ORIGINS 64
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct OriginLatency {
+    char* hostname;
+    int port;
+    double samples[POLICY_SAMPLES];     /* Milliseconds, a ring */
+    size_t count;
+    size_t next;
+    int p95_ms;                         /* -1 until POLICY_MIN_SAMPLES */
+    double last_used;
+} OriginLatency;
+
+struct PolicyCall;
+
+typedef struct PolicyAttempt {
+    struct PolicyCall* call;
+    struct AsyncOp* op;
+    double started;
+    bool hedge;
+} PolicyAttempt;
+
+typedef struct PolicyCall {
+    NetworkLoop* loop;
+    HttpExchange exchange;          /* Prototype, copied for each attempt */
+    NetworkRequestPolicy policy;
+    NetworkResponseCallback callback;
+    void* context;
+
+    double deadline;                /* network_now() time, 0 = none */
+    int retries;
+    PolicyAttempt* attempts[2];     /* In flight: an attempt and its hedge */
+    struct AsyncOp* alarm;          /* Hedge or backoff timer */
+    NetworkResponse* failure;       /* Latest failed response */
+    unsigned int seed;
+} PolicyCall;
+
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static OriginLatency origins[POLICY_MAX_ORIGINS];
+static size_t origin_count = 0;
+static NetworkPolicyStats policy_stats;
+
+/* ======================================================================== */
+/* Origin Latencies                                                          */
+/* ======================================================================== */
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Caller holds policy_lock. With create, the least recently used origin
+ * makes way when the table is full. */
+static OriginLatency* origin_find(const char* hostname, int port, bool create) {
+    OriginLatency* oldest = NULL;
+    size_t i;
+
+    for (i = 0; i < origin_count; i++) {
+        OriginLatency* origin = &origins[i];
+        if (origin->port == port && strcmp(origin->hostname, hostname) == 0) {
+            return origin;
+        }
+        if (!oldest || origin->last_used < oldest->last_used) oldest = origin;
+    }
+    if (!create) return NULL;
+
+    if (origin_count < POLICY_MAX_ORIGINS) {
+        oldest = &origins[origin_count++];
+    } else {
+        free(oldest->hostname);
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->hostname = strdup(hostname);
+    oldest->port = port;
+    oldest->p95_ms = -1;
+    if (!oldest->hostname) {
+        origin_count--;
+        return NULL;
+    }
+    return oldest;
+}
+
+static void origin_record(const char* hostname, int port, double ms) {
+    OriginLatency* origin;
+    double sorted[POLICY_SAMPLES];
+
+    pthread_mutex_lock(&policy_lock);
+    origin = origin_find(hostname, port, true);
+    if (origin) {
+        origin->samples[origin->next] = ms;
+        origin->next = (origin->next + 1) % POLICY_SAMPLES;
+        if (origin->count < POLICY_SAMPLES) origin->count++;
+        origin->last_used = network_now();
+
+        /* Worked out here, once per response, so reading it is free */
+        if (origin->count >= POLICY_MIN_SAMPLES) {
+            size_t rank = (origin->count * 95 + 99) / 100;
+            memcpy(sorted, origin->samples, origin->count * sizeof(double));
+            qsort(sorted, origin->count, sizeof(double), compare_doubles);
+            origin->p95_ms = (int)(sorted[rank - 1] + 0.5);
+            if (origin->p95_ms < 1) origin->p95_ms = 1;
+        }
+    }
+    pthread_mutex_unlock(&policy_lock);
+}
+
+/* ======================================================================== */
+/* Calls and Attempts                                                        */
+/* ======================================================================== */
+
+static void attempt_done(NetworkResponse* response, void* context);
+
+/* Milliseconds left before the call's deadline; INT32_MAX with none */
+static int call_remaining(PolicyCall* call) {
+    double left;
+
+    if (call->deadline <= 0) return INT32_MAX;
+    left = (call->deadline - network_now()) * 1000;
+    return left <= 0 ? 0 : left > INT32_MAX ? INT32_MAX : (int)left;
+}
+
+static void call_cancel_alarm(PolicyCall* call) {
+    if (!call->alarm) return;
+    network_loop_cancel(call->loop, call->alarm);
+    call->alarm = NULL;
+}
+
+/* Deliver response, drop whatever is still running and free the call */
+static void call_finish(PolicyCall* call, NetworkResponse* response) {
+    NetworkResponseCallback callback = call->callback;
+    void* context = call->context;
+    int i;
+
+    call_cancel_alarm(call);
+    for (i = 0; i < 2; i++) {
+        if (!call->attempts[i]) continue;
+        network_loop_cancel(call->loop, call->attempts[i]->op);
+        free(call->attempts[i]);
+    }
+
+    pthread_mutex_lock(&policy_lock);
+    if (call->deadline > 0 && response->statusCode() == 504 &&
+        network_now() >= call->deadline) {
+        policy_stats.deadlines_missed++;
+    }
+    pthread_mutex_unlock(&policy_lock);
+
+    if (call->failure && call->failure != response) call->failure->free();
+    free(call->exchange.hostname);
+    http_writer_free(&call->exchange.writer);
+    free(call);
+    callback(response, context);
+}
+
+/* Deliver the failure being held */
+static void call_fail(PolicyCall* call) {
+    NetworkResponse* failure = call->failure;
+
+    call->failure = NULL;
+    call_finish(call, failure);
+}
+
+static void hedge_fire(void* context);
+
+/* The delay before hedging, or -1 for none */
+static int call_hedge_delay(PolicyCall* call) {
+    int delay = call->policy.hedge_after_ms;
+
+    if (!call->exchange.idempotent) return -1;
+    if (delay == NETWORK_HEDGE_P95) {
+        delay = NetworkPolicyHedgeDelay(call->exchange.hostname,
+                                        call->exchange.port);
+    }
+    return delay > 0 ? delay : -1;
+}
+
+/* Send another copy of the exchange. Returns false if the deadline has
+ * passed or the loop refused it. */
+static bool attempt_start(PolicyCall* call, bool hedge) {
+    int remaining = call_remaining(call);
+    PolicyAttempt* attempt;
+    HttpExchange copy;
+    int delay;
+
+    if (remaining <= 0) return false;
+
+    attempt = calloc(1, sizeof(PolicyAttempt));
+    if (!attempt) return false;
+    if (!http_exchange_copy(&call->exchange, &copy)) {
+        free(attempt);
+        return false;
+    }
+    if (remaining < INT32_MAX &&
+        (copy.timeout_seconds <= 0 || remaining < copy.timeout_seconds * 1000)) {
+        copy.deadline_ms = remaining;
+    }
+
+    attempt->call = call;
+    attempt->started = network_now();
+    attempt->hedge = hedge;
+    attempt->op = network_loop_start(call->loop, &copy, attempt_done, attempt);
+    if (!attempt->op) {
+        free(attempt);
+        return false;
+    }
+    call->attempts[hedge ? 1 : 0] = attempt;
+    if (hedge) {
+        pthread_mutex_lock(&policy_lock);
+        policy_stats.hedges++;
+        pthread_mutex_unlock(&policy_lock);
+        return true;
+    }
+
+    delay = call_hedge_delay(call);
+    if (delay > 0 && delay < remaining) {
+        call->alarm = network_loop_after(call->loop, delay, hedge_fire, call);
+    }
+    return true;
+}
+
+static void hedge_fire(void* context) {
+    PolicyCall* call = (PolicyCall*)context;
+
+    call->alarm = NULL;
+    if (call->attempts[0] && !call->attempts[1]) attempt_start(call, true);
+}
+
+static void backoff_fire(void* context) {
+    PolicyCall* call = (PolicyCall*)context;
+
+    call->alarm = NULL;
+    if (!attempt_start(call, false)) call_fail(call);
+}
+
+/* Random wait before retry n: full jitter over backoff_ms * 2^n */
+static int call_backoff(PolicyCall* call) {
+    long cap = call->policy.backoff_ms;
+    int shift = call->retries < 20 ? call->retries : 20;
+
+    if (cap <= 0) return 0;
+    cap <<= shift;
+    if (call->policy.max_backoff_ms > 0 && cap > call->policy.max_backoff_ms) {
+        cap = call->policy.max_backoff_ms;
+    }
+    if (cap > INT32_MAX) cap = INT32_MAX;
+    return (int)(rand_r(&call->seed) % (cap + 1));
+}
+
+static bool retryable(int status) {
+    return status == 502 || status == 503 || status == 504;
+}
+
+static void attempt_done(NetworkResponse* response, void* context) {
+    PolicyAttempt* attempt = (PolicyAttempt*)context;
+    PolicyCall* call = attempt->call;
+    int status = response->statusCode();
+    int delay;
+
+    call->attempts[attempt->hedge ? 1 : 0] = NULL;
+
+    if (!retryable(status)) {
+        if (status < 500) {
+            origin_record(call->exchange.hostname, call->exchange.port,
+                          (network_now() - attempt->started) * 1000);
+        }
+        if (attempt->hedge) {
+            pthread_mutex_lock(&policy_lock);
+            policy_stats.hedges_won++;
+            pthread_mutex_unlock(&policy_lock);
+        }
+        free(attempt);
+        call_finish(call, response);
+        return;
+    }
+
+    free(attempt);
+    if (call->failure) call->failure->free();
+    call->failure = response;
+
+    /* The other copy may still come good */
+    if (call->attempts[0] || call->attempts[1]) return;
+
+    call_cancel_alarm(call);
+    if (!call->exchange.idempotent || call->retries >= call->policy.max_retries) {
+        call_fail(call);
+        return;
+    }
+
+    delay = call_backoff(call);
+    if (delay >= call_remaining(call)) {
+        call_fail(call);
+        return;
+    }
+    call->retries++;
+    pthread_mutex_lock(&policy_lock);
+    policy_stats.retries++;
+    pthread_mutex_unlock(&policy_lock);
+
+    if (delay > 0) {
+        call->alarm = network_loop_after(call->loop, delay, backoff_fire, call);
+        if (!call->alarm) call_fail(call);
+    } else if (!attempt_start(call, false)) {
+        call_fail(call);
+    }
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+bool network_policy_submit(struct NetworkLoop* loop, const HttpExchange* exchange,
+                           const struct NetworkRequestPolicy* policy,
+                           void (*callback)(struct NetworkResponse*, void*),
+                           void* context) {
+    PolicyCall* call;
+
+    if (!loop || !exchange->hostname || !exchange->writer.head || !callback) {
+        return false;
+    }
+
+    call = calloc(1, sizeof(PolicyCall));
+    if (!call) return false;
+    if (!http_exchange_copy(exchange, &call->exchange)) {
+        free(call);
+        return false;
+    }
+    call->loop = loop;
+    call->policy = *policy;
+    call->callback = callback;
+    call->context = context;
+    if (policy->deadline_ms > 0) {
+        call->deadline = network_now() + policy->deadline_ms / 1000.0;
+    }
+    call->seed = (unsigned int)((uintptr_t)call ^
+                                (uintptr_t)(network_now() * 1000000));
+
+    if (!attempt_start(call, false)) {
+        free(call->exchange.hostname);
+        http_writer_free(&call->exchange.writer);
+        free(call);
+        return false;
+    }
+
+    pthread_mutex_lock(&policy_lock);
+    policy_stats.requests++;
+    pthread_mutex_unlock(&policy_lock);
+    return true;
+}
+
+static void keep_response(NetworkResponse* response, void* context) {
+    *(NetworkResponse**)context = response;
+}
+
+struct NetworkResponse* network_policy_send(const HttpExchange* exchange,
+                                            const struct NetworkRequestPolicy* policy) {
+    NetworkLoop* loop = NetworkLoopMake();
+    NetworkResponse* response = NULL;
+
+    if (!loop) {
+        return NetworkResponseMake(500, "Internal Server Error",
+                                   "Failed to create event loop");
+    }
+    if (network_policy_submit(loop, exchange, policy, keep_response, &response)) {
+        loop->run();
+    }
+    loop->free();
+
+    if (!response) {
+        response = NetworkResponseMake(500, "Internal Server Error",
+                                       "Failed to build request");
+    }
+    return response;
+}
+
+/* ======================================================================== */
+/* Public API                                                               */
+/* ======================================================================== */
+
+void NetworkPolicyGetStats(NetworkPolicyStats* stats) {
+    if (!stats) return;
+    pthread_mutex_lock(&policy_lock);
+    *stats = policy_stats;
+    pthread_mutex_unlock(&policy_lock);
+}
+
+int NetworkPolicyHedgeDelay(const char* host, int port) {
+    OriginLatency* origin;
+    int delay = -1;
+
+    if (!host) return -1;
+    pthread_mutex_lock(&policy_lock);
+    origin = origin_find(host, port, false);
+    if (origin) delay = origin->p95_ms;
+    pthread_mutex_unlock(&policy_lock);
+    return delay;
+}
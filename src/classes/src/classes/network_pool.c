@@ -0,0 +1,361 @@
+/**
+ * @file network_pool.c
+ * @brief Keep-alive connection pool shared by all NetworkRequests
+ *
+ * Connections are grouped per origin (scheme, host, port). Idle connections
+ * are parked in a LIFO list so the most recently used, and therefore most
+ * likely still open, connection is handed out first. Every reuse is checked
+ * with connection_is_alive() and against the idle timeout.
+ */
+
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct PoolHost {
+    char* hostname;
+    int port;
+    bool use_ssl;
+
+    Connection* idle;      /* Parked connections, most recent first */
+    int idle_count;
+    int open_count;        /* Idle plus checked out */
+
+    struct PoolHost* next;
+} PoolHost;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static PoolHost* pool_hosts = NULL;
+
+static NetworkPoolOptions pool_options = {
+    32,     /* max_per_host */
+    8,      /* max_idle_per_host */
+    60      /* idle_timeout_seconds */
+};
+
+static NetworkPoolStats pool_stats;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+/* Caller must hold pool_mutex */
+static PoolHost* pool_host_find(const char* hostname, int port, bool use_ssl,
+                                bool create) {
+    PoolHost* host;
+
+    for (host = pool_hosts; host; host = host->next) {
+        if (host->port == port && host->use_ssl == use_ssl &&
+            strcasecmp(host->hostname, hostname) == 0) {
+            return host;
+        }
+    }
+
+    if (!create) return NULL;
+
+    host = calloc(1, sizeof(PoolHost));
+    if (!host) return NULL;
+
+    host->hostname = strdup(hostname);
+    if (!host->hostname) {
+        free(host);
+        return NULL;
+    }
+    host->port = port;
+    host->use_ssl = use_ssl;
+    host->next = pool_hosts;
+    pool_hosts = host;
+    return host;
+}
+
+/* Caller must hold pool_mutex. Moves expired or dead connections from the
+ * host's idle list onto the graveyard list so they can be closed unlocked. */
+static void pool_host_prune(PoolHost* host, double now, Connection** graveyard) {
+    Connection** link = &host->idle;
+
+    while (*link) {
+        Connection* conn = *link;
+        if (now - conn->idle_since > pool_options.idle_timeout_seconds ||
+            !connection_is_alive(conn)) {
+            *link = conn->pool_next;
+            host->idle_count--;
+            host->open_count--;
+            pool_stats.connections_discarded++;
+            conn->pool_next = *graveyard;
+            *graveyard = conn;
+        } else {
+            link = &conn->pool_next;
+        }
+    }
+}
+
+static void close_all(Connection* list) {
+    while (list) {
+        Connection* next = list->pool_next;
+        connection_free(list);
+        list = next;
+    }
+}
+
+static void deadline_after(struct timespec* ts, int seconds) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += seconds > 0 ? seconds : 30;
+}
+
+/* ======================================================================== */
+/* Pool Operations                                                          */
+/* ======================================================================== */
+
+Connection* connection_pool_acquire(const char* hostname, int port,
+                                    bool use_ssl, int timeout_seconds,
+                                    char* error, size_t error_size) {
+    PoolHost* host;
+    Connection* conn = NULL;
+    Connection* graveyard = NULL;
+    struct timespec deadline;
+    bool have_deadline = false;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    host = pool_host_find(hostname, port, use_ssl, true);
+    if (!host) {
+        pthread_mutex_unlock(&pool_mutex);
+        snprintf(error, error_size, "Out of memory");
+        return NULL;
+    }
+
+    for (;;) {
+        pool_host_prune(host, network_now(), &graveyard);
+
+        if (host->idle) {
+            conn = host->idle;
+            host->idle = conn->pool_next;
+            host->idle_count--;
+            conn->pool_next = NULL;
+            conn->reused = true;
+            conn->timeout_seconds = timeout_seconds;
+            pool_stats.connections_reused++;
+            break;
+        }
+
+        if (pool_options.max_per_host <= 0 ||
+            host->open_count < pool_options.max_per_host) {
+            /* Reserve the slot now, connect outside the lock */
+            host->open_count++;
+            break;
+        }
+
+        if (!have_deadline) {
+            deadline_after(&deadline, timeout_seconds);
+            have_deadline = true;
+        }
+        if (pthread_cond_timedwait(&pool_cond, &pool_mutex, &deadline)
+                == ETIMEDOUT) {
+            pthread_mutex_unlock(&pool_mutex);
+            close_all(graveyard);
+            snprintf(error, error_size,
+                     "Timed out waiting for a connection to %s:%d",
+                     hostname, port);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&pool_mutex);
+    close_all(graveyard);
+
+    if (conn) {
+        /* The event loop may have parked it in non-blocking mode */
+        connection_set_blocking(conn, true);
+        return conn;
+    }
+
+    conn = connection_create(hostname, port, use_ssl);
+    if (conn) {
+        conn->timeout_seconds = timeout_seconds;
+        if (connection_connect(conn)) {
+            pthread_mutex_lock(&pool_mutex);
+            pool_stats.connections_opened++;
+            pthread_mutex_unlock(&pool_mutex);
+            return conn;
+        }
+        snprintf(error, error_size, "%s", connection_error(conn));
+        connection_free(conn);
+    } else {
+        snprintf(error, error_size, "Failed to create connection");
+    }
+
+    /* Give the reserved slot back */
+    pthread_mutex_lock(&pool_mutex);
+    host->open_count--;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    return NULL;
+}
+
+void connection_pool_release(Connection* conn, bool keep_alive) {
+    PoolHost* host;
+
+    if (!conn) return;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    host = pool_host_find(conn->hostname, conn->port,
+                          conn->type == CONN_TYPE_SSL, false);
+
+    if (host && keep_alive &&
+        host->idle_count < pool_options.max_idle_per_host) {
+        conn->idle_since = network_now();
+        conn->requests_served++;
+        conn->reused = false;
+        conn->pool_next = host->idle;
+        host->idle = conn;
+        host->idle_count++;
+        conn = NULL;
+    } else if (host) {
+        host->open_count--;
+    }
+
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (conn) connection_free(conn);
+}
+
+Connection* connection_pool_take_idle(const char* hostname, int port,
+                                      bool use_ssl) {
+    PoolHost* host;
+    Connection* conn = NULL;
+    Connection* graveyard = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    host = pool_host_find(hostname, port, use_ssl, false);
+    if (host) {
+        pool_host_prune(host, network_now(), &graveyard);
+        if (host->idle) {
+            conn = host->idle;
+            host->idle = conn->pool_next;
+            host->idle_count--;
+            conn->pool_next = NULL;
+            conn->reused = true;
+            pool_stats.connections_reused++;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    close_all(graveyard);
+    return conn;
+}
+
+bool connection_pool_reserve(const char* hostname, int port, bool use_ssl) {
+    PoolHost* host;
+    bool reserved = false;
+
+    pthread_mutex_lock(&pool_mutex);
+    host = pool_host_find(hostname, port, use_ssl, true);
+    if (host && (pool_options.max_per_host <= 0 ||
+                 host->open_count < pool_options.max_per_host)) {
+        host->open_count++;
+        pool_stats.connections_opened++;
+        reserved = true;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return reserved;
+}
+
+void connection_pool_unreserve(const char* hostname, int port, bool use_ssl) {
+    PoolHost* host;
+
+    pthread_mutex_lock(&pool_mutex);
+    host = pool_host_find(hostname, port, use_ssl, false);
+    if (host && host->open_count > 0) {
+        host->open_count--;
+        pool_stats.connections_opened--;
+    }
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/* ======================================================================== */
+/* Public Configuration                                                     */
+/* ======================================================================== */
+
+void NetworkPoolConfigure(const NetworkPoolOptions* options) {
+    Connection* graveyard = NULL;
+    PoolHost* host;
+
+    if (!options) return;
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_options = *options;
+    if (pool_options.max_idle_per_host < 0) pool_options.max_idle_per_host = 0;
+
+    /* Trim idle lists that are now over the limit */
+    for (host = pool_hosts; host; host = host->next) {
+        while (host->idle_count > pool_options.max_idle_per_host) {
+            Connection* conn = host->idle;
+            host->idle = conn->pool_next;
+            host->idle_count--;
+            host->open_count--;
+            conn->pool_next = graveyard;
+            graveyard = conn;
+        }
+    }
+
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    close_all(graveyard);
+}
+
+void NetworkPoolGetOptions(NetworkPoolOptions* options) {
+    if (!options) return;
+
+    pthread_mutex_lock(&pool_mutex);
+    *options = pool_options;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void NetworkPoolGetStats(NetworkPoolStats* stats) {
+    PoolHost* host;
+
+    if (!stats) return;
+
+    pthread_mutex_lock(&pool_mutex);
+    *stats = pool_stats;
+    stats->idle_connections = 0;
+    for (host = pool_hosts; host; host = host->next) {
+        stats->idle_connections += (size_t)host->idle_count;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void NetworkPoolClear(void) {
+    Connection* graveyard = NULL;
+    PoolHost* host;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (host = pool_hosts; host; host = host->next) {
+        while (host->idle) {
+            Connection* conn = host->idle;
+            host->idle = conn->pool_next;
+            conn->pool_next = graveyard;
+            graveyard = conn;
+        }
+        host->open_count -= host->idle_count;
+        host->idle_count = 0;
+    }
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    close_all(graveyard);
+}
@@ -12,32 +12,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 /* ======================================================================== */
 /* Private Structures                                                       */
 /* ======================================================================== */
 
-typedef struct RequestHeader {
-    char* key;
-    char* value;
-    struct RequestHeader* next;
-} RequestHeader;
-
 typedef struct NetworkRequestPrivate {
     NetworkRequest public;  /* Public interface MUST be first */
 
     /* Request properties */
     char* url;
     HttpMethod method;
-    RequestHeader* headers;
-    char* body;
-    size_t body_length;
+    HttpHeaderTable headers;
+    HttpBody* body;         /* Shared with exchanges still sending it */
+
+    /* Streaming response consumer */
+    NetworkBodyHandler body_handler;
+    void* body_handler_context;
 
     /* Connection settings */
     int timeout_seconds;
+    bool keep_alive;
+    HttpVersion http_version;
     bool follow_redirects;
     int max_redirects;
 
+    /* Deadline, retries and hedging */
+    NetworkRequestPolicy policy;
+    bool has_policy;
+
     /* Parsed URL components */
     char* scheme;
     char* host;
@@ -61,16 +70,6 @@ static const char* method_to_string(HttpMethod method) {
     return "GET";
 }
 
-static void free_headers(RequestHeader* headers) {
-    while (headers) {
-        RequestHeader* next = headers->next;
-        free(headers->key);
-        free(headers->value);
-        free(headers);
-        headers = next;
-    }
-}
-
 static bool parse_url_clean(const char* url, NetworkRequestPrivate* private) {
     if (!url || !private) return false;
 
@@ -111,11 +110,23 @@ static bool parse_url_clean(const char* url, NetworkRequestPrivate* private) {
         private->port = 80;
     }
 
-    /* Parse host and port */
+    /* Parse host and port; IPv6 literals are bracketed, [::1]:8080 */
     char* path_start = strchr(ptr, '/');
     char* port_start = strchr(ptr, ':');
 
-    if (port_start && (!path_start || port_start < path_start)) {
+    if (*ptr == '[') {
+        char* close = strchr(ptr, ']');
+        if (!close) {
+            free(work);
+            return false;
+        }
+        *close = '\0';
+        private->host = strdup(ptr + 1);
+        ptr = close + 1;
+        path_start = strchr(ptr, '/');
+        if (*ptr == ':') private->port = atoi(ptr + 1);
+        ptr = path_start;
+    } else if (port_start && (!path_start || port_start < path_start)) {
         /* Host with port */
         *port_start = '\0';
         private->host = strdup(ptr);
@@ -124,7 +135,7 @@ static bool parse_url_clean(const char* url, NetworkRequestPrivate* private) {
         if (path_start) {
             *path_start = '\0';
             private->port = atoi(ptr);
-            ptr = path_start + 1;
+            ptr = path_start;
             *path_start = '/';
         } else {
             private->port = atoi(ptr);
@@ -161,62 +172,6 @@ static bool parse_url_clean(const char* url, NetworkRequestPrivate* private) {
     return true;
 }
 
-static RequestHeader* find_header(RequestHeader* headers, const char* key) {
-    while (headers) {
-        if (strcasecmp(headers->key, key) == 0) {
-            return headers;
-        }
-        headers = headers->next;
-    }
-    return NULL;
-}
-
-static void add_or_update_header(NetworkRequestPrivate* private,
-                                 const char* key, const char* value) {
-    RequestHeader* existing = find_header(private->headers, key);
-
-    if (existing) {
-        /* Update existing header */
-        free(existing->value);
-        existing->value = strdup(value);
-    } else {
-        /* Add new header */
-        RequestHeader* new_header = calloc(1, sizeof(RequestHeader));
-        if (new_header) {
-            new_header->key = strdup(key);
-            new_header->value = strdup(value);
-
-            /* Add to front of list */
-            new_header->next = private->headers;
-            private->headers = new_header;
-        }
-    }
-}
-
-static char* build_header_string(RequestHeader* headers) {
-    /* Calculate total size needed */
-    size_t total_size = 0;
-    RequestHeader* h = headers;
-    while (h) {
-        total_size += strlen(h->key) + strlen(h->value) + 4; /* ": \r\n" */
-        h = h->next;
-    }
-
-    if (total_size == 0) return NULL;
-
-    char* result = malloc(total_size + 1);
-    if (!result) return NULL;
-
-    char* ptr = result;
-    h = headers;
-    while (h) {
-        ptr += sprintf(ptr, "%s: %s\r\n", h->key, h->value);
-        h = h->next;
-    }
-
-    return result;
-}
-
 /* ======================================================================== */
 /* Trampoline Functions using TF_ macros                                    */
 /* ======================================================================== */
@@ -244,25 +199,47 @@ static TF_Setter(networkrequest_setMethod, NetworkRequest, NetworkRequestPrivate
 }
 
 static TF_Getter(networkrequest_body, NetworkRequest, NetworkRequestPrivate, const char*)
-    return private->body;
+    return private->body && private->body->fd < 0 ? private->body->data : NULL;
+}
+
+static TF_Dyadic(void, networkrequest_setBodyData, NetworkRequest, NetworkRequestPrivate,
+                const void*, data, size_t, length)
+    http_body_release(private->body);
+    private->body = data ? http_body_from_memory(data, length) : NULL;
 }
 
 static TF_Setter(networkrequest_setBody, NetworkRequest, NetworkRequestPrivate, const char*)
-    free(private->body);
-    if (newValue) {
-        private->body_length = strlen(newValue);
-        private->body = malloc(private->body_length + 1);
-        if (private->body) {
-            strcpy(private->body, newValue);
-        }
-    } else {
-        private->body = NULL;
-        private->body_length = 0;
+    (void)private; /* Suppress unused warning */
+    networkrequest_setBodyData(self, newValue, newValue ? strlen(newValue) : 0);
+}
+
+static TF_Unary(int, networkrequest_setBodyFile, NetworkRequest, NetworkRequestPrivate,
+               const char*, path)
+    struct stat info;
+    HttpBody* body;
+    int fd;
+
+    if (!path) return 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return 0;
     }
+
+    body = http_body_from_file(fd, 0, (size_t)info.st_size);
+    if (!body) {
+        close(fd);
+        return 0;
+    }
+    http_body_release(private->body);
+    private->body = body;
+    return 1;
 }
 
 static TF_Getter(networkrequest_bodyLength, NetworkRequest, NetworkRequestPrivate, size_t)
-    return private->body_length;
+    return private->body ? private->body->length : 0;
 }
 
 static TF_Unary(void, networkrequest_setBodyString, NetworkRequest, NetworkRequestPrivate, String*, str)
@@ -292,6 +269,12 @@ static TF_Unary(void, networkrequest_setBodyJson, NetworkRequest, NetworkRequest
     }
 }
 
+static TF_Dyadic(void, networkrequest_setBodyHandler, NetworkRequest, NetworkRequestPrivate,
+                NetworkBodyHandler, handler, void*, context)
+    private->body_handler = handler;
+    private->body_handler_context = context;
+}
+
 static TF_Getter(networkrequest_port, NetworkRequest, NetworkRequestPrivate, int)
     return private->port;
 }
@@ -308,149 +291,688 @@ static TF_Setter(networkrequest_setTimeout, NetworkRequest, NetworkRequestPrivat
     private->timeout_seconds = newValue;
 }
 
+static TF_Getter(networkrequest_keepAlive, NetworkRequest, NetworkRequestPrivate, int)
+    return private->keep_alive;
+}
+
+static TF_Setter(networkrequest_setKeepAlive, NetworkRequest, NetworkRequestPrivate, int)
+    private->keep_alive = newValue != 0;
+}
+
+static TF_Getter(networkrequest_httpVersion, NetworkRequest, NetworkRequestPrivate, HttpVersion)
+    return private->http_version;
+}
+
+static TF_Setter(networkrequest_setHttpVersion, NetworkRequest, NetworkRequestPrivate, HttpVersion)
+    private->http_version = newValue == HTTP_VERSION_2 ? HTTP_VERSION_2
+                                                       : HTTP_VERSION_1_1;
+}
+
+static TF_Unary(void, networkrequest_setPolicy, NetworkRequest, NetworkRequestPrivate,
+                const NetworkRequestPolicy*, policy)
+    private->has_policy = policy != NULL;
+    if (policy) private->policy = *policy;
+}
+
+static TF_Getter(networkrequest_followRedirects, NetworkRequest, NetworkRequestPrivate, int)
+    return private->follow_redirects;
+}
+
+static TF_Setter(networkrequest_setFollowRedirects, NetworkRequest, NetworkRequestPrivate, int)
+    private->follow_redirects = newValue != 0;
+}
+
+static TF_Getter(networkrequest_maxRedirects, NetworkRequest, NetworkRequestPrivate, int)
+    return private->max_redirects;
+}
+
+static TF_Setter(networkrequest_setMaxRedirects, NetworkRequest, NetworkRequestPrivate, int)
+    private->max_redirects = newValue > 0 ? newValue : 0;
+}
+
 static TF_Unary(const char*, networkrequest_header, NetworkRequest, NetworkRequestPrivate, const char*, key)
-    RequestHeader* header = find_header(private->headers, key);
+    const HttpHeaderEntry* header = key ? http_headers_find(&private->headers, key) : NULL;
     return header ? header->value : NULL;
 }
 
 static TF_Dyadic(void, networkrequest_setHeader, NetworkRequest, NetworkRequestPrivate,
                 const char*, key, const char*, value)
     if (key && value) {
-        add_or_update_header(private, key, value);
+        http_headers_set(&private->headers, key, value);
     }
 }
 
 static TF_Unary(void, networkrequest_removeHeader, NetworkRequest, NetworkRequestPrivate, const char*, key)
-    RequestHeader* prev = NULL;
-    RequestHeader* current = private->headers;
-
-    while (current) {
-        if (strcasecmp(current->key, key) == 0) {
-            if (prev) {
-                prev->next = current->next;
-            } else {
-                private->headers = current->next;
-            }
-            free(current->key);
-            free(current->value);
-            free(current);
-            return;
-        }
-        prev = current;
-        current = current->next;
-    }
+    if (key) http_headers_remove(&private->headers, key);
 }
 
 /* Forward declaration */
 NetworkResponse* NetworkResponseMake(int status_code, const char* status_text, const char* body);
 
-static TF_Getter(networkrequest_send, NetworkRequest, NetworkRequestPrivate, NetworkResponse*)
-    bool use_ssl;
-    Connection* conn;
-    NetworkResponse* error_resp;
-    String* full_path;
+/* Prepares the request head, without the common headers in skip and with
+ * the extra header lines (may be NULL), and hands the writer a reference
+ * to the body, which is sent from where it lies. Returns false if memory
+ * runs out. */
+static bool build_request_writer(NetworkRequestPrivate* private,
+                                 HttpRequestWriter* writer,
+                                 unsigned long long skip, const char* extra) {
+    const char* path = private->path ? private->path : "/";
+    char* full_path;
     char* header_string;
-    char* request;
-    ssize_t sent;
-    char buffer[65536];
-    size_t total_read = 0;
-    ssize_t bytes_read;
+    char* head = NULL;
+    size_t head_length = 0;
+    size_t length = strlen(path);
+
+    /* Build path with query. A plain buffer: a String costs a trampoline
+     * page per method, more than the rest of the request put together. */
+    full_path = malloc(length + (private->query ? strlen(private->query) + 1 : 0) + 1);
+    if (full_path) {
+        memcpy(full_path, path, length + 1);
+        if (private->query) {
+            full_path[length] = '?';
+            strcpy(full_path + length + 1, private->query);
+        }
+    }
 
-    if (!private->url || !private->host) {
-        return NetworkResponseMake(400, "Bad Request", "Invalid URL");
+    /* Build headers string */
+    header_string = http_headers_format(&private->headers, skip, extra);
+
+    /* Build HTTP request head */
+    if (full_path) {
+        head = http_build_request_head(
+            method_to_string(private->method),
+            full_path,
+            private->host,
+            header_string,
+            private->body ? private->body->length : 0,
+            private->keep_alive,
+            &head_length
+        );
     }
 
-    /* Determine if we need SSL */
-    use_ssl = (strcmp(private->scheme, "https") == 0);
+    free(full_path);
+    free(header_string);
 
-    /* Create connection */
-    conn = connection_create(private->host, private->port, use_ssl);
-    if (!conn) {
-        return NetworkResponseMake(500, "Internal Server Error",
-                                  "Failed to create connection");
+    http_writer_init(writer, head, head_length, head ? private->body : NULL);
+    return head != NULL;
+}
+
+/* Everything an exchange needs from the request but its host and writer */
+static void exchange_settings(NetworkRequestPrivate* private,
+                              HttpExchange* exchange) {
+    HttpMethod method = private->method;
+
+    exchange->port = private->port;
+    exchange->use_ssl = (strcmp(private->scheme, "https") == 0);
+    exchange->timeout_seconds = private->timeout_seconds;
+    exchange->no_body = method == HTTP_HEAD;
+    /* RFC 7231 section 4.2.2: repeating these has the same effect */
+    exchange->idempotent = method == HTTP_GET || method == HTTP_HEAD ||
+                           method == HTTP_PUT || method == HTTP_DELETE ||
+                           method == HTTP_OPTIONS;
+    exchange->keep_alive = private->keep_alive;
+    exchange->http2 = private->http_version == HTTP_VERSION_2;
+    exchange->sink = private->body_handler;
+    exchange->sink_context = private->body_handler_context;
+}
+
+/* ======================================================================== */
+/* Redirects                                                                */
+/* ======================================================================== */
+
+/* Permanent redirects (301 and 308) seen by this process. A client meets
+ * few moved URLs, so a short table does; the least recently used entry
+ * makes way when it is full. */
+#define MOVED_URLS_MAX 64
+
+typedef struct MovedUrl {
+    char* from;
+    char* to;
+    unsigned long used;
+} MovedUrl;
+
+static pthread_mutex_t moved_lock = PTHREAD_MUTEX_INITIALIZER;
+static MovedUrl moved_urls[MOVED_URLS_MAX];
+static unsigned long moved_clock = 0;
+
+/* Where from has moved to, as a copy for the caller to free, or NULL */
+static char* moved_lookup(const char* from) {
+    char* to = NULL;
+    size_t i;
+
+    pthread_mutex_lock(&moved_lock);
+    for (i = 0; i < MOVED_URLS_MAX; i++) {
+        if (moved_urls[i].from && strcmp(moved_urls[i].from, from) == 0) {
+            moved_urls[i].used = ++moved_clock;
+            to = strdup(moved_urls[i].to);
+            break;
+        }
     }
+    pthread_mutex_unlock(&moved_lock);
+    return to;
+}
 
-    /* Set timeout */
-    conn->timeout_seconds = private->timeout_seconds;
+static void moved_store(const char* from, const char* to) {
+    MovedUrl* slot = &moved_urls[0];
+    char* from_copy = strdup(from);
+    char* to_copy = strdup(to);
+    size_t i;
 
-    /* Connect to server */
-    if (!connection_connect(conn)) {
-        error_resp = NetworkResponseMake(502, "Bad Gateway",
-                                         connection_error(conn));
-        connection_free(conn);
-        return error_resp;
+    if (!from_copy || !to_copy) {
+        free(from_copy);
+        free(to_copy);
+        return;
     }
 
-    /* Build path with query */
-    full_path = StringMake(private->path ? private->path : "/");
-    if (private->query) {
-        full_path->append("?");
-        full_path->append(private->query);
+    /* Empty slots were never used, so they go before any entry */
+    pthread_mutex_lock(&moved_lock);
+    for (i = 0; i < MOVED_URLS_MAX; i++) {
+        if (moved_urls[i].from && strcmp(moved_urls[i].from, from) == 0) {
+            slot = &moved_urls[i];
+            break;
+        }
+        if (moved_urls[i].used < slot->used) slot = &moved_urls[i];
     }
+    free(slot->from);
+    free(slot->to);
+    slot->from = from_copy;
+    slot->to = to_copy;
+    slot->used = ++moved_clock;
+    pthread_mutex_unlock(&moved_lock);
+}
 
-    /* Build headers string */
-    header_string = build_header_string(private->headers);
-
-    /* Build HTTP request */
-    request = http_build_request(
-        method_to_string(private->method),
-        full_path->cStr(),
-        private->host,
-        header_string,
-        private->body,
-        private->body_length
-    );
-
-    full_path->free();
-    free(header_string);
+static char* format_string(const char* format, ...) {
+    va_list args;
+    char* url;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0) return NULL;
+
+    url = malloc((size_t)length + 1);
+    if (!url) return NULL;
+    va_start(args, format);
+    vsnprintf(url, (size_t)length + 1, format, args);
+    va_end(args);
+    return url;
+}
+
+/* "scheme://host:port", bracketing IPv6 literals */
+static char* request_origin(const NetworkRequestPrivate* private) {
+    return format_string(strchr(private->host, ':') ? "%s://[%s]:%d" : "%s://%s:%d",
+                      private->scheme, private->host, private->port);
+}
+
+/* The full URL the request goes to, the key for moved URLs */
+static char* request_target(const NetworkRequestPrivate* private) {
+    char* origin = request_origin(private);
+    char* url;
+
+    if (!origin) return NULL;
+    url = format_string("%s%s%s%s", origin, private->path ? private->path : "/",
+                     private->query ? "?" : "",
+                     private->query ? private->query : "");
+    free(origin);
+    return url;
+}
+
+/* Location resolved against the request's URL as RFC 3986 section 5.2
+ * does, without removing dot segments, which servers resolve anyway.
+ * NULL if it leads anywhere but http or https. */
+static char* resolve_location(const NetworkRequestPrivate* private,
+                              const char* location) {
+    const char* path = private->path ? private->path : "/";
+    int length = (int)strcspn(location, "#");   /* Fragments stay here */
+    size_t scheme = strspn(location, "abcdefghijklmnopqrstuvwxyz"
+                                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+.-");
+    char* origin;
+    char* url;
+    size_t i;
+
+    if (scheme > 0 && location[scheme] == ':') {
+        if (!(scheme == 4 && strncasecmp(location, "http", 4) == 0) &&
+            !(scheme == 5 && strncasecmp(location, "https", 5) == 0)) {
+            return NULL;
+        }
+        url = format_string("%.*s", length, location);
+        for (i = 0; url && i < scheme; i++) url[i] = (char)tolower((unsigned char)url[i]);
+        return url;
+    }
+    if (location[0] == '/' && location[1] == '/') {
+        return format_string("%s:%.*s", private->scheme, length, location);
+    }
+
+    origin = request_origin(private);
+    if (!origin) return NULL;
+    if (location[0] == '/') {
+        url = format_string("%s%.*s", origin, length, location);
+    } else if (location[0] == '?') {
+        url = format_string("%s%s%.*s", origin, path, length, location);
+    } else {
+        /* Relative to the directory the current path is in */
+        url = format_string("%s%.*s%.*s", origin, (int)(strrchr(path, '/') - path + 1),
+                         path, length, location);
+    }
+    free(origin);
+    return url;
+}
+
+static bool redirect_status(int status) {
+    return status == 301 || status == 302 || status == 303 ||
+           status == 307 || status == 308;
+}
+
+/* Point the hop at url. At first it borrows the request's URL parts, which
+ * are left alone; from then on it owns its own. */
+static bool hop_retarget(NetworkRequestPrivate* hop, bool* owned, const char* url) {
+    if (!*owned) {
+        hop->scheme = hop->host = hop->path = hop->query = NULL;
+        *owned = true;
+    }
+    return parse_url_clean(url, hop) && hop->host;
+}
+
+/* The headers a hop leaves out */
+static unsigned long long hop_skip(bool body_dropped, bool credentials_dropped) {
+    unsigned long long skip = 0;
+
+    if (body_dropped) {
+        skip |= HTTP_HEADER_BIT(HTTP_HEADER_CONTENT_TYPE) |
+                HTTP_HEADER_BIT(HTTP_HEADER_CONTENT_ENCODING);
+    }
+    if (credentials_dropped) {
+        skip |= HTTP_HEADER_BIT(HTTP_HEADER_AUTHORIZATION) |
+                HTTP_HEADER_BIT(HTTP_HEADER_PROXY_AUTHORIZATION) |
+                HTTP_HEADER_BIT(HTTP_HEADER_COOKIE);
+    }
+    return skip;
+}
 
-    if (!request) {
-        connection_free(conn);
+/* Send the request as the hop describes it, without the headers in skip
+ * and with the extra lines */
+static NetworkResponse* send_exchange(NetworkRequestPrivate* hop,
+                                      unsigned long long skip,
+                                      const char* extra) {
+    HttpExchange exchange;
+    NetworkResponse* response;
+
+    /* Borrows the host, so nothing is copied for a blocking send */
+    memset(&exchange, 0, sizeof(exchange));
+    exchange.hostname = hop->host;
+    exchange_settings(hop, &exchange);
+
+    if (!build_request_writer(hop, &exchange.writer, skip, extra)) {
+        http_writer_free(&exchange.writer);
         return NetworkResponseMake(500, "Internal Server Error",
                                   "Failed to build request");
     }
+    response = hop->has_policy
+        ? network_policy_send(&exchange, &hop->policy)
+        : network_exchange_send(&exchange);
+    http_writer_free(&exchange.writer);
+    return response;
+}
+
+/* Whether the response cache may answer this hop and keep its answer */
+static bool hop_cacheable(NetworkRequestPrivate* hop) {
+    const HttpHeaderEntry* control = http_headers_find(&hop->headers, "Cache-Control");
+
+    return hop->method == HTTP_GET && !hop->body_handler &&
+           !http_headers_find(&hop->headers, "Authorization") &&
+           !http_headers_find(&hop->headers, "If-None-Match") &&
+           !http_headers_find(&hop->headers, "If-Modified-Since") &&
+           !(control && strstr(control->value, "no-store"));
+}
 
-    /* Send request */
-    sent = connection_send(conn, request, strlen(request));
-    free(request);
+/* send_exchange, through the response cache when it applies */
+static NetworkResponse* send_once(NetworkRequestPrivate* hop,
+                                  unsigned long long skip) {
+    const HttpHeaderEntry* control;
+    const char* etag;
+    const char* modified;
+    NetworkResponse* response;
+    CacheEntry* entry;
+    char* validators = NULL;
+    char* url;
+    bool fresh = false;
 
-    if (sent < 0) {
-        error_resp = NetworkResponseMake(500, "Internal Server Error",
-                                         connection_error(conn));
-        connection_free(conn);
-        return error_resp;
+    /* Nothing to compute for the common case of no cache at all */
+    if (!network_cache_enabled() || !hop_cacheable(hop) ||
+        (url = request_target(hop)) == NULL) {
+        return send_exchange(hop, skip, NULL);
+    }
+    control = http_headers_find(&hop->headers, "Cache-Control");
+    entry = network_cache_lookup(url, control && strstr(control->value, "no-cache"),
+                                 &fresh);
+    if (entry && fresh) {
+        free(url);
+        return network_cache_respond(entry);
     }
 
-    /* Read response */
+    /* Ask only for a change */
+    if (entry) {
+        etag = network_cache_etag(entry);
+        modified = network_cache_last_modified(entry);
+        validators = format_string("%s%s%s%s%s%s",
+                                etag ? "If-None-Match: " : "", etag ? etag : "",
+                                etag ? "\r\n" : "",
+                                modified ? "If-Modified-Since: " : "",
+                                modified ? modified : "", modified ? "\r\n" : "");
+    }
+
+    response = send_exchange(hop, skip, validators);
+    free(validators);
+    if (entry && response->statusCode() == 304) {
+        response = network_cache_revalidated(entry, response);
+    } else {
+        if (entry) network_cache_release(entry);
+        network_cache_store(url, response);
+    }
+    free(url);
+    return response;
+}
+
+/*
+ * Each hop is sent like a request of its own, so one to the same host
+ * takes the connection the last hop gave back to the pool. The hop is a
+ * copy of the request whose URL parts, method and body change as it goes;
+ * the headers stay shared and are filtered as each head is built.
+ */
+static TF_Getter(networkrequest_send, NetworkRequest, NetworkRequestPrivate, NetworkResponse*)
+    NetworkRequestPrivate hop;
+    NetworkResponse* response = NULL;
+    const char* location;
+    bool owned = false;
+    bool body_dropped = false;
+    bool credentials_dropped = false;
+    char* origin;
+    char* target;
+    char* next;
+    int redirects = 0;
+    int status;
+
+    if (!private->url || !private->host) {
+        return NetworkResponseMake(400, "Bad Request", "Invalid URL");
+    }
+    if (!private->follow_redirects) return send_once(private, 0);
+
+    hop = *private;
+
+    /* Go straight to where the URL is known to have moved */
+    if (hop.method == HTTP_GET || hop.method == HTTP_HEAD) {
+        target = request_target(&hop);
+        while (target && redirects < hop.max_redirects &&
+               (next = moved_lookup(target)) != NULL) {
+            free(target);
+            target = next;
+            redirects++;
+        }
+        if (target && redirects > 0 && !hop_retarget(&hop, &owned, target)) {
+            response = NetworkResponseMake(502, "Bad Gateway",
+                                          "Invalid redirect location");
+        }
+        free(target);
+    }
+
+    while (!response) {
+        response = send_once(&hop, hop_skip(body_dropped, credentials_dropped));
+        status = response->statusCode();
+        location = response->header("Location");
+        if (!redirect_status(status) || !location ||
+            redirects >= hop.max_redirects) {
+            break;
+        }
+        next = resolve_location(&hop, location);
+        if (!next) break;
+
+        /* Only a GET or HEAD goes to a moved URL's new place unasked */
+        if ((status == 301 || status == 308) &&
+            (hop.method == HTTP_GET || hop.method == HTTP_HEAD) &&
+            (target = request_target(&hop)) != NULL) {
+            moved_store(target, next);
+            free(target);
+        }
+
+        /* RFC 7231 section 6.4: a 303 is followed with GET whatever the
+         * method was, and clients have long done the same for a POST
+         * answered with 301 or 302 */
+        if ((status == 303 && hop.method != HTTP_HEAD) ||
+            ((status == 301 || status == 302) && hop.method == HTTP_POST)) {
+            hop.method = HTTP_GET;
+            hop.body = NULL;
+            body_dropped = true;
+        }
+
+        response->free();
+        response = NULL;
+        origin = request_origin(&hop);
+        if (!origin || !hop_retarget(&hop, &owned, next)) {
+            response = NetworkResponseMake(502, "Bad Gateway",
+                                          "Invalid redirect location");
+        } else {
+            /* Credentials are only for the origin they were meant for */
+            target = request_origin(&hop);
+            if (!target || strcmp(origin, target) != 0) credentials_dropped = true;
+            free(target);
+            redirects++;
+        }
+        free(origin);
+        free(next);
+    }
 
-    while (total_read < sizeof(buffer) - 1) {
-        bytes_read = connection_recv(conn, buffer + total_read,
-                                     sizeof(buffer) - total_read - 1);
-        if (bytes_read <= 0) break;
-        total_read += bytes_read;
+    if (owned) {
+        free(hop.scheme);
+        free(hop.host);
+        free(hop.path);
+        free(hop.query);
     }
-    buffer[total_read] = '\0';
+    return response;
+}
+
+static TF_Triadic(int, networkrequest_sendAsync, NetworkRequest, NetworkRequestPrivate,
+                 NetworkLoop*, loop, NetworkResponseCallback, callback, void*, context)
+    HttpExchange exchange;
+    bool queued;
 
-    connection_free(conn);
+    if (!callback || !private->url || !private->host) return 0;
+
+    if (!loop) loop = NetworkLoopDefault();
+    if (!loop) return 0;
+
+    network_request_exchange(self, &exchange);
+    if (!private->has_policy) {
+        return network_loop_submit(loop, &exchange, callback, context);
+    }
 
-    /* Create response from raw data */
-    return NetworkResponseMake(200, "OK", buffer);
+    /* The policy sends copies of the exchange */
+    queued = exchange.hostname && exchange.writer.head &&
+             network_policy_submit(loop, &exchange, &private->policy,
+                                   callback, context);
+    free(exchange.hostname);
+    http_writer_free(&exchange.writer);
+    return queued;
 }
 
 static TF_Nullary(networkrequest_free, NetworkRequest, NetworkRequestPrivate)
     if (private) {
         free(private->url);
-        free(private->body);
+        http_body_release(private->body);
         free(private->scheme);
         free(private->host);
         free(private->path);
         free(private->query);
-        free_headers(private->headers);
+        http_headers_free(&private->headers);
         trampoline_tracker_free_by_context(self);
         free(private);
     }
 }
 
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+/* Send on a pooled connection and read the response, timing started */
+static NetworkResponse* exchange_transfer(HttpExchange* exchange,
+                                          NetworkTiming* timing) {
+    bool ok = false;
+    Connection* conn = NULL;
+    HttpResponseData data;
+    NetworkResponse* response;
+    char error[256];
+    int attempt;
+
+    memset(&data, 0, sizeof(data));
+
+    /* A pooled connection may have been closed by the server while it sat
+     * idle; if it fails before any response byte arrives, retry once on a
+     * fresh connection. */
+    for (attempt = 0; attempt < 2; attempt++) {
+        conn = connection_pool_acquire(exchange->hostname, exchange->port,
+                                       exchange->use_ssl,
+                                       exchange->timeout_seconds,
+                                       error, sizeof(error));
+        if (!conn) {
+            response = NetworkResponseMake(502, "Bad Gateway", error);
+            network_timing_deliver(response, exchange, timing);
+            return response;
+        }
+        network_timing_connection(timing, conn);
+
+        http_writer_rewind(&exchange->writer);
+        if (http_writer_send(conn, &exchange->writer) < 0) {
+            snprintf(error, sizeof(error), "%s", connection_error(conn));
+            if (conn->reused) {
+                connection_pool_release(conn, false);
+                conn = NULL;
+                continue;
+            }
+            connection_pool_release(conn, false);
+            response = NetworkResponseMake(500, "Internal Server Error", error);
+            network_timing_deliver(response, exchange, timing);
+            return response;
+        }
+        network_timing_sent(timing, &exchange->writer);
+
+        ok = http_read_response(conn, exchange->no_body, exchange->sink,
+                                exchange->sink_context, &data);
+        if (!ok) {
+            snprintf(error, sizeof(error), "%s", connection_error(conn));
+            if (data.bytes_received == 0 && conn->reused) {
+                http_response_data_free(&data);
+                connection_pool_release(conn, false);
+                conn = NULL;
+                continue;
+            }
+        }
+        break;
+    }
+
+    if (!conn) {
+        response = NetworkResponseMake(502, "Bad Gateway", error);
+        network_timing_deliver(response, exchange, timing);
+        return response;
+    }
+    connection_pool_release(conn, ok && exchange->keep_alive && data.keep_alive);
+
+    if (!ok) {
+        http_response_data_free(&data);
+        response = NetworkResponseMake(502, "Bad Gateway", error);
+    } else {
+        /* The response takes ownership of the received buffers */
+        network_timing_received(timing, &data);
+        response = network_response_adopt(&data);
+    }
+    network_timing_deliver(response, exchange, timing);
+    return response;
+}
+
+NetworkResponse* network_exchange_send(HttpExchange* exchange) {
+    NetworkLimiter* limiter;
+    NetworkTiming timing;
+    NetworkResponse* response;
+    char error[256];
+    double deadline = 0;
+
+    if (exchange->http2 && !h2_origin_declined(exchange->hostname, exchange->port,
+                                               exchange->use_ssl)) {
+        return network_h2_send(exchange);
+    }
+
+    network_timing_start(&timing);
+    limiter = network_limit_find(exchange->hostname, exchange->port);
+    if (!limiter) return exchange_transfer(exchange, &timing);
+
+    if (exchange->deadline_ms > 0) {
+        deadline = timing.start + exchange->deadline_ms / 1000.0;
+    } else if (exchange->timeout_seconds > 0) {
+        deadline = timing.start + exchange->timeout_seconds;
+    }
+    if (!network_limit_acquire(limiter, timing.start, deadline, error,
+                               sizeof(error))) {
+        response = NetworkResponseMake(503, "Service Unavailable", error);
+        network_timing_deliver(response, exchange, &timing);
+        return response;
+    }
+    timing.admitted = network_now();
+    response = exchange_transfer(exchange, &timing);
+    network_limit_release(limiter);
+    return response;
+}
+
+bool network_request_head_parts(struct NetworkRequest* request, char** head,
+                                size_t* split, size_t* length, char** query) {
+    NetworkRequestPrivate* private = (NetworkRequestPrivate*)request;
+    char* header_string;
+    char* line_end;
+
+    *head = NULL;
+    *query = NULL;
+    if (!private->url || !private->host) return false;
+
+    /* The usual head for the path alone, then cut around the query */
+    header_string = http_headers_format(&private->headers, 0, NULL);
+    *head = http_build_request_head(method_to_string(private->method),
+                                    private->path ? private->path : "/",
+                                    private->host, header_string, 0,
+                                    private->keep_alive, length);
+    free(header_string);
+    if (!*head) return false;
+
+    line_end = strstr(*head, "\r\n");
+    *split = (size_t)(line_end - *head) - strlen(" HTTP/1.1");
+    *length -= 2;
+    if (private->query) {
+        *query = strdup(private->query);
+        if (!*query) {
+            free(*head);
+            *head = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool network_request_exchange(struct NetworkRequest* request,
+                              HttpExchange* exchange) {
+    NetworkRequestPrivate* private = (NetworkRequestPrivate*)request;
+
+    memset(exchange, 0, sizeof(*exchange));
+    if (!private->url || !private->host) return false;
+
+    exchange->hostname = strdup(private->host);
+    exchange_settings(private, exchange);
+    build_request_writer(private, &exchange->writer, 0, NULL);
+
+    return exchange->hostname && exchange->writer.head;
+}
+
+const struct NetworkRequestPolicy* network_request_policy(struct NetworkRequest* request) {
+    NetworkRequestPrivate* private = (NetworkRequestPrivate*)request;
+    return private->has_policy ? &private->policy : NULL;
+}
+
 /* ======================================================================== */
 /* Creation Functions                                                        */
 /* ======================================================================== */
@@ -463,6 +985,7 @@ NetworkRequest* NetworkRequestMake(const char* url, HttpMethod method) {
     /* Initialize fields */
     private->method = method;
     private->timeout_seconds = 30;
+    private->keep_alive = true;
     private->follow_redirects = true;
     private->max_redirects = 5;
 
@@ -477,8 +1000,12 @@ NetworkRequest* NetworkRequestMake(const char* url, HttpMethod method) {
     }
 
     /* Add default headers */
-    add_or_update_header(private, "User-Agent", "TrampolineHTTP/2.0");
-    add_or_update_header(private, "Accept", "*/*");
+    http_headers_set(&private->headers, "User-Agent", "TrampolineHTTP/2.0");
+    http_headers_set(&private->headers, "Accept", "*/*");
+#if ZLIB_SUPPORT
+    /* Decoded as it arrives; removeHeader("Accept-Encoding") opts out */
+    http_headers_set(&private->headers, "Accept-Encoding", "gzip, deflate");
+#endif
 
     /* Create trampoline functions */
     public->url = trampoline_monitor(networkrequest_url, public, 0, &tracker);
@@ -493,15 +1020,28 @@ NetworkRequest* NetworkRequestMake(const char* url, HttpMethod method) {
     public->body = trampoline_monitor(networkrequest_body, public, 0, &tracker);
     public->setBody = trampoline_monitor(networkrequest_setBody, public, 1, &tracker);
     public->bodyLength = trampoline_monitor(networkrequest_bodyLength, public, 0, &tracker);
+    public->setBodyData = trampoline_monitor(networkrequest_setBodyData, public, 2, &tracker);
+    public->setBodyFile = trampoline_monitor(networkrequest_setBodyFile, public, 1, &tracker);
     public->setBodyString = trampoline_monitor(networkrequest_setBodyString, public, 1, &tracker);
     public->setBodyJson = trampoline_monitor(networkrequest_setBodyJson, public, 1, &tracker);
+    public->setBodyHandler = trampoline_monitor(networkrequest_setBodyHandler, public, 2, &tracker);
 
     public->port = trampoline_monitor(networkrequest_port, public, 0, &tracker);
     public->setPort = trampoline_monitor(networkrequest_setPort, public, 1, &tracker);
     public->timeout = trampoline_monitor(networkrequest_timeout, public, 0, &tracker);
     public->setTimeout = trampoline_monitor(networkrequest_setTimeout, public, 1, &tracker);
+    public->keepAlive = trampoline_monitor(networkrequest_keepAlive, public, 0, &tracker);
+    public->setKeepAlive = trampoline_monitor(networkrequest_setKeepAlive, public, 1, &tracker);
+    public->httpVersion = trampoline_monitor(networkrequest_httpVersion, public, 0, &tracker);
+    public->setHttpVersion = trampoline_monitor(networkrequest_setHttpVersion, public, 1, &tracker);
+    public->setPolicy = trampoline_monitor(networkrequest_setPolicy, public, 1, &tracker);
+    public->followRedirects = trampoline_monitor(networkrequest_followRedirects, public, 0, &tracker);
+    public->setFollowRedirects = trampoline_monitor(networkrequest_setFollowRedirects, public, 1, &tracker);
+    public->maxRedirects = trampoline_monitor(networkrequest_maxRedirects, public, 0, &tracker);
+    public->setMaxRedirects = trampoline_monitor(networkrequest_setMaxRedirects, public, 1, &tracker);
 
     public->send = trampoline_monitor(networkrequest_send, public, 0, &tracker);
+    public->sendAsync = trampoline_monitor(networkrequest_sendAsync, public, 3, &tracker);
     public->free = trampoline_monitor(networkrequest_free, public, 0, &tracker);
 
     /* Validate all trampolines */
@@ -511,7 +1051,7 @@ NetworkRequest* NetworkRequestMake(const char* url, HttpMethod method) {
         free(private->host);
         free(private->path);
         free(private->query);
-        free_headers(private->headers);
+        http_headers_free(&private->headers);
         free(private);
         return NULL;
     }
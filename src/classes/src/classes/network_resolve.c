@@ -0,0 +1,601 @@
+/**
+ * @file network_resolve.c
+ * @brief Cached getaddrinfo resolver shared by all connections
+ *
+ * Lookups are cached per hostname for a configurable TTL (getaddrinfo does
+ * not report record TTLs) and failures for a shorter negative TTL. Entries
+ * close to expiry are refreshed in the background while the old addresses
+ * keep being served, so a busy host never pays for DNS on the request path.
+ * Concurrent lookups of the same name share one getaddrinfo call.
+ *
+ * Addresses are returned in getaddrinfo's (RFC 6724) order, interleaved by
+ * family as RFC 8305 recommends so happy-eyeballs connects alternate
+ * between IPv6 and IPv4.
+ */
+
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define RESOLVE_MAX_ENTRIES 256
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct ResolveWaiter {
+    NetworkResolveCallback callback;
+    void* context;
+    int port;
+
+    /* Filled in under the lock before the callback runs */
+    NetworkAddressList list;
+    bool have;
+    char error[128];
+
+    struct ResolveWaiter* next;
+} ResolveWaiter;
+
+typedef struct ResolveEntry {
+    char* hostname;
+    NetworkAddress* addresses;      /* Port left as 0 */
+    size_t count;
+    char error[128];
+    double expires;
+    bool resolving;
+    bool pinned;                    /* Added with NetworkResolverAddHost */
+    ResolveWaiter* waiters;
+    struct ResolveEntry* next;
+} ResolveEntry;
+
+typedef struct ResolveJob {
+    char* hostname;
+    struct ResolveJob* next;
+} ResolveJob;
+
+static pthread_mutex_t resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resolve_work = PTHREAD_COND_INITIALIZER;
+static ResolveEntry* resolve_entries = NULL;
+static size_t resolve_entry_count = 0;
+
+static ResolveJob* job_head = NULL;
+static ResolveJob* job_tail = NULL;
+static int worker_count = 0;
+
+static NetworkResolverOptions resolve_options = {
+    60,     /* cache_ttl_seconds */
+    5,      /* negative_ttl_seconds */
+    250,    /* happy_eyeballs_delay_ms */
+    2       /* resolver_threads */
+};
+
+static NetworkResolverStats resolve_stats;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+static void set_port(NetworkAddress* address, int port) {
+    if (address->addr.ss_family == AF_INET6) {
+        ((struct sockaddr_in6*)&address->addr)->sin6_port = htons((uint16_t)port);
+    } else {
+        ((struct sockaddr_in*)&address->addr)->sin_port = htons((uint16_t)port);
+    }
+}
+
+/* Caller must hold resolve_mutex */
+static bool copy_addresses(const ResolveEntry* entry, int port,
+                           NetworkAddressList* out) {
+    size_t i;
+
+    out->items = malloc(entry->count * sizeof(NetworkAddress));
+    out->count = 0;
+    if (!out->items) return false;
+
+    memcpy(out->items, entry->addresses, entry->count * sizeof(NetworkAddress));
+    out->count = entry->count;
+    for (i = 0; i < out->count; i++) set_port(&out->items[i], port);
+    return true;
+}
+
+/* Caller must hold resolve_mutex */
+static bool entry_valid(const ResolveEntry* entry, double now) {
+    return entry->count > 0 && (entry->pinned || now < entry->expires);
+}
+
+/* Caller must hold resolve_mutex */
+static bool entry_failed(const ResolveEntry* entry, double now) {
+    return entry->count == 0 && entry->error[0] && now < entry->expires;
+}
+
+static void entry_free(ResolveEntry* entry) {
+    free(entry->hostname);
+    free(entry->addresses);
+    free(entry);
+}
+
+/* Caller must hold resolve_mutex. Makes room by dropping expired entries,
+ * then the one closest to expiry. */
+static void cache_evict(double now) {
+    ResolveEntry** link = &resolve_entries;
+    ResolveEntry** oldest = NULL;
+
+    while (*link) {
+        ResolveEntry* entry = *link;
+        if (!entry->pinned && !entry->resolving && now >= entry->expires) {
+            *link = entry->next;
+            entry_free(entry);
+            resolve_entry_count--;
+            continue;
+        }
+        if (!entry->pinned && !entry->resolving &&
+            (!oldest || entry->expires < (*oldest)->expires)) {
+            oldest = link;
+        }
+        link = &entry->next;
+    }
+
+    if (resolve_entry_count >= RESOLVE_MAX_ENTRIES && oldest) {
+        ResolveEntry* entry = *oldest;
+        *oldest = entry->next;
+        entry_free(entry);
+        resolve_entry_count--;
+    }
+}
+
+/* Caller must hold resolve_mutex */
+static ResolveEntry* entry_find(const char* hostname, bool create) {
+    ResolveEntry* entry;
+
+    for (entry = resolve_entries; entry; entry = entry->next) {
+        if (strcasecmp(entry->hostname, hostname) == 0) return entry;
+    }
+    if (!create) return NULL;
+
+    if (resolve_entry_count >= RESOLVE_MAX_ENTRIES) cache_evict(network_now());
+
+    entry = calloc(1, sizeof(ResolveEntry));
+    if (!entry) return NULL;
+    entry->hostname = strdup(hostname);
+    if (!entry->hostname) {
+        free(entry);
+        return NULL;
+    }
+    entry->next = resolve_entries;
+    resolve_entries = entry;
+    resolve_entry_count++;
+    return entry;
+}
+
+/* Runs getaddrinfo without holding any lock. On success the addresses are
+ * interleaved by family, starting with the family getaddrinfo preferred. */
+static bool lookup(const char* hostname, NetworkAddress** out, size_t* count,
+                   char* error, size_t error_size) {
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    struct addrinfo* ai;
+    NetworkAddress* primary;
+    NetworkAddress* secondary;
+    size_t primaries = 0;
+    size_t secondaries = 0;
+    size_t total = 0;
+    size_t i;
+    int first_family = 0;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(hostname, NULL, &hints, &result);
+    if (rc != 0) {
+        snprintf(error, error_size, "Failed to resolve hostname %s: %s",
+                 hostname, gai_strerror(rc));
+        return false;
+    }
+
+    for (ai = result; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6) total++;
+    }
+
+    primary = calloc(total ? total : 1, sizeof(NetworkAddress));
+    secondary = calloc(total ? total : 1, sizeof(NetworkAddress));
+    *out = calloc(total ? total : 1, sizeof(NetworkAddress));
+    if (!primary || !secondary || !*out || total == 0) {
+        free(primary);
+        free(secondary);
+        free(*out);
+        *out = NULL;
+        freeaddrinfo(result);
+        if (total) {
+            snprintf(error, error_size, "Out of memory");
+        } else {
+            snprintf(error, error_size, "No usable addresses for %s", hostname);
+        }
+        return false;
+    }
+
+    for (ai = result; ai; ai = ai->ai_next) {
+        NetworkAddress* slot;
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) continue;
+        if (!first_family) first_family = ai->ai_family;
+        slot = ai->ai_family == first_family ? &primary[primaries++]
+                                             : &secondary[secondaries++];
+        memcpy(&slot->addr, ai->ai_addr, ai->ai_addrlen);
+        slot->length = ai->ai_addrlen;
+    }
+    freeaddrinfo(result);
+
+    /* Alternate families: A1 B1 A2 B2 ... then whatever is left */
+    *count = 0;
+    for (i = 0; i < primaries || i < secondaries; i++) {
+        if (i < primaries) (*out)[(*count)++] = primary[i];
+        if (i < secondaries) (*out)[(*count)++] = secondary[i];
+    }
+    free(primary);
+    free(secondary);
+    return true;
+}
+
+/* Runs the lookup for an entry already marked resolving, stores the result
+ * and notifies everyone waiting on it */
+static void resolve_entry(const char* hostname) {
+    NetworkAddress* addresses = NULL;
+    size_t count = 0;
+    char error[128];
+    bool ok = lookup(hostname, &addresses, &count, error, sizeof(error));
+    ResolveEntry* entry;
+    ResolveWaiter* waiters = NULL;
+    ResolveWaiter* waiter;
+    double now = network_now();
+
+    pthread_mutex_lock(&resolve_mutex);
+    entry = entry_find(hostname, true);
+    if (entry) {
+        if (ok) {
+            free(entry->addresses);
+            entry->addresses = addresses;
+            entry->count = count;
+            entry->error[0] = '\0';
+            entry->expires = now + resolve_options.cache_ttl_seconds;
+            addresses = NULL;
+        } else {
+            resolve_stats.failures++;
+            /* A failed refresh keeps serving the addresses it had */
+            if (!entry_valid(entry, now)) {
+                free(entry->addresses);
+                entry->addresses = NULL;
+                entry->count = 0;
+                snprintf(entry->error, sizeof(entry->error), "%s", error);
+                entry->expires = now + resolve_options.negative_ttl_seconds;
+            }
+        }
+        entry->resolving = false;
+        waiters = entry->waiters;
+        entry->waiters = NULL;
+    }
+
+    /* Give each waiter its own copy while the entry is stable */
+    for (waiter = waiters; waiter; waiter = waiter->next) {
+        waiter->have = entry && entry->count > 0 &&
+                       copy_addresses(entry, waiter->port, &waiter->list);
+        snprintf(waiter->error, sizeof(waiter->error), "%s",
+                 entry && entry->error[0] ? entry->error : error);
+    }
+    pthread_cond_broadcast(&resolve_done);
+    pthread_mutex_unlock(&resolve_mutex);
+    free(addresses);
+
+    while (waiters) {
+        ResolveWaiter* next = waiters->next;
+        waiters->callback(waiters->have ? &waiters->list : NULL,
+                          waiters->have ? NULL : waiters->error,
+                          waiters->context);
+        free(waiters);
+        waiters = next;
+    }
+}
+
+static void* resolver_thread(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&resolve_mutex);
+    for (;;) {
+        ResolveJob* job;
+
+        while (!job_head) pthread_cond_wait(&resolve_work, &resolve_mutex);
+        job = job_head;
+        job_head = job->next;
+        if (!job_head) job_tail = NULL;
+        pthread_mutex_unlock(&resolve_mutex);
+
+        resolve_entry(job->hostname);
+        free(job->hostname);
+        free(job);
+
+        pthread_mutex_lock(&resolve_mutex);
+    }
+    return NULL;
+}
+
+/* Caller must hold resolve_mutex and have marked the entry resolving */
+static bool enqueue_job(const char* hostname) {
+    ResolveJob* job = calloc(1, sizeof(ResolveJob));
+
+    if (!job || !(job->hostname = strdup(hostname))) {
+        free(job);
+        return false;
+    }
+
+    /* Resolver threads start on first use and live for the process */
+    while (worker_count < (resolve_options.resolver_threads > 0 ?
+                           resolve_options.resolver_threads : 1)) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, resolver_thread, NULL) != 0) break;
+        pthread_detach(thread);
+        worker_count++;
+    }
+    if (worker_count == 0) {
+        free(job->hostname);
+        free(job);
+        return false;
+    }
+
+    if (job_tail) {
+        job_tail->next = job;
+    } else {
+        job_head = job;
+    }
+    job_tail = job;
+    pthread_cond_signal(&resolve_work);
+    return true;
+}
+
+/* Caller must hold resolve_mutex. Starts a background refresh once an
+ * entry is three quarters of the way to expiry. */
+static void maybe_refresh(ResolveEntry* entry, double now) {
+    double ttl = resolve_options.cache_ttl_seconds;
+
+    if (entry->pinned || entry->resolving || entry->expires - now > ttl / 4) {
+        return;
+    }
+    entry->resolving = enqueue_job(entry->hostname);
+}
+
+/* ======================================================================== */
+/* Resolver Operations                                                      */
+/* ======================================================================== */
+
+bool network_resolve(const char* hostname, int port, NetworkAddressList* out,
+                     char* error, size_t error_size) {
+    ResolveEntry* entry;
+    bool ok = false;
+
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&resolve_mutex);
+    resolve_stats.lookups++;
+
+    for (;;) {
+        double now = network_now();
+
+        entry = entry_find(hostname, true);
+        if (!entry) {
+            snprintf(error, error_size, "Out of memory");
+            break;
+        }
+        if (entry_valid(entry, now)) {
+            resolve_stats.cache_hits++;
+            ok = copy_addresses(entry, port, out);
+            if (!ok) snprintf(error, error_size, "Out of memory");
+            maybe_refresh(entry, now);
+            break;
+        }
+        if (entry_failed(entry, now)) {
+            resolve_stats.cache_hits++;
+            snprintf(error, error_size, "%s", entry->error);
+            break;
+        }
+        if (entry->resolving) {
+            /* Someone else is already asking; wait for their answer */
+            pthread_cond_wait(&resolve_done, &resolve_mutex);
+            continue;
+        }
+
+        /* Miss: resolve on this thread rather than queueing behind others */
+        resolve_stats.cache_misses++;
+        entry->resolving = true;
+        pthread_mutex_unlock(&resolve_mutex);
+        resolve_entry(hostname);
+        pthread_mutex_lock(&resolve_mutex);
+    }
+
+    pthread_mutex_unlock(&resolve_mutex);
+    return ok;
+}
+
+int network_resolve_cached(const char* hostname, int port,
+                           NetworkAddressList* out, char* error,
+                           size_t error_size) {
+    ResolveEntry* entry;
+    double now = network_now();
+    int result = 0;
+
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&resolve_mutex);
+    entry = entry_find(hostname, false);
+    if (entry && entry_valid(entry, now)) {
+        resolve_stats.lookups++;
+        resolve_stats.cache_hits++;
+        result = copy_addresses(entry, port, out) ? 1 : 0;
+        maybe_refresh(entry, now);
+    } else if (entry && entry_failed(entry, now)) {
+        resolve_stats.lookups++;
+        resolve_stats.cache_hits++;
+        snprintf(error, error_size, "%s", entry->error);
+        result = -1;
+    }
+    pthread_mutex_unlock(&resolve_mutex);
+    return result;
+}
+
+bool network_resolve_async(const char* hostname, int port,
+                           NetworkResolveCallback callback, void* context) {
+    ResolveEntry* entry;
+    ResolveWaiter* waiter;
+    NetworkAddressList list;
+    char error[128];
+    int cached = network_resolve_cached(hostname, port, &list, error,
+                                        sizeof(error));
+
+    if (cached > 0) {
+        callback(&list, NULL, context);
+        return true;
+    }
+    if (cached < 0) {
+        callback(NULL, error, context);
+        return true;
+    }
+
+    waiter = calloc(1, sizeof(ResolveWaiter));
+    if (!waiter) return false;
+    waiter->callback = callback;
+    waiter->context = context;
+    waiter->port = port;
+
+    pthread_mutex_lock(&resolve_mutex);
+    entry = entry_find(hostname, true);
+    if (!entry) {
+        pthread_mutex_unlock(&resolve_mutex);
+        free(waiter);
+        return false;
+    }
+    resolve_stats.lookups++;
+    if (!entry->resolving) {
+        resolve_stats.cache_misses++;
+        entry->resolving = enqueue_job(hostname);
+        if (!entry->resolving) {
+            pthread_mutex_unlock(&resolve_mutex);
+            free(waiter);
+            return false;
+        }
+    }
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    pthread_mutex_unlock(&resolve_mutex);
+    return true;
+}
+
+void network_address_list_free(NetworkAddressList* list) {
+    if (!list) return;
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+}
+
+int network_resolver_happy_eyeballs_delay(void) {
+    int delay;
+
+    pthread_mutex_lock(&resolve_mutex);
+    delay = resolve_options.happy_eyeballs_delay_ms;
+    pthread_mutex_unlock(&resolve_mutex);
+    return delay;
+}
+
+/* ======================================================================== */
+/* Public Configuration                                                     */
+/* ======================================================================== */
+
+void NetworkResolverConfigure(const NetworkResolverOptions* options) {
+    if (!options) return;
+
+    pthread_mutex_lock(&resolve_mutex);
+    resolve_options = *options;
+    if (resolve_options.cache_ttl_seconds < 0) resolve_options.cache_ttl_seconds = 0;
+    if (resolve_options.negative_ttl_seconds < 0) {
+        resolve_options.negative_ttl_seconds = 0;
+    }
+    pthread_mutex_unlock(&resolve_mutex);
+}
+
+void NetworkResolverGetOptions(NetworkResolverOptions* options) {
+    if (!options) return;
+
+    pthread_mutex_lock(&resolve_mutex);
+    *options = resolve_options;
+    pthread_mutex_unlock(&resolve_mutex);
+}
+
+void NetworkResolverGetStats(NetworkResolverStats* stats) {
+    if (!stats) return;
+
+    pthread_mutex_lock(&resolve_mutex);
+    *stats = resolve_stats;
+    stats->cached_entries = resolve_entry_count;
+    pthread_mutex_unlock(&resolve_mutex);
+}
+
+int NetworkResolverAddHost(const char* hostname, const char* address) {
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+    ResolveEntry* entry;
+    NetworkAddress* grown;
+
+    if (!hostname || !address) return 0;
+
+    /* Numeric only: an override must never itself hit DNS */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    if (getaddrinfo(address, NULL, &hints, &result) != 0) return 0;
+
+    pthread_mutex_lock(&resolve_mutex);
+    entry = entry_find(hostname, true);
+    if (entry && !entry->pinned) {
+        /* Replace whatever DNS said with the override */
+        free(entry->addresses);
+        entry->addresses = NULL;
+        entry->count = 0;
+        entry->pinned = true;
+    }
+    grown = entry ? realloc(entry->addresses,
+                            (entry->count + 1) * sizeof(NetworkAddress)) : NULL;
+    if (grown) {
+        memset(&grown[entry->count], 0, sizeof(NetworkAddress));
+        memcpy(&grown[entry->count].addr, result->ai_addr, result->ai_addrlen);
+        grown[entry->count].length = result->ai_addrlen;
+        entry->addresses = grown;
+        entry->count++;
+        entry->error[0] = '\0';
+    }
+    pthread_mutex_unlock(&resolve_mutex);
+
+    freeaddrinfo(result);
+    return grown != NULL;
+}
+
+void NetworkResolverClear(void) {
+    ResolveEntry** link;
+
+    pthread_mutex_lock(&resolve_mutex);
+    link = &resolve_entries;
+    while (*link) {
+        ResolveEntry* entry = *link;
+        /* In-flight lookups still have waiters to answer */
+        if (entry->resolving) {
+            link = &entry->next;
+            continue;
+        }
+        *link = entry->next;
+        entry_free(entry);
+        resolve_entry_count--;
+    }
+    pthread_mutex_unlock(&resolve_mutex);
+}
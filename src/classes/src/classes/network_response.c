@@ -8,73 +8,30 @@
 #include <trampoline/classes/json.h>
 #include <trampoline/classes/string.h>
 #include <trampoline/classes/network.h>
+#include "network_common.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <ctype.h>
 
 /* ======================================================================== */
 /* Private Structures                                                       */
 /* ======================================================================== */
 
-typedef struct ResponseHeader {
-    char* key;
-    char* value;
-    struct ResponseHeader* next;
-} ResponseHeader;
-
 typedef struct NetworkResponsePrivate {
     NetworkResponse public;  /* Public interface MUST be first */
 
     int status_code;
-    char* status_text;
-    ResponseHeader* headers;
-    char* body;
+    const char* status_text;    /* Into head, or owned_text */
+    char* owned_text;
+    char* head;             /* Status line and headers, parsed in place */
+    HttpHead fields;
+    char* storage;          /* Owns the body bytes; body points into it */
+    const char* body;
     size_t body_length;
-    size_t header_count;
+    CacheEntry* cached;     /* Holds the body instead of storage */
+    NetworkTiming timing;
 } NetworkResponsePrivate;
 
-/* ======================================================================== */
-/* Helper Functions                                                          */
-/* ======================================================================== */
-
-static void free_response_headers(ResponseHeader* headers) {
-    while (headers) {
-        ResponseHeader* next = headers->next;
-        if (headers->key) free(headers->key);
-        if (headers->value) free(headers->value);
-        free(headers);
-        headers = next;
-    }
-}
-
-static void add_response_header(NetworkResponsePrivate* private, const char* key, const char* value) {
-    ResponseHeader* new_header = calloc(1, sizeof(ResponseHeader));
-    if (!new_header) return;
-
-    new_header->key = strdup(key);
-    new_header->value = strdup(value);
-
-    if (!new_header->key || !new_header->value) {
-        if (new_header->key) free(new_header->key);
-        if (new_header->value) free(new_header->value);
-        free(new_header);
-        return;
-    }
-
-    /* Add to end of list */
-    if (!private->headers) {
-        private->headers = new_header;
-    } else {
-        ResponseHeader* current = private->headers;
-        while (current->next) {
-            current = current->next;
-        }
-        current->next = new_header;
-    }
-    private->header_count++;
-}
-
 /* ======================================================================== */
 /* Trampoline Functions using TF_ macros                                    */
 /* ======================================================================== */
@@ -100,20 +57,12 @@ static TF_Getter(networkresponse_isError, NetworkResponse, NetworkResponsePrivat
 }
 
 static TF_Unary(const char*, networkresponse_header, NetworkResponse, NetworkResponsePrivate, const char*, key)
-    ResponseHeader* current = private->headers;
-
-    while (current) {
-        if (strcasecmp(current->key, key) == 0) {
-            return current->value;
-        }
-        current = current->next;
-    }
-
-    return NULL;
+    if (!key || !private->head) return NULL;
+    return http_head_find(&private->fields, private->head, key);
 }
 
 static TF_Getter(networkresponse_headerCount, NetworkResponse, NetworkResponsePrivate, size_t)
-    return private->header_count;
+    return private->fields.count;
 }
 
 /* Removed headerKey - not in simplified API */
@@ -162,6 +111,7 @@ static TF_Getter(networkresponse_bodyAsJson, NetworkResponse, NetworkResponsePri
     if (!private->body || private->body_length == 0) {
         return NULL;
     }
+    if (private->cached) return network_cache_json(private->cached);
     return JsonParse(private->body);
 }
 
@@ -192,11 +142,17 @@ static TF_Unary(int, networkresponse_hasHeader, NetworkResponse, NetworkResponse
     return networkresponse_header(self, key) != NULL;
 }
 
+static TF_Getter(networkresponse_timing, NetworkResponse, NetworkResponsePrivate, const NetworkTiming*)
+    return &private->timing;
+}
+
 static TF_Nullary(networkresponse_free, NetworkResponse, NetworkResponsePrivate)
     if (private) {
-        if (private->status_text) free(private->status_text);
-        if (private->body) free(private->body);
-        free_response_headers(private->headers);
+        if (private->owned_text) free(private->owned_text);
+        if (private->head) free(private->head);
+        if (private->storage) free(private->storage);
+        if (private->cached) network_cache_release(private->cached);
+        http_head_free(&private->fields);
         trampoline_tracker_free_by_context(self);
         free(private);
     }
@@ -206,101 +162,68 @@ static TF_Nullary(networkresponse_free, NetworkResponse, NetworkResponsePrivate)
 /* Response Parsing                                                         */
 /* ======================================================================== */
 
-static void parse_response(NetworkResponsePrivate* private, const char* raw_response) {
-    if (!raw_response) return;
-
-    /* Make a copy to work with */
-    char* response = strdup(raw_response);
-    if (!response) return;
-
-    char* current = response;
-
-    /* Parse status line: HTTP/1.1 200 OK */
-    char* line_end = strstr(current, "\r\n");
-    if (line_end) {
-        *line_end = '\0';
-
-        /* Skip HTTP version */
-        char* space = strchr(current, ' ');
-        if (space) {
-            space++;
-            /* Parse status code */
-            private->status_code = atoi(space);
-
-            /* Parse status text */
-            space = strchr(space, ' ');
-            if (space) {
-                space++;
-                if (private->status_text) free(private->status_text);
-                private->status_text = strdup(space);
-            }
-        }
-
-        current = line_end + 2;  /* Skip \r\n */
-    }
-
-    /* Parse headers */
-    while (*current && *current != '\r') {
-        line_end = strstr(current, "\r\n");
-        if (!line_end) break;
-
-        *line_end = '\0';
-
-        /* Parse header: Key: Value */
-        char* colon = strchr(current, ':');
-        if (colon) {
-            *colon = '\0';
-            char* value = colon + 1;
-
-            /* Skip leading whitespace in value */
-            while (*value && isspace(*value)) value++;
-
-            add_response_header(private, current, value);
-        }
+/* Take status and headers from a parsed head; the response owns both */
+static void adopt_head(NetworkResponsePrivate* private, char* head,
+                       HttpHead* fields) {
+    private->head = head;
+    private->fields = *fields;
+    private->status_code = fields->status;
+    private->status_text = head + fields->reason;
+}
 
-        current = line_end + 2;
+/* A whole response given as text. It is copied once; the head is parsed in
+ * place within the copy and the body left where it is. */
+static void parse_response(NetworkResponsePrivate* private, const char* raw_response) {
+    HttpHead fields;
+    size_t length;
+    char* copy;
+    int result;
+
+    length = strlen(raw_response);
+    copy = malloc(length + 5);
+    if (!copy) return;
+    memcpy(copy, raw_response, length + 1);
+
+    http_head_init(&fields);
+    result = http_head_parse(&fields, copy, length);
+    if (result == 0) {
+        /* Headers with no body may stop short of the blank line */
+        memcpy(copy + length, "\r\n\r\n", 5);
+        result = http_head_parse(&fields, copy, length + 4);
     }
-
-    /* Skip empty line between headers and body */
-    if (strncmp(current, "\r\n", 2) == 0) {
-        current += 2;
+    if (result <= 0) {
+        /* Not a response after all; keep the text as the body */
+        http_head_free(&fields);
+        memcpy(copy, raw_response, length + 1);
+        private->body = private->storage = copy;
+        private->body_length = length;
+        return;
     }
 
-    /* Rest is body */
-    if (*current) {
-        if (private->body) free(private->body);
-        private->body = strdup(current);
-        private->body_length = strlen(current);
+    adopt_head(private, copy, &fields);
+    if (fields.length < length) {
+        private->body = copy + fields.length;
+        private->body_length = length - fields.length;
     }
+}
 
-    free(response);
+/* Framing headers are the server's to write, not the reply's */
+static bool is_framing_header(const char* name, size_t length) {
+    return (length == 14 && memcmp(name, "content-length", 14) == 0) ||
+           (length == 10 && memcmp(name, "connection", 10) == 0) ||
+           (length == 17 && memcmp(name, "transfer-encoding", 17) == 0);
 }
 
 /* ======================================================================== */
 /* Creation Functions                                                        */
 /* ======================================================================== */
 
-NetworkResponse* NetworkResponseMake(int status_code, const char* status_text, const char* body) {
+static NetworkResponsePrivate* networkresponse_alloc(void) {
     /* Use new TA_Allocate macro */
     TA_Allocate(NetworkResponse, NetworkResponsePrivate);
 
     if (!private) return NULL;
 
-    /* Initialize fields */
-    private->status_code = status_code;
-    private->status_text = status_text ? strdup(status_text) : NULL;
-    private->headers = NULL;
-    private->header_count = 0;
-
-    /* If body looks like a full HTTP response, parse it */
-    if (body && strncmp(body, "HTTP/", 5) == 0) {
-        parse_response(private, body);
-    } else {
-        /* Otherwise just set the body */
-        private->body = body ? strdup(body) : NULL;
-        private->body_length = body ? strlen(body) : 0;
-    }
-
     /* Create trampoline functions using trampoline_monitor */
     public->statusCode = trampoline_monitor(networkresponse_statusCode, public, 0, &tracker);
     public->statusText = trampoline_monitor(networkresponse_statusText, public, 0, &tracker);
@@ -321,17 +244,134 @@ NetworkResponse* NetworkResponseMake(int status_code, const char* status_text, c
     public->contentLength = trampoline_monitor(networkresponse_contentLength, public, 0, &tracker);
     public->hasHeader = trampoline_monitor(networkresponse_hasHeader, public, 1, &tracker);
     public->isJson = trampoline_monitor(networkresponse_isJson, public, 0, &tracker);
+    public->timing = trampoline_monitor(networkresponse_timing, public, 0, &tracker);
 
     public->free = trampoline_monitor(networkresponse_free, public, 0, &tracker);
 
     /* Validate all trampolines were created successfully */
     if (!trampoline_validate(tracker)) {
-        if (private->status_text) free(private->status_text);
-        if (private->body) free(private->body);
-        free_response_headers(private->headers);
         free(private);
         return NULL;
     }
 
-    return public;
+    return private;
+}
+
+NetworkResponse* NetworkResponseMake(int status_code, const char* status_text, const char* body) {
+    NetworkResponsePrivate* private = networkresponse_alloc();
+
+    if (!private) return NULL;
+
+    /* Initialize fields */
+    private->status_code = status_code;
+    private->owned_text = status_text ? strdup(status_text) : NULL;
+    private->status_text = private->owned_text;
+
+    /* If body looks like a full HTTP response, parse it */
+    if (body && strncmp(body, "HTTP/", 5) == 0) {
+        parse_response(private, body);
+    } else if (body) {
+        /* Otherwise just set the body */
+        private->storage = strdup(body);
+        private->body = private->storage;
+        private->body_length = private->storage ? strlen(body) : 0;
+    }
+
+    return &private->public;
+}
+
+NetworkResponse* network_response_adopt(HttpResponseData* data) {
+    NetworkResponsePrivate* private = networkresponse_alloc();
+
+    if (!private) {
+        http_response_data_free(data);
+        return NULL;
+    }
+
+    if (data->head) adopt_head(private, data->head, &data->fields);
+
+    /* The decoded body buffer becomes the response's storage as-is */
+    private->storage = data->body;
+    private->body = data->body;
+    private->body_length = data->body_length;
+
+    memset(data, 0, sizeof(*data));
+    return &private->public;
+}
+
+NetworkResponse* network_response_cached(const char* head, size_t head_length,
+                                         const char* body, size_t body_length,
+                                         CacheEntry* entry) {
+    NetworkResponsePrivate* private = networkresponse_alloc();
+    HttpHead fields;
+    char* copy;
+
+    if (!private) {
+        network_cache_release(entry);
+        return NULL;
+    }
+    private->cached = entry;
+    private->body = body;
+    private->body_length = body_length;
+
+    /* The head is parsed in place, so each response needs its own */
+    copy = malloc(head_length + 1);
+    if (!copy) return &private->public;
+    memcpy(copy, head, head_length);
+    copy[head_length] = '\0';
+    http_head_init(&fields);
+    if (http_head_parse(&fields, copy, head_length) == 1) {
+        adopt_head(private, copy, &fields);
+    } else {
+        http_head_free(&fields);
+        free(copy);
+    }
+    return &private->public;
+}
+
+void network_response_set_timing(NetworkResponse* response,
+                                 const NetworkTiming* timing) {
+    ((NetworkResponsePrivate*)response)->timing = *timing;
+}
+
+char* network_response_head(NetworkResponse* response, bool keep_alive,
+                            size_t* head_length) {
+    NetworkResponsePrivate* private = (NetworkResponsePrivate*)response;
+    const char* reason = private->status_text && private->status_text[0] ?
+                         private->status_text :
+                         http_reason_phrase(private->status_code);
+    size_t capacity = 128 + strlen(reason);
+    size_t length;
+    size_t i;
+    char* head;
+
+    for (i = 0; i < private->fields.count; i++) {
+        capacity += private->fields.fields[i].name_length +
+                    private->fields.fields[i].value_length + 4;
+    }
+    head = malloc(capacity);
+    if (!head) return NULL;
+
+    length = (size_t)snprintf(head, capacity, "HTTP/1.1 %d %s\r\n",
+                              private->status_code, reason);
+    for (i = 0; i < private->fields.count; i++) {
+        const HttpHeaderField* field = &private->fields.fields[i];
+        if (is_framing_header(private->head + field->name, field->name_length)) {
+            continue;
+        }
+        memcpy(head + length, private->head + field->name, field->name_length);
+        length += field->name_length;
+        head[length++] = ':';
+        head[length++] = ' ';
+        memcpy(head + length, private->head + field->value, field->value_length);
+        length += field->value_length;
+        head[length++] = '\r';
+        head[length++] = '\n';
+    }
+    length += (size_t)snprintf(head + length, capacity - length,
+                               "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+                               private->body_length,
+                               keep_alive ? "keep-alive" : "close");
+    *head_length = length;
+    return head;
 }
@@ -0,0 +1,1015 @@
+/**
+ * @file network_server.c
+ * @brief Embedded HTTP/1.1 server: epoll accept/read loop and worker pool
+ *
+ * One I/O thread owns the listening socket and every idle connection. It
+ * accepts, reads and parses request heads in place with the same parser the
+ * client uses for responses. Once a whole request (head and body) is
+ * buffered, the connection is handed to a worker thread, which runs the
+ * route's handler and writes the reply head and body with one sendmsg.
+ *
+ * A connection belongs to exactly one thread at a time. Under epoll it is
+ * watched with EPOLLONESHOT, so the I/O thread hears nothing more about it
+ * until the worker re-arms it after the reply; requests the client
+ * pipelined behind the first are served by the worker without a round trip
+ * through the I/O thread. Idle keep-alive connections are swept once a
+ * second.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define SERVER_USE_EPOLL 1
+#else
+#define SERVER_USE_EPOLL 0
+#endif
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_MAX_HEAD (64 * 1024)
+#define SERVER_RECV_CHUNK 16384
+#define SERVER_SEND_TIMEOUT_MS 10000
+#define SERVER_SWEEP_SECONDS 1.0
+
+static const HttpServerOptions default_options = {
+    4,                  /* threads */
+    5,                  /* idle_timeout_seconds */
+    1024 * 1024         /* max_body */
+};
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct ServerRoute {
+    char* method;               /* NULL matches any method */
+    char* path;
+    size_t path_length;
+    bool prefix;                /* Path ended in '*' */
+    HttpServerHandler handler;
+    void* context;
+    NetworkResponse* response;  /* Fixed reply, owned by the route */
+} ServerRoute;
+
+typedef struct ServerConnection {
+    int fd;
+    char* buffer;               /* Requests as received, parsed in place */
+    size_t used;
+    size_t capacity;            /* One more byte is always allocated */
+    HttpHead head;
+    bool framed;                /* Body length known for the current head */
+    size_t body_length;
+    bool continue_sent;         /* Answered Expect: 100-continue */
+    int error;                  /* Status to refuse the request with */
+
+    bool busy;                  /* Owned by a worker; guarded by lock */
+    double last_active;
+    struct ServerConnection* next;      /* All connections */
+    struct ServerConnection* prev;
+    struct ServerConnection* queued;    /* Work queue */
+} ServerConnection;
+
+/* What a handler receives; the public part MUST be first */
+typedef struct ServerRequest {
+    HttpServerRequest public;
+    const HttpHead* head;
+    const char* buffer;
+} ServerRequest;
+
+typedef struct HttpServerPrivate {
+    HttpServer public;          /* Public interface MUST be first */
+
+    HttpServerOptions options;
+    ServerRoute* routes;
+    size_t route_count;
+    size_t route_capacity;
+
+    int listen_fd;
+    int port;
+    bool listen_paused;         /* Out of descriptors; retried on sweep */
+    int wake_read;
+    int wake_write;
+    double last_sweep;
+
+    pthread_t io_thread;
+    pthread_t* workers;
+    int worker_count;
+    bool running;
+
+    pthread_mutex_t lock;       /* Guards everything below */
+    pthread_cond_t work;
+    bool stopping;
+    ServerConnection* connections;
+    ServerConnection* queue_head;
+    ServerConnection* queue_tail;
+
+#if SERVER_USE_EPOLL
+    int epoll_fd;
+#else
+    struct pollfd* poll_fds;
+    ServerConnection** poll_conns;
+    size_t poll_capacity;
+#endif
+} HttpServerPrivate;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Write every byte of iov, waiting out a full socket buffer */
+static bool send_all(int fd, struct iovec* iov, int count) {
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    while (count > 0) {
+        struct msghdr message;
+        ssize_t sent;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = (size_t)count;
+        sent = sendmsg(fd, &message, flags);
+        if (sent < 0) {
+            struct pollfd ready;
+
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            ready.fd = fd;
+            ready.events = POLLOUT;
+            if (poll(&ready, 1, SERVER_SEND_TIMEOUT_MS) <= 0) return false;
+            continue;
+        }
+        while (count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= (size_t)sent;
+        }
+    }
+    return true;
+}
+
+/* A short plain-text reply the server writes itself (404, 413, ...) */
+static bool send_status(int fd, int status, bool keep_alive, bool head_only) {
+    const char* reason = http_reason_phrase(status);
+    char head[256];
+    struct iovec iov;
+    int length;
+
+    length = snprintf(head, sizeof(head),
+                      "HTTP/1.1 %d %s\r\n"
+                      "Content-Type: text/plain\r\n"
+                      "Content-Length: %zu\r\n"
+                      "Connection: %s\r\n\r\n%s",
+                      status, reason, strlen(reason),
+                      keep_alive ? "keep-alive" : "close",
+                      head_only ? "" : reason);
+    iov.iov_base = head;
+    iov.iov_len = (size_t)length;
+    return send_all(fd, &iov, 1);
+}
+
+static void connection_reset_request(ServerConnection* conn) {
+    HttpHeaderField* fields = conn->head.fields;
+    size_t capacity = conn->head.capacity;
+
+    /* Keep the field array for the next request on this connection */
+    http_head_init_request(&conn->head);
+    conn->head.fields = fields;
+    conn->head.capacity = capacity;
+    conn->framed = false;
+    conn->body_length = 0;
+    conn->continue_sent = false;
+    conn->error = 0;
+}
+
+static void server_close(HttpServerPrivate* server, ServerConnection* conn) {
+    pthread_mutex_lock(&server->lock);
+    if (conn->prev) conn->prev->next = conn->next;
+    else server->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    pthread_mutex_unlock(&server->lock);
+
+    /* Closing also drops it from the epoll set */
+    close(conn->fd);
+    http_head_free(&conn->head);
+    free(conn->buffer);
+    free(conn);
+}
+
+/* Watch conn for the next request. Caller must hold the lock. */
+static void server_watch_locked(HttpServerPrivate* server,
+                                ServerConnection* conn) {
+    conn->busy = false;
+    conn->last_active = network_now();
+#if SERVER_USE_EPOLL
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+#else
+    /* The I/O thread rebuilds its poll set when woken */
+    if (write(server->wake_write, "w", 1) < 0) {
+        /* Pipe full: the I/O thread is already due to wake */
+    }
+#endif
+}
+
+/* Whether a whole request is buffered: 1 yes, 0 not yet, -1 refuse it
+ * with conn->error */
+static int request_ready(HttpServerPrivate* server, ServerConnection* conn) {
+    int result = http_head_parse(&conn->head, conn->buffer, conn->used);
+
+    if (result < 0) {
+        conn->error = HTTP_BAD_REQUEST;
+        return -1;
+    }
+    if (result == 0) {
+        if (conn->used > SERVER_MAX_HEAD) {
+            conn->error = 431;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!conn->framed) {
+        const char* length = http_head_find(&conn->head, conn->buffer,
+                                            "content-length");
+        const char* expect;
+        char* end;
+
+        if (http_head_find(&conn->head, conn->buffer, "transfer-encoding")) {
+            /* Chunked uploads are not supported; ask for a length */
+            conn->error = 411;
+            return -1;
+        }
+        if (length) {
+            unsigned long long value = strtoull(length, &end, 10);
+            if (end == length || *end != '\0') {
+                conn->error = HTTP_BAD_REQUEST;
+                return -1;
+            }
+            if (value > server->options.max_body) {
+                conn->error = 413;
+                return -1;
+            }
+            conn->body_length = (size_t)value;
+        }
+        conn->framed = true;
+
+        expect = http_head_find(&conn->head, conn->buffer, "expect");
+        if (expect && http_head_has_token(expect, "100-continue") &&
+            conn->used < conn->head.length + conn->body_length) {
+            struct iovec iov;
+            iov.iov_base = (void*)"HTTP/1.1 100 Continue\r\n\r\n";
+            iov.iov_len = 25;
+            conn->continue_sent = send_all(conn->fd, &iov, 1);
+        }
+    }
+    return conn->used >= conn->head.length + conn->body_length ? 1 : 0;
+}
+
+static ServerRoute* find_route(HttpServerPrivate* server, const char* method,
+                               const char* path, int* status) {
+    bool head = strcmp(method, "HEAD") == 0;
+    size_t i;
+
+    *status = HTTP_NOT_FOUND;
+    for (i = 0; i < server->route_count; i++) {
+        ServerRoute* route = &server->routes[i];
+
+        if (route->prefix ? strncmp(path, route->path, route->path_length) != 0
+                          : strcmp(path, route->path) != 0) {
+            continue;
+        }
+        if (!route->method || strcmp(route->method, method) == 0 ||
+            (head && strcmp(route->method, "GET") == 0)) {
+            return route;
+        }
+        *status = HTTP_METHOD_NOT_ALLOWED;
+    }
+    return NULL;
+}
+
+/* Run the handler for the buffered request and send its reply. Returns
+ * false if the connection should be closed afterwards. */
+static bool serve_request(HttpServerPrivate* server, ServerConnection* conn) {
+    HttpHead* head = &conn->head;
+    ServerRequest request;
+    NetworkResponse* response = NULL;
+    ServerRoute* route;
+    const char* connection;
+    char* target = conn->buffer + head->target;
+    char* query;
+    size_t end = head->length + conn->body_length;
+    char saved = conn->buffer[end];
+    bool keep_alive;
+    bool head_only;
+    bool sent;
+    int status;
+
+    connection = http_head_find(head, conn->buffer, "connection");
+    keep_alive = head->minor_version >= 1 ?
+                 !http_head_has_token(connection, "close") :
+                 http_head_has_token(connection, "keep-alive");
+
+    memset(&request, 0, sizeof(request));
+    request.head = head;
+    request.buffer = conn->buffer;
+    request.public.method = conn->buffer + head->method;
+    head_only = strcmp(request.public.method, "HEAD") == 0;
+    request.public.path = target;
+    query = memchr(target, '?', head->target_length);
+    if (query) {
+        *query = '\0';
+        request.public.query = query + 1;
+    }
+    if (conn->body_length) {
+        request.public.body = conn->buffer + head->length;
+        request.public.body_length = conn->body_length;
+    }
+
+    /* Terminate the body for the handler without losing the first byte
+     * of a pipelined request behind it */
+    conn->buffer[end] = '\0';
+
+    route = find_route(server, request.public.method, request.public.path,
+                       &status);
+    if (!route) {
+        conn->buffer[end] = saved;
+        return send_status(conn->fd, status, keep_alive, head_only) && keep_alive;
+    }
+    response = route->response ? route->response :
+               route->handler(&request.public, route->context);
+    conn->buffer[end] = saved;
+
+    if (!response) {
+        sent = send_status(conn->fd, HTTP_INTERNAL_SERVER_ERROR, keep_alive,
+                               head_only);
+    } else {
+        struct iovec iov[2];
+        size_t head_length;
+        char* reply = network_response_head(response, keep_alive, &head_length);
+        int count = 1;
+
+        if (!reply) {
+            sent = send_status(conn->fd, HTTP_INTERNAL_SERVER_ERROR, keep_alive,
+                               head_only);
+        } else {
+            iov[0].iov_base = reply;
+            iov[0].iov_len = head_length;
+            if (!head_only && response->bodyLength() > 0) {
+                iov[1].iov_base = (void*)response->body();
+                iov[1].iov_len = response->bodyLength();
+                count = 2;
+            }
+            sent = send_all(conn->fd, iov, count);
+            free(reply);
+        }
+        if (!route->response) response->free();
+    }
+    return sent && keep_alive;
+}
+
+/* Serve the buffered request and any pipelined behind it, then hand the
+ * connection back to the I/O thread or close it */
+static void serve_connection(HttpServerPrivate* server, ServerConnection* conn) {
+    for (;;) {
+        bool keep = serve_request(server, conn);
+        size_t consumed = conn->head.length + conn->body_length;
+        int ready;
+
+        memmove(conn->buffer, conn->buffer + consumed, conn->used - consumed);
+        conn->used -= consumed;
+        connection_reset_request(conn);
+        if (!keep) break;
+
+        ready = request_ready(server, conn);
+        if (ready > 0) continue;
+        if (ready < 0) {
+            send_status(conn->fd, conn->error, false, false);
+            break;
+        }
+
+        pthread_mutex_lock(&server->lock);
+        server_watch_locked(server, conn);
+        pthread_mutex_unlock(&server->lock);
+        return;
+    }
+    server_close(server, conn);
+}
+
+static void* worker_main(void* arg) {
+    HttpServerPrivate* server = (HttpServerPrivate*)arg;
+
+    for (;;) {
+        ServerConnection* conn;
+
+        pthread_mutex_lock(&server->lock);
+        while (!server->queue_head && !server->stopping) {
+            pthread_cond_wait(&server->work, &server->lock);
+        }
+        conn = server->queue_head;
+        if (conn) {
+            server->queue_head = conn->queued;
+            if (!server->queue_head) server->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&server->lock);
+
+        if (!conn) return NULL;
+        serve_connection(server, conn);
+    }
+}
+
+/* ======================================================================== */
+/* I/O Thread                                                               */
+/* ======================================================================== */
+
+static void server_dispatch(HttpServerPrivate* server, ServerConnection* conn) {
+    pthread_mutex_lock(&server->lock);
+    conn->busy = true;
+    conn->queued = NULL;
+    if (server->queue_tail) server->queue_tail->queued = conn;
+    else server->queue_head = conn;
+    server->queue_tail = conn;
+    pthread_cond_signal(&server->work);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* Read what the client sent; dispatch once a request is complete */
+static void server_readable(HttpServerPrivate* server, ServerConnection* conn) {
+    size_t limit = SERVER_MAX_HEAD + server->options.max_body;
+    int result;
+
+    for (;;) {
+        size_t space = conn->capacity - conn->used;
+        ssize_t n;
+
+        if (space < SERVER_RECV_CHUNK / 2 && conn->capacity < limit) {
+            size_t capacity = conn->capacity * 2;
+            char* grown;
+
+            /* A declared body is received in one allocation */
+            if (conn->framed &&
+                capacity < conn->head.length + conn->body_length) {
+                capacity = conn->head.length + conn->body_length;
+            }
+            grown = realloc(conn->buffer, capacity + 1);
+            if (!grown) {
+                server_close(server, conn);
+                return;
+            }
+            conn->buffer = grown;
+            conn->capacity = capacity;
+            space = capacity - conn->used;
+        }
+        if (space == 0) break;
+
+        n = recv(conn->fd, conn->buffer + conn->used, space, 0);
+        if (n > 0) {
+            conn->used += (size_t)n;
+            /* A short read almost always means the socket is drained */
+            if ((size_t)n < space) break;
+        } else if (n == 0) {
+            server_close(server, conn);
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            server_close(server, conn);
+            return;
+        }
+    }
+
+    result = request_ready(server, conn);
+    if (result > 0) {
+        server_dispatch(server, conn);
+    } else if (result < 0) {
+        send_status(conn->fd, conn->error, false, false);
+        server_close(server, conn);
+    } else {
+        pthread_mutex_lock(&server->lock);
+        server_watch_locked(server, conn);
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+static void server_pause_listener(HttpServerPrivate* server, bool paused) {
+    server->listen_paused = paused;
+#if SERVER_USE_EPOLL
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = paused ? 0 : EPOLLIN;
+        ev.data.ptr = &server->listen_fd;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->listen_fd, &ev);
+    }
+#endif
+}
+
+static void server_accept(HttpServerPrivate* server) {
+    for (;;) {
+        ServerConnection* conn;
+        int one = 1;
+        int fd = accept(server->listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            /* Out of descriptors: stop listening until the next sweep
+             * rather than spin on a listener that stays readable */
+            if (errno == EMFILE || errno == ENFILE) {
+                server_pause_listener(server, true);
+            }
+            return;
+        }
+        set_nonblocking(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn = calloc(1, sizeof(ServerConnection));
+        if (conn) conn->buffer = malloc(SERVER_RECV_CHUNK + 1);
+        if (!conn || !conn->buffer) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->capacity = SERVER_RECV_CHUNK;
+        connection_reset_request(conn);
+
+        pthread_mutex_lock(&server->lock);
+        conn->next = server->connections;
+        if (conn->next) conn->next->prev = conn;
+        server->connections = conn;
+#if SERVER_USE_EPOLL
+        {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            ev.data.ptr = conn;
+            epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        }
+#endif
+        conn->last_active = network_now();
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+/* Close keep-alive connections that have sat idle too long */
+static void server_sweep(HttpServerPrivate* server, double now) {
+    ServerConnection* conn;
+    ServerConnection* next;
+    ServerConnection* expired = NULL;
+
+    pthread_mutex_lock(&server->lock);
+    for (conn = server->connections; conn; conn = next) {
+        next = conn->next;
+        if (conn->busy ||
+            now - conn->last_active < server->options.idle_timeout_seconds) {
+            continue;
+        }
+        if (conn->prev) conn->prev->next = conn->next;
+        else server->connections = conn->next;
+        if (conn->next) conn->next->prev = conn->prev;
+        conn->next = expired;
+        expired = conn;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    while (expired) {
+        conn = expired;
+        expired = conn->next;
+        close(conn->fd);
+        http_head_free(&conn->head);
+        free(conn->buffer);
+        free(conn);
+    }
+
+    if (server->listen_paused) server_pause_listener(server, false);
+    server->last_sweep = now;
+}
+
+static void server_drain_wake(HttpServerPrivate* server) {
+    char drain[64];
+    while (read(server->wake_read, drain, sizeof(drain)) > 0) {
+        /* Just draining */
+    }
+}
+
+static bool server_stopping(HttpServerPrivate* server) {
+    bool stopping;
+
+    pthread_mutex_lock(&server->lock);
+    stopping = server->stopping;
+    pthread_mutex_unlock(&server->lock);
+    return stopping;
+}
+
+#if SERVER_USE_EPOLL
+
+static void server_poll(HttpServerPrivate* server, int timeout_ms) {
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int count = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS,
+                           timeout_ms);
+    int i;
+
+    /* Workers re-arm a connection while holding the lock; taking it here
+     * makes their writes to the connection visible before it is read */
+    pthread_mutex_lock(&server->lock);
+    pthread_mutex_unlock(&server->lock);
+
+    for (i = 0; i < count; i++) {
+        void* ptr = events[i].data.ptr;
+
+        if (ptr == &server->listen_fd) {
+            server_accept(server);
+        } else if (ptr == &server->wake_read) {
+            server_drain_wake(server);
+        } else {
+            server_readable(server, (ServerConnection*)ptr);
+        }
+    }
+}
+
+#else
+
+static void server_poll(HttpServerPrivate* server, int timeout_ms) {
+    ServerConnection* conn;
+    size_t count = 2;
+    size_t i;
+    int ready;
+
+    /* Slots 0 and 1 are the wake-up pipe and the listener; then every
+     * connection not owned by a worker */
+    pthread_mutex_lock(&server->lock);
+    for (conn = server->connections; conn; conn = conn->next) count++;
+    if (server->poll_capacity < count) {
+        size_t capacity = count * 2;
+        struct pollfd* fds = realloc(server->poll_fds, capacity * sizeof(*fds));
+        ServerConnection** conns;
+        if (fds) server->poll_fds = fds;
+        conns = realloc(server->poll_conns, capacity * sizeof(*conns));
+        if (conns) server->poll_conns = conns;
+        if (!fds || !conns) {
+            pthread_mutex_unlock(&server->lock);
+            return;
+        }
+        server->poll_capacity = capacity;
+    }
+
+    server->poll_fds[0].fd = server->wake_read;
+    server->poll_fds[0].events = POLLIN;
+    server->poll_fds[1].fd = server->listen_paused ? -1 : server->listen_fd;
+    server->poll_fds[1].events = POLLIN;
+    server->poll_conns[0] = server->poll_conns[1] = NULL;
+    count = 2;
+    for (conn = server->connections; conn; conn = conn->next) {
+        if (conn->busy) continue;
+        server->poll_fds[count].fd = conn->fd;
+        server->poll_fds[count].events = POLLIN;
+        server->poll_conns[count] = conn;
+        count++;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    for (i = 0; i < count; i++) server->poll_fds[i].revents = 0;
+    ready = poll(server->poll_fds, (nfds_t)count, timeout_ms);
+    if (ready <= 0) return;
+
+    if (server->poll_fds[0].revents) server_drain_wake(server);
+    if (server->poll_fds[1].revents) server_accept(server);
+    for (i = 2; i < count; i++) {
+        if (server->poll_fds[i].revents) {
+            server_readable(server, server->poll_conns[i]);
+        }
+    }
+}
+
+#endif
+
+static void* io_main(void* arg) {
+    HttpServerPrivate* server = (HttpServerPrivate*)arg;
+
+    server->last_sweep = network_now();
+    while (!server_stopping(server)) {
+        double now;
+
+        server_poll(server, (int)(SERVER_SWEEP_SECONDS * 1000));
+        now = network_now();
+        if (now - server->last_sweep >= SERVER_SWEEP_SECONDS) {
+            server_sweep(server, now);
+        }
+    }
+    return NULL;
+}
+
+static int server_bind(const char* host, int port, int* bound_port) {
+    struct addrinfo hints;
+    struct addrinfo* results = NULL;
+    struct addrinfo* ai;
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    char service[16];
+    int fd = -1;
+    int one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &results) != 0) return -1;
+
+    /* The first address that binds wins */
+    for (ai = results; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(results);
+    if (fd < 0) return -1;
+
+    if (getsockname(fd, (struct sockaddr*)&address, &length) < 0) {
+        close(fd);
+        return -1;
+    }
+    *bound_port = address.ss_family == AF_INET6 ?
+                  ntohs(((struct sockaddr_in6*)&address)->sin6_port) :
+                  ntohs(((struct sockaddr_in*)&address)->sin_port);
+    set_nonblocking(fd);
+    return fd;
+}
+
+/* ======================================================================== */
+/* Public API                                                               */
+/* ======================================================================== */
+
+const char* HttpServerRequestHeader(const HttpServerRequest* request,
+                                    const char* name) {
+    const ServerRequest* server_request = (const ServerRequest*)request;
+
+    if (!request || !name) return NULL;
+    return http_head_find(server_request->head, server_request->buffer, name);
+}
+
+/* ======================================================================== */
+/* Trampoline Functions using TF_ macros                                    */
+/* ======================================================================== */
+
+static int add_route(HttpServerPrivate* private, const char* method,
+                     const char* path, HttpServerHandler handler,
+                     void* context, NetworkResponse* response) {
+    ServerRoute* route;
+    size_t length;
+
+    if (!path || private->running) return 0;
+    if (private->route_count == private->route_capacity) {
+        size_t capacity = private->route_capacity ? private->route_capacity * 2 : 8;
+        ServerRoute* grown = realloc(private->routes, capacity * sizeof(ServerRoute));
+        if (!grown) return 0;
+        private->routes = grown;
+        private->route_capacity = capacity;
+    }
+
+    route = &private->routes[private->route_count];
+    memset(route, 0, sizeof(*route));
+    route->method = method ? strdup(method) : NULL;
+    route->path = strdup(path);
+    if ((method && !route->method) || !route->path) {
+        free(route->method);
+        free(route->path);
+        return 0;
+    }
+    length = strlen(path);
+    route->prefix = length > 0 && path[length - 1] == '*';
+    route->path_length = route->prefix ? length - 1 : length;
+    if (route->prefix) route->path[length - 1] = '\0';
+    route->handler = handler;
+    route->context = context;
+    route->response = response;
+    private->route_count++;
+    return 1;
+}
+
+static TF_Tetradic(int, httpserver_route, HttpServer, HttpServerPrivate,
+                   const char*, method, const char*, path,
+                   HttpServerHandler, handler, void*, context)
+    if (!handler) return 0;
+    return add_route(private, method, path, handler, context, NULL);
+}
+
+static TF_Triadic(int, httpserver_routeResponse, HttpServer, HttpServerPrivate,
+                  const char*, method, const char*, path,
+                  NetworkResponse*, response)
+    if (!response) return 0;
+    return add_route(private, method, path, NULL, NULL, response);
+}
+
+static TF_Dyadic(int, httpserver_listen, HttpServer, HttpServerPrivate,
+                 const char*, host, int, port)
+    int fds[2];
+    int i;
+
+    if (private->running) return -1;
+
+    private->listen_fd = server_bind(host, port, &private->port);
+    if (private->listen_fd < 0) {
+        private->port = -1;
+        return -1;
+    }
+    if (pipe(fds) < 0) {
+        close(private->listen_fd);
+        private->port = -1;
+        return -1;
+    }
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+    private->wake_read = fds[0];
+    private->wake_write = fds[1];
+    private->stopping = false;
+    private->listen_paused = false;
+
+#if SERVER_USE_EPOLL
+    private->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &private->listen_fd;
+        epoll_ctl(private->epoll_fd, EPOLL_CTL_ADD, private->listen_fd, &ev);
+        ev.data.ptr = &private->wake_read;
+        epoll_ctl(private->epoll_fd, EPOLL_CTL_ADD, private->wake_read, &ev);
+    }
+#endif
+
+    private->workers = calloc((size_t)private->options.threads, sizeof(pthread_t));
+    private->worker_count = 0;
+    private->running = true;
+    if (private->workers) {
+        for (i = 0; i < private->options.threads; i++) {
+            if (pthread_create(&private->workers[i], NULL, worker_main, private) != 0) break;
+            private->worker_count++;
+        }
+    }
+    if (private->worker_count == 0 ||
+        pthread_create(&private->io_thread, NULL, io_main, private) != 0) {
+        /* Unwind whatever started */
+        pthread_mutex_lock(&private->lock);
+        private->stopping = true;
+        pthread_cond_broadcast(&private->work);
+        pthread_mutex_unlock(&private->lock);
+        for (i = 0; i < private->worker_count; i++) {
+            pthread_join(private->workers[i], NULL);
+        }
+        free(private->workers);
+        private->workers = NULL;
+#if SERVER_USE_EPOLL
+        close(private->epoll_fd);
+#endif
+        close(private->listen_fd);
+        close(private->wake_read);
+        close(private->wake_write);
+        private->running = false;
+        private->port = -1;
+        return -1;
+    }
+    return private->port;
+}
+
+static TF_Getter(httpserver_port, HttpServer, HttpServerPrivate, int)
+    return private->running ? private->port : -1;
+}
+
+static TF_Nullary(httpserver_stop, HttpServer, HttpServerPrivate)
+    ServerConnection* conn;
+    int i;
+
+    if (!private->running) return;
+
+    pthread_mutex_lock(&private->lock);
+    private->stopping = true;
+    pthread_cond_broadcast(&private->work);
+    pthread_mutex_unlock(&private->lock);
+    if (write(private->wake_write, "s", 1) < 0) {
+        /* The I/O thread notices within a sweep interval anyway */
+    }
+
+    /* Workers finish the requests already queued, then exit */
+    pthread_join(private->io_thread, NULL);
+    for (i = 0; i < private->worker_count; i++) {
+        pthread_join(private->workers[i], NULL);
+    }
+    free(private->workers);
+    private->workers = NULL;
+    private->worker_count = 0;
+
+    while ((conn = private->connections) != NULL) {
+        private->connections = conn->next;
+        close(conn->fd);
+        http_head_free(&conn->head);
+        free(conn->buffer);
+        free(conn);
+    }
+    private->queue_head = private->queue_tail = NULL;
+
+#if SERVER_USE_EPOLL
+    close(private->epoll_fd);
+#else
+    free(private->poll_fds);
+    free(private->poll_conns);
+    private->poll_fds = NULL;
+    private->poll_conns = NULL;
+    private->poll_capacity = 0;
+#endif
+    close(private->listen_fd);
+    close(private->wake_read);
+    close(private->wake_write);
+    private->running = false;
+}
+
+static TF_Nullary(httpserver_free, HttpServer, HttpServerPrivate)
+    size_t i;
+
+    httpserver_stop(self);
+    for (i = 0; i < private->route_count; i++) {
+        free(private->routes[i].method);
+        free(private->routes[i].path);
+        if (private->routes[i].response) private->routes[i].response->free();
+    }
+    free(private->routes);
+    pthread_mutex_destroy(&private->lock);
+    pthread_cond_destroy(&private->work);
+    trampoline_tracker_free_by_context(self);
+    free(private);
+}
+
+/* ======================================================================== */
+/* Creation Functions                                                        */
+/* ======================================================================== */
+
+HttpServer* HttpServerMake(const HttpServerOptions* options) {
+    TA_Allocate(HttpServer, HttpServerPrivate);
+
+    if (!private) return NULL;
+
+    private->options = options ? *options : default_options;
+    if (private->options.threads < 1) private->options.threads = 1;
+    if (private->options.idle_timeout_seconds < 1) {
+        private->options.idle_timeout_seconds = 1;
+    }
+    private->listen_fd = -1;
+    private->port = -1;
+    pthread_mutex_init(&private->lock, NULL);
+    pthread_cond_init(&private->work, NULL);
+
+    /* Create trampoline functions */
+    public->route = trampoline_monitor(httpserver_route, public, 4, &tracker);
+    public->routeResponse = trampoline_monitor(httpserver_routeResponse, public, 3, &tracker);
+    public->listen = trampoline_monitor(httpserver_listen, public, 2, &tracker);
+    public->port = trampoline_monitor(httpserver_port, public, 0, &tracker);
+    public->stop = trampoline_monitor(httpserver_stop, public, 0, &tracker);
+    public->free = trampoline_monitor(httpserver_free, public, 0, &tracker);
+
+    /* Validate all trampolines */
+    if (!trampoline_validate(tracker)) {
+        pthread_mutex_destroy(&private->lock);
+        pthread_cond_destroy(&private->work);
+        free(private);
+        return NULL;
+    }
+
+    return public;
+}
@@ -0,0 +1,258 @@
+/**
+ * @file network_template.c
+ * @brief Prepared requests for endpoints called over and over
+ *
+ * A template is taken from a configured NetworkRequest once: the URL is
+ * parsed and the request line and headers are serialized into one buffer,
+ * split where the query goes. Each send copies that buffer with the query
+ * and Content-Length filled in and sends it with the body. A blocking send
+ * whose head and body fit in TEMPLATE_STACK_BYTES builds both on the stack
+ * and borrows the template's host, so the request side allocates nothing;
+ * only the response does. Templates are not changed by sending, so one
+ * template may be used from several threads at once. A prototype's
+ * NetworkRequestPolicy is kept and applied to every send.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Blocking sends whose head and body fit in this much are built on the stack */
+#define TEMPLATE_STACK_BYTES 8192
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct NetworkRequestTemplatePrivate {
+    NetworkRequestTemplate public;  /* Public interface MUST be first */
+
+    HttpExchange target;        /* Everything but the writer */
+    char* head;                 /* Request line and headers, no blank line */
+    size_t split;               /* Where "?query" goes in head */
+    size_t length;
+    char* query;                /* The URL's own query, or NULL */
+    NetworkRequestPolicy policy;
+    bool has_policy;
+} NetworkRequestTemplatePrivate;
+
+/* Stack space for a blocking send, aligned for the HttpBody at its start */
+typedef union TemplateScratch {
+    long long align_integer;
+    long double align_float;
+    void* align_pointer;
+    char bytes[TEMPLATE_STACK_BYTES];
+} TemplateScratch;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+/* Size of the head stamped with query and a body of body_length bytes */
+static size_t stamp_size(NetworkRequestTemplatePrivate* private,
+                         const char* query, size_t body_length) {
+    size_t size = private->length + 2;
+
+    if (query && *query) size += 1 + strlen(query);
+    if (body_length > 0) size += 40;    /* "Content-Length: " and 20 digits */
+    return size + 1;
+}
+
+/* Write the head into out, which holds stamp_size() bytes; returns its
+ * length */
+static size_t stamp_head(NetworkRequestTemplatePrivate* private,
+                         const char* query, size_t body_length, char* out) {
+    size_t offset = private->split;
+
+    memcpy(out, private->head, private->split);
+    if (query && *query) {
+        size_t length = strlen(query);
+
+        out[offset++] = '?';
+        memcpy(out + offset, query, length);
+        offset += length;
+    }
+    memcpy(out + offset, private->head + private->split,
+           private->length - private->split);
+    offset += private->length - private->split;
+    if (body_length > 0) {
+        offset += (size_t)sprintf(out + offset, "Content-Length: %zu\r\n",
+                                  body_length);
+    }
+    memcpy(out + offset, "\r\n", 3);
+    return offset + 2;
+}
+
+/* Place a body in space, which holds sizeof(HttpBody) + length + 1 bytes.
+ * Its own reference is never released, so it is never freed. */
+static HttpBody* place_body(void* space, const void* data, size_t length) {
+    HttpBody* body = (HttpBody*)space;
+
+    body->refs = 1;
+    body->fd = -1;
+    body->offset = 0;
+    body->length = length;
+    memcpy(body->data, data, length);
+    body->data[length] = '\0';
+    return body;
+}
+
+/* ======================================================================== */
+/* Trampoline Functions using TF_ macros                                    */
+/* ======================================================================== */
+
+static TF_Triadic(NetworkResponse*, networkrequesttemplate_send,
+                  NetworkRequestTemplate, NetworkRequestTemplatePrivate,
+                  const char*, query, const void*, body, size_t, length)
+    TemplateScratch scratch;
+    HttpExchange exchange;
+    HttpBody* held = NULL;
+    NetworkResponse* response;
+    size_t body_space;
+    size_t head_size;
+    char* head;
+
+    if (!query) query = private->query;
+    if (!body) length = 0;
+    body_space = length > 0 ? sizeof(HttpBody) + length + 1 : 0;
+    head_size = stamp_size(private, query, length);
+
+    if (body_space + head_size <= sizeof(scratch)) {
+        head = scratch.bytes + body_space;
+        if (length > 0) held = place_body(scratch.bytes, body, length);
+    } else {
+        head = malloc(head_size);
+        if (length > 0) held = http_body_from_memory(body, length);
+        if (!head || (length > 0 && !held)) {
+            free(head);
+            http_body_release(held);
+            return NetworkResponseMake(500, "Internal Server Error",
+                                       "Failed to build request");
+        }
+    }
+
+    /* The exchange borrows the host and, when on the stack, the head */
+    exchange = private->target;
+    http_writer_init(&exchange.writer, head,
+                     stamp_head(private, query, length, head), held);
+    response = private->has_policy
+        ? network_policy_send(&exchange, &private->policy)
+        : network_exchange_send(&exchange);
+
+    if (head == scratch.bytes + body_space) {
+        exchange.writer.head = NULL;
+    } else {
+        http_body_release(held);
+    }
+    http_writer_free(&exchange.writer);
+    return response;
+}
+
+static TF_Pentadic(int, networkrequesttemplate_sendAsync,
+                   NetworkRequestTemplate, NetworkRequestTemplatePrivate,
+                   NetworkLoop*, loop, const char*, query, const char*, body,
+                   NetworkResponseCallback, callback, void*, context)
+    HttpExchange exchange;
+    HttpBody* held = NULL;
+    size_t length = body ? strlen(body) : 0;
+    char* head;
+
+    if (!callback) return 0;
+    if (!loop) loop = NetworkLoopDefault();
+    if (!loop) return 0;
+
+    if (!query) query = private->query;
+
+    /* The loop outlives this call, so everything goes on the heap */
+    exchange = private->target;
+    exchange.hostname = strdup(private->target.hostname);
+    head = malloc(stamp_size(private, query, length));
+    if (length > 0) held = http_body_from_memory(body, length);
+    http_writer_init(&exchange.writer, head,
+                     head ? stamp_head(private, query, length, head) : 0, held);
+    http_body_release(held);
+
+    if (!exchange.hostname || !head || (length > 0 && !held)) {
+        free(exchange.hostname);
+        http_writer_free(&exchange.writer);
+        return 0;
+    }
+    if (private->has_policy) {
+        /* The policy sends copies of the exchange */
+        int queued = network_policy_submit(loop, &exchange, &private->policy,
+                                           callback, context);
+        free(exchange.hostname);
+        http_writer_free(&exchange.writer);
+        return queued;
+    }
+    return network_loop_submit(loop, &exchange, callback, context);
+}
+
+static TF_Nullary(networkrequesttemplate_free, NetworkRequestTemplate,
+                  NetworkRequestTemplatePrivate)
+    if (private) {
+        free(private->target.hostname);
+        free(private->head);
+        free(private->query);
+        trampoline_tracker_free_by_context(self);
+        free(private);
+    }
+}
+
+/* ======================================================================== */
+/* Creation Functions                                                        */
+/* ======================================================================== */
+
+NetworkRequestTemplate* NetworkRequestTemplateMake(NetworkRequest* prototype) {
+    HttpExchange target;
+
+    if (!prototype) return NULL;
+
+    /* Target and settings as a send would use them; the head is rebuilt
+     * without the query below */
+    if (!network_request_exchange(prototype, &target)) {
+        free(target.hostname);
+        http_writer_free(&target.writer);
+        return NULL;
+    }
+    http_writer_free(&target.writer);
+
+    TA_Allocate(NetworkRequestTemplate, NetworkRequestTemplatePrivate);
+
+    if (!private) {
+        free(target.hostname);
+        return NULL;
+    }
+
+    private->target = target;
+    if (network_request_policy(prototype)) {
+        private->policy = *network_request_policy(prototype);
+        private->has_policy = true;
+    }
+    if (!network_request_head_parts(prototype, &private->head, &private->split,
+                                    &private->length, &private->query)) {
+        free(private->target.hostname);
+        free(private);
+        return NULL;
+    }
+
+    /* Create trampoline functions */
+    public->send = trampoline_monitor(networkrequesttemplate_send, public, 3, &tracker);
+    public->sendAsync = trampoline_monitor(networkrequesttemplate_sendAsync, public, 5, &tracker);
+    public->free = trampoline_monitor(networkrequesttemplate_free, public, 0, &tracker);
+
+    /* Validate all trampolines */
+    if (!trampoline_validate(tracker)) {
+        free(private->target.hostname);
+        free(private->head);
+        free(private->query);
+        free(private);
+        return NULL;
+    }
+
+    return public;
+}
@@ -0,0 +1,327 @@
+/**
+ * @file network_tls.c
+ * @brief Shared TLS client context and session resumption
+ *
+ * Every TLS connection is created from one process-wide SSL_CTX instead
+ * of building and configuring a context per connection. Sessions the
+ * server hands out (TLS 1.2 session IDs/tickets, TLS 1.3 PSK tickets) are
+ * kept per host:port, so a repeat connection offers one back and skips the
+ * certificate exchange and key agreement of a full handshake.
+ *
+ * TLS 1.3 tickets are meant to be used once (RFC 8446 appendix C.4), so
+ * they are taken out of the cache when offered; servers send a fresh one
+ * after every handshake. Several are kept per host so concurrent connects
+ * from the event loop can all resume.
+ */
+
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define TLS_SESSIONS_PER_HOST 16
+
+static NetworkTlsOptions tls_options = {
+    1,      /* session_cache */
+    256     /* max_hosts */
+};
+
+static NetworkTlsStats tls_stats;
+
+#if SSL_SUPPORT
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct TlsHost {
+    char* key;                                  /* "host:port" */
+    SSL_SESSION* sessions[TLS_SESSIONS_PER_HOST];   /* Newest last */
+    int count;
+    struct TlsHost* next;                       /* Most recently used first */
+} TlsHost;
+
+static pthread_mutex_t tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX* tls_context = NULL;
+static TlsHost* tls_hosts = NULL;
+static size_t tls_host_count = 0;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+static void host_key(const char* hostname, int port, char* key, size_t size) {
+    snprintf(key, size, "%s:%d", hostname, port);
+}
+
+static void host_free(TlsHost* host) {
+    int i;
+    for (i = 0; i < host->count; i++) SSL_SESSION_free(host->sessions[i]);
+    free(host->key);
+    free(host);
+}
+
+/* Caller must hold tls_mutex. Found hosts move to the front. */
+static TlsHost* host_find(const char* key, bool create) {
+    TlsHost** link = &tls_hosts;
+    TlsHost* host;
+
+    while (*link) {
+        host = *link;
+        if (strcmp(host->key, key) == 0) {
+            *link = host->next;
+            host->next = tls_hosts;
+            tls_hosts = host;
+            return host;
+        }
+        /* Drop the least recently used host when the cache is full */
+        if (create && !host->next && tls_host_count >= (size_t)tls_options.max_hosts) {
+            *link = NULL;
+            host_free(host);
+            tls_host_count--;
+            break;
+        }
+        link = &host->next;
+    }
+    if (!create) return NULL;
+
+    host = calloc(1, sizeof(TlsHost));
+    if (!host) return NULL;
+    host->key = strdup(key);
+    if (!host->key) {
+        free(host);
+        return NULL;
+    }
+    host->next = tls_hosts;
+    tls_hosts = host;
+    tls_host_count++;
+    return host;
+}
+
+/* OpenSSL hands over each new session; TLS 1.3 tickets arrive after the
+ * handshake, during the first reads. Returning 1 keeps the reference. */
+static int tls_new_session(SSL* ssl, SSL_SESSION* session) {
+    Connection* conn = SSL_get_app_data(ssl);
+    char key[300];
+    TlsHost* host;
+    int kept = 0;
+
+    if (!conn || !SSL_SESSION_is_resumable(session)) return 0;
+    host_key(conn->hostname, conn->port, key, sizeof(key));
+
+    pthread_mutex_lock(&tls_mutex);
+    if (tls_options.session_cache) {
+        host = host_find(key, true);
+        if (host) {
+            if (host->count == TLS_SESSIONS_PER_HOST) {
+                SSL_SESSION_free(host->sessions[0]);
+                memmove(host->sessions, host->sessions + 1,
+                        (TLS_SESSIONS_PER_HOST - 1) * sizeof(SSL_SESSION*));
+                host->count--;
+            }
+            host->sessions[host->count++] = session;
+            kept = 1;
+        }
+    }
+    pthread_mutex_unlock(&tls_mutex);
+    return kept;
+}
+
+/* A session to offer the host, or NULL. The caller owns the reference. */
+static SSL_SESSION* take_session(const char* hostname, int port) {
+    SSL_SESSION* session = NULL;
+    char key[300];
+    TlsHost* host;
+
+    host_key(hostname, port, key, sizeof(key));
+
+    pthread_mutex_lock(&tls_mutex);
+    host = tls_options.session_cache ? host_find(key, false) : NULL;
+    if (host && host->count > 0) {
+        session = host->sessions[host->count - 1];
+        if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION) {
+            /* Single use: the cache gives up its reference */
+            host->count--;
+        } else {
+            SSL_SESSION_up_ref(session);
+        }
+    }
+    pthread_mutex_unlock(&tls_mutex);
+    return session;
+}
+
+/* Caller must hold tls_mutex */
+static SSL_CTX* context_locked(void) {
+    if (tls_context) return tls_context;
+
+    network_init_ssl();
+    tls_context = SSL_CTX_new(TLS_client_method());
+    if (!tls_context) return NULL;
+
+    SSL_CTX_set_options(tls_context, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+    SSL_CTX_set_verify(tls_context, SSL_VERIFY_NONE, NULL);
+
+    /* A blocked write may be retried from a different buffer holding the
+     * same bytes (see connection_sendv) */
+    SSL_CTX_set_mode(tls_context, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    /* Sessions are kept here, per host, rather than in OpenSSL's cache,
+     * which keys client sessions by nothing useful */
+    SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_CLIENT |
+                                               SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_context, tls_new_session);
+    return tls_context;
+}
+
+/* SNI carries names only, never address literals (RFC 6066 section 3) */
+static bool is_address(const char* hostname) {
+    unsigned char buffer[sizeof(struct in6_addr)];
+    return inet_pton(AF_INET, hostname, buffer) == 1 ||
+           inet_pton(AF_INET6, hostname, buffer) == 1;
+}
+
+/* ======================================================================== */
+/* Internal API                                                             */
+/* ======================================================================== */
+
+bool network_tls_available(void) {
+    bool ok;
+
+    pthread_mutex_lock(&tls_mutex);
+    ok = context_locked() != NULL;
+    pthread_mutex_unlock(&tls_mutex);
+    return ok;
+}
+
+bool network_tls_attach(Connection* conn) {
+    SSL_CTX* context;
+    SSL_SESSION* session;
+
+    conn->tls_start = network_now();
+    pthread_mutex_lock(&tls_mutex);
+    context = context_locked();
+    conn->ssl = context ? SSL_new(context) : NULL;
+    pthread_mutex_unlock(&tls_mutex);
+
+    if (!conn->ssl) {
+        snprintf(conn->error_buffer, sizeof(conn->error_buffer),
+                "Failed to create SSL structure");
+        return false;
+    }
+
+    SSL_set_fd(conn->ssl, conn->socket_fd);
+    SSL_set_app_data(conn->ssl, conn);
+    if (!is_address(conn->hostname)) {
+        SSL_set_tlsext_host_name(conn->ssl, conn->hostname);
+    }
+
+    /* h2 first; the server picks (RFC 7301) */
+    if (conn->offer_h2) {
+        static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+        SSL_set_alpn_protos(conn->ssl, protocols, sizeof(protocols) - 1);
+    }
+
+    session = take_session(conn->hostname, conn->port);
+    if (session) {
+        SSL_set_session(conn->ssl, session);
+        SSL_SESSION_free(session);
+    }
+    return true;
+}
+
+void network_tls_handshake_done(Connection* conn) {
+    const unsigned char* protocol = NULL;
+    unsigned int length = 0;
+
+    conn->tls_end = network_now();
+    SSL_get0_alpn_selected(conn->ssl, &protocol, &length);
+    conn->h2 = conn->offer_h2 && length == 2 && memcmp(protocol, "h2", 2) == 0;
+
+    pthread_mutex_lock(&tls_mutex);
+    tls_stats.handshakes++;
+    if (SSL_session_reused(conn->ssl)) tls_stats.resumed++;
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+void network_tls_cleanup(void) {
+    NetworkTlsClearSessions();
+
+    pthread_mutex_lock(&tls_mutex);
+    if (tls_context) {
+        /* Live connections hold their own reference to the context */
+        SSL_CTX_free(tls_context);
+        tls_context = NULL;
+    }
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+/* ======================================================================== */
+/* Public API                                                               */
+/* ======================================================================== */
+
+void NetworkTlsConfigure(const NetworkTlsOptions* options) {
+    if (!options) return;
+
+    pthread_mutex_lock(&tls_mutex);
+    tls_options = *options;
+    if (tls_options.max_hosts < 1) tls_options.max_hosts = 1;
+    pthread_mutex_unlock(&tls_mutex);
+
+    if (!options->session_cache) NetworkTlsClearSessions();
+}
+
+void NetworkTlsGetOptions(NetworkTlsOptions* options) {
+    if (!options) return;
+
+    pthread_mutex_lock(&tls_mutex);
+    *options = tls_options;
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+void NetworkTlsGetStats(NetworkTlsStats* stats) {
+    TlsHost* host;
+
+    if (!stats) return;
+
+    pthread_mutex_lock(&tls_mutex);
+    *stats = tls_stats;
+    stats->cached_sessions = 0;
+    for (host = tls_hosts; host; host = host->next) {
+        stats->cached_sessions += (size_t)host->count;
+    }
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+void NetworkTlsClearSessions(void) {
+    pthread_mutex_lock(&tls_mutex);
+    while (tls_hosts) {
+        TlsHost* host = tls_hosts;
+        tls_hosts = host->next;
+        host_free(host);
+    }
+    tls_host_count = 0;
+    pthread_mutex_unlock(&tls_mutex);
+}
+
+#else
+
+void NetworkTlsConfigure(const NetworkTlsOptions* options) {
+    if (options) tls_options = *options;
+}
+
+void NetworkTlsGetOptions(NetworkTlsOptions* options) {
+    if (options) *options = tls_options;
+}
+
+void NetworkTlsGetStats(NetworkTlsStats* stats) {
+    if (stats) *stats = tls_stats;
+}
+
+void NetworkTlsClearSessions(void) {
+    /* No-op when SSL is disabled */
+}
+
+#endif
@@ -0,0 +1,1053 @@
+/**
+ * @file network_websocket.c
+ * @brief WebSocket client (RFC 6455) on a Connection of its own
+ *
+ * connect() opens the connection, sends the upgrade request and checks the
+ * 101 reply, Sec-WebSocket-Accept included; SHA-1 and base64 are done here,
+ * so ws:// works in builds without OpenSSL. Whatever the server sent after
+ * its head stays in the receive buffer as the first frames.
+ *
+ * Frames are parsed where they land in the receive buffer. A message in a
+ * single frame is handed out where it lies: the byte after it is saved and
+ * replaced with a NUL, and put back by the next receive. The payloads of a
+ * fragmented message are moved down to the front of the buffer one after
+ * another, over headers already parsed, so the message is joined without a
+ * second buffer. Control frames between fragments are answered and skipped.
+ *
+ * Servers never mask, so masking happens on the way out: each frame is
+ * built in a send buffer that is kept between frames, with the payload
+ * masked as it is copied in, sixteen bytes at a time with SSE2 or NEON and
+ * eight at a time in a 64-bit word otherwise. Once both buffers have grown
+ * to the largest message, nothing is allocated per frame.
+ */
+
+#include <trampoline/trampoline.h>
+#include <trampoline/macros.h>
+#include <trampoline/classes/network.h>
+#include "network_common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+
+#if SSL_SUPPORT
+#include <openssl/rand.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Receive buffer to start with, and the least room a read is given */
+#define WEBSOCKET_READ_BYTES 16384
+/* Largest handshake reply head */
+#define WEBSOCKET_MAX_HEAD 65536
+#define WEBSOCKET_DEFAULT_MAX_MESSAGE (16u * 1024 * 1024)
+/* Close code reported for a close frame without one */
+#define WEBSOCKET_CLOSE_NO_STATUS 1005
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+enum {
+    WS_OP_CONTINUATION = 0x0,
+    WS_OP_TEXT = 0x1,
+    WS_OP_BINARY = 0x2,
+    WS_OP_CLOSE = 0x8,
+    WS_OP_PING = 0x9,
+    WS_OP_PONG = 0xA
+};
+
+typedef enum {
+    WS_IDLE,                /* Not connected yet */
+    WS_OPEN,
+    WS_CLOSING,             /* Our close frame is sent, the reply is awaited */
+    WS_CLOSED
+} WebSocketState;
+
+/* ======================================================================== */
+/* Private Structures                                                       */
+/* ======================================================================== */
+
+typedef struct WebSocketPrivate {
+    WebSocket public;           /* Public interface MUST be first */
+
+    /* Where to connect, from the URL */
+    char* hostname;
+    char* authority;            /* Host header: the URL's host[:port] */
+    char* path;                 /* Path and query */
+    int port;
+    bool use_ssl;
+
+    HttpHeaderTable headers;
+    char* offered_protocol;
+    char* protocol;             /* Chosen by the server */
+    int timeout_seconds;
+    size_t max_message;
+
+    Connection* conn;
+    WebSocketState state;
+    int close_code;
+    char error[256];
+    bool has_error;
+    unsigned long pongs;
+    uint64_t mask_state;        /* xorshift64* state for masking keys */
+
+    /* Receive buffer: [joined fragments | parsed frames | unparsed bytes] */
+    unsigned char* buffer;
+    size_t capacity;
+    size_t length;
+    size_t raw;                 /* First byte not yet parsed */
+    size_t gathered;            /* Fragment bytes joined at the front */
+    int gathering;              /* Opcode of the open fragmented message, 0 if none */
+    size_t wanted;              /* Bytes from raw the next frame needs */
+
+    /* The message last returned, borrowed from the buffer */
+    const char* message;
+    size_t message_length;
+    bool message_text;
+    size_t consumed;            /* Bytes to drop on the next receive */
+    size_t saved_at;            /* Byte overwritten by the message's NUL */
+    unsigned char saved;
+    bool has_saved;
+
+    unsigned char* send_buffer;
+    size_t send_capacity;
+} WebSocketPrivate;
+
+/* ======================================================================== */
+/* Helper Functions                                                          */
+/* ======================================================================== */
+
+/* SHA-1 (FIPS 180-4), only ever used on the short handshake key */
+static uint32_t rotl32(uint32_t value, int bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block(uint32_t state[5], const unsigned char* block) {
+    uint32_t w[80];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (i = 16; i < 80; i++) {
+        w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    for (i = 0; i < 80; i++) {
+        uint32_t f, k, t;
+
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = rotl32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+static void sha1(const unsigned char* data, size_t length, unsigned char digest[20]) {
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned char tail[128];
+    size_t whole = length & ~(size_t)63;
+    size_t rest = length - whole;
+    size_t tail_length = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)length * 8;
+    size_t i;
+
+    for (i = 0; i < whole; i += 64) sha1_block(state, data + i);
+
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + whole, rest);
+    tail[rest] = 0x80;
+    for (i = 0; i < 8; i++) tail[tail_length - 1 - i] = (unsigned char)(bits >> (i * 8));
+    for (i = 0; i < tail_length; i += 64) sha1_block(state, tail + i);
+
+    for (i = 0; i < 20; i++) digest[i] = (unsigned char)(state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+/* Base64 of data into out, which holds 4 * ((length + 2) / 3) + 1 bytes */
+static void base64_encode(const unsigned char* data, size_t length, char* out) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+
+    for (i = 0; i + 2 < length; i += 3) {
+        *out++ = alphabet[data[i] >> 2];
+        *out++ = alphabet[(data[i] & 0x03) << 4 | data[i + 1] >> 4];
+        *out++ = alphabet[(data[i + 1] & 0x0f) << 2 | data[i + 2] >> 6];
+        *out++ = alphabet[data[i + 2] & 0x3f];
+    }
+    if (i < length) {
+        *out++ = alphabet[data[i] >> 2];
+        if (i + 1 < length) {
+            *out++ = alphabet[(data[i] & 0x03) << 4 | data[i + 1] >> 4];
+            *out++ = alphabet[(data[i + 1] & 0x0f) << 2];
+        } else {
+            *out++ = alphabet[(data[i] & 0x03) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+/* Unpredictable bytes for the handshake key and the masking seed */
+static void random_bytes(unsigned char* out, size_t length) {
+    uint64_t mix;
+    size_t i;
+    int fd;
+
+#if SSL_SUPPORT
+    if (RAND_bytes(out, (int)length) == 1) return;
+#endif
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        ssize_t got = read(fd, out, length);
+
+        close(fd);
+        if (got == (ssize_t)length) return;
+    }
+    mix = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)out ^
+          (uint64_t)(network_now() * 1e9);
+    for (i = 0; i < length; i++) {
+        mix = mix * 6364136223846793005ULL + 1442695040888963407ULL;
+        out[i] = (unsigned char)(mix >> 56);
+    }
+}
+
+/* Masking key for the next frame, from a generator seeded by random_bytes */
+static void next_mask(WebSocketPrivate* private, unsigned char key[4]) {
+    uint64_t x = private->mask_state;
+    uint32_t value;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    private->mask_state = x;
+    value = (uint32_t)((x * 2685821657736338717ULL) >> 32);
+    memcpy(key, &value, 4);
+}
+
+/* XOR length bytes of in with the repeating key into out (which may be in) */
+static void mask_copy(unsigned char* out, const unsigned char* in, size_t length,
+                      const unsigned char key[4]) {
+    uint32_t key32;
+    uint64_t key64;
+    size_t i = 0;
+
+    /* The key's bytes in memory order, so any word lines up with key[0] */
+    memcpy(&key32, key, 4);
+    key64 = (uint64_t)key32 << 32 | key32;
+
+#if defined(__SSE2__)
+    {
+        __m128i wide = _mm_set1_epi32((int)key32);
+
+        for (; i + 16 <= length; i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(const void*)(in + i));
+            _mm_storeu_si128((__m128i*)(void*)(out + i), _mm_xor_si128(block, wide));
+        }
+    }
+#elif defined(__ARM_NEON)
+    {
+        uint8x16_t wide = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+
+        for (; i + 16 <= length; i += 16) {
+            vst1q_u8(out + i, veorq_u8(vld1q_u8(in + i), wide));
+        }
+    }
+#endif
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+
+        memcpy(&word, in + i, 8);
+        word ^= key64;
+        memcpy(out + i, &word, 8);
+    }
+    for (; i < length; i++) out[i] = in[i] ^ key[i & 3];
+}
+
+/* Grow *buffer to at least needed bytes, doubling */
+static bool reserve(unsigned char** buffer, size_t* capacity, size_t needed) {
+    size_t size = *capacity ? *capacity : WEBSOCKET_READ_BYTES;
+    unsigned char* grown;
+
+    if (needed <= *capacity) return true;
+    while (size < needed) size *= 2;
+    grown = realloc(*buffer, size);
+    if (!grown) return false;
+    *buffer = grown;
+    *capacity = size;
+    return true;
+}
+
+/* Split ws://host:port/path (or wss, http, https) into its parts */
+static bool parse_url(WebSocketPrivate* private, const char* url) {
+    const char* p;
+    const char* authority;
+    const char* host_end;
+    const char* end;
+
+    if (!url) return false;
+    if (strncasecmp(url, "ws://", 5) == 0) {
+        p = url + 5;
+    } else if (strncasecmp(url, "wss://", 6) == 0) {
+        p = url + 6;
+        private->use_ssl = true;
+    } else if (strncasecmp(url, "http://", 7) == 0) {
+        p = url + 7;
+    } else if (strncasecmp(url, "https://", 8) == 0) {
+        p = url + 8;
+        private->use_ssl = true;
+    } else {
+        return false;
+    }
+    private->port = private->use_ssl ? 443 : 80;
+
+    authority = p;
+    end = p + strcspn(p, "/?#");
+    if (end == authority) return false;
+
+    if (*authority == '[') {
+        host_end = memchr(authority, ']', (size_t)(end - authority));
+        if (!host_end) return false;
+        private->hostname = strndup(authority + 1, (size_t)(host_end - authority - 1));
+        host_end++;
+    } else {
+        host_end = memchr(authority, ':', (size_t)(end - authority));
+        if (!host_end) host_end = end;
+        private->hostname = strndup(authority, (size_t)(host_end - authority));
+    }
+    if (host_end < end && *host_end == ':') {
+        char* digits_end;
+        long port = strtol(host_end + 1, &digits_end, 10);
+
+        if (digits_end != end || port <= 0 || port > 65535) return false;
+        private->port = (int)port;
+    }
+    private->authority = strndup(authority, (size_t)(end - authority));
+
+    /* The rest up to any fragment is the target; "?q" alone becomes "/?q" */
+    p = end;
+    end = p + strcspn(p, "#");
+    if (*p == '/') {
+        private->path = strndup(p, (size_t)(end - p));
+    } else {
+        private->path = malloc((size_t)(end - p) + 2);
+        if (private->path) {
+            private->path[0] = '/';
+            memcpy(private->path + 1, p, (size_t)(end - p));
+            private->path[end - p + 1] = '\0';
+        }
+    }
+    return private->hostname && private->authority && private->path;
+}
+
+static void close_connection(WebSocketPrivate* private) {
+    private->state = WS_CLOSED;
+    connection_free(private->conn);
+    private->conn = NULL;
+}
+
+/* Record why the socket stopped working and close it */
+static void fail(WebSocketPrivate* private, const char* reason) {
+    if (!private->has_error) {
+        snprintf(private->error, sizeof(private->error), "%.*s",
+                 (int)sizeof(private->error) - 1, reason);
+        private->has_error = true;
+    }
+    close_connection(private);
+}
+
+static bool send_all(WebSocketPrivate* private, const unsigned char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = connection_send(private->conn, data, length);
+
+        if (sent <= 0) {
+            char reason[300];
+
+            snprintf(reason, sizeof(reason), "Send failed: %s",
+                     connection_error(private->conn));
+            fail(private, reason);
+            return false;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+/* Build one masked, final frame in the send buffer and send it */
+static bool send_frame(WebSocketPrivate* private, int opcode, const void* data,
+                       size_t length) {
+    unsigned char* frame;
+    size_t header = 2;
+    int i;
+
+    if (!private->conn) return false;
+    if (!reserve(&private->send_buffer, &private->send_capacity, length + 14)) {
+        fail(private, "Out of memory");
+        return false;
+    }
+    frame = private->send_buffer;
+    frame[0] = (unsigned char)(0x80 | opcode);
+    if (length < 126) {
+        frame[1] = (unsigned char)(0x80 | length);
+    } else if (length <= 0xffff) {
+        frame[1] = 0x80 | 126;
+        frame[2] = (unsigned char)(length >> 8);
+        frame[3] = (unsigned char)length;
+        header = 4;
+    } else {
+        frame[1] = 0x80 | 127;
+        for (i = 0; i < 8; i++) frame[2 + i] = (unsigned char)((uint64_t)length >> (56 - i * 8));
+        header = 10;
+    }
+    next_mask(private, frame + header);
+    mask_copy(frame + header + 4, data, length, frame + header);
+    return send_all(private, frame, header + 4 + length);
+}
+
+/* Tell the server why we are giving up, then fail */
+static int fail_with_close(WebSocketPrivate* private, int code, const char* reason) {
+    unsigned char payload[2];
+
+    payload[0] = (unsigned char)(code >> 8);
+    payload[1] = (unsigned char)code;
+    if (private->state == WS_OPEN) send_frame(private, WS_OP_CLOSE, payload, 2);
+    fail(private, reason);
+    return -1;
+}
+
+/* Put back the byte under the last message's NUL and drop its bytes */
+static void release_message(WebSocketPrivate* private) {
+    if (private->has_saved) {
+        private->buffer[private->saved_at] = private->saved;
+        private->has_saved = false;
+    }
+    if (private->consumed > 0) {
+        memmove(private->buffer, private->buffer + private->consumed,
+                private->length - private->consumed);
+        private->length -= private->consumed;
+        private->raw -= private->consumed;
+        private->consumed = 0;
+    }
+    private->message = NULL;
+    private->message_length = 0;
+}
+
+/* Hand out length bytes at offset as the message, NUL terminated in place */
+static int deliver(WebSocketPrivate* private, size_t offset, size_t length, bool text) {
+    size_t end = offset + length;
+
+    if (end < private->length) {
+        private->saved = private->buffer[end];
+        private->saved_at = end;
+        private->has_saved = true;
+    }
+    private->buffer[end] = '\0';
+    private->message = (const char*)private->buffer + offset;
+    private->message_length = length;
+    private->message_text = text;
+    private->consumed = private->raw;
+    return 1;
+}
+
+/* A control frame's payload at p: answer pings, note pongs, finish on close */
+static int control_frame(WebSocketPrivate* private, int opcode,
+                         const unsigned char* p, size_t size) {
+    switch (opcode) {
+    case WS_OP_PING:
+        if (private->state == WS_OPEN && !send_frame(private, WS_OP_PONG, p, size)) {
+            return -1;
+        }
+        return 0;
+    case WS_OP_PONG:
+        private->pongs++;
+        return 0;
+    case WS_OP_CLOSE:
+        if (size == 1) {
+            return fail_with_close(private, WEBSOCKET_CLOSE_PROTOCOL_ERROR,
+                                   "Close frame with a one byte payload");
+        }
+        private->close_code = size >= 2 ? (p[0] << 8 | p[1]) : WEBSOCKET_CLOSE_NO_STATUS;
+        if (private->state == WS_CLOSING) {
+            /* The reply to our close */
+            close_connection(private);
+        } else if (send_frame(private, WS_OP_CLOSE, p, size >= 2 ? 2 : 0)) {
+            /* Echoed the server's code */
+            fail(private, "Closed by the server");
+        }
+        return -1;
+    default:
+        return fail_with_close(private, WEBSOCKET_CLOSE_PROTOCOL_ERROR,
+                               "Unknown control frame");
+    }
+}
+
+/*
+ * Parse frames from raw until a message is complete (1), more bytes are
+ * needed (0, with wanted set) or the socket is closed (-1)
+ */
+static int next_frame(WebSocketPrivate* private) {
+    for (;;) {
+        unsigned char* frame = private->buffer + private->raw;
+        size_t available = private->length - private->raw;
+        uint64_t size;
+        size_t header = 2;
+        size_t payload;
+        int opcode;
+        bool fin;
+        int i;
+
+        if (available < 2) {
+            private->wanted = 2;
+            return 0;
+        }
+        fin = (frame[0] & 0x80) != 0;
+        opcode = frame[0] & 0x0f;
+        if (frame[0] & 0x70) {
+            return fail_with_close(private, WEBSOCKET_CLOSE_PROTOCOL_ERROR,
+                                   "Reserved frame bits set");
+        }
+        if (frame[1] & 0x80) {
+            return fail_with_close(private, WEBSOCKET_CLOSE_PROTOCOL_ERROR,
+                                   "Masked frame from the server");
+        }
+        size = frame[1] & 0x7f;
+        if (size == 126) {
+            header = 4;
+            if (available < header) {
+                private->wanted = header;
+                return 0;
+            }
+            size = (uint64_t)frame[2] << 8 | frame[3];
+        } else if (size == 127) {
+            header = 10;
+            if (available < header) {
+                private->wanted = header;
+                return 0;
+            }
+            size = 0;
+            for (i = 2; i < 10; i++) size = size << 8 | frame[i];
+        }
+
+        if (opcode >= WS_OP_CLOSE) {
+            if (!fin || size > 125) {
+                return fail_with_close(private, WEBSOCKET_CLOSE_PROTOCOL_ERROR,
+                                       "Fragmented or oversized control frame");
+            }
+        } else if (size > private->max_message - private->gathered) {
+            return fail_with_close(private, WEBSOCKET_CLOSE_TOO_BIG, "Message too big");
+        }
+        payload = (size_t)size;
+        if (available < header + payload) {
+            private->wanted = header + payload;
+            return 0;
+        }
+
+        if (opcode >= WS_OP_CLOSE) {
+            int result = control_frame(private, opcode, frame + header, payload);
+
+            if (result != 0) return result;
+            private->raw += header + payload;
+            continue;
+        }
+        if (opcode == WS_OP_CONTINUATION ? private->gathering == 0
+                                         : private->gathering != 0) {
+            return fail_with_close(private, WEBSOCKET_CLOSE_PROTOCOL_ERROR,
+                                   "Unexpected continuation frame");
+        }
+        if (opcode != WS_OP_CONTINUATION && opcode != WS_OP_TEXT &&
+            opcode != WS_OP_BINARY) {
+            return fail_with_close(private, WEBSOCKET_CLOSE_PROTOCOL_ERROR,
+                                   "Unknown data frame");
+        }
+
+        if (fin && private->gathering == 0) {
+            /* Whole message in one frame: hand it out where it lies */
+            private->raw += header + payload;
+            return deliver(private, private->raw - payload, payload, opcode == WS_OP_TEXT);
+        }
+
+        /* A fragment: join it to the others at the front. The headers
+         * already parsed keep gathered below raw, so there is always room
+         * for the NUL. */
+        if (private->gathering == 0) private->gathering = opcode;
+        memmove(private->buffer + private->gathered, frame + header, payload);
+        private->gathered += payload;
+        private->raw += header + payload;
+        if (fin) {
+            size_t length = private->gathered;
+            bool text = private->gathering == WS_OP_TEXT;
+
+            private->gathering = 0;
+            private->gathered = 0;
+            return deliver(private, 0, length, text);
+        }
+    }
+}
+
+/*
+ * Read more bytes, waiting until deadline (forever if wait is false).
+ * Returns 1 after a read, 0 on timeout, -1 once closed.
+ */
+static int fill(WebSocketPrivate* private, double deadline, bool wait_forever) {
+    size_t needed;
+    ssize_t received;
+
+    /* Frames parsed since the last message are dead space now */
+    if (private->raw > private->gathered) {
+        memmove(private->buffer + private->gathered, private->buffer + private->raw,
+                private->length - private->raw);
+        private->length -= private->raw - private->gathered;
+        private->raw = private->gathered;
+    }
+    needed = private->raw + private->wanted;
+    if (needed < private->length + WEBSOCKET_READ_BYTES) {
+        needed = private->length + WEBSOCKET_READ_BYTES;
+    }
+    /* One spare byte for the NUL after a message */
+    if (!reserve(&private->buffer, &private->capacity, needed + 1)) {
+        return fail_with_close(private, WEBSOCKET_CLOSE_TOO_BIG, "Out of memory");
+    }
+
+    for (;;) {
+        bool pending = false;
+
+#if SSL_SUPPORT
+        pending = private->conn->ssl && SSL_pending(private->conn->ssl) > 0;
+#endif
+        if (!pending) {
+            struct pollfd pfd;
+            int wait_ms = -1;
+            int ready;
+
+            if (!wait_forever) {
+                double left = deadline - network_now();
+
+                wait_ms = left > 0 ? (int)(left * 1000.0 + 0.999) : 0;
+            }
+            pfd.fd = private->conn->socket_fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            ready = poll(&pfd, 1, wait_ms);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready == 0) return 0;
+        }
+
+        received = connection_recv(private->conn, private->buffer + private->length,
+                                   private->capacity - private->length - 1);
+        if (received > 0) {
+            private->length += (size_t)received;
+            return 1;
+        }
+        if (received < 0 && connection_would_block(private->conn)) {
+            /* A partial TLS record: wait for the rest */
+            continue;
+        }
+        if (received == 0) {
+            fail(private, "Connection closed without a close frame");
+        } else {
+            char reason[300];
+
+            snprintf(reason, sizeof(reason), "Receive failed: %s",
+                     connection_error(private->conn));
+            fail(private, reason);
+        }
+        return -1;
+    }
+}
+
+/* Next message within timeout_ms (negative: no limit); as receive() */
+static int pump(WebSocketPrivate* private, int timeout_ms) {
+    double deadline = network_now() + (timeout_ms > 0 ? timeout_ms / 1000.0 : 0);
+
+    release_message(private);
+    for (;;) {
+        int result;
+
+        if (!private->conn) return -1;
+        result = next_frame(private);
+        if (result != 0) return result;
+        result = fill(private, deadline, timeout_ms < 0);
+        if (result <= 0) return result;
+    }
+}
+
+/* Send the upgrade request and check the reply; false after fail() */
+static bool handshake(WebSocketPrivate* private) {
+    unsigned char nonce[16];
+    unsigned char digest[20];
+    char key[32];
+    char accept[32];
+    char seeded[96];
+    char extra[512];
+    char* lines;
+    char* request;
+    size_t request_length;
+    const char* value;
+    HttpHead head;
+    int parsed = 0;
+    bool ok;
+
+    random_bytes(nonce, sizeof(nonce));
+    base64_encode(nonce, sizeof(nonce), key);
+    snprintf(seeded, sizeof(seeded), "%s%s", key, WEBSOCKET_GUID);
+    sha1((const unsigned char*)seeded, strlen(seeded), digest);
+    base64_encode(digest, sizeof(digest), accept);
+
+    if (private->offered_protocol) {
+        snprintf(extra, sizeof(extra),
+                 "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n"
+                 "Sec-WebSocket-Protocol: %s\r\n", key, private->offered_protocol);
+    } else {
+        snprintf(extra, sizeof(extra),
+                 "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n", key);
+    }
+    lines = http_headers_format(&private->headers,
+                                HTTP_HEADER_BIT(HTTP_HEADER_HOST) |
+                                HTTP_HEADER_BIT(HTTP_HEADER_CONNECTION) |
+                                HTTP_HEADER_BIT(HTTP_HEADER_UPGRADE), extra);
+    request_length = strlen(private->path) + strlen(private->authority) +
+                     (lines ? strlen(lines) : 0) + 96;
+    request = malloc(request_length);
+    if (!lines || !request) {
+        free(lines);
+        free(request);
+        fail(private, "Out of memory");
+        return false;
+    }
+    request_length = (size_t)snprintf(request, request_length,
+                                      "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                                      "Upgrade: websocket\r\nConnection: Upgrade\r\n%s\r\n",
+                                      private->path, private->authority, lines);
+    free(lines);
+    ok = send_all(private, (const unsigned char*)request, request_length);
+    free(request);
+    if (!ok) return false;
+
+    /* Read the reply head; frames may follow it in the same read */
+    http_head_init(&head);
+    while (parsed == 0) {
+        ssize_t received;
+
+        if (!reserve(&private->buffer, &private->capacity,
+                     private->length + WEBSOCKET_READ_BYTES + 1)) {
+            parsed = -1;
+            break;
+        }
+        received = connection_recv(private->conn, private->buffer + private->length,
+                                   private->capacity - private->length - 1);
+        if (received <= 0) {
+            http_head_free(&head);
+            fail(private, received == 0 ? "Connection closed during the handshake"
+                                        : "Timed out waiting for the handshake");
+            return false;
+        }
+        private->length += (size_t)received;
+        parsed = http_head_parse(&head, (char*)private->buffer, private->length);
+        if (parsed == 0 && private->length > WEBSOCKET_MAX_HEAD) parsed = -1;
+    }
+    if (parsed < 0) {
+        http_head_free(&head);
+        fail(private, "Malformed handshake reply");
+        return false;
+    }
+
+    if (head.status != 101) {
+        snprintf(private->error, sizeof(private->error),
+                 "Handshake refused with HTTP %d", head.status);
+        private->has_error = true;
+        ok = false;
+    } else {
+        value = http_head_find(&head, (const char*)private->buffer, "upgrade");
+        ok = value && http_head_has_token(value, "websocket");
+        value = http_head_find(&head, (const char*)private->buffer, "connection");
+        ok = ok && value && http_head_has_token(value, "upgrade");
+        value = http_head_find(&head, (const char*)private->buffer,
+                               "sec-websocket-accept");
+        ok = ok && value && strcmp(value, accept) == 0;
+        if (!ok) {
+            snprintf(private->error, sizeof(private->error),
+                     "Handshake reply is not a WebSocket upgrade");
+            private->has_error = true;
+        }
+    }
+    if (ok) {
+        value = http_head_find(&head, (const char*)private->buffer,
+                               "sec-websocket-protocol");
+        if (value) private->protocol = strdup(value);
+    }
+
+    /* Whatever followed the head is the first frames */
+    if (ok) {
+        memmove(private->buffer, private->buffer + head.length,
+                private->length - head.length);
+        private->length -= head.length;
+        private->raw = 0;
+    }
+    http_head_free(&head);
+    if (!ok) close_connection(private);
+    return ok;
+}
+
+/* ======================================================================== */
+/* Trampoline Functions using TF_ macros                                    */
+/* ======================================================================== */
+
+static TF_Dyadic(void, websocket_setHeader, WebSocket, WebSocketPrivate,
+                 const char*, name, const char*, value)
+    if (!name) return;
+    if (value) {
+        http_headers_set(&private->headers, name, value);
+    } else {
+        http_headers_remove(&private->headers, name);
+    }
+}
+
+static TF_Setter(websocket_setProtocol, WebSocket, WebSocketPrivate, const char*)
+    free(private->offered_protocol);
+    private->offered_protocol = newValue ? strdup(newValue) : NULL;
+}
+
+static TF_Getter(websocket_timeout, WebSocket, WebSocketPrivate, int)
+    return private->timeout_seconds;
+}
+
+static TF_Setter(websocket_setTimeout, WebSocket, WebSocketPrivate, int)
+    if (newValue > 0) private->timeout_seconds = newValue;
+}
+
+static TF_Getter(websocket_maxMessage, WebSocket, WebSocketPrivate, size_t)
+    return private->max_message;
+}
+
+static TF_Setter(websocket_setMaxMessage, WebSocket, WebSocketPrivate, size_t)
+    if (newValue > 0) private->max_message = newValue;
+}
+
+static TF_Getter(websocket_connect, WebSocket, WebSocketPrivate, int)
+    if (private->state != WS_IDLE) return private->state == WS_OPEN;
+
+    private->conn = connection_create(private->hostname, private->port,
+                                      private->use_ssl);
+    if (!private->conn) {
+        fail(private, private->use_ssl ? "TLS is not available"
+                                       : "Could not create connection");
+        return 0;
+    }
+    private->conn->timeout_seconds = private->timeout_seconds;
+    if (!connection_connect(private->conn)) {
+        char reason[300];
+
+        snprintf(reason, sizeof(reason), "Connect failed: %s",
+                 connection_error(private->conn));
+        fail(private, reason);
+        return 0;
+    }
+    if (!handshake(private)) return 0;
+    private->state = WS_OPEN;
+    return 1;
+}
+
+static TF_Getter(websocket_protocol, WebSocket, WebSocketPrivate, const char*)
+    return private->protocol;
+}
+
+static TF_Unary(int, websocket_sendText, WebSocket, WebSocketPrivate,
+                const char*, text)
+    if (private->state != WS_OPEN) return 0;
+    return send_frame(private, WS_OP_TEXT, text, text ? strlen(text) : 0);
+}
+
+static TF_Dyadic(int, websocket_sendBinary, WebSocket, WebSocketPrivate,
+                 const void*, data, size_t, length)
+    if (private->state != WS_OPEN) return 0;
+    return send_frame(private, WS_OP_BINARY, data, data ? length : 0);
+}
+
+static TF_Unary(int, websocket_ping, WebSocket, WebSocketPrivate,
+                const char*, payload)
+    size_t length = payload ? strlen(payload) : 0;
+
+    if (private->state != WS_OPEN) return 0;
+    return send_frame(private, WS_OP_PING, payload, length > 125 ? 125 : length);
+}
+
+static TF_Unary(int, websocket_receive, WebSocket, WebSocketPrivate,
+                int, timeout_ms)
+    if (private->state != WS_OPEN) return -1;
+    return pump(private, timeout_ms);
+}
+
+static TF_Getter(websocket_message, WebSocket, WebSocketPrivate, const char*)
+    return private->message;
+}
+
+static TF_Getter(websocket_messageLength, WebSocket, WebSocketPrivate, size_t)
+    return private->message_length;
+}
+
+static TF_Getter(websocket_messageIsText, WebSocket, WebSocketPrivate, int)
+    return private->message && private->message_text;
+}
+
+static TF_Getter(websocket_messageJson, WebSocket, WebSocketPrivate, Json*)
+    return private->message ? JsonParse(private->message) : NULL;
+}
+
+static TF_Getter(websocket_pongs, WebSocket, WebSocketPrivate, unsigned long)
+    return private->pongs;
+}
+
+static TF_Dyadic(int, websocket_close, WebSocket, WebSocketPrivate,
+                 int, code, const char*, reason)
+    unsigned char payload[125];
+    size_t length = reason ? strlen(reason) : 0;
+    double deadline;
+
+    if (private->state != WS_OPEN) return 0;
+    if (length > sizeof(payload) - 2) length = sizeof(payload) - 2;
+    payload[0] = (unsigned char)(code >> 8);
+    payload[1] = (unsigned char)code;
+    if (length > 0) memcpy(payload + 2, reason, length);
+    if (!send_frame(private, WS_OP_CLOSE, payload, length + 2)) return 1;
+    private->state = WS_CLOSING;
+
+    /* Read, dropping messages, until the server's close frame arrives */
+    deadline = network_now() + private->timeout_seconds;
+    while (private->state == WS_CLOSING) {
+        int left_ms = (int)((deadline - network_now()) * 1000.0);
+
+        if (left_ms <= 0 || pump(private, left_ms) == 0) {
+            fail(private, "Timed out waiting for the close reply");
+            break;
+        }
+    }
+    return 1;
+}
+
+static TF_Getter(websocket_isOpen, WebSocket, WebSocketPrivate, int)
+    return private->state == WS_OPEN;
+}
+
+static TF_Getter(websocket_closeCode, WebSocket, WebSocketPrivate, int)
+    return private->close_code;
+}
+
+static TF_Getter(websocket_error, WebSocket, WebSocketPrivate, const char*)
+    return private->has_error ? private->error : NULL;
+}
+
+static TF_Nullary(websocket_free, WebSocket, WebSocketPrivate)
+    if (private) {
+        if (private->state == WS_OPEN) {
+            unsigned char payload[2] = { WEBSOCKET_CLOSE_GOING_AWAY >> 8,
+                                         WEBSOCKET_CLOSE_GOING_AWAY & 0xff };
+            send_frame(private, WS_OP_CLOSE, payload, 2);
+        }
+        connection_free(private->conn);
+        http_headers_free(&private->headers);
+        free(private->hostname);
+        free(private->authority);
+        free(private->path);
+        free(private->offered_protocol);
+        free(private->protocol);
+        free(private->buffer);
+        free(private->send_buffer);
+        trampoline_tracker_free_by_context(self);
+        free(private);
+    }
+}
+
+/* ======================================================================== */
+/* Creation Functions                                                        */
+/* ======================================================================== */
+
+static void websocket_release(WebSocketPrivate* private) {
+    http_headers_free(&private->headers);
+    free(private->hostname);
+    free(private->authority);
+    free(private->path);
+    free(private);
+}
+
+WebSocket* WebSocketMake(const char* url) {
+    unsigned char seed[8];
+
+    TA_Allocate(WebSocket, WebSocketPrivate);
+
+    if (!private) return NULL;
+
+    http_headers_init(&private->headers);
+    if (!parse_url(private, url)) {
+        websocket_release(private);
+        return NULL;
+    }
+    private->timeout_seconds = 30;
+    private->max_message = WEBSOCKET_DEFAULT_MAX_MESSAGE;
+    random_bytes(seed, sizeof(seed));
+    memcpy(&private->mask_state, seed, sizeof(seed));
+    if (private->mask_state == 0) private->mask_state = 0x9E3779B97F4A7C15ULL;
+
+    /* Create trampoline functions */
+    public->setHeader = trampoline_monitor(websocket_setHeader, public, 2, &tracker);
+    public->setProtocol = trampoline_monitor(websocket_setProtocol, public, 1, &tracker);
+    public->timeout = trampoline_monitor(websocket_timeout, public, 0, &tracker);
+    public->setTimeout = trampoline_monitor(websocket_setTimeout, public, 1, &tracker);
+    public->maxMessage = trampoline_monitor(websocket_maxMessage, public, 0, &tracker);
+    public->setMaxMessage = trampoline_monitor(websocket_setMaxMessage, public, 1, &tracker);
+    public->connect = trampoline_monitor(websocket_connect, public, 0, &tracker);
+    public->protocol = trampoline_monitor(websocket_protocol, public, 0, &tracker);
+    public->sendText = trampoline_monitor(websocket_sendText, public, 1, &tracker);
+    public->sendBinary = trampoline_monitor(websocket_sendBinary, public, 2, &tracker);
+    public->ping = trampoline_monitor(websocket_ping, public, 1, &tracker);
+    public->receive = trampoline_monitor(websocket_receive, public, 1, &tracker);
+    public->message = trampoline_monitor(websocket_message, public, 0, &tracker);
+    public->messageLength = trampoline_monitor(websocket_messageLength, public, 0, &tracker);
+    public->messageIsText = trampoline_monitor(websocket_messageIsText, public, 0, &tracker);
+    public->messageJson = trampoline_monitor(websocket_messageJson, public, 0, &tracker);
+    public->pongs = trampoline_monitor(websocket_pongs, public, 0, &tracker);
+    public->close = trampoline_monitor(websocket_close, public, 2, &tracker);
+    public->isOpen = trampoline_monitor(websocket_isOpen, public, 0, &tracker);
+    public->closeCode = trampoline_monitor(websocket_closeCode, public, 0, &tracker);
+    public->error = trampoline_monitor(websocket_error, public, 0, &tracker);
+    public->free = trampoline_monitor(websocket_free, public, 0, &tracker);
+
+    /* Validate all trampolines */
+    if (!trampoline_validate(tracker)) {
+        websocket_release(private);
+        return NULL;
+    }
+
+    return public;
+}
@@ -1,9 +1,23 @@
 #include "trampoline.h"
 #include <stdlib.h>
 
+/* The tracker list is shared by every object in the process, and objects
+ * may be created and freed on any thread (e.g. HttpServer workers), so it
+ * is guarded where POSIX threads exist. Other targets are single threaded. */
+#if (defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))) && \
+    !defined(AMIGA) && !defined(__amigaos__)
+  #include <pthread.h>
+  static pthread_mutex_t trackers_lock = PTHREAD_MUTEX_INITIALIZER;
+  #define TRACKERS_LOCK() pthread_mutex_lock(&trackers_lock)
+  #define TRACKERS_UNLOCK() pthread_mutex_unlock(&trackers_lock)
+#else
+  #define TRACKERS_LOCK()
+  #define TRACKERS_UNLOCK()
+#endif
+
 TTTracker __trampolines = { 0 };
 
-TTTracker* trampoline_find_matching_context(void* context) {
+static TTTracker* find_matching_context_locked(void* context) {
   TTTracker* next = &__trampolines;
 
   for (; next; next = next->next) {
@@ -14,7 +28,16 @@ TTTracker* trampoline_find_matching_context(void* context) {
   return next;
 }
 
-TTTracker* find_tracker_for_trampoline(void* trampoline) {
+TTTracker* trampoline_find_matching_context(void* context) {
+  TTTracker* tracker;
+
+  TRACKERS_LOCK();
+  tracker = find_matching_context_locked(context);
+  TRACKERS_UNLOCK();
+  return tracker;
+}
+
+static TTTracker* find_tracker_for_trampoline_locked(void* trampoline) {
   TTTracker* tracker = &__trampolines;
 
   /* Iterate through all trackers in the global list */
@@ -38,7 +61,16 @@ TTTracker* find_tracker_for_trampoline(void* trampoline) {
   return NULL;
 }
 
-TTTracker* trampoline_track_with_tracker(
+TTTracker* find_tracker_for_trampoline(void* trampoline) {
+  TTTracker* tracker;
+
+  TRACKERS_LOCK();
+  tracker = find_tracker_for_trampoline_locked(trampoline);
+  TRACKERS_UNLOCK();
+  return tracker;
+}
+
+static TTTracker* track_with_tracker_locked(
   void* trampoline,
   void* context,
   TTTracker* tracker
@@ -50,7 +82,7 @@ TTTracker* trampoline_track_with_tracker(
 
   if (parent == NULL) {
     /* Make an effort to find a match if we weren't given one */
-    parent = trampoline_find_matching_context(context);
+    parent = find_matching_context_locked(context);
   }
 
   if (!trampoline && parent) {
@@ -105,12 +137,30 @@ TTTracker* trampoline_track_with_tracker(
   return parent;
 }
 
+TTTracker* trampoline_track_with_tracker(
+  void* trampoline,
+  void* context,
+  TTTracker* tracker
+) {
+  TTTracker* parent;
+
+  TRACKERS_LOCK();
+  parent = track_with_tracker_locked(trampoline, context, tracker);
+  TRACKERS_UNLOCK();
+  return parent;
+}
+
 TTTracker* trampoline_track(void* trampoline, void* context) {
-  TTTracker* parent = trampoline_find_matching_context(context);
-  return trampoline_track_with_tracker(trampoline, context, parent);
+  TTTracker* parent;
+
+  TRACKERS_LOCK();
+  parent = find_matching_context_locked(context);
+  parent = track_with_tracker_locked(trampoline, context, parent);
+  TRACKERS_UNLOCK();
+  return parent;
 }
 
-unsigned int trampoline_tracker_free(TTTracker* tracker) {
+static unsigned int tracker_free_locked(TTTracker* tracker) {
   TTTracker* prev = NULL;
   TTAllocNode* node = NULL;
   TTAllocNode* next_node = NULL;
@@ -155,28 +205,41 @@ unsigned int trampoline_tracker_free(TTTracker* tracker) {
   return freed_count;
 }
 
+unsigned int trampoline_tracker_free(TTTracker* tracker) {
+  unsigned int freed_count;
+
+  TRACKERS_LOCK();
+  freed_count = tracker_free_locked(tracker);
+  TRACKERS_UNLOCK();
+  return freed_count;
+}
+
 unsigned int trampoline_tracker_free_by_context(void* context) {
-  TTTracker* tracker = trampoline_find_matching_context(context);
+  unsigned int freed_count;
 
-  return trampoline_tracker_free(tracker);
+  TRACKERS_LOCK();
+  freed_count = tracker_free_locked(find_matching_context_locked(context));
+  TRACKERS_UNLOCK();
+  return freed_count;
 }
 
 unsigned int trampoline_tracker_free_by_trampoline(void* trampoline) {
   TTTracker* tracker = NULL;
+  unsigned int freed_count = 0;
 
-  /* Find the tracker that contains this trampoline */
-  tracker = find_tracker_for_trampoline(trampoline);
+  TRACKERS_LOCK();
 
-  /* If no tracker found, nothing to destroy */
-  if (!tracker)
-    return 0;
+  /* Find the tracker that contains this trampoline */
+  tracker = find_tracker_for_trampoline_locked(trampoline);
 
   /* Don't try to destroy the global static tracker */
-  if (tracker == &__trampolines)
-    return 0;
+  if (tracker && tracker != &__trampolines) {
+    /* Destroy the tracker directly */
+    freed_count = tracker_free_locked(tracker);  // BUG FIX: Was tracker->context
+  }
 
-  /* Destroy the tracker directly */
-  return trampoline_tracker_free(tracker);  // BUG FIX: Was tracker->context
+  TRACKERS_UNLOCK();
+  return freed_count;
 }
 
 int trampoline_validate(TTTracker* tracker) {